@@ -45,24 +45,600 @@
 ** that error message.  But if the error is an OOM, the error might not be
 ** reported.  The routine always returns non-zero if there is an error.
 **
+** To defragment into memory, from an open connection or a database image:
+**
+**   int sqlite3_scrub_and_defrag_serialize(
+**       sqlite3 *db,               // Source connection
+**       const char *zSchema,       // "main", an attached schema, or NULL
+**       unsigned char **paOut,     // OUT: Image, from sqlite3_malloc()
+**       sqlite3_int64 *pnOut,      // OUT: Size of the image in bytes
+**       char **pzErrMsg            // Write error message here
+**   );
+**   int sqlite3_scrub_and_defrag_buffer(
+**       const unsigned char *aSrc, // Source database image
+**       sqlite3_int64 nSrc,        // Size of aSrc in bytes
+**       unsigned char **paOut,     // OUT: Image, from sqlite3_malloc()
+**       sqlite3_int64 *pnOut,      // OUT: Size of the image in bytes
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** The image is what a file copy would hold, but in rollback journal mode
+** as WAL cannot be used in memory.  No file is written.  The image can be
+** handed to sqlite3_deserialize() with the FREEONCLOSE flag or released
+** with sqlite3_free().  Each source page is read straight into its place
+** in the image.  db must not be in a transaction; it is left open.  A
+** plain ":memory:" database has no file to read, so it is first copied out
+** with sqlite3_serialize(), which takes as much memory again; one opened
+** with the memdb VFS is read in place.  aSrc, for example the output of
+** sqlite3_serialize(), is read in place; it must be in rollback journal
+** mode too.
+**
+** To copy between connections the application already holds open:
+**
+**   int sqlite3_scrub_and_defrag_db(
+**       sqlite3 *db,               // Source connection
+**       const char *zSchema,       // "main", an attached schema, or NULL
+**       sqlite3 *dbDest,           // Destination connection, empty "main"
+**       const sqlite3_defrag_options *pOpt,  // Options, or NULL
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** Nothing is opened or reopened: the files are read and written through
+** the VFS of each connection and under the locks it takes, and both are
+** left open.  Neither may be in a transaction.  The journal mode of dbDest
+** is turned off for the copy and then restored.  The options, zeroed for
+** the defaults, are the progress callback and the strict and cksum flags
+** of the incremental API below:
+**
+**   struct sqlite3_defrag_options {
+**     int nStep;                   // Pages between callbacks, or <=0
+**     int (*xProgress)(void*,unsigned,unsigned,sqlite3_int64,
+**                      sqlite3_int64,const char*);
+**     void *pProgressArg;          // First argument to xProgress
+**     int bStrict;                 // Check the b-tree structure
+**     int bCksum;                  // Checksum VFS checksums
+**     int bSalvage;                // Drop corrupt subtrees, see below
+**     char **pzReport;             // Salvage: what was dropped, or NULL
+**     int bObjects;                // Figures for each b-tree, see below
+**     int bStat1;                  // Write sqlite_stat1, see below
+**     int bTimers;                 // Time every read and write, see below
+**   };
+**
+** To interleave the copy with other work, as with sqlite3_backup_step():
+**
+**   sqlite3_defrag *sqlite3_scrub_and_defrag_init(zSourceFile, zDestFile);
+**   int sqlite3_scrub_and_defrag_step(sqlite3_defrag*, int nPage);
+**   int sqlite3_scrub_and_defrag_remaining(sqlite3_defrag*);
+**   int sqlite3_scrub_and_defrag_pagecount(sqlite3_defrag*);
+**   int sqlite3_scrub_and_defrag_finish(sqlite3_defrag*, char **pzErrMsg);
+**   void sqlite3_scrub_and_defrag_progress(sqlite3_defrag*, nStep, xProgress,
+**                                          pArg);
+**   char *sqlite3_scrub_and_defrag_stats(sqlite3_defrag*);
+**   int sqlite3_scrub_and_defrag_strict(sqlite3_defrag*, int bStrict);
+**   int sqlite3_scrub_and_defrag_cksum(sqlite3_defrag*, int bCksum);
+**   int sqlite3_scrub_and_defrag_salvage(sqlite3_defrag*, int bSalvage);
+**   char *sqlite3_scrub_and_defrag_salvage_report(sqlite3_defrag*);
+**   int sqlite3_scrub_and_defrag_objects(sqlite3_defrag*, int bObjects);
+**   int sqlite3_scrub_and_defrag_stat1(sqlite3_defrag*, int bStat1);
+**   int sqlite3_scrub_and_defrag_timers(sqlite3_defrag*, int bTimers);
+**
+** Init opens both databases and returns NULL only on OOM.  Each step copies
+** up to nPage pages (all if negative) and returns SQLITE_OK while there is
+** more to do, SQLITE_DONE once the root pages of the copy are updated, or
+** an error.  The read transaction on the source is held from init to
+** finish.  Finish closes everything; if it is called before SQLITE_DONE
+** the destination is truncated to zero bytes.  The progress call installs
+** a callback as described for sqlite3_scrub_and_defrag_v2() below.  Stats
+** returns a JSON object, from sqlite3_malloc(), with the time spent so far
+** opening, checkpointing, reading, parsing, writing, throttled and updating
+** root pages, pages read and written per page type, bytes zeroed in gaps,
+** freeblocks and overflow tails, the deepest b-tree level and log2
+** histograms of read and write latency.  On Linux, building with
+** -DSCRUB_DEFRAG_PROFILE adds a "profile" member: user-space cycles,
+** instructions, cache misses and branch misses spent walking each page
+** type, per page and per cell, from perf_event_open().  It stays at zero
+** where the kernel does not allow the counters.  Strict mode, which must be
+** turned on before the first step, makes the copy check the structure of
+** the source as it goes, most of what 'pragma integrity_check' covers: no
+** page used twice or left out, one kind of page and one leaf depth per
+** b-tree, rowids in order and overflow chains of the right length.  A
+** failed check stops the copy with an error, as corruption always has.
+** For databases kept by the checksum VFS (8 reserved bytes per page),
+** cksum makes the copy verify the checksum of every source page it reads
+** and write a correct one on every page of the copy; it returns
+** SQLITE_MISMATCH if the source has another number of reserved bytes.
+** Salvage mode, which turns strict mode on, makes a corrupt page or
+** overflow chain cost only the subtree or cell it belongs to: the cell
+** that leads to it is removed from its parent and the copy goes on.  The
+** copy is truncated to the pages written and the indexes of the damaged
+** tables are rebuilt, so that it is consistent.  The report, from
+** sqlite3_malloc() or NULL if nothing was lost, has one line per loss
+** giving the b-tree, the error with its page and check line, and the
+** pages and cells dropped.  Corruption in the schema b-tree still fails.
+** Objects, also set before the first step, adds an "objects" array to the
+** stats with one member per b-tree, in the order copied: pages written by
+** type, depth, cells, entries, payload bytes, the average leaf fill and a
+** histogram of leaves by tenths of fill, overflow chains with a log2
+** histogram of their lengths in pages, and the bytes zeroed.  This is what
+** sqlite3_analyzer reports, without a second scan.  Stat1, set before the
+** first step too, leaves the copy analyzed: the walk reads every index
+** entry in key order, so comparing each key with the one before gives the
+** row counts and distinct prefixes of sqlite_stat1, and a sample taken at
+** even intervals gives sqlite_stat4 if the library was built with
+** SQLITE_ENABLE_STAT4 or the source has that table.  sqlite_stat1 is what
+** ANALYZE would write, but an index whose keys overflow or use a collating
+** sequence other than BINARY is handed to ANALYZE on the copy, and so is
+** the whole copy if salvage dropped anything.  Timers, which may be turned
+** on at any time, make every read and write go between two clock readings
+** for the read, write and throttle times and the latency histograms of the
+** stats; without them those stay at zero and the I/O path reads no clock.
+**
+** To copy many databases in a row without setting up each copy afresh:
+**
+**   sqlite3_defrag *sqlite3_scrub_and_defrag_create(void);
+**   int sqlite3_scrub_and_defrag_run(sqlite3_defrag*, zSourceFile,
+**       zDestFile, const sqlite3_defrag_options*, char **pzErrMsg);
+**   void sqlite3_scrub_and_defrag_destroy(sqlite3_defrag*);
+**
+** A context from create runs one whole copy per call to run, with options
+** as for sqlite3_scrub_and_defrag_db() below (NULL for the defaults).  Its
+** page buffers, the SQL that remaps the root pages, the strict-mode bitmap
+** and the checksum weights are kept from run to run and only reset, and
+** the stats of the last run stay available.  A context may be used by one
+** thread at a time; give each thread its own.
+**
+** To follow a long copy, or to stop it, use:
+**
+**   int sqlite3_scrub_and_defrag_v2(
+**       const char *zSourceFile,   // Source database filename
+**       const char *zDestFile,     // Destination database filename
+**       int nStep,                 // Pages between callbacks, or <=0
+**       int (*xProgress)(          // Progress callback, or NULL
+**          void *pArg,             //   Copy of the next argument
+**          unsigned nDone,         //   Pages written so far
+**          unsigned nTotal,        //   Pages the destination will hold
+**          sqlite3_int64 nRead,    //   Bytes read so far
+**          sqlite3_int64 nWrite,   //   Bytes written so far
+**          const char *zBtree      //   Table or index being copied
+**       ),
+**       void *pArg,                // First argument to xProgress
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** xProgress is invoked after every nStep pages written (1024 by default)
+** and once more after the last one.  If it returns non-zero the copy stops,
+** both databases are closed, the destination is truncated to zero bytes
+** and SQLITE_ABORT is returned.
+**
+** When compiled with -DSQLITE_ENABLE_SESSION (and a library built with the
+** session extension and the pre-update hook) an online variant is also
+** available:
+**
+**   int sqlite3_scrub_and_defrag_online(
+**       sqlite3 *db,               // Connection the service writes through
+**       const char *zDestFile,     // Scratch file, renamed over the source
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** The source must be a WAL database in which every table has a PRIMARY KEY,
+** and every write must be made through db while the call runs.  A snapshot
+** is copied as above while the session extension records the writes made
+** since.  Those changes are replayed into the copy in rounds until the delta
+** is small, then writers are locked out for one last round and the copy is
+** renamed over the source.  On success, db and any other connection to the
+** source still refer to the old file, which is made unreadable before the
+** lock is released: their next statement fails with SQLITE_NOTADB, so
+** nothing written after the call returns is lost silently.  The caller must
+** close and reopen them.
+**
+** To defragment a database without room for a second copy:
+**
+**   int sqlite3_scrub_and_defrag_inplace(
+**       const char *zFile,         // Database to defragment
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** The pages are moved to the places a copy would give them inside the file
+** itself, which is then truncated.  An EXCLUSIVE lock is held for the whole
+** run, so the database must not be in use, and WAL databases are refused.
+** Progress is journaled in "<zFile>-defrag" and sqlite3 refuses to open the
+** file until the run completes.  If a run is interrupted by a crash, call
+** the function again on the same file: it picks up where it stopped.
+**
+** For databases with auto-vacuum off, free space can also be reclaimed a
+** little at a time:
+**
+**   int sqlite3_scrub_and_defrag_compact(
+**       const char *zFile,         // Database to compact
+**       int nPage,                 // Move at most this many pages, or <=0
+**       int nMs,                   // Stop after about this many ms, or <=0
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** Pages at the end of the file are moved into freelist slots near the front
+** and the file is truncated.  Work is done in rounds of up to 1024 pages,
+** each atomic with respect to crashes; the budgets are checked between
+** rounds.  SQLITE_DONE is returned once no freelist slot is left below the
+** last live page, SQLITE_OK if a budget ran out first.  Locking and journal
+** are as for sqlite3_scrub_and_defrag_inplace(), but each round is short
+** and other connections may use the database between calls.  Deleted
+** content is not zeroed in this mode.
+**
+** To decide whether a database is worth defragmenting:
+**
+**   int sqlite3_scrub_and_defrag_analyze(
+**       const char *zFile,         // Database to analyze
+**       int nSamplePct,            // Percent of pages to sample, or 0
+**       char **pzReport,           // OUT: Report, from sqlite3_malloc()
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** The report has one line per table and index: pages, depth, the share of
+** links between pages adjacent in key order that are not to the next page,
+** leaf fill, freeblock and gap bytes, overflow pages and the share of
+** overflow chain links that are not to the next page.  It ends with the
+** file size, the freelist size and the size a defrag would produce.  With
+** nSamplePct>0 the upper levels of each b-tree are read in full but only
+** every (100/nSamplePct)-th of its lowest interior pages, at least 8 where
+** it has that many, is read with its leaves and overflow pages.  The
+** figures below that level are then estimates, the same on every run, and
+** the report gains a column with the 95% error bound on the page count.
+** Nothing is written except that a database in WAL mode is first given a
+** passive checkpoint, as the b-trees are read from the database file.
+**
+** To check a copy without running 'pragma integrity_check' on it:
+**
+**   int sqlite3_scrub_and_defrag_verify(
+**       const char *zSourceFile,   // Source database filename
+**       const char *zDestFile,     // Copy made from it
+**       int nThread,               // Threads to use, or <=0 for 4
+**       char **pzReport,           // OUT: Report, from sqlite3_malloc()
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** Every table and index is read from both files in key order and the
+** entries compared: rowids, payload sizes and a hash of each payload,
+** overflow included.  The report names the first difference found in each
+** b-tree and ends with a count of the entries compared.  SQLITE_MISMATCH
+** is returned if there is any difference.  The sqlite_stat tables are left
+** out, as a copy made with stat1 set has them afresh and one made without
+** may hold them from the source.  Each thread takes one b-tree at a time.
+** The source should not be written to while it is compared.
+**
+** To keep a defrag from starving other work on the same disks:
+**
+**   void sqlite3_scrub_and_defrag_set_limits(
+**       sqlite3_int64 nReadBps,    // Bytes read per second, or 0
+**       sqlite3_int64 nWriteBps    // Bytes written per second, or 0
+**   );
+**   int sqlite3_scrub_and_defrag_limit_file(const char *zFile);
+**   void sqlite3_scrub_and_defrag_reload_limits(void);
+**   int sqlite3_scrub_and_defrag_idle_io(void);
+**
+** The limits apply to every run in the process and may be changed while one
+** is in progress.  A limit file holds "read=N write=N"; it is re-read about
+** once a second and after sqlite3_scrub_and_defrag_reload_limits(), which is
+** safe to call from a signal handler.  On Linux, idle_io() puts the calling
+** thread in the idle I/O scheduling class; elsewhere it returns SQLITE_ERROR.
+**
+** To run many copies from one long-lived process:
+**
+**   int sqlite3_scrub_and_defrag_daemon(
+**       const char *zSocket,       // Unix domain socket to listen on
+**       int nWorker,               // Worker threads, or <=0 for 4
+**       char **pzErrMsg            // Write error message here
+**   );
+**
+** Clients connect to zSocket (created mode 0600) and send JSON requests,
+** one per line: {"op":"copy","src":..,"dest":..} with optional "strict",
+** "cksum", "salvage", "objects" and "stat1" members queues a job and
+** replies with its id; {"op":"status","id":N} replies with its state,
+** timings, error and the stats JSON, refreshed every 4 MB written;
+** {"op":"status"} lists every job; {"op":"cancel","id":N} stops a job,
+** leaving its destination empty; and {"op":"shutdown"} cancels the queued
+** jobs and returns once the running ones are done.  At most nWorker jobs
+** run at once, and the rate limits apply to all of them together rather
+** than to each.  Not available on Windows or without threads.
+**
+** Compiled with -DSCRUB_DEFRAG_EXTENSION this file is also a loadable
+** extension (entry point sqlite3_defrag_init(), which an application that
+** links it in can hand to sqlite3_auto_extension() instead).  It adds the
+** SQL function:
+**
+**      SELECT scrub_defrag('dest.db' [, '{"schema":"aux","strict":1}']);
+**
+** which copies a schema of the calling connection ("main" by default) into
+** dest.db through sqlite3_scrub_and_defrag_db() and returns the JSON of
+** sqlite3_scrub_and_defrag_stats().  The options object may also hold
+** "cksum":1, "objects":1, "stat1":1 and "salvage":1, whose report is the
+** "salvage_report" member of the result.  The function cannot be used
+** inside a transaction, nor from triggers or views.
+**
 ** If compiled with -DDEFRAG_STANDALONE then a main() procedure is added and
 ** this file becomes a standalone program that can be run as follows:
 **
-**      ./sqlite3defrag SOURCE DEST
+**      ./sqlite3defrag [OPTIONS] SOURCE DEST
+**      ./sqlite3defrag [OPTIONS] --in-place DATABASE
+**      ./sqlite3defrag [OPTIONS] --compact DATABASE [MAXPAGES [MAXMS]]
+**      ./sqlite3defrag [OPTIONS] --analyze DATABASE [SAMPLE-PERCENT]
+**      ./sqlite3defrag [OPTIONS] --verify SOURCE DEST [THREADS]
+**      ./sqlite3defrag [OPTIONS] --daemon SOCKET [WORKERS]
+**      ./sqlite3defrag --request SOCKET JSON
+**
+** where OPTIONS are --read-limit N, --write-limit N, --limit-file FILE (which
+** SIGHUP reloads), --idle, --progress, --stats, --objects (which implies
+** --stats), --stat1, --strict, --cksum and --salvage, which prints the
+** salvage report on stderr and exits with 3 if anything was lost.
+** --request sends one request to a daemon and prints the reply.
 **
 */
-#include "sqlite3.h"
+#ifdef SCRUB_DEFRAG_EXTENSION
+# include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT1
+#else
+# include "sqlite3.h"
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#ifdef __linux__
+# include <dirent.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/syscall.h>
+#endif
+#ifdef DEFRAG_STANDALONE
+# include <signal.h>
+#endif
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+#endif
+
+/*
+** Cell pointers are scanned SCRUB_DEFRAG_LANES at a time where the compiler
+** targets SSE2 (8 lanes) or AVX2 (16 lanes), and one at a time otherwise.
+** Page checksums use the same instruction sets.
+*/
+#if defined(__AVX2__)
+# define SCRUB_DEFRAG_LANES 16
+#elif defined(__SSE2__) || defined(_M_X64)
+# define SCRUB_DEFRAG_LANES 8
+#else
+# define SCRUB_DEFRAG_LANES 0
+#endif
+/*
+** Where the kernel has copy_file_range(), runs of overflow pages are copied
+** from file to file without passing through user space.  On XFS and btrfs
+** the kernel shares the blocks instead of copying them.
+*/
+#ifndef SCRUB_DEFRAG_KCOPY
+# if defined(__linux__) && defined(SYS_copy_file_range)
+#  define SCRUB_DEFRAG_KCOPY 1
+# else
+#  define SCRUB_DEFRAG_KCOPY 0
+# endif
+#endif
+/* Most overflow pages in one kernel copy */
+#define SCRUB_DEFRAG_RUN 256
+#ifndef SCRUB_DEFRAG_THREADS
+# ifdef _WIN32
+#  define SCRUB_DEFRAG_THREADS 0   /* Verify on the calling thread only */
+# else
+#  define SCRUB_DEFRAG_THREADS 1
+# endif
+#endif
+#if SCRUB_DEFRAG_THREADS
+# include <pthread.h>
+#endif
+/*
+** The daemon of sqlite3_scrub_and_defrag_daemon() needs threads and Unix
+** domain sockets.
+*/
+#ifndef SCRUB_DEFRAG_DAEMON
+# if SCRUB_DEFRAG_THREADS && !defined(_WIN32)
+#  define SCRUB_DEFRAG_DAEMON 1
+# else
+#  define SCRUB_DEFRAG_DAEMON 0
+# endif
+#endif
+#if SCRUB_DEFRAG_DAEMON
+# include <errno.h>
+# include <unistd.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/time.h>
+# include <sys/un.h>
+#endif
+#ifdef SCRUB_DEFRAG_PROFILE
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+#endif
 
 typedef struct ScrubDefragState ScrubDefragState;
+typedef struct ScrubDefragBucket ScrubDefragBucket;
+typedef struct ScrubDefragShared ScrubDefragShared;
+typedef struct ScrubDefragFrame ScrubDefragFrame;
+typedef struct ScrubDefragStats ScrubDefragStats;
+typedef struct ScrubDefragBtreeStats ScrubDefragBtreeStats;
+typedef struct ScrubDefragSample ScrubDefragSample;
+typedef struct ScrubDefragPlan ScrubDefragPlan;
+typedef struct ScrubDefragState sqlite3_defrag;
+typedef struct sqlite3_defrag_options sqlite3_defrag_options;
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 
+/* Options of sqlite3_scrub_and_defrag_db().  Zeroed means the defaults. */
+struct sqlite3_defrag_options {
+  int nStep;               /* Pages between progress callbacks, or <=0 */
+  int (*xProgress)(void*,unsigned,unsigned,sqlite3_int64,sqlite3_int64,
+                   const char*);  /* Progress callback, or NULL */
+  void *pProgressArg;      /* First argument to xProgress */
+  int bStrict;             /* As sqlite3_scrub_and_defrag_strict() */
+  int bCksum;              /* As sqlite3_scrub_and_defrag_cksum() */
+  int bSalvage;            /* As sqlite3_scrub_and_defrag_salvage() */
+  char **pzReport;         /* Salvage: write what was dropped here, or NULL */
+  int bObjects;            /* As sqlite3_scrub_and_defrag_objects() */
+  int bStat1;              /* As sqlite3_scrub_and_defrag_stat1() */
+  int bTimers;             /* As sqlite3_scrub_and_defrag_timers() */
+};
+
+/* A token bucket limiting the rate of reads or writes */
+struct ScrubDefragBucket {
+  double nToken;           /* Bytes that may be transferred now */
+  sqlite3_int64 iLast;     /* Time of the last refill in ms, or 0 */
+};
+
+/* Buckets shared by all the runs of one daemon, see scrubDefragThrottle() */
+struct ScrubDefragShared {
+  ScrubDefragBucket aBucket[2];  /* Rate limits on reads [0] and writes [1] */
+#if SCRUB_DEFRAG_THREADS
+  pthread_mutex_t mutex;         /* Guards aBucket[] */
+#endif
+};
+
+/* A b-tree page on the walk stack, with the position reached on it */
+struct ScrubDefragFrame {
+  u8 *a;                   /* Page content (p->page1 for page 1) */
+  u32 pgno;                /* Source page number */
+  u32 iDest;               /* Destination page number */
+  u32 iCell;               /* Next cell to visit */
+  u32 nCell;               /* Number of cells on the page */
+  u32 iPtr;                /* Offset of the cell pointer array in a[] */
+  u8 eType;                /* Page type byte */
+  u8 bDown;                /* The child of cell iCell has been visited */
+  u8 bRight;               /* The right-most child has been visited */
+  u8 bRoot;                /* This is the root of its b-tree */
+};
+
+/* Page types counted by ScrubDefragStats */
+#define SCRUB_DEFRAG_TYPE_INDEX_INTERIOR  0    /* 0x02 */
+#define SCRUB_DEFRAG_TYPE_TABLE_INTERIOR  1    /* 0x05 */
+#define SCRUB_DEFRAG_TYPE_INDEX_LEAF      2    /* 0x0a */
+#define SCRUB_DEFRAG_TYPE_TABLE_LEAF      3    /* 0x0d */
+#define SCRUB_DEFRAG_TYPE_OVERFLOW        4
+#define SCRUB_DEFRAG_NTYPE                5
+
+/* Latency histogram buckets: bucket i counts calls taking < 2^i us */
+#define SCRUB_DEFRAG_NHIST          16
+
+/* Hardware counters of a -DSCRUB_DEFRAG_PROFILE build */
+#define SCRUB_DEFRAG_PROF_CYCLES    0
+#define SCRUB_DEFRAG_PROF_INSNS     1
+#define SCRUB_DEFRAG_PROF_CACHE     2     /* Cache misses */
+#define SCRUB_DEFRAG_PROF_BRANCH    3     /* Branch misses */
+#define SCRUB_DEFRAG_NPROF          4
+
+/* Counters and timers of a copy.  Times are in microseconds. */
+struct ScrubDefragStats {
+  sqlite3_int64 aRead[SCRUB_DEFRAG_NTYPE];   /* Pages read, by type */
+  sqlite3_int64 aWrite[SCRUB_DEFRAG_NTYPE];  /* Pages written, by type */
+  sqlite3_int64 nGapZero;       /* Bytes zeroed between cell index and cells */
+  sqlite3_int64 nFreeblock;     /* Freeblocks zeroed */
+  sqlite3_int64 nFreeblockZero; /* Bytes zeroed in freeblocks */
+  sqlite3_int64 nTailZero;      /* Bytes zeroed at the end of overflow chains */
+  sqlite3_int64 nKcopy;         /* Overflow pages copied by the kernel */
+  int mxDepth;                  /* Deepest b-tree level reached, root is 0 */
+  sqlite3_int64 tStart;         /* Clock at init */
+  sqlite3_int64 tOpen;          /* Opening both databases, less checkpoint */
+  sqlite3_int64 tCkpt;          /* Checkpointing the source */
+  sqlite3_int64 tRead;          /* Inside xRead */
+  sqlite3_int64 tWrite;         /* Inside xWrite */
+  sqlite3_int64 tThrottle;      /* Waiting on the rate limits */
+  sqlite3_int64 tWalk;          /* Walking the b-trees, I/O included */
+  sqlite3_int64 tRoots;         /* Updating the root pages */
+  sqlite3_int64 tTotal;         /* Init to done */
+  sqlite3_int64 aReadHist[SCRUB_DEFRAG_NHIST];   /* xRead latencies */
+  sqlite3_int64 aWriteHist[SCRUB_DEFRAG_NHIST];  /* xWrite latencies */
+#ifdef SCRUB_DEFRAG_PROFILE
+  int aProfFd[SCRUB_DEFRAG_NPROF];  /* perf_event group, leader first */
+  int bProf;                        /* aProfFd[] is open */
+  int eProf;                        /* Page type charged for this step */
+  int nProfFrame;                   /* Walk stack depth when it began */
+  sqlite3_int64 aProfLast[SCRUB_DEFRAG_NPROF];  /* Counters then */
+  sqlite3_int64 aProf[SCRUB_DEFRAG_NTYPE][SCRUB_DEFRAG_NPROF];
+  sqlite3_int64 aProfPage[SCRUB_DEFRAG_NTYPE];  /* Pages finished */
+  sqlite3_int64 aProfCell[SCRUB_DEFRAG_NTYPE];  /* Cells on those pages */
+#endif
+};
+
+/* Leaf fill histogram buckets, one per tenth of the usable page */
+#define SCRUB_DEFRAG_NFILL          10
+
+/*
+** Figures for one table or index, gathered by the copy for the report of
+** sqlite3_scrub_and_defrag_objects().  Page counts and zeroed bytes are
+** the growth of the run totals in ScrubDefragStats while the b-tree was
+** copied; a[] holds those totals when it started.
+*/
+struct ScrubDefragBtreeStats {
+  char *zName;             /* Table or index name */
+  char *zType;             /* Its type in sqlite_master */
+  sqlite3_int64 aPage[SCRUB_DEFRAG_NTYPE];  /* Pages written, by type */
+  sqlite3_int64 nZero;     /* Gap, freeblock and overflow tail bytes zeroed */
+  sqlite3_int64 a[SCRUB_DEFRAG_NTYPE+1];    /* Totals at the start */
+  int nDepth;              /* Levels, leaves included */
+  sqlite3_int64 nCell;     /* Cells on all pages */
+  sqlite3_int64 nEntry;    /* Rows or index entries */
+  sqlite3_int64 nPayload;  /* Payload bytes, overflow included */
+  sqlite3_int64 nLeafUsed; /* Bytes of the leaves in use */
+  sqlite3_int64 aFill[SCRUB_DEFRAG_NFILL];  /* Leaves by tenths of fill */
+  sqlite3_int64 nChain;    /* Overflow chains */
+  sqlite3_int64 aChain[SCRUB_DEFRAG_NHIST]; /* Chains by log2 of length */
+};
+
+/* sqlite_stat4 rows written per index, as SQLITE_STAT4_SAMPLES */
+#define SCRUB_DEFRAG_NSAMPLE        24
+
+/* A candidate sqlite_stat4 sample, one index entry */
+struct ScrubDefragSample {
+  sqlite3_int64 *anEq;     /* Entries equal on 1..nCol columns, 0 until known */
+  sqlite3_int64 *anLt;     /* Entries less on 1..nCol columns */
+  sqlite3_int64 *anDLt;    /* Distinct values less on 1..nCol columns */
+  u8 *aRec;                /* The index record */
+  int nRec;                /* Bytes at aRec */
+};
+
+/* What the copy counts of a b-tree for the planner */
+#define SCRUB_DEFRAG_PLAN_NONE      0    /* Nothing: sqlite_% tables */
+#define SCRUB_DEFRAG_PLAN_ROWS      1    /* Rows of a table */
+#define SCRUB_DEFRAG_PLAN_KEYS      2    /* Keys of an index */
+
+/*
+** The sqlite_stat1 and sqlite_stat4 figures of the b-tree being copied,
+** for sqlite3_scrub_and_defrag_stat1().  Index entries arrive in key order,
+** so one compare with the previous key tells which prefixes are new.  The
+** stat4 samples are taken every nStride entries; when aSample[] fills up
+** every other one is dropped and nStride doubles.
+*/
+struct ScrubDefragPlan {
+  int eTree;               /* SCRUB_DEFRAG_PLAN_* */
+  char *zTbl;              /* Table, the "tbl" column of the stat tables */
+  char *zIdx;              /* The "idx" column: the b-tree name */
+  char *zAnalyze;          /* What to hand to ANALYZE if bAnalyze is set */
+  int bAnalyze;            /* Keys that cannot be compared here were seen */
+  int nKey;                /* Key columns, one average each in sqlite_stat1 */
+  int nCol;                /* Columns compared: nKey, or all for stat4 */
+  sqlite3_int64 nRow;      /* Rows or entries so far */
+  sqlite3_int64 *anDist;   /* Distinct prefixes of 1..nCol columns so far */
+  sqlite3_int64 *anRun;    /* First entry of the current run of each prefix */
+  int *aiPend;             /* First sample whose anEq[] for it is unknown */
+  u8 *aPrev;               /* The previous key */
+  int nPrev;               /* Bytes at aPrev */
+  u8 *aKey;                /* Buffer for the key being counted */
+  ScrubDefragSample aSample[2*SCRUB_DEFRAG_NSAMPLE];
+  int nSample;             /* Entries used in aSample[] */
+  sqlite3_int64 nStride;   /* Entries between samples */
+};
+
+/* Deepest b-tree accepted before the source is reported as corrupt */
+#define SCRUB_DEFRAG_MAX_DEPTH      50
 
 /* State information for a scrub-and-defrag operation */
 struct ScrubDefragState {
@@ -71,19 +647,96 @@ struct ScrubDefragState {
   int rcErr;               /* Error code */
   char *zErr;              /* Error message text */
   sqlite3 *dbSrc;          /* Source database connection */
+  const char *zSrcDb;      /* Schema of dbSrc to copy, or NULL for "main" */
+  int bBorrowSrc;          /* dbSrc belongs to the caller: do not close it */
   sqlite3_file *pSrc;      /* Source file handle */
   sqlite3 *dbDest;         /* Destination database connection */
+  int bBorrowDest;         /* dbDest belongs to the caller: do not close it */
+  char *zDestJournal;      /* Journal mode of a borrowed dbDest, to restore */
   sqlite3_file *pDest;     /* Destination file handle */
   u32 szPage;              /* Page size */
   u32 szUsable;            /* Usable bytes on each page */
+  u32 mxLocalLeaf;         /* Most payload kept on a table leaf page */
+  u32 mxLocal;             /* Most payload kept on other b-tree pages */
+  u32 mnLocal;             /* Least payload kept with the cell on overflow */
   u32 nDestPage;           /* # pages of destination database */
   u32 nSrcPage;            /* # pages of source database*/
   u32 nFreePage;           /* Number of freelist pages */
   u8 *page1;               /* Content of page 1 */
+  u8 *aOut;                /* Copy to memory: the image, nDestPage pages */
+  sqlite3_int64 nOut;      /* Copy to memory: bytes in aOut once done */
   u32 iDestPageNo;         /* Current Destination database page no */
   u32 iLock;               /* Lock page number */
+  int eCkpt;               /* Checkpoint mode used on the source */
+  sqlite3 *dbLock;         /* Writer lock released once the snapshot is set */
+  u32 *aMap;               /* In-place mapping pass: aMap[src] is dest page */
+  u8 *aKind;               /* In-place mapping pass: SCRUB_DEFRAG_KIND_* */
+  ScrubDefragBucket aBucket[2];  /* Rate limits on reads [0] and writes [1] */
+  ScrubDefragShared *pShared;    /* Use these buckets instead, or NULL */
+  sqlite3_vfs *pClock;     /* VFS whose clock paces the buckets, or NULL */
+  int (*xProgress)(void*,unsigned,unsigned,sqlite3_int64,sqlite3_int64,
+                   const char*);  /* Progress callback, or NULL */
+  void *pProgressArg;      /* First argument to xProgress */
+  u32 nProgressStep;       /* Invoke xProgress every this many pages */
+  u32 nPageDone;           /* Pages written so far */
+  sqlite3_int64 nByteRead; /* Bytes read so far */
+  sqlite3_int64 nByteWrite;/* Bytes written so far */
+  const char *zBtree;      /* Name of the b-tree being copied */
+  ScrubDefragFrame aFrame[SCRUB_DEFRAG_MAX_DEPTH+1];  /* Walk stack */
+  int nFrame;              /* Number of entries in aFrame[] */
+  u32 iOvfl;               /* Next page of the overflow chain being copied */
+  u32 nOvfl;               /* Payload bytes left on that chain */
+  u8 *aOvfl;               /* Buffer for overflow pages, zeroed for bKcopy */
+  int bKcopy;              /* Overflow runs go through copy_file_range() */
+  int bKcopyFd;            /* Kcopy: fdSrc and fdDest are set */
+  int fdSrc, fdDest;       /* Kcopy: own descriptors on both files, or -1 */
+  u32 iRunSrc;             /* Kcopy: first source page of the pending run */
+  u32 iRunDest;            /* Kcopy: and its destination page */
+  u32 nRun;                /* Kcopy: pages in the run */
+  u32 aRunNext[SCRUB_DEFRAG_RUN];  /* Kcopy: new next-page pointers */
+  sqlite3_stmt *pRoots;    /* Copy: the roots not yet started */
+  char *zSql;              /* Copy: SQL that fixes up the root pages */
+  sqlite3_int64 nSql;      /* Copy: bytes of SQL in zSql */
+  sqlite3_int64 nSqlAlloc; /* Copy: bytes allocated at zSql */
+  int bDone;               /* Copy: finished, root pages updated */
+  int bStrict;             /* Copy: check the b-tree structure as well */
+  u8 *aSeen;               /* Strict: bitmap of the source pages reached */
+  int nLeafDepth;          /* Strict: depth of leaves in this b-tree, or 0 */
+  int bKey;                /* Strict: iKey holds the last rowid seen */
+  sqlite3_int64 iKey;      /* Strict: the last rowid seen in this b-tree */
+  int bCksum;              /* Copy: check and write checksum VFS checksums */
+  u32 *aCksumW;            /* Cksum: word weights, see scrubDefragCksumInit() */
+  int bSalvage;            /* Copy: drop corrupt subtrees instead of failing */
+  int bDestErr;            /* The error is the destination's: no salvage */
+  int bSalvaged;           /* Salvage: the current b-tree has lost pages */
+  sqlite3_str *pLoss;      /* Salvage: one line per subtree or chain dropped */
+  sqlite3_str *pReindex;   /* Salvage: damaged b-trees, each 0-terminated */
+  u8 *aUsed;               /* Salvage: bytes of a page taken by cells */
+  int bObjects;            /* Copy: gather figures for each b-tree */
+  int bTimers;             /* Time each read and write for p->st */
+  ScrubDefragBtreeStats *aObj;  /* Objects: one entry per b-tree started */
+  int nObj;                /* Objects: entries used in aObj[] */
+  int nObjAlloc;           /* Objects: entries allocated */
+  int bStat1;              /* Copy: write sqlite_stat1 (and sqlite_stat4) */
+  int bStat4;              /* Stat1: the copy will have sqlite_stat4 */
+  sqlite3_stmt *pPlanInfo; /* Stat1: the key columns of an index */
+  sqlite3_str *pPlan;      /* Stat1: SQL that fills the stat tables */
+  ScrubDefragPlan plan;    /* Stat1: the b-tree being copied */
+  u32 nSeen;               /* Bytes allocated at aSeen */
+  u32 szBuf;               /* Page size of the pooled buffers, or 0 */
+  u8 *apPage[SCRUB_DEFRAG_MAX_DEPTH+1];  /* Page buffer of each walk level */
+  u8 *aPage1;              /* Page buffer for page1 */
+  int bKeep;               /* Context: keep buffers from run to run */
+  ScrubDefragStats st;     /* Counters and timers */
 };
 
+/* Default interval between progress callbacks, in pages */
+#define SCRUB_DEFRAG_PROGRESS_STEP  1024
+
+/* Kinds of live page recorded by the in-place mapping pass */
+#define SCRUB_DEFRAG_KIND_BTREE     1
+#define SCRUB_DEFRAG_KIND_OVERFLOW  2
+
 static void scrubDefragIncDestPageNo(ScrubDefragState *p){
   p->iDestPageNo++;
   if(p->iDestPageNo == p->iLock) p->iDestPageNo++;
@@ -98,6 +751,51 @@ static void scrubDefragErr(ScrubDefragState *p, const char *zFormat, ...){
   if( p->rcErr==0 ) p->rcErr = SQLITE_ERROR;
 }
 
+/*
+** Append to the SQL that fixes up the root pages.  p->zSql grows by
+** doubling and a context keeps it between runs.
+*/
+static void scrubDefragSqlAppend(ScrubDefragState *p, const char *zFormat, ...){
+  va_list ap;
+  char *z;
+  sqlite3_int64 n;
+  if( p->rcErr ) return;
+  va_start(ap, zFormat);
+  z = sqlite3_vmprintf(zFormat, ap);
+  va_end(ap);
+  if( z==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  n = (sqlite3_int64)strlen(z);
+  if( p->nSql+n+1>p->nSqlAlloc ){
+    sqlite3_int64 nNew = 2*(p->nSql+n+1);
+    char *zNew = sqlite3_realloc64(p->zSql, nNew);
+    if( zNew==0 ){
+      sqlite3_free(z);
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    p->zSql = zNew;
+    p->nSqlAlloc = nNew;
+  }
+  memcpy(&p->zSql[p->nSql], z, n+1);
+  p->nSql += n;
+  sqlite3_free(z);
+}
+
+/*
+** Set the usable page size from the reserved-bytes header field, and the
+** payload thresholds that follow from it, so that cell parsing does not
+** divide for every cell.
+*/
+static void scrubDefragSetUsable(ScrubDefragState *p, u32 nReserve){
+  p->szUsable = p->szPage - nReserve;
+  p->mxLocalLeaf = p->szUsable - 35;
+  p->mxLocal = ((p->szUsable - 12)*64/255) - 23;
+  p->mnLocal = ((p->szUsable - 12)*32/255) - 23;
+}
+
 /* Allocate memory to hold a single page of content */
 static u8 *scrubDefragAllocPage(ScrubDefragState *p){
   u8 *pPage;
@@ -107,147 +805,723 @@ static u8 *scrubDefragAllocPage(ScrubDefragState *p){
   return pPage;
 }
 
-/* Read a page from the source database into memory.  Use the memory
-** provided by pBuf if not NULL or allocate a new page if pBuf==NULL.
+/*
+** Buffers of one page (and the checksum weights, which depend on the page
+** size) are allocated on first use and reused for the rest of the run: one
+** for each level of the walk stack, one for page 1, one for overflow pages.
+** A context from sqlite3_scrub_and_defrag_create() keeps them between runs
+** too, until a source with another page size comes along.
 */
-static u8 *scrubDefragRead(ScrubDefragState *p, int pgno, u8 *pBuf){
-  int rc;
-  sqlite3_int64 iOff;
-  u8 *pOut = pBuf;
-  if( p->rcErr ) return 0;
-  if( pOut==0 ){
-    pOut = scrubDefragAllocPage(p);
-    if( pOut==0 ) return 0;
-  }
-  iOff = (pgno-1)*(sqlite3_int64)p->szPage;
-  rc = p->pSrc->pMethods->xRead(p->pSrc, pOut, p->szPage, iOff);
-  if( rc!=SQLITE_OK ){
-    if( pBuf==0 ) sqlite3_free(pOut);
-    pOut = 0;
-    scrubDefragErr(p, "read failed for page %d", pgno);
-    p->rcErr = SQLITE_IOERR;
+static void scrubDefragPoolFree(ScrubDefragState *p){
+  int i;
+  for(i=0; i<=SCRUB_DEFRAG_MAX_DEPTH; i++){
+    sqlite3_free(p->apPage[i]);
+    p->apPage[i] = 0;
   }
-  return pOut;  
+  sqlite3_free(p->aPage1);
+  p->aPage1 = 0;
+  sqlite3_free(p->aOvfl);
+  p->aOvfl = 0;
+  sqlite3_free(p->aUsed);
+  p->aUsed = 0;
+  sqlite3_free(p->aCksumW);
+  p->aCksumW = 0;
+  p->szBuf = 0;
 }
 
-/* Write a page to the destination database */
-static void scrubDefragWrite(ScrubDefragState *p, int pgno, const u8 *pData){
-  int rc;
-  sqlite3_int64 iOff;
-  if( p->rcErr ) return;
-  if( pgno > p->nDestPage ){
-    scrubDefragErr(p, "internal logic error or database is corrupt, "
-                   "please run 'pragma integrity_check' on database: %s",
-                   p->zSrcFile);
-    p->rcErr = SQLITE_CORRUPT;
-    return;
-  }
-  iOff = (pgno-1)*(sqlite3_int64)p->szPage;
-  rc = p->pDest->pMethods->xWrite(p->pDest, pData, p->szPage, iOff);
-  if( rc!=SQLITE_OK ){
-    scrubDefragErr(p, "write failed for page %d", pgno);
-    p->rcErr = SQLITE_IOERR;
+/* Drop pooled buffers of the wrong size, once p->szPage is known */
+static void scrubDefragPoolCheck(ScrubDefragState *p){
+  if( p->szBuf!=p->szPage ){
+    scrubDefragPoolFree(p);
+    p->szBuf = p->szPage;
+  }else if( p->aOvfl ){
+    /* The kernel copy path needs it zeroed */
+    memset(p->aOvfl, 0, p->szPage);
   }
 }
 
-/* Prepare a statement against the "db" database. */
-static sqlite3_stmt *scrubDefragPrepare(
-  ScrubDefragState *p,      /* Backup context */
-  sqlite3 *db,        /* Database to prepare against */
-  const char *zSql    /* SQL statement */
-){
-  sqlite3_stmt *pStmt;
-  if( p->rcErr ) return 0;
-  p->rcErr = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
-  if( p->rcErr ){
-    scrubDefragErr(p, "SQL error \"%s\" on \"%s\"",
-                   sqlite3_errmsg(db), zSql);
-    sqlite3_finalize(pStmt);
-    return 0;
+/* Return the pooled page buffer *pp, allocating it if need be */
+static u8 *scrubDefragPoolPage(ScrubDefragState *p, u8 **pp){
+  if( *pp==0 ) *pp = scrubDefragAllocPage(p);
+  return *pp;
+}
+
+/* Microseconds from a monotonic clock, for the timers in p->st */
+static sqlite3_int64 scrubDefragClock(void){
+#ifdef CLOCK_MONOTONIC
+  struct timespec t;
+  if( clock_gettime(CLOCK_MONOTONIC, &t)==0 ){
+    return (sqlite3_int64)t.tv_sec*1000000 + t.tv_nsec/1000;
   }
-  return pStmt;
+#endif
+  return (sqlite3_int64)clock()*1000000/CLOCKS_PER_SEC;
 }
 
-/* Execute  SQL statement and return an int value */
-static void scrubDefragDbInt(
-  ScrubDefragState *p,
-  const char* zSql,
-  int * pRes,
-  const char* zErr
-){
-  int rc;
-  sqlite3_stmt *pStmt;
-  if( p->rcErr ) return;
-  pStmt = scrubDefragPrepare(p, p->dbSrc, zSql);
-  if( pStmt==0)  return; 
-  rc = sqlite3_step(pStmt);
-  if( rc==SQLITE_ROW ){
-     *pRes = sqlite3_column_int(pStmt , 0);
+/* As scrubDefragClock() if p->bTimers is set, or 0 without a system call */
+static sqlite3_int64 scrubDefragIoClock(ScrubDefragState *p){
+  return p->bTimers ? scrubDefragClock() : 0;
+}
+
+/* Add a latency of d microseconds to histogram aHist[] */
+static void scrubDefragHist(sqlite3_int64 *aHist, sqlite3_int64 d){
+  int i = 0;
+  while( i<SCRUB_DEFRAG_NHIST-1 && d>=((sqlite3_int64)1<<i) ) i++;
+  aHist[i]++;
+}
+
+/* Map a b-tree page type byte to SCRUB_DEFRAG_TYPE_*, or -1 */
+static int scrubDefragPageType(u8 eType){
+  switch( eType ){
+    case 0x02: return SCRUB_DEFRAG_TYPE_INDEX_INTERIOR;
+    case 0x05: return SCRUB_DEFRAG_TYPE_TABLE_INTERIOR;
+    case 0x0a: return SCRUB_DEFRAG_TYPE_INDEX_LEAF;
+    case 0x0d: return SCRUB_DEFRAG_TYPE_TABLE_LEAF;
   }
-  p->rcErr = sqlite3_finalize(pStmt);
-  if( p->rcErr ) {
-    scrubDefragErr(p, zErr);
+  return -1;
+}
+
+#ifdef SCRUB_DEFRAG_PROFILE
+/*
+** Profiling build.  A perf_event group of user-space cycles, instructions,
+** cache misses and branch misses is read at every step of the b-tree walk
+** and the difference charged to the type of the page that step worked on,
+** so the figures leave out the kernel side of reads and writes.  If the
+** counters cannot be opened (perf_event_paranoid, no PMU) nothing is
+** recorded.
+*/
+static void scrubDefragProfOpen(ScrubDefragState *p){
+  static const u32 aConfig[SCRUB_DEFRAG_NPROF] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  ScrubDefragStats *pSt = &p->st;
+  int i;
+  for(i=0; i<SCRUB_DEFRAG_NPROF; i++){
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = aConfig[i];
+    pe.disabled = i==0;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    pe.read_format = PERF_FORMAT_GROUP;
+    pSt->aProfFd[i] = (int)syscall(SYS_perf_event_open, &pe, 0, -1,
+                                   i ? pSt->aProfFd[0] : -1, 0);
+    if( pSt->aProfFd[i]<0 ){
+      while( i>0 ) close(pSt->aProfFd[--i]);
+      return;
+    }
   }
+  ioctl(pSt->aProfFd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(pSt->aProfFd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  pSt->bProf = 1;
+  pSt->eProf = -1;
 }
-/* Open the source database file */
-static void scrubDefragOpenSrc(ScrubDefragState *p){
-  sqlite3_stmt *pStmt;
-  int rc;
-  /* Open the source database file */
-  p->rcErr = sqlite3_open_v2(p->zSrcFile, &p->dbSrc,
-                 SQLITE_OPEN_READWRITE |
-                 SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
-  if( p->rcErr ){
-    scrubDefragErr(p, "cannot open source database: %s",
-                      sqlite3_errmsg(p->dbSrc));
-    return;
+
+static void scrubDefragProfClose(ScrubDefragState *p){
+  int i;
+  if( !p->st.bProf ) return;
+  for(i=SCRUB_DEFRAG_NPROF-1; i>=0; i--) close(p->st.aProfFd[i]);
+  p->st.bProf = 0;
+}
+
+/*
+** Charge the counters since the last call to the step that just ended,
+** then note the page type the next step works on (-1 if the walk is over).
+** A step that pushed a child is charged to the child: it read the page and
+** zeroed its free space.
+*/
+static void scrubDefragProfTick(ScrubDefragState *p, int bEnd){
+  ScrubDefragStats *pSt = &p->st;
+  sqlite3_int64 a[1+SCRUB_DEFRAG_NPROF];
+  int i, e;
+  if( !pSt->bProf ) return;
+  if( read(pSt->aProfFd[0], a, sizeof(a))!=sizeof(a) ) return;
+  e = pSt->eProf;
+  if( p->nFrame>pSt->nProfFrame ){
+    e = scrubDefragPageType(p->aFrame[p->nFrame-1].a[
+          p->aFrame[p->nFrame-1].pgno==1 ? 100 : 0]);
   }
-  p->rcErr = sqlite3_exec(p->dbSrc, "SELECT 1 FROM sqlite_master; BEGIN;",
-                          0, 0, 0);
-  if( p->rcErr ){
-    scrubDefragErr(p,
-       "cannot start a read transaction on the source database: %s",
-       sqlite3_errmsg(p->dbSrc));
-    return;
+  if( e>=0 ){
+    for(i=0; i<SCRUB_DEFRAG_NPROF; i++){
+      pSt->aProf[e][i] += a[1+i] - pSt->aProfLast[i];
+    }
   }
-  rc = sqlite3_wal_checkpoint_v2(p->dbSrc, "main", SQLITE_CHECKPOINT_FULL,
-                                 0, 0);
-  if( rc ){
-    scrubDefragErr(p, "cannot checkpoint the source database");
-    return;
+  memcpy(pSt->aProfLast, &a[1], sizeof(pSt->aProfLast));
+  pSt->nProfFrame = p->nFrame;
+  if( bEnd ){
+    pSt->eProf = -1;
+  }else if( p->iOvfl ){
+    pSt->eProf = SCRUB_DEFRAG_TYPE_OVERFLOW;
+  }else{
+    ScrubDefragFrame *pFrame = &p->aFrame[p->nFrame-1];
+    pSt->eProf = scrubDefragPageType(pFrame->a[pFrame->pgno==1 ? 100 : 0]);
   }
-  scrubDefragDbInt(p, "PRAGMA page_size", &p->szPage, 
-                      "unable to determine the page size");
-  if( p->rcErr ) return;
-  scrubDefragDbInt(p, "PRAGMA page_count", &p->nSrcPage, 
-                      "unable to determine the size of the source database");
-  if( p->rcErr ) return;
+}
+#endif /* SCRUB_DEFRAG_PROFILE */
 
-  scrubDefragDbInt(p, "PRAGMA freelist_count", &p->nFreePage, 
-                      "unable to determine the free-list size of the source database");
-  if( p->rcErr ) return;
+/*
+** I/O rate limits.
+**
+** Every scrubDefragRead() and scrubDefragWrite() draws its bytes from a
+** token bucket, one for reads and one for writes, that refills at the
+** configured rate and holds at most SCRUB_DEFRAG_BURST_MS worth of bytes.
+** The rates are process-wide and may be changed while a run is in
+** progress, either directly or through a control file that is re-read
+** once a second and whenever sqlite3_scrub_and_defrag_reload_limits() is
+** called (which is safe from a signal handler).  Each run keeps its own
+** buckets, so concurrent runs in one process are each held to the limit,
+** except the jobs of a daemon, which draw on one shared pair of buckets so
+** that the limit applies to the daemon as a whole.
+**
+** The control file name and the time of its last read are guarded by the
+** SQLITE_MUTEX_STATIC_APP1 mutex.  scrubDefragReload is only ever set
+** outside it, as a signal handler may not take a mutex.
+*/
+#define SCRUB_DEFRAG_BURST_MS       100     /* Bucket depth in milliseconds */
+#define SCRUB_DEFRAG_POLL_MS        1000    /* Control file poll interval */
 
-  sqlite3_file_control(p->dbSrc, "main", SQLITE_FCNTL_FILE_POINTER, &p->pSrc);
-  if( p->pSrc==0 || p->pSrc->pMethods==0 ){
-    scrubDefragErr(p, "cannot get the source file handle");
-    p->rcErr = SQLITE_ERROR;
+static volatile sqlite3_int64 scrubDefragReadBps = 0;   /* 0: no limit */
+static volatile sqlite3_int64 scrubDefragWriteBps = 0;  /* 0: no limit */
+static volatile int scrubDefragReload = 0;     /* Re-read the control file */
+static volatile int scrubDefragHasLimitFile = 0;  /* LimitFile is set */
+static char *scrubDefragLimitFile = 0;         /* Control file, or NULL */
+static sqlite3_int64 scrubDefragLimitPoll = 0; /* Last read of that file */
+
+/* Milliseconds since the julian epoch, from the VFS clock */
+static sqlite3_int64 scrubDefragNow(sqlite3_vfs *pVfs){
+  sqlite3_int64 t = 0;
+  if( pVfs->iVersion>=2 && pVfs->xCurrentTimeInt64 ){
+    pVfs->xCurrentTimeInt64(pVfs, &t);
+  }else{
+    double r = 0.0;
+    pVfs->xCurrentTime(pVfs, &r);
+    t = (sqlite3_int64)(r*86400000.0);
   }
+  return t;
 }
 
-/* Create and open the destination file */
-static void scrubDefragOpenDest(ScrubDefragState *p){
+/*
+** Load limits from the control file, which holds "read=N" and "write=N"
+** words giving bytes per second (0 for no limit).  Words that are absent
+** leave the limit unchanged.  Return non-zero if the file is unreadable.
+*/
+static int scrubDefragLoadLimits(const char *zFile){
+  char zWord[64];
+  long long n;
+  FILE *in = fopen(zFile, "rb");
+  if( in==0 ) return 1;
+  while( fscanf(in, "%63s", zWord)==1 ){
+    if( sscanf(zWord, "read=%lld", &n)==1 ) scrubDefragReadBps = n;
+    if( sscanf(zWord, "write=%lld", &n)==1 ) scrubDefragWriteBps = n;
+  }
+  fclose(in);
+  return 0;
+}
+
+/*
+** Re-read the control file if a reload was asked for or it was last read
+** SCRUB_DEFRAG_POLL_MS or more before iNow.  The name is copied under the
+** mutex, so that the file is read while limit_file() may replace it.
+*/
+static void scrubDefragPollLimits(sqlite3_int64 iNow){
+  sqlite3_mutex *pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  char *zFile = 0;
+  sqlite3_mutex_enter(pMutex);
+  if( scrubDefragLimitFile
+   && (scrubDefragReload || iNow-scrubDefragLimitPoll>=SCRUB_DEFRAG_POLL_MS)
+  ){
+    scrubDefragReload = 0;
+    scrubDefragLimitPoll = iNow;
+    zFile = sqlite3_mprintf("%s", scrubDefragLimitFile);
+  }
+  sqlite3_mutex_leave(pMutex);
+  if( zFile ){
+    scrubDefragLoadLimits(zFile);
+    sqlite3_free(zFile);
+  }
+}
+
+/* Wait until nByte bytes of read (bWrite==0) or write budget are free */
+static void scrubDefragThrottle(
+  ScrubDefragState *p,
+  int bWrite,
+  sqlite3_int64 nByte
+){
+  ScrubDefragBucket *pB = &p->aBucket[bWrite];
+  ScrubDefragShared *pShared = p->pShared;
+  sqlite3_int64 nRate, iNow;
+  double nCap;
+
+  if( scrubDefragHasLimitFile==0
+   && scrubDefragReadBps<=0 && scrubDefragWriteBps<=0
+  ){
+    return;
+  }
+  if( p->pClock==0 ) p->pClock = sqlite3_vfs_find(0);
+  if( scrubDefragHasLimitFile ){
+    scrubDefragPollLimits(scrubDefragNow(p->pClock));
+  }
+#if SCRUB_DEFRAG_THREADS
+  if( pShared ){
+    pB = &pShared->aBucket[bWrite];
+    pthread_mutex_lock(&pShared->mutex);
+  }
+#endif
+  /* Read the clock holding the mutex, so that pB->iLast never goes back */
+  iNow = scrubDefragNow(p->pClock);
+  while( (nRate = bWrite ? scrubDefragWriteBps : scrubDefragReadBps)>0 ){
+    int nWait;
+    nCap = nRate*(double)SCRUB_DEFRAG_BURST_MS/1000.0;
+    if( nCap<nByte ) nCap = (double)nByte;
+    if( pB->iLast==0 ){
+      pB->nToken = nCap;
+    }else{
+      pB->nToken += (iNow - pB->iLast)*(double)nRate/1000.0;
+      if( pB->nToken>nCap ) pB->nToken = nCap;
+    }
+    pB->iLast = iNow;
+    if( pB->nToken>=nByte ){
+      pB->nToken -= nByte;
+      break;
+    }
+    nWait = (int)((nByte - pB->nToken)*1000.0/nRate) + 1;
+#if SCRUB_DEFRAG_THREADS
+    if( pShared ) pthread_mutex_unlock(&pShared->mutex);
+#endif
+    sqlite3_sleep(nWait);
+#if SCRUB_DEFRAG_THREADS
+    if( pShared ) pthread_mutex_lock(&pShared->mutex);
+#endif
+    iNow = scrubDefragNow(p->pClock);
+  }
+  if( nRate<=0 ) pB->iLast = 0;
+#if SCRUB_DEFRAG_THREADS
+  if( pShared ) pthread_mutex_unlock(&pShared->mutex);
+#endif
+}
+
+/*
+** Set the process-wide limits, in bytes per second, on reading and
+** writing.  Zero or less means no limit.
+*/
+void sqlite3_scrub_and_defrag_set_limits(
+  sqlite3_int64 nReadBps,
+  sqlite3_int64 nWriteBps
+){
+  scrubDefragReadBps = nReadBps;
+  scrubDefragWriteBps = nWriteBps;
+}
+
+/*
+** Take the limits from control file zFile from now on, or stop polling if
+** zFile is NULL.  Return SQLITE_CANTOPEN if the file cannot be read.
+*/
+int sqlite3_scrub_and_defrag_limit_file(const char *zFile){
+  sqlite3_mutex *pMutex;
+  char *zCopy = 0;
+  char *zOld;
+  if( zFile ){
+    if( scrubDefragLoadLimits(zFile) ) return SQLITE_CANTOPEN;
+    zCopy = sqlite3_mprintf("%s", zFile);
+    if( zCopy==0 ) return SQLITE_NOMEM;
+  }
+  pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+  sqlite3_mutex_enter(pMutex);
+  zOld = scrubDefragLimitFile;
+  scrubDefragLimitFile = zCopy;
+  scrubDefragHasLimitFile = zCopy!=0;
+  sqlite3_mutex_leave(pMutex);
+  sqlite3_free(zOld);
+  return SQLITE_OK;
+}
+
+/* Re-read the control file before the next I/O.  Async-signal-safe. */
+void sqlite3_scrub_and_defrag_reload_limits(void){
+  scrubDefragReload = 1;
+}
+
+/*
+** Move the calling thread to the idle I/O scheduling class, so that its
+** reads and writes are only served when the disk is otherwise idle.
+** Return SQLITE_OK on success, or SQLITE_ERROR where that is unsupported.
+*/
+int sqlite3_scrub_and_defrag_idle_io(void){
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  /* ioprio_set(IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE,0)) */
+  if( syscall(SYS_ioprio_set, 1, 0, 3<<13)==0 ) return SQLITE_OK;
+#endif
+  return SQLITE_ERROR;
+}
+
+/*
+** Page checksums.
+**
+** A database used with the checksum VFS (ext/misc/cksumvfs.c) has 8 bytes
+** reserved at the end of every page that hold two 32-bit sums over the
+** rest of it, read as little-endian words w[0], w[1], ... in pairs:
+**
+**     s1 += w[2i] + s2;   s2 += w[2i+1] + s1;
+**
+** The recurrence is linear, so each sum is also a fixed weighted sum of
+** the words, the weights being Fibonacci numbers that depend only on the
+** position of a word in the page.  A copy with checksums on computes the
+** weights once and then checksums a page as two dot products, which
+** vectorize: 8 words at a time with AVX2, 4 with SSE2, and otherwise the
+** recurrence above one pair at a time.
+*/
+#define SCRUB_DEFRAG_CKSUM_RESERVE  8
+
+/*
+** Fill p->aCksumW[] with the weight of each word of a page in s1, followed
+** by the weight of each word in s2.
+*/
+static void scrubDefragCksumInit(ScrubDefragState *p){
+  u32 nWord = (p->szPage - SCRUB_DEFRAG_CKSUM_RESERVE)/4;
+  u32 *aW1, *aW2, a = 1, b = 0, t;
+  int j;
+  aW1 = sqlite3_malloc64(2*(sqlite3_int64)nWord*sizeof(u32));
+  if( aW1==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  aW2 = &aW1[nWord];
+  /* Pair j is followed by k pairs and enters the sums through M^k, where
+  ** M = [[1,1],[1,2]] and M^k = [[a,b],[b,a+b]]. */
+  for(j=(int)nWord/2-1; j>=0; j--){
+    aW1[2*j] = a+b;
+    aW1[2*j+1] = b;
+    aW2[2*j] = a+2*b;
+    aW2[2*j+1] = a+b;
+    t = a+b;
+    b = a+2*b;
+    a = t;
+  }
+  p->aCksumW = aW1;
+}
+
+/* Checksum page a[] into aOut[0..7] */
+static void scrubDefragCksumCompute(ScrubDefragState *p, const u8 *a, u8 *aOut){
+  u32 nWord = (p->szPage - SCRUB_DEFRAG_CKSUM_RESERVE)/4;
+  u32 s1 = 0, s2 = 0, i = 0;
+#if defined(__AVX2__)
+  const u32 *aW1 = p->aCksumW, *aW2 = &p->aCksumW[nWord];
+  __m256i acc1 = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256();
+  __m128i h1, h2;
+  for(; i+8<=nWord; i+=8){
+    __m256i w = _mm256_loadu_si256((const __m256i*)&a[4*i]);
+    acc1 = _mm256_add_epi32(acc1, _mm256_mullo_epi32(w,
+               _mm256_loadu_si256((const __m256i*)&aW1[i])));
+    acc2 = _mm256_add_epi32(acc2, _mm256_mullo_epi32(w,
+               _mm256_loadu_si256((const __m256i*)&aW2[i])));
+  }
+  h1 = _mm_add_epi32(_mm256_castsi256_si128(acc1),
+                     _mm256_extracti128_si256(acc1, 1));
+  h2 = _mm_add_epi32(_mm256_castsi256_si128(acc2),
+                     _mm256_extracti128_si256(acc2, 1));
+  h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, 0x4e));
+  h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, 0x4e));
+  h1 = _mm_add_epi32(h1, _mm_shuffle_epi32(h1, 0xb1));
+  h2 = _mm_add_epi32(h2, _mm_shuffle_epi32(h2, 0xb1));
+  s1 = (u32)_mm_cvtsi128_si32(h1);
+  s2 = (u32)_mm_cvtsi128_si32(h2);
+  for(; i<nWord; i++){
+    u32 w;
+    memcpy(&w, &a[4*i], 4);
+    s1 += w*aW1[i];
+    s2 += w*aW2[i];
+  }
+#elif SCRUB_DEFRAG_LANES
+  /* No 32-bit multiply in SSE2: even and odd lanes are multiplied into
+  ** 64-bit products, of which only the low halves are kept in the end. */
+  const u32 *aW1 = p->aCksumW, *aW2 = &p->aCksumW[nWord];
+  __m128i e1 = _mm_setzero_si128(), o1 = _mm_setzero_si128();
+  __m128i e2 = _mm_setzero_si128(), o2 = _mm_setzero_si128();
+  __m128i h1, h2;
+  for(; i+4<=nWord; i+=4){
+    __m128i w = _mm_loadu_si128((const __m128i*)&a[4*i]);
+    __m128i c1 = _mm_loadu_si128((const __m128i*)&aW1[i]);
+    __m128i c2 = _mm_loadu_si128((const __m128i*)&aW2[i]);
+    __m128i wo = _mm_srli_epi64(w, 32);
+    e1 = _mm_add_epi64(e1, _mm_mul_epu32(w, c1));
+    o1 = _mm_add_epi64(o1, _mm_mul_epu32(wo, _mm_srli_epi64(c1, 32)));
+    e2 = _mm_add_epi64(e2, _mm_mul_epu32(w, c2));
+    o2 = _mm_add_epi64(o2, _mm_mul_epu32(wo, _mm_srli_epi64(c2, 32)));
+  }
+  h1 = _mm_add_epi32(e1, o1);
+  h2 = _mm_add_epi32(e2, o2);
+  s1 = (u32)_mm_cvtsi128_si32(h1) + (u32)_mm_cvtsi128_si32(_mm_srli_si128(h1,8));
+  s2 = (u32)_mm_cvtsi128_si32(h2) + (u32)_mm_cvtsi128_si32(_mm_srli_si128(h2,8));
+  for(; i<nWord; i++){
+    u32 w;
+    memcpy(&w, &a[4*i], 4);
+    s1 += w*aW1[i];
+    s2 += w*aW2[i];
+  }
+#else
+  for(; i<nWord; i+=2, a+=8){
+    s1 += ((u32)a[0] | (u32)a[1]<<8 | (u32)a[2]<<16 | (u32)a[3]<<24) + s2;
+    s2 += ((u32)a[4] | (u32)a[5]<<8 | (u32)a[6]<<16 | (u32)a[7]<<24) + s1;
+  }
+#endif
+  aOut[0] = (u8)s1;  aOut[1] = (u8)(s1>>8);
+  aOut[2] = (u8)(s1>>16);  aOut[3] = (u8)(s1>>24);
+  aOut[4] = (u8)s2;  aOut[5] = (u8)(s2>>8);
+  aOut[6] = (u8)(s2>>16);  aOut[7] = (u8)(s2>>24);
+}
+
+/* True if the checksum stored at the end of page a[] is correct */
+static int scrubDefragCksumOk(ScrubDefragState *p, const u8 *a){
+  u8 aSum[SCRUB_DEFRAG_CKSUM_RESERVE];
+  scrubDefragCksumCompute(p, a, aSum);
+  return memcmp(aSum, &a[p->szPage-SCRUB_DEFRAG_CKSUM_RESERVE], 8)==0;
+}
+
+/* Store the checksum of page a[] in its last 8 bytes */
+static void scrubDefragCksumSet(ScrubDefragState *p, u8 *a){
+  scrubDefragCksumCompute(p, a, &a[p->szPage-SCRUB_DEFRAG_CKSUM_RESERVE]);
+}
+
+/* Read a page from the source database into memory.  Use the memory
+** provided by pBuf if not NULL or allocate a new page if pBuf==NULL.
+*/
+static u8 *scrubDefragRead(ScrubDefragState *p, int pgno, u8 *pBuf){
+  int rc;
+  sqlite3_int64 iOff;
+  sqlite3_int64 t0, t1, t2;
+  u8 *pOut = pBuf;
+  if( p->rcErr ) return 0;
+  if( pOut==0 ){
+    pOut = scrubDefragAllocPage(p);
+    if( pOut==0 ) return 0;
+  }
+  iOff = (pgno-1)*(sqlite3_int64)p->szPage;
+  t0 = scrubDefragIoClock(p);
+  scrubDefragThrottle(p, 0, p->szPage);
+  t1 = scrubDefragIoClock(p);
+  rc = p->pSrc->pMethods->xRead(p->pSrc, pOut, p->szPage, iOff);
+  if( p->bTimers ){
+    t2 = scrubDefragClock();
+    p->st.tThrottle += t1 - t0;
+    p->st.tRead += t2 - t1;
+    scrubDefragHist(p->st.aReadHist, t2 - t1);
+  }
+  p->nByteRead += p->szPage;
+  if( rc!=SQLITE_OK ){
+    if( pBuf==0 ) sqlite3_free(pOut);
+    pOut = 0;
+    scrubDefragErr(p, "read failed for page %d", pgno);
+    p->rcErr = SQLITE_IOERR;
+  }else if( p->bCksum && !scrubDefragCksumOk(p, pOut) ){
+    if( pBuf==0 ) sqlite3_free(pOut);
+    pOut = 0;
+    scrubDefragErr(p, "checksum mismatch on page %d of source database",
+                   pgno);
+    p->rcErr = SQLITE_CORRUPT;
+  }
+  return pOut;  
+}
+
+/* Write a page to the destination database */
+static void scrubDefragWrite(ScrubDefragState *p, int pgno, const u8 *pData){
+  int rc;
+  sqlite3_int64 iOff;
+  sqlite3_int64 t0, t1, t2;
+  if( p->rcErr ) return;
+  if( pgno > p->nDestPage ){
+    scrubDefragErr(p, "internal logic error or database is corrupt, "
+                   "please run 'pragma integrity_check' on database: %s",
+                   p->zSrcFile);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  iOff = (pgno-1)*(sqlite3_int64)p->szPage;
+  if( p->aOut ){
+    /* Pages are normally read straight into their slot in the image */
+    if( &p->aOut[iOff]!=pData ) memcpy(&p->aOut[iOff], pData, p->szPage);
+    p->nByteWrite += p->szPage;
+    return;
+  }
+  t0 = scrubDefragIoClock(p);
+  scrubDefragThrottle(p, 1, p->szPage);
+  t1 = scrubDefragIoClock(p);
+  rc = p->pDest->pMethods->xWrite(p->pDest, pData, p->szPage, iOff);
+  if( p->bTimers ){
+    t2 = scrubDefragClock();
+    p->st.tThrottle += t1 - t0;
+    p->st.tWrite += t2 - t1;
+    scrubDefragHist(p->st.aWriteHist, t2 - t1);
+  }
+  if( rc!=SQLITE_OK ){
+    scrubDefragErr(p, "write failed for page %d", pgno);
+    p->rcErr = SQLITE_IOERR;
+    p->bDestErr = 1;
+    return;
+  }
+  p->nByteWrite += p->szPage;
+}
+
+/*
+** When copying to memory, return the slot of destination page pgno in
+** p->aOut, so that the source page can be read into the place it is
+** written from.  Return NULL when copying to a file or on error.
+*/
+static u8 *scrubDefragSlot(ScrubDefragState *p, u32 pgno){
+  if( p->aOut==0 || p->rcErr ) return 0;
+  if( pgno==0 || pgno>p->nDestPage ){
+    scrubDefragErr(p, "internal logic error or database is corrupt, "
+                   "please run 'pragma integrity_check' on database: %s",
+                   p->zSrcFile);
+    p->rcErr = SQLITE_CORRUPT;
+    return 0;
+  }
+  return &p->aOut[(pgno-1)*(sqlite3_int64)p->szPage];
+}
+
+/* Prepare a statement against the "db" database. */
+static sqlite3_stmt *scrubDefragPrepare(
+  ScrubDefragState *p,      /* Backup context */
+  sqlite3 *db,        /* Database to prepare against */
+  const char *zSql    /* SQL statement */
+){
   sqlite3_stmt *pStmt;
+  if( p->rcErr ) return 0;
+  p->rcErr = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  if( p->rcErr ){
+    scrubDefragErr(p, "SQL error \"%s\" on \"%s\"",
+                   sqlite3_errmsg(db), zSql);
+    sqlite3_finalize(pStmt);
+    return 0;
+  }
+  return pStmt;
+}
+
+/* Execute  SQL statement and return an int value */
+static void scrubDefragDbInt(
+  ScrubDefragState *p,
+  const char* zSql,
+  int * pRes,
+  const char* zErr
+){
   int rc;
-  char *zSql;
+  sqlite3_stmt *pStmt;
   if( p->rcErr ) return;
-  p->rcErr = sqlite3_open_v2(p->zDestFile, &p->dbDest,
-                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+  pStmt = scrubDefragPrepare(p, p->dbSrc, zSql);
+  if( pStmt==0)  return; 
+  rc = sqlite3_step(pStmt);
+  if( rc==SQLITE_ROW ){
+     *pRes = sqlite3_column_int(pStmt , 0);
+  }
+  p->rcErr = sqlite3_finalize(pStmt);
+  if( p->rcErr ) {
+    scrubDefragErr(p, zErr);
+  }
+}
+/*
+** Start reading schema p->zSrcDb ("main" if NULL) of connection p->dbSrc:
+** begin a read transaction, checkpoint, and find the page size, page
+** count, freelist size and file handle.
+*/
+static void scrubDefragBeginSrc(ScrubDefragState *p){
+  const char *zDb = p->zSrcDb ? p->zSrcDb : "main";
+  static const char *azPragma[] = { "page_size", "page_count",
+                                    "freelist_count" };
+  static const char *azErr[] = {
+    "unable to determine the page size",
+    "unable to determine the size of the source database",
+    "unable to determine the free-list size of the source database"
+  };
+  u32 *apOut[3];
+  char *zSql;
+  int rc, i, n;
+  int nLog = 0, nCkpt = 0;
+
+  apOut[0] = &p->szPage;
+  apOut[1] = &p->nSrcPage;
+  apOut[2] = &p->nFreePage;
+  zSql = sqlite3_mprintf("SELECT 1 FROM \"%w\".sqlite_master; BEGIN;", zDb);
+  if( zSql==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  p->rcErr = sqlite3_exec(p->dbSrc, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+  if( p->rcErr ){
+    scrubDefragErr(p,
+       "cannot start a read transaction on the source database: %s",
+       sqlite3_errmsg(p->dbSrc));
+    return;
+  }
+  p->st.tCkpt = scrubDefragClock();
+  rc = sqlite3_wal_checkpoint_v2(p->dbSrc, zDb, p->eCkpt, &nLog, &nCkpt);
+  p->st.tCkpt = scrubDefragClock() - p->st.tCkpt;
+  if( rc || (p->dbLock && nLog!=nCkpt) ){
+    /* With writers locked out by p->dbLock, a passive checkpoint that does
+    ** not reach the end of the WAL means an older reader is holding it back
+    ** and the database file is not the latest snapshot. */
+    scrubDefragErr(p, "cannot checkpoint the source database");
+    return;
+  }
+  for(i=0; i<3; i++){
+    zSql = sqlite3_mprintf("PRAGMA \"%w\".%s", zDb, azPragma[i]);
+    if( zSql==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    n = 0;
+    scrubDefragDbInt(p, zSql, &n, azErr[i]);
+    sqlite3_free(zSql);
+    if( p->rcErr ) return;
+    *apOut[i] = (u32)n;
+  }
+
+  /* The read transaction now pins the snapshot, so writers may resume */
+  if( p->dbLock ){
+    sqlite3_exec(p->dbLock, "COMMIT;", 0, 0, 0);
+  }
+
+  sqlite3_file_control(p->dbSrc, zDb, SQLITE_FCNTL_FILE_POINTER, &p->pSrc);
+  if( p->pSrc==0 || p->pSrc->pMethods==0 ){
+    scrubDefragErr(p, "cannot get the source file handle");
+    p->rcErr = SQLITE_ERROR;
+  }
+}
+
+/* Open the source database file */
+static void scrubDefragOpenSrc(ScrubDefragState *p){
+  p->rcErr = sqlite3_open_v2(p->zSrcFile, &p->dbSrc,
+                 SQLITE_OPEN_READWRITE |
                  SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
   if( p->rcErr ){
-    scrubDefragErr(p, "cannot open destination database: %s",
-                      sqlite3_errmsg(p->dbDest));
+    scrubDefragErr(p, "cannot open source database: %s",
+                      sqlite3_errmsg(p->dbSrc));
     return;
   }
+  scrubDefragBeginSrc(p);
+}
+
+/*
+** Prepare connection p->dbDest to receive the copy: set the page size,
+** turn the journal off and take an exclusive lock on the empty database,
+** then find its file handle.  The journal mode of a connection that
+** belongs to the caller is saved in p->zDestJournal.
+*/
+static void scrubDefragBeginDest(ScrubDefragState *p){
+  sqlite3_stmt *pStmt;
+  int rc;
+  char *zSql;
+  if( p->rcErr ) return;
+  if( p->bBorrowDest ){
+    pStmt = scrubDefragPrepare(p, p->dbDest, "PRAGMA main.journal_mode;");
+    if( pStmt==0 ) return;
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      p->zDestJournal = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+      if( p->zDestJournal==0 ) p->rcErr = SQLITE_NOMEM;
+    }
+    sqlite3_finalize(pStmt);
+    if( p->rcErr ) return;
+  }
   zSql = sqlite3_mprintf("PRAGMA page_size(%u);", p->szPage);
   if( zSql==0 ){
     p->rcErr = SQLITE_NOMEM;
@@ -279,6 +1553,20 @@ static void scrubDefragOpenDest(ScrubDefragState *p){
                    sqlite3_column_int(pStmt, 0));
   }
   sqlite3_finalize(pStmt);
+  if( p->rcErr ) return;
+  if( p->bBorrowDest ){
+    /* A WAL database keeps the page size it was created with */
+    pStmt = scrubDefragPrepare(p, p->dbDest, "PRAGMA main.page_size;");
+    if( pStmt==0 ) return;
+    if( sqlite3_step(pStmt)!=SQLITE_ROW
+     || (u32)sqlite3_column_int(pStmt, 0)!=p->szPage
+    ){
+      scrubDefragErr(p, "cannot set the page size of the destination "
+                        "to %u", p->szPage);
+    }
+    sqlite3_finalize(pStmt);
+    if( p->rcErr ) return;
+  }
   sqlite3_file_control(p->dbDest, "main", SQLITE_FCNTL_FILE_POINTER, &p->pDest);
   if( p->pDest==0 || p->pDest->pMethods==0 ){
     scrubDefragErr(p, "cannot get the destination file handle");
@@ -286,6 +1574,49 @@ static void scrubDefragOpenDest(ScrubDefragState *p){
   }
 }
 
+/* Open the destination database file */
+static void scrubDefragOpenDest(ScrubDefragState *p){
+  if( p->rcErr ) return;
+  p->rcErr = sqlite3_open_v2(p->zDestFile, &p->dbDest,
+                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                 SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
+  if( p->rcErr ){
+    scrubDefragErr(p, "cannot open destination database: %s",
+                      sqlite3_errmsg(p->dbDest));
+    return;
+  }
+  scrubDefragBeginDest(p);
+}
+
+/*
+** Let go of p->dbDest after the pages have been written around its pager.
+** A connection of our own is closed without committing, which would write
+** its stale page 1 over the copy.  One that belongs to the caller has its
+** transaction rolled back instead, which with the journal off drops the
+** page cache and lock and leaves the file as written, and gets its journal
+** mode back.
+*/
+static void scrubDefragEndDest(ScrubDefragState *p){
+  p->pDest = 0;
+  if( !p->bBorrowDest ){
+    sqlite3_close(p->dbDest);
+    p->dbDest = 0;
+    return;
+  }
+  if( p->dbDest==0 ) return;
+  if( !sqlite3_get_autocommit(p->dbDest) ){
+    sqlite3_exec(p->dbDest, "ROLLBACK;", 0, 0, 0);
+  }
+  if( p->zDestJournal ){
+    char *zSql = sqlite3_mprintf("PRAGMA main.journal_mode=%s;",
+                                 p->zDestJournal);
+    if( zSql ) sqlite3_exec(p->dbDest, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+    sqlite3_free(p->zDestJournal);
+    p->zDestJournal = 0;
+  }
+}
+
 /* Read a 32-bit big-endian integer */
 static u32 scrubDefragInt32(const u8 *a){
   u32 v = a[3];
@@ -313,6 +1644,9 @@ static u32 scrubDefragInt16(const u8 *a){
 static int scrubDefragVarint(const u8 *z, sqlite3_int64 *pVal){
   sqlite3_int64 v = 0;
   int i;
+  /* Payload sizes are nearly always one or two bytes */
+  if( z[0]<0x80 ){ *pVal = z[0]; return 1; }
+  if( z[1]<0x80 ){ *pVal = ((sqlite3_int64)(z[0]&0x7f)<<7) | z[1]; return 2; }
   for(i=0; i<8; i++){
     v = (v<<7) + (z[i]&0x7f);
     if( (z[i]&0x80)==0 ){ *pVal = v; return i+1; }
@@ -327,262 +1661,6730 @@ static int scrubDefragVarint(const u8 *z, sqlite3_int64 *pVal){
 */
 static int scrubDefragVarintSize(const u8 *z){
   int i;
-  for(i=0; i<8; i++){
+  if( z[0]<0x80 ) return 1;
+  for(i=1; i<8; i++){
     if( (z[i]&0x80)==0 ){ return i+1; }
   }
   return 9;
 }
 
-/*
-** Copy an overflow chain from source to destination.  Zero out any
-** unused tail at the end of the overflow chain.
-*/
-static void scrubDefragOverflow(ScrubDefragState *p, int pgno, u32 nByte){
-  u8 *a, *aBuf;
-  u32 iCurrentPageNo;
+/* Size in bytes of a record value of serial type t */
+static u32 scrubDefragSerialSize(sqlite3_int64 t){
+  static const u8 aSize[] = { 0, 1, 2, 3, 4, 6, 8, 8, 0, 0, 0, 0 };
+  if( t<12 ) return aSize[t];
+  return (u32)((t-12)/2);
+}
 
-  aBuf = scrubDefragAllocPage(p);
-  if( aBuf==0 ) return;
-  while( nByte>0 && pgno!=0 ){
-    a = scrubDefragRead(p, pgno, aBuf);
-    if( a==0 ) break;
-    if( nByte >= (p->szUsable)-4 ){
-      nByte -= (p->szUsable) - 4;
-    }else{
-      u32 x = (p->szUsable - 4) - nByte;
-      u32 i = p->szUsable - x;
-      memset(&a[i], 0, x);
-      nByte = 0;
-    }
-    pgno = scrubDefragInt32(a);
-    iCurrentPageNo = p->iDestPageNo;
-    if(pgno !=0) {
-      scrubDefragIncDestPageNo(p);
-      scrubDefragWriteInt32(a, p->iDestPageNo);
-    }
-    scrubDefragWrite(p, iCurrentPageNo, a);
+/* Count a page of type eType (or -1) as written and report progress */
+static void scrubDefragEmitted(ScrubDefragState *p, int eType){
+  if( eType>=0 ) p->st.aWrite[eType]++;
+  p->nPageDone++;
+  if( p->xProgress
+   && (p->nPageDone % p->nProgressStep==0 || p->nPageDone==p->nDestPage)
+   && p->xProgress(p->pProgressArg, p->nPageDone, p->nDestPage,
+                   p->nByteRead, p->nByteWrite, p->zBtree)
+  ){
+    scrubDefragErr(p, "interrupted by the progress callback");
+    p->rcErr = SQLITE_ABORT;
   }
-  sqlite3_free(aBuf);      
 }
-   
 
 /*
-** Copy B-Tree page pgno, and all of its children, from source to destination.
-** Zero out deleted content during the copy.
+** Hand a finished page over to the destination.  Normally the page is
+** written at iDest, after its checksum if those are on.  During the
+** mapping pass of an in-place defrag nothing is written; the destination
+** of source page iSrc is recorded instead.  Either way the page counts
+** towards p->nPageDone.
 */
-static void scrubDefragBtree(ScrubDefragState *p, int pgno, int iDepth, int bRoot){
-  u8 *a;
-  u32 i, n, pc;
-  u32 nCell;
-  u32 nPrefix;
-  u32 szHdr;
-  u32 iChild;
+static void scrubDefragEmit(
+  ScrubDefragState *p,
+  u32 iSrc,                /* Source page number */
+  u32 iDest,               /* Destination page number */
+  u8 eKind,                /* SCRUB_DEFRAG_KIND_BTREE or _OVERFLOW */
+  u8 *a                    /* Page content */
+){
+  if( p->aMap==0 ){
+    int eType = SCRUB_DEFRAG_TYPE_OVERFLOW;
+    if( p->bCksum ) scrubDefragCksumSet(p, a);
+    scrubDefragWrite(p, iDest, a);
+    if( p->rcErr ) return;
+    if( eKind==SCRUB_DEFRAG_KIND_BTREE ){
+      eType = scrubDefragPageType(a[iSrc==1 ? 100 : 0]);
+    }
+    scrubDefragEmitted(p, eType);
+    return;
+  }
+  if( p->rcErr ) return;
+  p->nPageDone++;
+  if( iSrc>p->nSrcPage || p->aKind[iSrc] ){
+    scrubDefragErr(p, "corrupt: page %d is used more than once", iSrc);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  p->aMap[iSrc] = iDest;
+  p->aKind[iSrc] = eKind;
+}
+
+/* Offset of cell i from the cell pointer array aPtr[] */
+#define SCRUB_DEFRAG_CELL(aPtr, i) (((u32)(aPtr)[2*(i)]<<8) | (aPtr)[2*(i)+1])
+
+/*
+** Strict mode.
+**
+** The copy already parses every page it copies, so a strict copy checks
+** most of what 'pragma integrity_check' would along the way: that no page
+** is reached twice or lies outside the file, that the pages of a b-tree are
+** all of the same kind (table or index) and all of its leaves at the same
+** depth, that the rowids of a table are in ascending order within and
+** across pages, interior keys included, that overflow chains are exactly
+** as long as their payloads, and that every page not on the freelist is
+** reached.  The order of index keys is not checked, since comparing them
+** needs the collating sequences.
+*/
+
+/*
+** Mark source page pgno as reached.  Return non-zero if it is out of range,
+** the lock page, or was reached before.
+*/
+static int scrubDefragStrictSeen(ScrubDefragState *p, u32 pgno){
+  u8 m = (u8)(1 << (pgno & 7));
+  if( pgno<1 || pgno>p->nSrcPage || pgno==p->iLock ) return 1;
+  if( p->aSeen[pgno>>3] & m ) return 1;
+  p->aSeen[pgno>>3] |= m;
+  return 0;
+}
+
+/*
+** Rowid iKey comes next in key order, from a leaf cell if bLeaf or else
+** from a table interior cell.  Return non-zero if it is out of order: leaf
+** rowids exceed every key before them, an interior key may equal the last
+** rowid of its left child.
+*/
+static int scrubDefragStrictKey(
+  ScrubDefragState *p,
+  sqlite3_int64 iKey,
+  int bLeaf
+){
+  if( p->bKey && (iKey<p->iKey || (bLeaf && iKey==p->iKey)) ) return 1;
+  p->iKey = iKey;
+  p->bKey = 1;
+  return 0;
+}
+
+/*
+** Check b-tree page pgno, content a[], before it is pushed onto the walk
+** stack.  Return 0 or the line number of the failed check.
+*/
+static int scrubDefragStrictPage(
+  ScrubDefragState *p,
+  u32 pgno,
+  const u8 *a,
+  int bRoot
+){
+  const u8 *aTop = &a[pgno==1 ? 100 : 0];
+  const u8 *aPtr;
+  u8 eType = aTop[0];
+  int iDepth = p->nFrame;
+  u32 nCell, i, pc, mxPc;
+  sqlite3_int64 iKey;
+
+  if( scrubDefragPageType(eType)<0 ) return __LINE__;
+  if( bRoot ){
+    p->nLeafDepth = 0;
+    p->bKey = 0;
+  }else if( (eType & ~0x08)!=(p->aFrame[iDepth-1].eType & ~0x08) ){
+    return __LINE__;       /* A table page in an index or the reverse */
+  }
+  if( (eType & 0x08)==0 ){
+    if( p->nLeafDepth && iDepth+1>=p->nLeafDepth ) return __LINE__;
+    return 0;
+  }
+  if( p->nLeafDepth==0 ){
+    p->nLeafDepth = iDepth+1;
+  }else if( p->nLeafDepth!=iDepth+1 ){
+    return __LINE__;
+  }
+  if( eType!=0x0d ) return 0;
+  nCell = scrubDefragInt16(&aTop[3]);
+  aPtr = &aTop[8];
+  mxPc = p->szUsable - 3 - 9;
+  for(i=0; i<nCell; i++){
+    pc = SCRUB_DEFRAG_CELL(aPtr, i);
+    if( pc-9 > mxPc ) return __LINE__;
+    pc += scrubDefragVarintSize(&a[pc]);
+    scrubDefragVarint(&a[pc], &iKey);
+    if( scrubDefragStrictKey(p, iKey, 1) ) return __LINE__;
+  }
+  return 0;
+}
+
+/*
+** Check the key of the table interior cell at offset pc of a[], once the
+** subtree to its left has been walked.  Return 0 or the line number of
+** the failed check.
+*/
+static int scrubDefragStrictSep(ScrubDefragState *p, const u8 *a, u32 pc){
+  sqlite3_int64 iKey;
+  scrubDefragVarint(&a[pc+4], &iKey);
+  return scrubDefragStrictKey(p, iKey, 0) ? __LINE__ : 0;
+}
+
+#if SCRUB_DEFRAG_KCOPY
+/*
+** Return the number of descriptors of this process open on the file h is
+** open on, or -1 if that cannot be told.
+*/
+static int scrubDefragKcopyUsers(int h){
+  DIR *pDir;
+  struct dirent *pEnt;
+  struct stat st1, st2;
+  int n = 0;
+  if( fstat(h, &st1) ) return -1;
+  pDir = opendir("/proc/self/fd");
+  if( pDir==0 ) return -1;
+  while( (pEnt = readdir(pDir))!=0 ){
+    int i = atoi(pEnt->d_name);
+    if( pEnt->d_name[0]<'0' || pEnt->d_name[0]>'9' || i==dirfd(pDir) ){
+      continue;
+    }
+    if( fstat(i, &st2)==0
+     && st1.st_dev==st2.st_dev && st1.st_ino==st2.st_ino
+    ){
+      n++;
+    }
+  }
+  closedir(pDir);
+  return n;
+}
+
+/*
+** Open a descriptor of our own on the file of schema zDb of db, for reading
+** or (bWrite) writing, or return -1 if it is not a plain file of the unix
+** VFS.  Closing it would drop every POSIX lock this process holds on the
+** file, so it is only opened if the connection's own descriptor is the
+** only other one, and is closed by scrubDefragKcopyClose() once that
+** connection is closed.
+*/
+static int scrubDefragKcopyFd(sqlite3 *db, const char *zDb, int bWrite){
+  const char *zPath = sqlite3_db_filename(db, zDb);
+  char *zVfs = 0;
+  struct stat st;
+  int h;
+  sqlite3_file_control(db, zDb, SQLITE_FCNTL_VFSNAME, &zVfs);
+  h = zVfs && strncmp(zVfs, "unix", 4)==0 && strchr(zVfs, '/')==0;
+  sqlite3_free(zVfs);
+  if( !h || zPath==0 || zPath[0]==0 ) return -1;
+  h = open(zPath, (bWrite ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+  if( h<0 ) return -1;
+  if( fstat(h, &st) || !S_ISREG(st.st_mode) || scrubDefragKcopyUsers(h)!=2 ){
+    close(h);
+    return -1;
+  }
+  return h;
+}
+
+/*
+** Turn on kernel copies of overflow pages if both files allow them.  Only
+** connections opened for this copy qualify: a connection of the caller, or
+** the other connections of an online run, may hold locks on the file that
+** closing the descriptors afterwards would drop.
+*/
+static void scrubDefragKcopyOpen(ScrubDefragState *p){
+  p->bKcopyFd = 1;
+  p->fdSrc = p->fdDest = -1;
+  if( p->pDest==0 || p->bBorrowDest || p->bBorrowSrc || p->dbLock ) return;
+  p->fdSrc = scrubDefragKcopyFd(p->dbSrc, p->zSrcDb ? p->zSrcDb : "main", 0);
+  if( p->fdSrc>=0 ) p->fdDest = scrubDefragKcopyFd(p->dbDest, "main", 1);
+  p->bKcopy = p->fdSrc>=0 && p->fdDest>=0;
+}
+
+/*
+** Close the descriptors of scrubDefragKcopyOpen(), once the connections
+** to both files are closed.  If some other descriptor was opened on a file
+** since, closing ours could drop its locks, so that one is left open.
+*/
+static void scrubDefragKcopyClose(ScrubDefragState *p){
+  if( !p->bKcopyFd ) return;
+  if( p->fdSrc>=0 && scrubDefragKcopyUsers(p->fdSrc)==1 ) close(p->fdSrc);
+  if( p->fdDest>=0 && scrubDefragKcopyUsers(p->fdDest)==1 ) close(p->fdDest);
+  p->fdSrc = p->fdDest = -1;
+  p->bKcopyFd = 0;
+  p->bKcopy = 0;
+}
+
+/*
+** Copy the pending run of overflow pages with copy_file_range(), then
+** write the new next-page pointers over the copy and zero the last nTail
+** bytes of content on its last page.  If the kernel cannot copy between
+** the two files, the run goes through memory and so does the rest.  The
+** pages of the run are counted as written only here, once they are, so
+** that progress reports agree with p->nByteWrite.
+*/
+static void scrubDefragKcopyFlush(ScrubDefragState *p, u32 nTail){
+  sqlite3_int64 iIn = (p->iRunSrc-1)*(sqlite3_int64)p->szPage;
+  sqlite3_int64 iOut = (p->iRunDest-1)*(sqlite3_int64)p->szPage;
+  sqlite3_int64 nByte = p->nRun*(sqlite3_int64)p->szPage;
+  sqlite3_int64 t0, t1, t2;
+  u32 i, nRun = p->nRun;
+  int rc = SQLITE_OK;
+  u8 aPtr[4];
+
+  p->nRun = 0;
+  if( p->rcErr || nRun==0 ) return;
+  if( p->iRunDest+nRun-1 > p->nDestPage ){
+    scrubDefragErr(p, "internal logic error or database is corrupt, "
+                   "please run 'pragma integrity_check' on database: %s",
+                   p->zSrcFile);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  t0 = scrubDefragIoClock(p);
+  scrubDefragThrottle(p, 0, nByte);
+  scrubDefragThrottle(p, 1, nByte);
+  t1 = scrubDefragIoClock(p);
+  while( nByte>0 ){
+    long n = syscall(SYS_copy_file_range, p->fdSrc, &iIn, p->fdDest, &iOut,
+                     (size_t)nByte, 0);
+    if( n<=0 ) break;
+    nByte -= n;
+  }
+  if( p->bTimers ){
+    t2 = scrubDefragClock();
+    p->st.tThrottle += t1 - t0;
+    p->st.tWrite += t2 - t1;
+    scrubDefragHist(p->st.aWriteHist, t2 - t1);
+  }
+  if( nByte>0 ){
+    /* EXDEV, ENOSYS, EOPNOTSUPP or a short source: copy through memory */
+    p->bKcopy = 0;
+    for(i=0; i<nRun && p->rcErr==SQLITE_OK; i++){
+      u8 *a = scrubDefragRead(p, p->iRunSrc+i, p->aOvfl);
+      if( a==0 ) return;
+      scrubDefragWriteInt32(a, p->aRunNext[i]);
+      if( i==nRun-1 ) memset(&a[p->szUsable-nTail], 0, nTail);
+      scrubDefragWrite(p, p->iRunDest+i, a);
+      if( p->rcErr ) return;
+      scrubDefragEmitted(p, SCRUB_DEFRAG_TYPE_OVERFLOW);
+    }
+    return;
+  }
+  p->st.nKcopy += nRun;
+  for(i=0; i<nRun && rc==SQLITE_OK; i++){
+    iOut = (p->iRunDest+i-1)*(sqlite3_int64)p->szPage;
+    scrubDefragWriteInt32(aPtr, p->aRunNext[i]);
+    rc = p->pDest->pMethods->xWrite(p->pDest, aPtr, 4, iOut);
+  }
+  if( rc==SQLITE_OK && nTail ){
+    iOut += p->szUsable - nTail;
+    rc = p->pDest->pMethods->xWrite(p->pDest, p->aOvfl, nTail, iOut);
+  }
+  if( rc ){
+    scrubDefragErr(p, "write failed for page %d", p->iRunDest);
+    p->rcErr = SQLITE_IOERR;
+    return;
+  }
+  for(i=0; i<nRun && p->rcErr==SQLITE_OK; i++){
+    p->nByteRead += p->szPage;
+    p->nByteWrite += p->szPage;
+    scrubDefragEmitted(p, SCRUB_DEFRAG_TYPE_OVERFLOW);
+  }
+}
+
+/*
+** As scrubDefragOverflow(), but only the next-page pointer is read here.
+** The page joins the pending run if it follows on from it in both files,
+** and the run is copied by the kernel when it breaks or the chain ends.
+*/
+static void scrubDefragOverflowKcopy(ScrubDefragState *p){
+  u32 iSrc = p->iOvfl;
+  u32 iCurrentPageNo;
+  u32 nTail = 0;
+  u8 aNext[4];
+  sqlite3_int64 t0, t1, t2;
+  int rc = SQLITE_IOERR;
+
+  if( p->aOvfl==0 ){
+    /* Zeroes for the tail of a chain, or the buffer if kernel copy fails */
+    p->aOvfl = scrubDefragAllocPage(p);
+    if( p->aOvfl==0 ) return;
+    memset(p->aOvfl, 0, p->szPage);
+  }
+  if( p->bStrict && scrubDefragStrictSeen(p, iSrc) ){
+    scrubDefragErr(p, "corrupt: overflow page %d is out of range or "
+                      "used more than once", iSrc);
+    return;
+  }
+  if( iSrc<=p->nSrcPage ){
+    t0 = scrubDefragIoClock(p);
+    scrubDefragThrottle(p, 0, 4);
+    t1 = scrubDefragIoClock(p);
+    rc = p->pSrc->pMethods->xRead(p->pSrc, aNext, 4,
+                                  (iSrc-1)*(sqlite3_int64)p->szPage);
+    if( p->bTimers ){
+      t2 = scrubDefragClock();
+      p->st.tThrottle += t1 - t0;
+      p->st.tRead += t2 - t1;
+      scrubDefragHist(p->st.aReadHist, t2 - t1);
+    }
+  }
+  if( rc!=SQLITE_OK ){
+    scrubDefragErr(p, "read failed for page %d", iSrc);
+    p->rcErr = SQLITE_IOERR;
+    return;
+  }
+  if( p->nOvfl >= (p->szUsable)-4 ){
+    p->nOvfl -= (p->szUsable) - 4;
+  }else{
+    nTail = (p->szUsable - 4) - p->nOvfl;
+    p->st.nTailZero += nTail;
+    p->nOvfl = 0;
+  }
+  p->st.aRead[SCRUB_DEFRAG_TYPE_OVERFLOW]++;
+#ifdef SCRUB_DEFRAG_PROFILE
+  p->st.aProfPage[SCRUB_DEFRAG_TYPE_OVERFLOW]++;
+#endif
+  p->iOvfl = scrubDefragInt32(aNext);
+  if( p->bStrict && (p->nOvfl==0)!=(p->iOvfl==0) ){
+    scrubDefragErr(p, "corrupt: overflow chain through page %d does not "
+                      "match its payload size", iSrc);
+    return;
+  }
+  iCurrentPageNo = p->iDestPageNo;
+  if( p->iOvfl!=0 ) scrubDefragIncDestPageNo(p);
+  if( p->nRun>0 && (p->nRun==SCRUB_DEFRAG_RUN
+                    || iSrc!=p->iRunSrc+p->nRun
+                    || iCurrentPageNo!=p->iRunDest+p->nRun) ){
+    scrubDefragKcopyFlush(p, 0);
+    if( p->rcErr ) return;
+  }
+  if( p->nRun==0 ){
+    p->iRunSrc = iSrc;
+    p->iRunDest = iCurrentPageNo;
+  }
+  p->aRunNext[p->nRun++] = p->iOvfl ? p->iDestPageNo : 0;
+  if( p->nOvfl==0 ) p->iOvfl = 0;
+  if( p->iOvfl==0 ) scrubDefragKcopyFlush(p, nTail);
+}
+#endif /* SCRUB_DEFRAG_KCOPY */
+
+/*
+** Copy the next page of the overflow chain p->iOvfl from source to
+** destination.  Zero out any unused tail at the end of the chain.
+*/
+static void scrubDefragOverflow(ScrubDefragState *p){
+  u8 *a;
+  u32 iCurrentPageNo;
+  u32 iSrc = p->iOvfl;
+
+#if SCRUB_DEFRAG_KCOPY
+  if( p->bKcopy && !p->bCksum && !p->bSalvage ){
+    scrubDefragOverflowKcopy(p);
+    return;
+  }
+#endif
+  if( p->aOvfl==0 && p->aOut==0 ){
+    p->aOvfl = scrubDefragAllocPage(p);
+    if( p->aOvfl==0 ) return;
+  }
+  if( p->bStrict && scrubDefragStrictSeen(p, iSrc) ){
+    scrubDefragErr(p, "corrupt: overflow page %d is out of range or "
+                      "used more than once", iSrc);
+    return;
+  }
+  if( p->bSalvage && p->iDestPageNo>p->nDestPage ){
+    scrubDefragErr(p, "corrupt: more pages reached than are in use, at "
+                      "overflow page %d", iSrc);
+    return;
+  }
+  a = scrubDefragRead(p, iSrc,
+                      p->aOut ? scrubDefragSlot(p, p->iDestPageNo) : p->aOvfl);
+  if( a==0 ) return;
+  if( p->nOvfl >= (p->szUsable)-4 ){
+    p->nOvfl -= (p->szUsable) - 4;
+  }else{
+    u32 x = (p->szUsable - 4) - p->nOvfl;
+    u32 i = p->szUsable - x;
+    memset(&a[i], 0, x);
+    p->st.nTailZero += x;
+    p->nOvfl = 0;
+  }
+  p->st.aRead[SCRUB_DEFRAG_TYPE_OVERFLOW]++;
+#ifdef SCRUB_DEFRAG_PROFILE
+  p->st.aProfPage[SCRUB_DEFRAG_TYPE_OVERFLOW]++;
+#endif
+  p->iOvfl = scrubDefragInt32(a);
+  if( p->bStrict && (p->nOvfl==0)!=(p->iOvfl==0) ){
+    scrubDefragErr(p, "corrupt: overflow chain through page %d does not "
+                      "match its payload size", iSrc);
+    return;
+  }
+  iCurrentPageNo = p->iDestPageNo;
+  if( p->iOvfl!=0 ){
+    scrubDefragIncDestPageNo(p);
+    scrubDefragWriteInt32(a, p->iDestPageNo);
+  }
+  scrubDefragEmit(p, iSrc, iCurrentPageNo, SCRUB_DEFRAG_KIND_OVERFLOW, a);
+  if( p->nOvfl==0 ) p->iOvfl = 0;
+}
+
+/*
+** Zero out the gap between the cell index and the start of the cell
+** content area, and the body of every free block, on b-tree page a[].
+** nPrefix is 100 for page 1 and 0 for all other pages.  Return 0 on
+** success or the line number of the failed check if the page is corrupt.
+*/
+static int scrubDefragZeroFree(ScrubDefragState *p, u8 *a, u32 nPrefix){
+  u8 *aTop = &a[nPrefix];
+  u32 szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  u32 nCell = scrubDefragInt16(&aTop[3]);
+  u32 n, pc, x, y;
+
+  x = scrubDefragInt16(&aTop[5]);  /* First byte of cell content area */
+  if( x>p->szUsable ) return __LINE__;
+  y = szHdr + nPrefix + nCell*2;
+  if( y>x ) return __LINE__;
+  if( y<x ){
+    memset(a+y, 0, x-y);  /* Zero the gap */
+    p->st.nGapZero += x-y;
+  }
+
+  /* Zero out all the free blocks */  
+  pc = scrubDefragInt16(&aTop[1]);
+  if( pc>0 && pc<x ) return __LINE__;
+  while( pc ){
+    if( pc>(p->szUsable)-4 ) return __LINE__;
+    n = scrubDefragInt16(&a[pc+2]);
+    if( pc+n>(p->szUsable) ) return __LINE__;
+    if( n>4 ) memset(&a[pc+4], 0, n-4);
+    p->st.nFreeblock++;
+    if( n>4 ) p->st.nFreeblockZero += n-4;
+    x = scrubDefragInt16(&a[pc]);
+    if( x<pc+4 && x>0 ) return __LINE__;
+    pc = x;
+  }
+  return 0;
+}
+
+/*
+** The payload-size varint of a cell on a page of type eType starts at
+** offset pc of a[].  Set *piPtr to the offset of the cell's overflow page
+** number, or to 0 if all of the payload is local, and *pnOvfl to the number
+** of payload bytes stored on the overflow chain.  Return 0 on success or
+** the line number of the failed check if the cell is corrupt.
+*/
+static int scrubDefragCellOverflow(
+  ScrubDefragState *p,
+  const u8 *a,
+  u8 eType,
+  u32 pc,
+  u32 *piPtr,
+  u32 *pnOvfl
+){
+  u32 X, M, K, nLocal;
+  sqlite3_int64 P;
+  *piPtr = 0;
+  *pnOvfl = 0;
+  pc += scrubDefragVarint(&a[pc], &P);
+  if( pc >= p->szUsable ) return __LINE__;
+  X = eType==0x0d ? p->mxLocalLeaf : p->mxLocal;
+  if( P<=X ){
+    /* All content is local.  No overflow */
+    return 0;
+  }
+  M = p->mnLocal;
+  K = M + ((P-M)%(p->szUsable-4));
+  if( eType==0x0d ){
+    pc += scrubDefragVarintSize(&a[pc]);
+    if( pc > (p->szUsable-4) ) return __LINE__;
+  }
+  nLocal = K<=X ? K : M;
+  if( pc+nLocal > p->szUsable-4 ) return __LINE__;
+  *piPtr = pc+nLocal;
+  *pnOvfl = P-nLocal;
+  return 0;
+}
+
+/*
+** Salvage mode.
+**
+** A copy normally stops at the first corrupt page.  In salvage mode the
+** page, and the subtree below it, is dropped instead and the copy goes on:
+** the cell that pointed to it is removed from its parent, the subtree's
+** destination page numbers are handed out again, and a line saying what
+** was lost and why is added to p->pLoss.  An overflow chain that cannot be
+** copied takes its cell with it.  A page left without cells is dropped in
+** turn; a root left with one child is replaced by that child, and a root
+** left with none becomes an empty leaf.  Salvage implies strict mode, so
+** that pages reached twice or lying outside the file are caught before
+** they are copied.  The schema b-tree is not salvaged: without it the rest
+** of the copy could not be found.  Once the copy is done the destination
+** is truncated to the pages actually written and every damaged table and
+** index is reindexed, so that the copy passes 'pragma integrity_check'.
+*/
+
+/* What failed, for scrubDefragSalvage() */
+#define SCRUB_DEFRAG_FAIL_CHILD  1   /* The child just pushed from the top */
+#define SCRUB_DEFRAG_FAIL_CELL   2   /* The overflow chain of the last cell */
+#define SCRUB_DEFRAG_FAIL_PAGE   3   /* The page on top of the walk stack */
+#define SCRUB_DEFRAG_FAIL_ROOT   4   /* The root page of the b-tree */
+
+/*
+** Return the size of the cell at offset pc of b-tree page a[] of type
+** eType, as much of it as is stored on the page, or 0 if it is corrupt.
+*/
+static u32 scrubDefragCellSize(
+  ScrubDefragState *p,
+  const u8 *a,
+  u8 eType,
+  u32 pc
+){
+  u32 n = (eType==0x02 || eType==0x05) ? 4 : 0;
+  u32 iPtr, nOvfl;
+  sqlite3_int64 P;
+  if( eType==0x05 ) return 4 + scrubDefragVarintSize(&a[pc+4]);
+  if( scrubDefragCellOverflow(p, a, eType, pc+n, &iPtr, &nOvfl) ) return 0;
+  if( iPtr ) return iPtr + 4 - pc;
+  n += scrubDefragVarint(&a[pc+n], &P);
+  if( eType==0x0d ) n += scrubDefragVarintSize(&a[pc+n]);
+  n += (u32)P;
+  if( n<4 ) n = 4;
+  return pc+n<=p->szUsable ? n : 0;
+}
+
+/*
+** Add the iSize bytes at offset iStart of b-tree page a[], whose header is
+** at offset hdr, to its free space, merging it with the freeblocks and
+** fragments next to it as SQLite does, and zero it.  Return 0 or the line
+** number of the failed check if the free space of the page is corrupt.
+*/
+static int scrubDefragFreeSpace(
+  ScrubDefragState *p,
+  u8 *a,
+  u32 hdr,
+  u32 iStart,
+  u32 iSize
+){
+  u32 iPtr = hdr + 1;      /* Offset of the pointer to the next freeblock */
+  u32 iFreeBlk;            /* The first freeblock after iStart, or 0 */
+  u32 iEnd = iStart + iSize;
+  u32 nFrag = 0;
+  u32 x;
+
+  while( (iFreeBlk = scrubDefragInt16(&a[iPtr]))<iStart ){
+    if( iFreeBlk<=iPtr ){
+      if( iFreeBlk==0 ) break;
+      return __LINE__;
+    }
+    iPtr = iFreeBlk;
+  }
+  if( iFreeBlk>p->szUsable-4 ) return __LINE__;
+  if( iFreeBlk && iEnd+3>=iFreeBlk ){
+    /* Merge with the freeblock that follows */
+    if( iEnd>iFreeBlk ) return __LINE__;
+    nFrag = iFreeBlk - iEnd;
+    iEnd = iFreeBlk + scrubDefragInt16(&a[iFreeBlk+2]);
+    if( iEnd>p->szUsable ) return __LINE__;
+    iFreeBlk = scrubDefragInt16(&a[iFreeBlk]);
+  }
+  if( iPtr>hdr+1 ){
+    /* Merge with the freeblock before */
+    u32 iPtrEnd = iPtr + scrubDefragInt16(&a[iPtr+2]);
+    if( iPtrEnd+3>=iStart ){
+      if( iPtrEnd>iStart ) return __LINE__;
+      nFrag += iStart - iPtrEnd;
+      iStart = iPtr;
+    }
+  }
+  if( nFrag>a[hdr+7] ) return __LINE__;
+  a[hdr+7] -= (u8)nFrag;
+  x = scrubDefragInt16(&a[hdr+5]);
+  if( x==0 ) x = 65536;
+  memset(&a[iStart], 0, iEnd-iStart);
+  if( iStart<=x ){
+    /* The space joins the gap before the cell content area */
+    if( iStart<x || iPtr!=hdr+1 ) return __LINE__;
+    a[hdr+1] = (u8)(iFreeBlk>>8);
+    a[hdr+2] = (u8)iFreeBlk;
+    a[hdr+5] = (u8)(iEnd>>8);
+    a[hdr+6] = (u8)iEnd;
+  }else{
+    a[iPtr] = (u8)(iStart>>8);
+    a[iPtr+1] = (u8)iStart;
+    a[iStart] = (u8)(iFreeBlk>>8);
+    a[iStart+1] = (u8)iFreeBlk;
+    a[iStart+2] = (u8)((iEnd-iStart)>>8);
+    a[iStart+3] = (u8)(iEnd-iStart);
+  }
+  return 0;
+}
+
+/*
+** Salvage: check that the cells and freeblocks of b-tree page a[], whose
+** header is at offset hdr, lie in the cell content area without overlap.
+** The bytes between them are zeroed and become the fragmented byte count
+** of the page.  Return 0 or the line number of the failed check.
+*/
+static int scrubDefragSalvagePage(ScrubDefragState *p, u8 *a, u32 hdr){
+  u8 *aUsed = p->aUsed;
+  u8 eType = a[hdr];
+  u32 nCell = scrubDefragInt16(&a[hdr+3]);
+  u32 iPtr = hdr + 8 + 4*(eType==0x02 || eType==0x05);
+  u32 x = scrubDefragInt16(&a[hdr+5]);
+  u32 i, pc, sz, nFrag = 0;
+
+  if( x==0 ) x = 65536;
+  memset(aUsed, 0, p->szUsable);
+  for(i=0; i<nCell; i++){
+    pc = SCRUB_DEFRAG_CELL(&a[iPtr], i);
+    if( pc<x || pc>=p->szUsable ) return __LINE__;
+    sz = scrubDefragCellSize(p, a, eType, pc);
+    if( sz==0 || pc+sz>p->szUsable ) return __LINE__;
+    if( memchr(&aUsed[pc], 1, sz) ) return __LINE__;
+    memset(&aUsed[pc], 1, sz);
+  }
+  for(pc=scrubDefragInt16(&a[hdr+1]); pc; pc=scrubDefragInt16(&a[pc])){
+    sz = scrubDefragInt16(&a[pc+2]);
+    if( memchr(&aUsed[pc], 1, sz) ) return __LINE__;
+    memset(&aUsed[pc], 1, sz);
+  }
+  for(pc=x; pc<p->szUsable; pc++){
+    if( aUsed[pc]==0 ){
+      a[pc] = 0;
+      nFrag++;
+    }
+  }
+  if( nFrag>255 ) return __LINE__;
+  a[hdr+7] = (u8)nFrag;
+  return 0;
+}
+
+/*
+** Objects: count b-tree page a[] of source page pgno, at walk stack level
+** iDepth, against the b-tree being copied.  Cells that do not parse are
+** skipped, as the walk will report them.
+*/
+static void scrubDefragObjPage(
+  ScrubDefragState *p,
+  const u8 *a,
+  u32 pgno,
+  int iDepth
+){
+  ScrubDefragBtreeStats *pObj = &p->aObj[p->nObj-1];
+  const u8 *aTop = &a[pgno==1 ? 100 : 0];
+  u32 szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  u32 nCell = scrubDefragInt16(&aTop[3]);
+  u32 i, pc, iPtr, nOvfl, nFree;
+  sqlite3_int64 P;
+
+  if( iDepth+1>pObj->nDepth ) pObj->nDepth = iDepth+1;
+  pObj->nCell += nCell;
+  if( aTop[0]==0x05 ) return;
+  pObj->nEntry += nCell;
+  for(i=0; i<nCell; i++){
+    pc = scrubDefragInt16(&aTop[szHdr+i*2]) + 4*(aTop[0]==0x02);
+    if( pc>p->szUsable-4 ) continue;
+    if( scrubDefragCellOverflow(p, a, aTop[0], pc, &iPtr, &nOvfl) ) continue;
+    scrubDefragVarint(&a[pc], &P);
+    pObj->nPayload += P;
+    if( iPtr ){
+      pObj->nChain++;
+      scrubDefragHist(pObj->aChain, (nOvfl + p->szUsable-5)/(p->szUsable-4));
+    }
+  }
+  if( aTop[0]==0x02 ) return;
+
+  /* A leaf: the fragments, freeblocks and gap are unused */
+  nFree = aTop[7] + scrubDefragInt16(&aTop[5]) - (u32)(aTop-a) - szHdr
+        - 2*nCell;
+  for(pc=scrubDefragInt16(&aTop[1]); pc; pc=scrubDefragInt16(&a[pc])){
+    nFree += scrubDefragInt16(&a[pc+2]);
+  }
+  if( nFree>p->szUsable ) nFree = p->szUsable;
+  pObj->nLeafUsed += p->szUsable - nFree;
+  i = (p->szUsable - nFree)*SCRUB_DEFRAG_NFILL/p->szUsable;
+  pObj->aFill[i<SCRUB_DEFRAG_NFILL ? i : SCRUB_DEFRAG_NFILL-1]++;
+}
+
+/*
+** Stat1: decode the number of serial type t, 1 to 9, at a[].  Return 1 and
+** set *pR for a real, or return 0 and set *pI for an integer.
+*/
+static int scrubDefragPlanNum(
+  sqlite3_int64 t,
+  const u8 *a,
+  sqlite3_int64 *pI,
+  double *pR
+){
+  sqlite3_uint64 v = 0;
+  u32 i, n = scrubDefragSerialSize(t);
+  if( t>=8 ){
+    *pI = t-8;
+    return 0;
+  }
+  for(i=0; i<n; i++) v = (v<<8) | a[i];
+  if( t==7 ){
+    memcpy(pR, &v, 8);
+    return 1;
+  }
+  if( n<8 && (a[0]&0x80) ) v |= ~(sqlite3_uint64)0 << (8*n);
+  *pI = (sqlite3_int64)v;
+  return 0;
+}
+
+/* Stat1: true if integer i and real r compare equal, as SQLite has it */
+static int scrubDefragPlanIntReal(sqlite3_int64 i, double r){
+  return r>=-9223372036854775808.0 && r<9223372036854775808.0
+      && (sqlite3_int64)r==i && r==(double)i;
+}
+
+/*
+** Stat1: true if value a[] of serial type ta equals value b[] of serial
+** type tb under the BINARY collating sequence.  NULLs are equal, as they
+** are to ANALYZE.
+*/
+static int scrubDefragPlanEq(
+  sqlite3_int64 ta,
+  const u8 *a,
+  sqlite3_int64 tb,
+  const u8 *b
+){
+  sqlite3_int64 i, j;
+  double r, s;
+  if( ta==tb ){
+    /* A value has one encoding of each type, but for the two zero reals */
+    if( memcmp(a, b, scrubDefragSerialSize(ta))==0 ) return 1;
+    if( ta!=7 ) return 0;
+  }
+  if( ta>=12 || tb>=12 || ta==0 || tb==0 ) return 0;
+  switch( scrubDefragPlanNum(ta, a, &i, &r)*2
+        + scrubDefragPlanNum(tb, b, &j, &s) ){
+    case 0:  return i==j;
+    case 1:  return scrubDefragPlanIntReal(i, s);
+    case 2:  return scrubDefragPlanIntReal(j, r);
+    default: return r==s;
+  }
+}
+
+/*
+** Stat1: return how many of the first nCol values of records a[], na
+** bytes, and b[], nb bytes, are equal, or -1 if either is corrupt or too
+** short.  Both buffers have 9 bytes of slack for the header varints.
+*/
+static int scrubDefragPlanCmp(
+  const u8 *a, int na,
+  const u8 *b, int nb,
+  int nCol
+){
+  sqlite3_int64 ha, hb;       /* Header sizes */
+  sqlite3_int64 ta, tb;       /* Serial types */
+  sqlite3_int64 ia, ib;       /* Next serial type in each header */
+  sqlite3_int64 ja, jb;       /* Next value in each body */
+  int k;
+
+  ia = scrubDefragVarint(a, &ha);
+  ib = scrubDefragVarint(b, &hb);
+  if( ha>na || hb>nb ) return -1;
+  ja = ha;
+  jb = hb;
+  for(k=0; k<nCol; k++){
+    if( ia>=ha || ib>=hb ) return -1;
+    ia += scrubDefragVarint(&a[ia], &ta);
+    ib += scrubDefragVarint(&b[ib], &tb);
+    if( ta<0 || ta>0x7fffffff || ta==10 || ta==11
+     || tb<0 || tb>0x7fffffff || tb==10 || tb==11
+     || ja+scrubDefragSerialSize(ta)>na || jb+scrubDefragSerialSize(tb)>nb
+    ){
+      return -1;
+    }
+    if( !scrubDefragPlanEq(ta, &a[ja], tb, &b[jb]) ) return k;
+    ja += scrubDefragSerialSize(ta);
+    jb += scrubDefragSerialSize(tb);
+  }
+  return nCol;
+}
+
+/*
+** Stat1: take the key in p->plan.aKey, n bytes, as a stat4 sample.  Out
+** of memory, the index is left to ANALYZE.
+*/
+static void scrubDefragPlanSample(ScrubDefragState *p, int n){
+  ScrubDefragPlan *pPlan = &p->plan;
+  ScrubDefragSample *pS;
+  int i, k, nCol = pPlan->nCol;
+
+  if( pPlan->nSample==2*SCRUB_DEFRAG_NSAMPLE ){
+    /* Keep every other sample and take half as many from now on */
+    for(i=0; i<SCRUB_DEFRAG_NSAMPLE; i++){
+      sqlite3_free(pPlan->aSample[2*i+1].anEq);
+      pPlan->aSample[i] = pPlan->aSample[2*i];
+    }
+    pPlan->nSample = SCRUB_DEFRAG_NSAMPLE;
+    pPlan->nStride *= 2;
+    for(k=0; k<nCol; k++){
+      for(i=0; i<pPlan->nSample && pPlan->aSample[i].anEq[k]; i++){}
+      pPlan->aiPend[k] = i;
+    }
+  }
+  pS = &pPlan->aSample[pPlan->nSample];
+  pS->anEq = sqlite3_malloc64(3*nCol*sizeof(sqlite3_int64) + n);
+  if( pS->anEq==0 ){
+    pPlan->bAnalyze = 1;
+    return;
+  }
+  pS->anLt = &pS->anEq[nCol];
+  pS->anDLt = &pS->anLt[nCol];
+  pS->aRec = (u8*)&pS->anDLt[nCol];
+  pS->nRec = n;
+  memcpy(pS->aRec, pPlan->aKey, n);
+  for(k=0; k<nCol; k++){
+    pS->anEq[k] = 0;
+    pS->anLt[k] = pPlan->anRun[k];
+    pS->anDLt[k] = pPlan->anDist[k] - 1;
+  }
+  pPlan->nSample++;
+}
+
+/*
+** Stat1: count the index entry with record a[], n bytes, which follows the
+** last one counted in key order.  Each prefix the entry does not share
+** with the previous key starts a new run, ending the run of the samples
+** taken in the old one.
+*/
+static void scrubDefragPlanKey(ScrubDefragState *p, const u8 *a, int n){
+  ScrubDefragPlan *pPlan = &p->plan;
+  u8 *aKey = pPlan->aKey;
+  int i, k, iEq;
+
+  memcpy(aKey, a, n);
+  memset(&aKey[n], 0, 9);
+  if( pPlan->nRow==0 ){
+    iEq = scrubDefragPlanCmp(aKey, n, aKey, n, pPlan->nCol);
+    if( iEq>=0 ) iEq = 0;
+  }else{
+    iEq = scrubDefragPlanCmp(pPlan->aPrev, pPlan->nPrev, aKey, n, pPlan->nCol);
+  }
+  if( iEq<0 ){
+    pPlan->bAnalyze = 1;
+    return;
+  }
+  for(k=iEq; k<pPlan->nCol; k++){
+    for(i=pPlan->aiPend[k]; i<pPlan->nSample; i++){
+      pPlan->aSample[i].anEq[k] = pPlan->nRow - pPlan->aSample[i].anLt[k];
+    }
+    pPlan->aiPend[k] = pPlan->nSample;
+    pPlan->anRun[k] = pPlan->nRow;
+    pPlan->anDist[k]++;
+  }
+  if( p->bStat4 && pPlan->nRow%pPlan->nStride==0 ){
+    scrubDefragPlanSample(p, n);
+  }
+  pPlan->nRow++;
+  pPlan->aKey = pPlan->aPrev;
+  pPlan->aPrev = aKey;
+  pPlan->nPrev = n;
+}
+
+/*
+** Stat1: count the index cell of page a[] whose payload size is at offset
+** pc.  A key that overflows is left to ANALYZE.
+*/
+static void scrubDefragPlanCell(ScrubDefragState *p, const u8 *a, u32 pc){
+  sqlite3_int64 P;
+  if( pc>p->szUsable-4 ){
+    p->plan.bAnalyze = 1;
+    return;
+  }
+  pc += scrubDefragVarint(&a[pc], &P);
+  if( P>p->mxLocal || pc+P>p->szUsable ){
+    p->plan.bAnalyze = 1;
+    return;
+  }
+  scrubDefragPlanKey(p, &a[pc], (int)P);
+}
+
+/*
+** Stat1: count b-tree page a[] of source page pgno against the b-tree
+** being copied: the rows of a table leaf or the keys of an index leaf.
+** The keys of an index interior page are counted by the walk, each after
+** the subtree to its left.
+*/
+static void scrubDefragPlanPage(ScrubDefragState *p, const u8 *a, u32 pgno){
+  ScrubDefragPlan *pPlan = &p->plan;
+  const u8 *aTop = &a[pgno==1 ? 100 : 0];
+  u32 i, nCell = scrubDefragInt16(&aTop[3]);
+
+  if( pPlan->eTree==SCRUB_DEFRAG_PLAN_ROWS ){
+    if( aTop[0]==0x0d ){
+      pPlan->nRow += nCell;
+      return;
+    }
+    if( aTop[0]!=0x0a ) return;
+    /* A WITHOUT ROWID table: an index on its primary key */
+    pPlan->eTree = SCRUB_DEFRAG_PLAN_KEYS;
+    if( pPlan->nKey==0 ) pPlan->bAnalyze = 1;
+  }
+  if( aTop[0]!=0x0a ) return;
+  for(i=0; i<nCell && !pPlan->bAnalyze; i++){
+    scrubDefragPlanCell(p, a, scrubDefragInt16(&aTop[8+2*i]));
+  }
+}
+
+/*
+** Push b-tree page pgno onto the walk stack.  The page is read and its
+** deleted content zeroed; it is written once all of its children are.
+*/
+static void scrubDefragPush(ScrubDefragState *p, u32 pgno, int bRoot){
+  ScrubDefragFrame *pFrame;
+  u8 *a, *aTop;
+  int ln;
+
+  if( p->rcErr ) return;
+  if( p->nFrame>SCRUB_DEFRAG_MAX_DEPTH ){
+    scrubDefragErr(p, "corrupt: b-tree too deep at page %d", pgno);
+    return;
+  }
+  if( p->bStrict && scrubDefragStrictSeen(p, pgno) ){
+    scrubDefragErr(p, "corrupt: page %d is out of range or used more than "
+                      "once", pgno);
+    return;
+  }
+  if( p->bSalvage && p->iDestPageNo>p->nDestPage ){
+    scrubDefragErr(p, "corrupt: more pages reached than are in use, at "
+                      "page %d", pgno);
+    return;
+  }
+  if( pgno==1 ){
+    a = p->page1;
+  }else{
+    a = p->aOut ? scrubDefragSlot(p, p->iDestPageNo)
+                : scrubDefragPoolPage(p, &p->apPage[p->nFrame]);
+    if( a==0 || scrubDefragRead(p, pgno, a)==0 ) return;
+  }
+
+  /* Zero out the gap and the free blocks */
+  ln = scrubDefragZeroFree(p, a, pgno==1 ? 100 : 0);
+  if( ln==0 && p->bStrict ) ln = scrubDefragStrictPage(p, pgno, a, bRoot);
+  if( ln==0 && p->bSalvage ){
+    ln = scrubDefragSalvagePage(p, a, pgno==1 ? 100 : 0);
+  }
+  if( ln ){
+    scrubDefragErr(p, "corruption on page %d of source database (errid=%d)",
+                   pgno, ln);
+    return;
+  }
+  ln = scrubDefragPageType(a[pgno==1 ? 100 : 0]);
+  if( ln>=0 ) p->st.aRead[ln]++;
+  if( p->nFrame>p->st.mxDepth ) p->st.mxDepth = p->nFrame;
+  if( p->nObj>0 ) scrubDefragObjPage(p, a, pgno, p->nFrame);
+  if( p->plan.eTree ) scrubDefragPlanPage(p, a, pgno);
+  pFrame = &p->aFrame[p->nFrame++];
+  memset(pFrame, 0, sizeof(*pFrame));
+  pFrame->a = a;
+  pFrame->pgno = pgno;
+  pFrame->iDest = p->iDestPageNo;
+  pFrame->bRoot = (u8)bRoot;
+  aTop = &a[pgno==1 ? 100 : 0];
+  pFrame->eType = aTop[0];
+  pFrame->nCell = scrubDefragInt16(&aTop[3]);
+  pFrame->iPtr = (u32)(aTop - a) + 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+}
+
+/* Pop the top of the walk stack */
+static void scrubDefragPop(ScrubDefragState *p){
+  ScrubDefragFrame *pFrame = &p->aFrame[--p->nFrame];
+  pFrame->a = 0;
+}
+
+/* Abandon the walk in progress, if any */
+static void scrubDefragWalkReset(ScrubDefragState *p){
+  while( p->nFrame>0 ) scrubDefragPop(p);
+  p->iOvfl = 0;
+  p->nOvfl = 0;
+  p->nRun = 0;
+}
+
+/*
+** Remove cell i from the page of pFrame.  Return 0 or the line number of
+** the failed check if the page is corrupt.
+*/
+static int scrubDefragDropCell(
+  ScrubDefragState *p,
+  ScrubDefragFrame *pFrame,
+  u32 i
+){
+  u8 *a = pFrame->a;
+  u8 *aPtr = &a[pFrame->iPtr];
+  u32 hdr = pFrame->pgno==1 ? 100 : 0;
+  u32 pc = SCRUB_DEFRAG_CELL(aPtr, i);
+  u32 sz;
+
+  if( pc<pFrame->iPtr+2*pFrame->nCell || pc>=p->szUsable ) return __LINE__;
+  sz = scrubDefragCellSize(p, a, pFrame->eType, pc);
+  if( sz==0 ) return __LINE__;
+  pFrame->nCell--;
+  memmove(&aPtr[2*i], &aPtr[2*i+2], 2*(pFrame->nCell-i));
+  aPtr[2*pFrame->nCell] = aPtr[2*pFrame->nCell+1] = 0;
+  a[hdr+3] = (u8)(pFrame->nCell>>8);
+  a[hdr+4] = (u8)pFrame->nCell;
+  return scrubDefragFreeSpace(p, a, hdr, pc, sz);
+}
+
+/*
+** Return the first destination page given out for cell i of the page of
+** pFrame, which has been visited: its child for an interior page, else
+** the first page of its overflow chain.  If bChain, return the first page
+** of the chain in either case.  Return 0 if there is none.
+*/
+static u32 scrubDefragCellDest(
+  ScrubDefragState *p,
+  ScrubDefragFrame *pFrame,
+  u32 i,
+  int bChain
+){
+  const u8 *a = pFrame->a;
+  u32 pc = SCRUB_DEFRAG_CELL(&a[pFrame->iPtr], i);
+  u32 iPtr, nOvfl;
+  if( pc>p->szUsable-4 ) return 0;
+  if( pFrame->eType==0x05 ) return bChain ? 0 : scrubDefragInt32(&a[pc]);
+  if( pFrame->eType==0x02 ){
+    if( !bChain ) return scrubDefragInt32(&a[pc]);
+    pc += 4;
+  }
+  if( scrubDefragCellOverflow(p, a, pFrame->eType, pc, &iPtr, &nOvfl)
+   || iPtr==0
+  ){
+    return 0;
+  }
+  return scrubDefragInt32(&a[iPtr]);
+}
+
+/*
+** Return the leaf page type of the b-tree being copied, for a root that
+** could not be read: 0x0a for an index or a WITHOUT ROWID table, else 0x0d.
+*/
+static u8 scrubDefragSalvageType(ScrubDefragState *p){
+  const char *zType = (const char*)sqlite3_column_text(p->pRoots, 2);
+  sqlite3_stmt *pStmt = 0;
+  char *zSql;
+  u8 eType = 0x0d;
+  if( zType && strcmp(zType, "index")==0 ) return 0x0a;
+  zSql = sqlite3_mprintf("SELECT wr FROM pragma_table_list"
+                         " WHERE schema=%Q AND name=%Q",
+                         p->zSrcDb ? p->zSrcDb : "main", p->zBtree);
+  if( zSql
+   && sqlite3_prepare_v2(p->dbSrc, zSql, -1, &pStmt, 0)==SQLITE_OK
+   && sqlite3_step(pStmt)==SQLITE_ROW
+   && sqlite3_column_int(pStmt, 0)
+  ){
+    eType = 0x0a;
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_free(zSql);
+  return eType;
+}
+
+/*
+** Write an empty leaf page of type eType, or of the type the schema
+** implies if eType is not a leaf type, as the root of the b-tree being
+** copied, destination page iDest.  The walk stack is empty.
+*/
+static void scrubDefragSalvageRoot(ScrubDefragState *p, u32 iDest, u8 eType){
+  u8 *a;
+  if( eType!=0x0a && eType!=0x0d ) eType = scrubDefragSalvageType(p);
+  a = p->aOut ? scrubDefragSlot(p, iDest)
+              : scrubDefragPoolPage(p, &p->apPage[p->nFrame]);
+  if( a==0 ) return;
+  memset(a, 0, p->szPage);
+  a[0] = eType;
+  a[5] = (u8)(p->szUsable>>8);
+  a[6] = (u8)p->szUsable;
+  p->iDestPageNo = iDest;
+  scrubDefragEmit(p, 0, iDest, SCRUB_DEFRAG_KIND_BTREE, a);
+  scrubDefragIncDestPageNo(p);
+}
+
+/*
+** The error in p->rcErr came from eFail.  If it can be salvaged, log it,
+** clear it and repair the walk stack so that the walk can go on.
+*/
+static void scrubDefragSalvage(ScrubDefragState *p, int eFail){
+  ScrubDefragFrame *pFrame;
+  u8 *aTop;
+  u32 i, iDest, iChild;
+
+  if( !p->bSalvage || p->bDestErr
+   || p->rcErr==SQLITE_NOMEM || p->rcErr==SQLITE_ABORT
+   || p->zBtree==0 || strcmp(p->zBtree, "sqlite_schema")==0
+  ){
+    return;
+  }
+  if( p->pLoss==0 ) p->pLoss = sqlite3_str_new(0);
+  if( p->pReindex==0 ) p->pReindex = sqlite3_str_new(0);
+  if( !p->bSalvaged ){
+    sqlite3_str_append(p->pReindex, p->zBtree, (int)strlen(p->zBtree)+1);
+    p->bSalvaged = 1;
+  }
+  sqlite3_str_appendf(p->pLoss, "%s: %s", p->zBtree, p->zErr);
+  sqlite3_free(p->zErr);
+  p->zErr = 0;
+  p->rcErr = SQLITE_OK;
+  p->iOvfl = 0;
+  p->nOvfl = 0;
+  p->bKey = 0;
+
+  while( p->rcErr==SQLITE_OK ){
+    if( eFail==SCRUB_DEFRAG_FAIL_ROOT ){
+      sqlite3_str_appendall(p->pLoss, "; emptied the b-tree");
+      scrubDefragSalvageRoot(p, p->iDestPageNo, 0);
+      break;
+    }
+    pFrame = &p->aFrame[p->nFrame-1];
+    if( eFail==SCRUB_DEFRAG_FAIL_PAGE ){
+      if( pFrame->bRoot ){
+        u8 eType = pFrame->eType | 0x08;
+        iDest = pFrame->iDest;
+        sqlite3_str_appendall(p->pLoss, "; emptied the b-tree");
+        scrubDefragPop(p);
+        scrubDefragSalvageRoot(p, iDest, eType);
+        break;
+      }
+      sqlite3_str_appendf(p->pLoss, "; dropped page %u", pFrame->pgno);
+      scrubDefragPop(p);
+      eFail = SCRUB_DEFRAG_FAIL_CHILD;
+      continue;
+    }
+
+    /* Drop the cell of the top page that led to the failure */
+    aTop = &pFrame->a[pFrame->pgno==1 ? 100 : 0];
+    if( eFail==SCRUB_DEFRAG_FAIL_CHILD && pFrame->bRight ){
+      /* The right-most child: the child of the last cell takes its place
+      ** and the overflow chain of that cell, numbered in between, goes */
+      iDest = scrubDefragInt32(&aTop[8]);
+      if( pFrame->nCell==0 ){
+        eFail = SCRUB_DEFRAG_FAIL_PAGE;
+        continue;
+      }
+      i = pFrame->nCell-1;
+      iChild = scrubDefragCellDest(p, pFrame, i, 1);
+      if( iChild ) iDest = iChild;
+      iChild = scrubDefragCellDest(p, pFrame, i, 0);
+      if( iChild==0 || scrubDefragDropCell(p, pFrame, i) ){
+        eFail = SCRUB_DEFRAG_FAIL_PAGE;
+        continue;
+      }
+      scrubDefragWriteInt32(&aTop[8], iChild);
+    }else{
+      i = pFrame->iCell;
+      if( eFail==SCRUB_DEFRAG_FAIL_CELL || pFrame->eType==0x05 ) i--;
+      iDest = scrubDefragCellDest(p, pFrame, i, 0);
+      if( iDest==0 || scrubDefragDropCell(p, pFrame, i) ){
+        eFail = SCRUB_DEFRAG_FAIL_PAGE;
+        continue;
+      }
+      pFrame->iCell = i;
+      pFrame->bDown = 0;
+    }
+    p->iDestPageNo = iDest-1;
+    sqlite3_str_appendf(p->pLoss, "; dropped cell %u of page %u",
+                        i, pFrame->pgno);
+    if( pFrame->nCell>0 || (pFrame->bRoot && (pFrame->eType & 0x08)) ) break;
+    if( !pFrame->bRoot || pFrame->bRight ){
+      eFail = SCRUB_DEFRAG_FAIL_PAGE;
+      continue;
+    }
+
+    /* A root left with only its right-most child, not yet visited, is
+    ** replaced by that child */
+    iChild = scrubDefragInt32(&aTop[8]);
+    iDest = pFrame->iDest;
+    scrubDefragPop(p);
+    p->iDestPageNo = iDest;
+    p->nLeafDepth = 0;
+    sqlite3_str_appendf(p->pLoss, "; page %u is the new root", iChild);
+    scrubDefragPush(p, iChild, 1);
+    if( p->rcErr==SQLITE_OK || p->rcErr==SQLITE_NOMEM ) break;
+    sqlite3_str_appendf(p->pLoss, "; %s", p->zErr);
+    sqlite3_free(p->zErr);
+    p->zErr = 0;
+    p->rcErr = SQLITE_OK;
+    eFail = SCRUB_DEFRAG_FAIL_ROOT;
+  }
+  sqlite3_str_appendall(p->pLoss, "\n");
+}
+
+#if SCRUB_DEFRAG_LANES
+/*
+** Byte-swap the SCRUB_DEFRAG_LANES big-endian cell offsets at aPtr into
+** aPc[].  Return non-zero if any of them is outside lo..lo+span.  Offsets
+** are biased by 0x8000 so that a signed compare does the unsigned one.
+*/
+static int scrubDefragCellBlock(const u8 *aPtr, u32 lo, u32 span, u16 *aPc){
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i*)aPtr);
+  __m256i t;
+  v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+  _mm256_storeu_si256((__m256i*)aPc, v);
+  t = _mm256_sub_epi16(v, _mm256_set1_epi16((short)lo));
+  t = _mm256_xor_si256(t, _mm256_set1_epi16((short)0x8000));
+  t = _mm256_cmpgt_epi16(t, _mm256_set1_epi16((short)(span ^ 0x8000)));
+  return _mm256_movemask_epi8(t);
+#else
+  __m128i v = _mm_loadu_si128((const __m128i*)aPtr);
+  __m128i t;
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  _mm_storeu_si128((__m128i*)aPc, v);
+  t = _mm_sub_epi16(v, _mm_set1_epi16((short)lo));
+  t = _mm_xor_si128(t, _mm_set1_epi16((short)0x8000));
+  t = _mm_cmpgt_epi16(t, _mm_set1_epi16((short)(span ^ 0x8000)));
+  return _mm_movemask_epi8(t);
+#endif
+}
+
+/*
+** Return non-zero if any byte of the 2*SCRUB_DEFRAG_LANES byte vector a[]
+** is greater than lim.
+*/
+static int scrubDefragAnyAbove(const u8 *a, u32 lim){
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i*)a);
+  v = _mm256_subs_epu8(v, _mm256_set1_epi8((char)lim));
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()))
+         != (int)0xffffffff;
+#else
+  __m128i v = _mm_loadu_si128((const __m128i*)a);
+  v = _mm_subs_epu8(v, _mm_set1_epi8((char)lim));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()))!=0xffff;
+#endif
+}
+#endif /* SCRUB_DEFRAG_LANES */
+
+/*
+** Cell i of leaf page pFrame, at offset pc, is not known to be local.  If
+** its payload overflows, renumber the chain, set it up in p->iOvfl and move
+** pFrame->iCell past the cell.  Return 0 or the line number of the failed
+** check if the cell is corrupt.
+*/
+static int scrubDefragLeafOverflow(
+  ScrubDefragState *p,
+  ScrubDefragFrame *pFrame,
+  u32 i,
+  u32 pc
+){
+  u8 *a = pFrame->a;
+  u32 iPtr, nOvfl, iChild;
+  int ln = scrubDefragCellOverflow(p, a, pFrame->eType, pc, &iPtr, &nOvfl);
+  if( ln || iPtr==0 ) return ln;
+  iChild = scrubDefragInt32(&a[iPtr]);
+  if( iChild==0 ) return __LINE__;
+  scrubDefragIncDestPageNo(p);
+  scrubDefragWriteInt32(&a[iPtr], p->iDestPageNo);
+  p->iOvfl = iChild;
+  p->nOvfl = nOvfl;
+  pFrame->iCell = i+1;
+  return 0;
+}
+
+/*
+** Visit the cells of a leaf page from pFrame->iCell on.  Cells whose payload
+** size fits in one varint byte and is at most mxLocal are entirely local
+** and need no further decoding.  Stop after the first cell with an
+** overflow chain, which is set up in p->iOvfl for the caller.  Return 0 or
+** the line number of the failed check if the page is corrupt.
+**
+** With SIMD, a block of cell offsets is byte-swapped and range-checked at
+** once, then the first payload-size bytes of the block are tested together;
+** only blocks with a cell that may overflow are visited cell by cell.  A
+** block with a bad offset is left to the scalar loop, which visits the cells
+** before it first and fails on the same cell as it always has.  The cell
+** pointer array does not change until an overflow chain is set up, so the
+** offsets decoded for a block stay valid until this routine returns.
+*/
+static int scrubDefragLeafCells(
+  ScrubDefragState *p,
+  ScrubDefragFrame *pFrame,
+  u32 mxLocal              /* p->mxLocalLeaf or p->mxLocal */
+){
+  u8 *a = pFrame->a;
+  const u8 *aPtr = &a[pFrame->iPtr];
+  u32 nCell = pFrame->nCell;
+  u32 mxPc = p->szUsable - 3 - 9;    /* Cells start in 9..szUsable-3 */
+  u32 i = pFrame->iCell, pc;
+  int ln;
+
+#if SCRUB_DEFRAG_LANES
+  u32 lim = mxLocal<0x7f ? mxLocal : 0x7f;
+  while( i+SCRUB_DEFRAG_LANES<=nCell ){
+    u16 aPc[SCRUB_DEFRAG_LANES];
+    u8 aFirst[2*SCRUB_DEFRAG_LANES];  /* One vector, upper half zero */
+    int k;
+    if( scrubDefragCellBlock(&aPtr[2*i], 9, mxPc, aPc) ) break;
+    for(k=0; k<SCRUB_DEFRAG_LANES; k++) aFirst[k] = a[aPc[k]];
+    memset(&aFirst[SCRUB_DEFRAG_LANES], 0, SCRUB_DEFRAG_LANES);
+    if( scrubDefragAnyAbove(aFirst, lim) ){
+      for(k=0; k<SCRUB_DEFRAG_LANES; k++){
+        if( aFirst[k]<=lim ) continue;
+        ln = scrubDefragLeafOverflow(p, pFrame, i+k, aPc[k]);
+        if( ln || p->iOvfl ) return ln;
+      }
+    }
+    i += SCRUB_DEFRAG_LANES;
+  }
+#endif
+  for(; i<nCell; i++){
+    pc = SCRUB_DEFRAG_CELL(aPtr, i);
+    if( pc-9 > mxPc ) return __LINE__;
+    if( a[pc]<0x80 && a[pc]<=mxLocal ) continue;
+    ln = scrubDefragLeafOverflow(p, pFrame, i, pc);
+    if( ln || p->iOvfl ) return ln;
+  }
+  pFrame->iCell = nCell;
+  return 0;
+}
+
+/*
+** Continue the b-tree walk on the stack, copying each page once all of its
+** children have been copied and zeroing out deleted content on the way.
+** Stop when the walk is complete or, if nPage>0, once nPage more pages
+** have been emitted.  Children are renumbered in the order the recursion
+** of a pre-order copy would visit them.  Each page type has its own case:
+** a table interior cell is a child and a key, an index interior cell adds
+** a payload that may overflow after the child, and leaf cells are handled
+** in bulk by scrubDefragLeafCells().
+*/
+static void scrubDefragWalk(ScrubDefragState *p, u32 nPage){
+  u32 iEnd = p->nPageDone + nPage;
+  u32 mxPcInterior = p->szUsable - 4 - 13;  /* Cells start in 13..szUsable-4 */
+
+  while( p->rcErr==0 && (p->nFrame>0 || p->iOvfl!=0) ){
+    ScrubDefragFrame *pFrame;
+    u8 *a;
+    u32 pc, iChild, nOvfl;
+    int ln = 0;
+
+    if( nPage>0 && p->nPageDone>=iEnd ) break;
+#ifdef SCRUB_DEFRAG_PROFILE
+    scrubDefragProfTick(p, 0);
+#endif
+    if( p->iOvfl ){
+      scrubDefragOverflow(p);
+      if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_CELL);
+      continue;
+    }
+    pFrame = &p->aFrame[p->nFrame-1];
+    a = pFrame->a;
+
+    switch( pFrame->eType ){
+      case 0x05:
+        if( pFrame->iCell<pFrame->nCell ){
+          if( p->bStrict && pFrame->iCell>0 ){
+            pc = SCRUB_DEFRAG_CELL(&a[pFrame->iPtr], pFrame->iCell-1);
+            ln = scrubDefragStrictSep(p, a, pc);
+            if( ln ) goto walk_corrupt;
+          }
+          pc = SCRUB_DEFRAG_CELL(&a[pFrame->iPtr], pFrame->iCell);
+          if( pc-13 > mxPcInterior ){ ln=__LINE__; goto walk_corrupt; }
+          iChild = scrubDefragInt32(&a[pc]);
+          if( iChild==0 ){ ln=__LINE__; goto walk_corrupt; }
+          scrubDefragIncDestPageNo(p);
+          scrubDefragWriteInt32(&a[pc], p->iDestPageNo);
+          pFrame->iCell++;
+          scrubDefragPush(p, iChild, 0);
+          if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_CHILD);
+          continue;
+        }
+        break;
+      case 0x02:
+        if( pFrame->iCell<pFrame->nCell ){
+          pc = SCRUB_DEFRAG_CELL(&a[pFrame->iPtr], pFrame->iCell);
+          if( pc-13 > mxPcInterior ){ ln=__LINE__; goto walk_corrupt; }
+          if( !pFrame->bDown ){
+            iChild = scrubDefragInt32(&a[pc]);
+            if( iChild==0 ){ ln=__LINE__; goto walk_corrupt; }
+            scrubDefragIncDestPageNo(p);
+            scrubDefragWriteInt32(&a[pc], p->iDestPageNo);
+            pFrame->bDown = 1;
+            scrubDefragPush(p, iChild, 0);
+            if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_CHILD);
+            continue;
+          }
+          pFrame->bDown = 0;
+          pFrame->iCell++;
+          if( p->plan.eTree==SCRUB_DEFRAG_PLAN_KEYS && !p->plan.bAnalyze ){
+            scrubDefragPlanCell(p, a, pc+4);
+          }
+          ln = scrubDefragCellOverflow(p, a, 0x02, pc+4, &pc, &nOvfl);
+          if( ln ) goto walk_corrupt;
+          if( pc==0 ) continue;
+          iChild = scrubDefragInt32(&a[pc]);
+          if( iChild==0 ){ ln=__LINE__; goto walk_corrupt; }
+          scrubDefragIncDestPageNo(p);
+          scrubDefragWriteInt32(&a[pc], p->iDestPageNo);
+          p->iOvfl = iChild;
+          p->nOvfl = nOvfl;
+          continue;
+        }
+        break;
+      case 0x0d:
+        ln = scrubDefragLeafCells(p, pFrame, p->mxLocalLeaf);
+        if( ln ) goto walk_corrupt;
+        if( p->iOvfl ) continue;
+        break;
+      default:
+        ln = scrubDefragLeafCells(p, pFrame, p->mxLocal);
+        if( ln ) goto walk_corrupt;
+        if( p->iOvfl ) continue;
+        break;
+    }
+
+    /* Walk the right-most tree */
+    if( (pFrame->eType==0x05 || pFrame->eType==0x02) && !pFrame->bRight ){
+      u8 *aTop = &a[pFrame->pgno==1 ? 100 : 0];
+      if( p->bStrict && pFrame->eType==0x05 && pFrame->nCell>0 ){
+        pc = SCRUB_DEFRAG_CELL(&a[pFrame->iPtr], pFrame->nCell-1);
+        ln = scrubDefragStrictSep(p, a, pc);
+        if( ln ) goto walk_corrupt;
+      }
+      iChild = scrubDefragInt32(&aTop[8]);
+      pFrame->bRight = 1;
+      scrubDefragIncDestPageNo(p);
+      scrubDefragWriteInt32(&aTop[8], p->iDestPageNo);
+      scrubDefragPush(p, iChild, 0);
+      if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_CHILD);
+      continue;
+    }
+    if( pFrame->bRoot ){
+      scrubDefragIncDestPageNo(p);
+    }
+
+    /* Write this one page */
+    scrubDefragEmit(p, pFrame->pgno, pFrame->iDest, SCRUB_DEFRAG_KIND_BTREE, a);
+#ifdef SCRUB_DEFRAG_PROFILE
+    ln = scrubDefragPageType(pFrame->eType);
+    if( ln>=0 ){
+      p->st.aProfPage[ln]++;
+      p->st.aProfCell[ln] += pFrame->nCell;
+    }
+#endif
+    scrubDefragPop(p);
+    continue;
+
+walk_corrupt:
+    scrubDefragErr(p, "corruption on page %d of source database (errid=%d)",
+                   pFrame->pgno, ln);
+    if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_PAGE);
+  }
+#ifdef SCRUB_DEFRAG_PROFILE
+  scrubDefragProfTick(p, 1);
+#endif
+}
+
+/*
+** Copy B-Tree page pgno, and all of its children, from source to destination.
+** Zero out deleted content during the copy.
+*/
+static void scrubDefragBtree(ScrubDefragState *p, u32 pgno){
+  scrubDefragPush(p, pgno, 1);
+  scrubDefragWalk(p, 0);
+  scrubDefragWalkReset(p);
+}
+
+/* Objects: the totals that ScrubDefragBtreeStats.a[] records */
+static void scrubDefragObjTotals(ScrubDefragState *p, sqlite3_int64 *a){
+  memcpy(a, p->st.aWrite, sizeof(p->st.aWrite));
+  a[SCRUB_DEFRAG_NTYPE] = p->st.nGapZero + p->st.nFreeblockZero
+                        + p->st.nTailZero;
+}
+
+/* Objects: close the figures of the b-tree last started, if any */
+static void scrubDefragObjEnd(ScrubDefragState *p){
+  ScrubDefragBtreeStats *pObj;
+  sqlite3_int64 a[SCRUB_DEFRAG_NTYPE+1];
+  int i;
+  if( p->nObj==0 ) return;
+  pObj = &p->aObj[p->nObj-1];
+  scrubDefragObjTotals(p, a);
+  for(i=0; i<SCRUB_DEFRAG_NTYPE; i++) pObj->aPage[i] = a[i] - pObj->a[i];
+  pObj->nZero = a[SCRUB_DEFRAG_NTYPE] - pObj->a[SCRUB_DEFRAG_NTYPE];
+}
+
+/* Objects: start the figures of b-tree zName of type zType */
+static void scrubDefragObjBegin(
+  ScrubDefragState *p,
+  const char *zName,
+  const char *zType
+){
+  ScrubDefragBtreeStats *pObj;
+  if( !p->bObjects || p->rcErr ) return;
+  scrubDefragObjEnd(p);
+  if( p->nObj==p->nObjAlloc ){
+    int nNew = p->nObjAlloc ? 2*p->nObjAlloc : 16;
+    pObj = sqlite3_realloc64(p->aObj, nNew*sizeof(ScrubDefragBtreeStats));
+    if( pObj==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    p->aObj = pObj;
+    p->nObjAlloc = nNew;
+  }
+  pObj = &p->aObj[p->nObj];
+  memset(pObj, 0, sizeof(*pObj));
+  pObj->zName = sqlite3_mprintf("%s", zName);
+  pObj->zType = sqlite3_mprintf("%s", zType);
+  if( pObj->zName==0 || pObj->zType==0 ){
+    sqlite3_free(pObj->zName);
+    sqlite3_free(pObj->zType);
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  scrubDefragObjTotals(p, pObj->a);
+  p->nObj++;
+}
+
+/* Objects: free the figures gathered */
+static void scrubDefragObjFree(ScrubDefragState *p){
+  int i;
+  for(i=0; i<p->nObj; i++){
+    sqlite3_free(p->aObj[i].zName);
+    sqlite3_free(p->aObj[i].zType);
+  }
+  sqlite3_free(p->aObj);
+  p->aObj = 0;
+  p->nObj = p->nObjAlloc = 0;
+}
+
+/* Stat1: free the figures of the b-tree being copied, keeping the buffers */
+static void scrubDefragPlanReset(ScrubDefragState *p){
+  ScrubDefragPlan *pPlan = &p->plan;
+  u8 *aPrev = pPlan->aPrev;
+  u8 *aKey = pPlan->aKey;
+  int i;
+  for(i=0; i<pPlan->nSample; i++) sqlite3_free(pPlan->aSample[i].anEq);
+  sqlite3_free(pPlan->zTbl);
+  sqlite3_free(pPlan->zIdx);
+  sqlite3_free(pPlan->zAnalyze);
+  sqlite3_free(pPlan->anDist);
+  memset(pPlan, 0, sizeof(*pPlan));
+  pPlan->aPrev = aPrev;
+  pPlan->aKey = aKey;
+}
+
+/* Stat1: free everything, once the copy is over */
+static void scrubDefragPlanFree(ScrubDefragState *p){
+  scrubDefragPlanReset(p);
+  sqlite3_free(p->plan.aPrev);
+  sqlite3_free(p->plan.aKey);
+  p->plan.aPrev = p->plan.aKey = 0;
+  sqlite3_finalize(p->pPlanInfo);
+  p->pPlanInfo = 0;
+  sqlite3_free(sqlite3_str_finish(p->pPlan));
+  p->pPlan = 0;
+}
+
+/* Stat1: add the sqlite_stat4 rows of the index just copied to p->pPlan */
+static void scrubDefragPlanSamples(ScrubDefragState *p){
+  ScrubDefragPlan *pPlan = &p->plan;
+  int n = pPlan->nSample<SCRUB_DEFRAG_NSAMPLE ? pPlan->nSample
+                                             : SCRUB_DEFRAG_NSAMPLE;
+  int i, j, k;
+
+  /* The runs still open end with the index */
+  for(k=0; k<pPlan->nCol; k++){
+    for(i=pPlan->aiPend[k]; i<pPlan->nSample; i++){
+      pPlan->aSample[i].anEq[k] = pPlan->nRow - pPlan->aSample[i].anLt[k];
+    }
+  }
+  for(j=0; j<n; j++){
+    ScrubDefragSample *pS = &pPlan->aSample[j*pPlan->nSample/n];
+    const sqlite3_int64 *aList[3];
+    aList[0] = pS->anEq;
+    aList[1] = pS->anLt;
+    aList[2] = pS->anDLt;
+    sqlite3_str_appendf(p->pPlan, "\nINSERT INTO main.sqlite_stat4 "
+                        "VALUES(%Q,%Q", pPlan->zTbl, pPlan->zIdx);
+    for(i=0; i<3; i++){
+      for(k=0; k<pPlan->nCol; k++){
+        sqlite3_str_appendf(p->pPlan, k ? " %lld" : ",'%lld", aList[i][k]);
+      }
+      sqlite3_str_appendall(p->pPlan, "'");
+    }
+    sqlite3_str_appendall(p->pPlan, ",X'");
+    for(i=0; i<pS->nRec; i++){
+      sqlite3_str_appendf(p->pPlan, "%02x", pS->aRec[i]);
+    }
+    sqlite3_str_appendall(p->pPlan, "');");
+  }
+}
+
+/*
+** Stat1: add the SQL that records the figures of the b-tree last started,
+** if any, to p->pPlan.  It writes what ANALYZE would: a row count for a
+** table that no index covers, and for an index the number of entries and
+** the average number of entries per distinct value of each key prefix.
+*/
+static void scrubDefragPlanEnd(ScrubDefragState *p){
+  ScrubDefragPlan *pPlan = &p->plan;
+  int k;
+  if( pPlan->eTree==SCRUB_DEFRAG_PLAN_NONE ) return;
+  if( p->pPlan==0 ) p->pPlan = sqlite3_str_new(0);
+  if( pPlan->eTree==SCRUB_DEFRAG_PLAN_ROWS ){
+    if( pPlan->nRow>0 ){
+      sqlite3_str_appendf(p->pPlan,
+          "\nINSERT INTO main.sqlite_stat1 SELECT %Q,NULL,'%lld'"
+          " WHERE NOT EXISTS (SELECT 1 FROM pragma_index_list(%Q,'main')"
+          " WHERE NOT partial);",
+          pPlan->zTbl, pPlan->nRow, pPlan->zTbl);
+    }
+  }else if( pPlan->bAnalyze ){
+    sqlite3_str_appendf(p->pPlan, "\nANALYZE main.\"%w\";", pPlan->zAnalyze);
+  }else if( pPlan->nRow>0 ){
+    sqlite3_str_appendf(p->pPlan,
+        "\nINSERT INTO main.sqlite_stat1 VALUES(%Q,%Q,'%lld",
+        pPlan->zTbl, pPlan->zIdx, pPlan->nRow);
+    for(k=0; k<pPlan->nKey; k++){
+      sqlite3_int64 nDist = pPlan->anDist[k];
+      sqlite3_int64 iVal = (pPlan->nRow + nDist - 1)/nDist;
+      /* ANALYZE takes an average just over one as one */
+      if( iVal==2 && pPlan->nRow*10<=nDist*11 ) iVal = 1;
+      sqlite3_str_appendf(p->pPlan, " %lld", iVal);
+    }
+    sqlite3_str_appendall(p->pPlan, "');");
+    if( p->bStat4 ) scrubDefragPlanSamples(p);
+  }
+  scrubDefragPlanReset(p);
+}
+
+/*
+** Stat1: start the figures of b-tree zName of type zType, of table zTbl.
+** The key columns of an index, or of the primary key of a table in case
+** it is WITHOUT ROWID, and their collating sequences come from the source.
+** An index with a key column that does not use BINARY is left to ANALYZE.
+*/
+static void scrubDefragPlanBegin(
+  ScrubDefragState *p,
+  const char *zName,
+  const char *zType,
+  const char *zTbl
+){
+  ScrubDefragPlan *pPlan = &p->plan;
+  int bIndex = zType && strcmp(zType, "index")==0;
+  int nAll = 0;            /* Columns of the index */
+  int iColl = -1;          /* First column with another collating sequence */
+  int rc;
+
+  if( !p->bStat1 || p->rcErr ) return;
+  scrubDefragPlanEnd(p);
+  /* ANALYZE leaves the sqlite_% tables and their indexes alone */
+  if( zTbl==0 || sqlite3_strlike("sqlite\\_%", zTbl, '\\')==0 ) return;
+  if( p->pPlanInfo==0 ){
+    const char *zDb = p->zSrcDb ? p->zSrcDb : "main";
+    char *zSql = sqlite3_mprintf(
+        "SELECT x.key, upper(x.coll)<>'BINARY', l.name"
+        "  FROM (SELECT CASE WHEN ?2='index' THEN ?1 ELSE"
+        "          (SELECT name FROM pragma_index_list(?1,%Q)"
+        "            WHERE origin='pk')"
+        "        END AS name) AS l, pragma_index_xinfo(l.name,%Q) AS x"
+        " ORDER BY x.seqno", zDb, zDb);
+    if( zSql==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    p->pPlanInfo = scrubDefragPrepare(p, p->dbSrc, zSql);
+    sqlite3_free(zSql);
+    if( p->pPlanInfo==0 ) return;
+  }
+  sqlite3_bind_text(p->pPlanInfo, 1, zName, -1, SQLITE_STATIC);
+  sqlite3_bind_text(p->pPlanInfo, 2, zType, -1, SQLITE_STATIC);
+  while( sqlite3_step(p->pPlanInfo)==SQLITE_ROW ){
+    if( sqlite3_column_int(p->pPlanInfo, 0) ) pPlan->nKey++;
+    if( sqlite3_column_int(p->pPlanInfo, 1) && iColl<0 ) iColl = nAll;
+    if( nAll++==0 ){
+      pPlan->zAnalyze = sqlite3_mprintf("%s",
+                            sqlite3_column_text(p->pPlanInfo, 2));
+    }
+  }
+  rc = sqlite3_reset(p->pPlanInfo);
+  if( rc ){
+    p->rcErr = rc;
+    scrubDefragErr(p, "cannot read the index columns: %s",
+                   sqlite3_errmsg(p->dbSrc));
+    return;
+  }
+
+  /* A sqlite_stat4 sample compares the rowid or primary key too, except in
+  ** the primary key of a WITHOUT ROWID table */
+  pPlan->nCol = p->bStat4 && bIndex ? nAll : pPlan->nKey;
+  pPlan->bAnalyze = (iColl>=0 && iColl<pPlan->nCol) || (bIndex && nAll==0);
+  pPlan->eTree = bIndex ? SCRUB_DEFRAG_PLAN_KEYS : SCRUB_DEFRAG_PLAN_ROWS;
+  pPlan->zTbl = sqlite3_mprintf("%s", zTbl);
+  pPlan->zIdx = sqlite3_mprintf("%s", zName);
+  if( pPlan->zAnalyze==0 ) pPlan->zAnalyze = sqlite3_mprintf("%s", zName);
+  pPlan->nStride = 1;
+  if( pPlan->nCol>0 ){
+    sqlite3_int64 nByte = pPlan->nCol*(2*sizeof(sqlite3_int64) + sizeof(int));
+    pPlan->anDist = sqlite3_malloc64(nByte);
+    if( pPlan->anDist ){
+      memset(pPlan->anDist, 0, nByte);
+      pPlan->anRun = &pPlan->anDist[pPlan->nCol];
+      pPlan->aiPend = (int*)&pPlan->anRun[pPlan->nCol];
+    }
+  }
+  if( pPlan->aPrev==0 ) pPlan->aPrev = sqlite3_malloc(p->szUsable + 9);
+  if( pPlan->aKey==0 ) pPlan->aKey = sqlite3_malloc(p->szUsable + 9);
+  if( pPlan->zTbl==0 || pPlan->zIdx==0 || pPlan->zAnalyze==0
+   || (pPlan->nCol>0 && pPlan->anDist==0)
+   || pPlan->aPrev==0 || pPlan->aKey==0
+  ){
+    scrubDefragPlanReset(p);
+    p->rcErr = SQLITE_NOMEM;
+  }
+}
+
+/*
+** Open both databases and prepare page 1 for a copy.  The first step
+** starts on the b-tree of the schema and p->pRoots will deliver the rest,
+** tables last.
+*/
+static void scrubDefragCopyInit(ScrubDefragState *p){
+  char *zSql;
+  p->iDestPageNo = 1;
+  scrubDefragSqlAppend(p, "BEGIN EXCLUSIVE;\nPRAGMA writable_schema=on;");
+  if( p->rcErr ) return;
+
+  /* Open both source and destination databases.  The source connection
+  ** is already open if it was supplied by the caller, and there is no
+  ** destination database when copying to memory. */
+  p->st.tStart = scrubDefragClock();
+  if( p->dbSrc ){
+    scrubDefragBeginSrc(p);
+  }else{
+    scrubDefragOpenSrc(p);
+  }
+  if( p->dbDest ){
+    scrubDefragBeginDest(p);
+  }else if( p->zDestFile ){
+    scrubDefragOpenDest(p);
+  }
+  p->st.tOpen = scrubDefragClock() - p->st.tStart - p->st.tCkpt;
+  if (p->rcErr) return;
+
+  p->iLock = (1073742335/p->szPage)+1;
+  p->nDestPage = p->nSrcPage - p->nFreePage;
+  if(p->nSrcPage >= p->iLock && p->nDestPage < p->iLock){
+    p->nDestPage--; 
+  }
+  if( p->dbDest==0 ){
+    if( p->nDestPage==0 ){
+      scrubDefragErr(p, "the source database is empty");
+      return;
+    }
+    /* Zeroed so that a page the walk never reaches, and the lock page,
+    ** hold no stale heap content */
+    p->aOut = sqlite3_malloc64(p->nDestPage*(sqlite3_int64)p->szPage);
+    if( p->aOut==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    memset(p->aOut, 0, p->nDestPage*(sqlite3_int64)p->szPage);
+  }
+
+  /* Read in page 1 */
+  scrubDefragPoolCheck(p);
+  p->page1 = scrubDefragRead(p, 1, p->aOut ? scrubDefragSlot(p, 1)
+                                           : scrubDefragPoolPage(p, &p->aPage1));
+  if( p->page1==0 ) return;
+#if SCRUB_DEFRAG_KCOPY
+  scrubDefragKcopyOpen(p);
+#endif
+
+  scrubDefragWriteInt32(&p->page1[28], p->nDestPage);
+  /* First freelist trunk page */
+  scrubDefragWriteInt32(&p->page1[32], 0);
+  /* freelist count */
+  scrubDefragWriteInt32(&p->page1[36], 0);
+  /* autovacuum */
+  scrubDefragWriteInt32(&p->page1[52], 0);
+  if( p->aOut ){
+    /* In-memory databases cannot be in WAL mode */
+    p->page1[18] = p->page1[19] = 1;
+  }
+
+  scrubDefragSetUsable(p, p->page1[20]);
+
+#ifdef SCRUB_DEFRAG_PROFILE
+  scrubDefragProfOpen(p);
+#endif
+  zSql = sqlite3_mprintf(
+      "SELECT rootpage,name,type,tbl_name FROM \"%w\".sqlite_master"
+      "   WHERE coalesce(rootpage,0)>0"
+      "   ORDER BY CASE type WHEN 'table' THEN 2 "
+      "                      WHEN 'index' THEN 1 "
+      "                      ELSE 0 END, rootpage",
+      p->zSrcDb ? p->zSrcDb : "main");
+  if( zSql==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  p->pRoots = scrubDefragPrepare(p, p->dbSrc, zSql);
+  sqlite3_free(zSql);
+  if( p->pRoots==0 ) return;
+  p->zBtree = "sqlite_schema";
+}
+
+/*
+** Rewrite the checksum of destination page pgno, read into a[], through
+** file handle pFile.  If iDepth>=0 the page belongs to the schema b-tree
+** at that depth and its children are rewritten too.
+*/
+static void scrubDefragCksumFix(
+  ScrubDefragState *p,
+  sqlite3_file *pFile,
+  u32 pgno,
+  int iDepth
+){
+  sqlite3_int64 iOff = (pgno-1)*(sqlite3_int64)p->szPage;
+  u8 *a, *aTop;
+  u32 i, nCell;
+  int rc;
+
+  if( p->rcErr ) return;
+  if( iDepth>SCRUB_DEFRAG_MAX_DEPTH ){
+    scrubDefragErr(p, "corrupt: schema b-tree of the copy too deep");
+    return;
+  }
+  a = scrubDefragAllocPage(p);
+  if( a==0 ) return;
+  rc = pFile->pMethods->xRead(pFile, a, p->szPage, iOff);
+  if( rc==SQLITE_OK ){
+    scrubDefragCksumSet(p, a);
+    rc = pFile->pMethods->xWrite(pFile, a, p->szPage, iOff);
+  }
+  if( rc ){
+    scrubDefragErr(p, "cannot rewrite the checksum of page %d", pgno);
+    p->rcErr = SQLITE_IOERR;
+  }
+  aTop = &a[pgno==1 ? 100 : 0];
+  if( iDepth>=0 && (aTop[0]==0x05 || aTop[0]==0x02) ){
+    nCell = scrubDefragInt16(&aTop[3]);
+    for(i=0; i<nCell && p->rcErr==SQLITE_OK; i++){
+      u32 pc = SCRUB_DEFRAG_CELL(&aTop[12], i);
+      if( pc>p->szUsable-4 ) break;
+      scrubDefragCksumFix(p, pFile, scrubDefragInt32(&a[pc]), iDepth+1);
+    }
+    scrubDefragCksumFix(p, pFile, scrubDefragInt32(&aTop[8]), iDepth+1);
+  }
+  sqlite3_free(a);
+}
+
+/*
+** The root pages of the copy were updated through SQLite, which leaves
+** stale checksums on every page it wrote: page 1, the pages of the schema
+** b-tree, and any freelist trunk or page it added.  Rewrite those.
+*/
+static void scrubDefragCksumFixup(ScrubDefragState *p){
+  sqlite3_file *pFile = 0;
+  u8 aHdr[100];
+  u32 pgno, nPage;
+
+  sqlite3_file_control(p->dbDest, "main", SQLITE_FCNTL_FILE_POINTER, &pFile);
+  if( pFile==0 || pFile->pMethods==0
+   || pFile->pMethods->xRead(pFile, aHdr, sizeof(aHdr), 0)
+  ){
+    scrubDefragErr(p, "cannot read the header of the copy");
+    p->rcErr = SQLITE_IOERR;
+    return;
+  }
+  nPage = scrubDefragInt32(&aHdr[28]);
+  scrubDefragCksumFix(p, pFile, 1, 0);
+  pgno = scrubDefragInt32(&aHdr[32]);
+  while( pgno && pgno<=nPage && p->rcErr==SQLITE_OK ){
+    u8 aNext[4];
+    scrubDefragCksumFix(p, pFile, pgno, -1);
+    if( pFile->pMethods->xRead(pFile, aNext, 4,
+                               (pgno-1)*(sqlite3_int64)p->szPage) ){
+      break;
+    }
+    pgno = scrubDefragInt32(aNext);
+  }
+  /* Salvage reindexing may have rewritten any page */
+  pgno = p->pReindex ? 2 : p->nDestPage+1;
+  for(; pgno<=nPage && p->rcErr==SQLITE_OK; pgno++){
+    if( pgno!=p->iLock ) scrubDefragCksumFix(p, pFile, pgno, -1);
+  }
+  if( p->rcErr==SQLITE_OK && pFile->pMethods->xSync(pFile, SQLITE_SYNC_NORMAL) ){
+    scrubDefragErr(p, "cannot sync the copy");
+    p->rcErr = SQLITE_IOERR;
+  }
+}
+
+/*
+** Open the image in p->aOut as p->dbDest, an in-memory database, so that
+** its root pages can be updated through SQLite.  The image may be grown by
+** the update but is not freed when p->dbDest is closed.
+*/
+static void scrubDefragMemOpen(ScrubDefragState *p){
+  sqlite3_int64 nByte = p->nDestPage*(sqlite3_int64)p->szPage;
+  p->rcErr = sqlite3_open(":memory:", &p->dbDest);
+  if( p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_deserialize(p->dbDest, "main", p->aOut, nByte, nByte,
+                                   SQLITE_DESERIALIZE_RESIZEABLE);
+  }
+}
+
+/*
+** Take the image back from p->dbDest, which may have moved it, and close
+** p->dbDest.
+*/
+static void scrubDefragMemTake(ScrubDefragState *p){
+  sqlite3_int64 nByte = 0;
+  u8 *a = sqlite3_serialize(p->dbDest, "main", &nByte,
+                            SQLITE_SERIALIZE_NOCOPY);
+  if( a ){
+    p->aOut = p->page1 = a;
+    p->nOut = nByte;
+  }else if( p->rcErr==SQLITE_OK ){
+    scrubDefragErr(p, "cannot get the image of the copy: %s",
+                   sqlite3_errmsg(p->dbDest));
+  }
+  sqlite3_close(p->dbDest);
+  p->dbDest = 0;
+}
+
+/*
+** Salvage: the walk is over.  If fewer pages were written than were
+** expected, make the copy that size: page 1 gets the new page count and
+** the destination is truncated.
+*/
+static void scrubDefragSalvageEnd(ScrubDefragState *p){
+  u32 nPage = p->iDestPageNo - 1;
+  if( nPage==p->iLock ) nPage--;
+  if( nPage>=p->nDestPage ) return;
+  if( p->pLoss==0 ) p->pLoss = sqlite3_str_new(0);
+  sqlite3_str_appendf(p->pLoss, "%u of the %u pages in use were not copied\n",
+                      p->nDestPage - nPage, p->nDestPage);
+  p->nDestPage = nPage;
+  scrubDefragWriteInt32(&p->page1[28], nPage);
+  if( p->bCksum ) scrubDefragCksumSet(p, p->page1);
+  scrubDefragWrite(p, 1, p->page1);
+  if( p->rcErr==SQLITE_OK && p->aOut==0
+   && p->pDest->pMethods->xTruncate(p->pDest, nPage*(sqlite3_int64)p->szPage)
+  ){
+    scrubDefragErr(p, "cannot truncate the copy");
+    p->rcErr = SQLITE_IOERR;
+  }
+}
+
+/*
+** Set secure_delete on the main database of p->dbDest to bOn and return
+** what it was, so that pages freed once the copy is done are zeroed too.
+*/
+static int scrubDefragSecureDelete(ScrubDefragState *p, int bOn){
+  sqlite3_stmt *pStmt = 0;
+  int bSecure = 0;
+  if( sqlite3_prepare_v2(p->dbDest, "PRAGMA main.secure_delete", -1,
+                         &pStmt, 0)==SQLITE_OK
+   && sqlite3_step(pStmt)==SQLITE_ROW
+  ){
+    bSecure = sqlite3_column_int(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_exec(p->dbDest, bOn ? "PRAGMA main.secure_delete=ON;"
+                              : "PRAGMA main.secure_delete=OFF;", 0, 0, 0);
+  return bSecure;
+}
+
+/*
+** Salvage: rebuild the indexes of every damaged b-tree on p->dbDest, whose
+** root pages have been updated, with secure_delete on so that the old
+** index pages are zeroed.  A failure, a missing collating sequence for
+** instance, goes in the report but does not fail the copy.
+*/
+static void scrubDefragSalvageReindex(ScrubDefragState *p){
+  const char *z = sqlite3_str_value(p->pReindex);
+  const char *zEnd = z + sqlite3_str_length(p->pReindex);
+  int bSecure;
+
+  /* The connection still holds the schema with the old root pages */
+  sqlite3_exec(p->dbDest, "PRAGMA writable_schema=RESET;", 0, 0, 0);
+  bSecure = scrubDefragSecureDelete(p, 1);
+  for(; z && z<zEnd; z+=strlen(z)+1){
+    char *zSql = sqlite3_mprintf("REINDEX main.\"%w\";", z);
+    if( zSql==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      break;
+    }
+    if( sqlite3_exec(p->dbDest, zSql, 0, 0, 0) ){
+      sqlite3_str_appendf(p->pLoss, "%s: cannot reindex: %s\n",
+                          z, sqlite3_errmsg(p->dbDest));
+    }
+    sqlite3_free(zSql);
+  }
+  scrubDefragSecureDelete(p, bSecure);
+}
+
+/*
+** Stat1: fill the stat tables of p->dbDest, whose root pages have been
+** updated, from p->pPlan.  ANALYZE of sqlite_schema analyzes nothing but
+** creates the tables if need be.  If salvage dropped anything the figures
+** gathered no longer hold, and the whole copy is analyzed instead.
+*/
+static void scrubDefragPlanWrite(ScrubDefragState *p){
+  const char *zPlan = p->pPlan ? sqlite3_str_value(p->pPlan) : 0;
+  char *zSql, *zErr = 0;
+  int bSecure;
+
+  if( p->pPlan && sqlite3_str_errcode(p->pPlan) ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  zSql = sqlite3_mprintf(
+      "BEGIN;\nANALYZE main.sqlite_schema;\nDELETE FROM main.sqlite_stat1;"
+      "%s%s\nCOMMIT;",
+      p->bStat4 ? "\nDELETE FROM main.sqlite_stat4;" : "",
+      p->pLoss ? "\nANALYZE main;" : zPlan ? zPlan : "");
+  if( zSql==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  sqlite3_exec(p->dbDest, "PRAGMA writable_schema=RESET;", 0, 0, 0);
+  bSecure = scrubDefragSecureDelete(p, 1);
+  if( (p->rcErr = sqlite3_exec(p->dbDest, zSql, 0, 0, &zErr)) ){
+    scrubDefragErr(p, "cannot write the planner statistics: %z", zErr);
+    sqlite3_exec(p->dbDest, "ROLLBACK;", 0, 0, 0);
+  }
+  scrubDefragSecureDelete(p, bSecure);
+  sqlite3_free(zSql);
+}
+
+/*
+** Copy about nPage more pages, or all that are left if nPage<=0.  Once the
+** last b-tree is done the root pages are updated and p->bDone set.
+*/
+static void scrubDefragCopyStep(ScrubDefragState *p, int nPage){
+  char* errmsg=0;
+  int rc;
+  int bDefensive = 0;
+
+  while( p->rcErr==0 && !p->bDone ){
+    u32 nBefore = p->nPageDone;
+    sqlite3_int64 t0 = scrubDefragClock();
+    scrubDefragWalk(p, nPage>0 ? (u32)nPage : 0);
+    p->st.tWalk += scrubDefragClock() - t0;
+    if( p->rcErr ) return;
+    if( nPage>0 ){
+      nPage -= p->nPageDone - nBefore;
+      if( nPage<=0 ) return;
+    }
+    if( p->nFrame>0 || p->iOvfl ) continue;
+
+    /* Start on the next b-tree */
+    if( p->nPageDone==0 ){
+      scrubDefragObjBegin(p, "sqlite_schema", "table");
+      scrubDefragPush(p, 1, 1);
+      continue;
+    }
+    if( p->pRoots ){
+      if( sqlite3_step(p->pRoots)==SQLITE_ROW ){
+        sqlite3_stmt *pStmt = p->pRoots;
+        scrubDefragSqlAppend(p, "\nUPDATE SQLITE_MASTER SET rootpage=%d "
+                               "  WHERE rootpage=%d AND name=%Q AND type=%Q;",
+                               p->iDestPageNo, 
+                               sqlite3_column_int(pStmt, 0),
+                               sqlite3_column_text(pStmt, 1), 
+                               sqlite3_column_text(pStmt, 2));
+        if( p->rcErr ) return;
+        p->zBtree = (const char*)sqlite3_column_text(pStmt, 1);
+        p->bSalvaged = 0;
+        scrubDefragObjBegin(p, p->zBtree,
+                            (const char*)sqlite3_column_text(pStmt, 2));
+        scrubDefragPlanBegin(p, p->zBtree,
+                             (const char*)sqlite3_column_text(pStmt, 2),
+                             (const char*)sqlite3_column_text(pStmt, 3));
+        if( p->rcErr ) return;
+        scrubDefragPush(p, (u32)sqlite3_column_int(pStmt, 0), 1);
+        if( p->rcErr ) scrubDefragSalvage(p, SCRUB_DEFRAG_FAIL_ROOT);
+        continue;
+      }
+      p->zBtree = 0;
+      rc = sqlite3_finalize(p->pRoots);
+      p->pRoots = 0;
+      if( rc ){
+        p->rcErr = rc;
+        scrubDefragErr(p, "cannot read the schema: %s",
+                       sqlite3_errmsg(p->dbSrc));
+        return;
+      }
+    }
+    scrubDefragObjEnd(p);
+    scrubDefragPlanEnd(p);
+    if( p->bSalvage ){
+      scrubDefragSalvageEnd(p);
+      if( p->rcErr ) return;
+    }else if( p->bStrict && p->nPageDone!=p->nDestPage ){
+      scrubDefragErr(p, "corrupt: %u of %u pages not on the freelist are "
+                        "reached from the schema", p->nPageDone, p->nDestPage);
+      p->rcErr = SQLITE_CORRUPT;
+      return;
+    }
+
+    scrubDefragSqlAppend(p, "\nCOMMIT;\nPRAGMA writable_schema=off;");
+    if( p->rcErr ) return;
+    p->st.tRoots = scrubDefragClock();
+    scrubDefragEndDest(p);
+    /* reopen the destination database and update the root pages */
+    if( p->aOut ){
+      scrubDefragMemOpen(p);
+    }else if( p->bBorrowDest ){
+      /* Defensive mode would refuse writable_schema */
+      sqlite3_db_config(p->dbDest, SQLITE_DBCONFIG_DEFENSIVE, -1, &bDefensive);
+      sqlite3_db_config(p->dbDest, SQLITE_DBCONFIG_DEFENSIVE, 0, (int*)0);
+    }else{
+      p->rcErr = sqlite3_open_v2(p->zDestFile, &p->dbDest, 
+                       SQLITE_OPEN_READWRITE |
+                       SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
+    }
+    if( p->rcErr ){ 
+      scrubDefragErr(p, "Error occurred while reopen destination database:%s",
+                         sqlite3_errmsg(p->dbDest));
+    }else if( p->rcErr = sqlite3_exec(p->dbDest, p->zSql, 0, 0, &errmsg) ){
+        scrubDefragErr(p, "Error occurred while update root page: %z",errmsg);
+    }else{
+      if( p->pReindex ) scrubDefragSalvageReindex(p);
+      if( p->bStat1 ) scrubDefragPlanWrite(p);
+      if( p->bCksum ) scrubDefragCksumFixup(p);
+    }
+    if( p->aOut ) scrubDefragMemTake(p);
+    if( p->bBorrowDest ){
+      /* The connection still holds the schema with the old root pages */
+      sqlite3_exec(p->dbDest, "PRAGMA writable_schema=RESET;", 0, 0, 0);
+      sqlite3_db_config(p->dbDest, SQLITE_DBCONFIG_DEFENSIVE, bDefensive,
+                        (int*)0);
+    }
+    p->st.tRoots = scrubDefragClock() - p->st.tRoots;
+    p->st.tTotal = scrubDefragClock() - p->st.tStart;
+    p->bDone = 1;
+  }
+}
+
+/*
+** Release everything held by a copy.  Both database connections are closed.
+** A copy that was cancelled or abandoned leaves an empty destination.
+*/
+static void scrubDefragCopyClose(ScrubDefragState *p){
+  scrubDefragWalkReset(p);
+#ifdef SCRUB_DEFRAG_PROFILE
+  scrubDefragProfClose(p);
+#endif
+  sqlite3_finalize(p->pRoots);
+  p->pRoots = 0;
+  scrubDefragPlanFree(p);
+  p->nSql = 0;
+  sqlite3_free(sqlite3_str_finish(p->pLoss));
+  p->pLoss = 0;
+  sqlite3_free(sqlite3_str_finish(p->pReindex));
+  p->pReindex = 0;
+  if( !p->bKeep ){
+    scrubDefragObjFree(p);
+    sqlite3_free(p->zSql);
+    p->zSql = 0;
+    p->nSqlAlloc = 0;
+    sqlite3_free(p->aSeen);
+    p->aSeen = 0;
+    p->nSeen = 0;
+    scrubDefragPoolFree(p);
+  }
+  if( p->pDest && !p->bDone && p->page1
+   && (p->rcErr==SQLITE_OK || p->rcErr==SQLITE_ABORT)
+  ){
+    p->pDest->pMethods->xTruncate(p->pDest, 0);
+  }
+  scrubDefragEndDest(p);
+  p->dbDest = 0;
+  /* But do close out the read-transaction on the source database */
+  sqlite3_exec(p->dbSrc, "COMMIT;", 0, 0, 0);
+  if( !p->bBorrowSrc ) sqlite3_close(p->dbSrc);
+  p->dbSrc = 0;
+#if SCRUB_DEFRAG_KCOPY
+  scrubDefragKcopyClose(p);
+#endif
+  p->page1 = 0;
+  sqlite3_free(p->aOut);
+  p->aOut = 0;
+}
+
+/*
+** Copy every b-tree of the source database into the destination.  This is
+** the body of sqlite3_scrub_and_defrag() after the ScrubDefragState has been
+** initialized.  Both database connections are closed before returning.
+*/
+static void scrubDefragCopy(ScrubDefragState *p){
+  scrubDefragCopyInit(p);
+  scrubDefragCopyStep(p, 0);
+  scrubDefragCopyClose(p);
+}
+
+int sqlite3_scrub_and_defrag_v2(
+  const char *zSrcFile,    /* Source file */
+  const char *zDestFile,   /* Destination file */
+  int nStep,               /* Pages between callbacks, or <=0 for default */
+  int (*xProgress)(void*,unsigned,unsigned,sqlite3_int64,sqlite3_int64,
+                   const char*),
+  void *pArg,              /* First argument to xProgress */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+
+  memset(&s, 0, sizeof(s));
+  s.zSrcFile = zSrcFile;
+  s.zDestFile = zDestFile;
+  s.eCkpt = SQLITE_CHECKPOINT_FULL;
+  s.xProgress = xProgress;
+  s.pProgressArg = pArg;
+  s.nProgressStep = nStep>0 ? nStep : SCRUB_DEFRAG_PROGRESS_STEP;
+  scrubDefragCopy(&s);
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+
+int sqlite3_scrub_and_defrag(
+  const char *zSrcFile,    /* Source file */
+  const char *zDestFile,   /* Destination file */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  return sqlite3_scrub_and_defrag_v2(zSrcFile, zDestFile, 0, 0, 0, pzErr);
+}
+
+/*
+** Copy schema zSchema (NULL for "main") of connection db, which has a file
+** or memdb image to read the pages from, into an image in memory from
+** sqlite3_malloc().  Each page is read from the source straight into its
+** place in the image.
+*/
+static int scrubDefragSerializeDb(
+  sqlite3 *db,             /* Source connection, not in a transaction */
+  const char *zSchema,     /* Schema of db to copy, or NULL for "main" */
+  unsigned char **paOut,   /* OUT: The image, from sqlite3_malloc() */
+  sqlite3_int64 *pnOut,    /* OUT: Size of the image in bytes */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+
+  memset(&s, 0, sizeof(s));
+  *paOut = 0;
+  *pnOut = 0;
+  s.zSrcFile = sqlite3_db_filename(db, zSchema ? zSchema : "main");
+  s.eCkpt = SQLITE_CHECKPOINT_FULL;
+  if( !sqlite3_get_autocommit(db) ){
+    scrubDefragErr(&s, "cannot defragment from inside a transaction");
+  }else{
+    s.dbSrc = db;
+    s.zSrcDb = zSchema;
+    s.bBorrowSrc = 1;
+    scrubDefragCopyInit(&s);
+    scrubDefragCopyStep(&s, 0);
+  }
+  if( s.rcErr==SQLITE_OK ){
+    *paOut = s.aOut;
+    *pnOut = s.nOut;
+    s.aOut = s.page1 = 0;
+  }
+  scrubDefragCopyClose(&s);
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+
+/*
+** Copy the nSrc byte database image aSrc into an image in memory from
+** sqlite3_malloc().  aSrc is opened read-only with the memdb VFS and read
+** in place.
+*/
+static int scrubDefragSerializeImage(
+  const unsigned char *aSrc, /* Source database image */
+  sqlite3_int64 nSrc,      /* Size of aSrc in bytes */
+  unsigned char **paOut,   /* OUT: The image, from sqlite3_malloc() */
+  sqlite3_int64 *pnOut,    /* OUT: Size of the image in bytes */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  sqlite3 *db = 0;
+  int rc = sqlite3_open(":memory:", &db);
+  *paOut = 0;
+  *pnOut = 0;
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_deserialize(db, "main", (unsigned char*)aSrc, nSrc, nSrc,
+                             SQLITE_DESERIALIZE_READONLY);
+  }
+  if( rc ){
+    if( pzErr ){
+      *pzErr = sqlite3_mprintf("cannot open the source image: %s",
+                               sqlite3_errmsg(db));
+    }
+  }else{
+    rc = scrubDefragSerializeDb(db, 0, paOut, pnOut, pzErr);
+  }
+  sqlite3_close(db);
+  return rc;
+}
+
+/*
+** Copy schema zSchema (NULL for "main") of connection db into an image in
+** memory from sqlite3_malloc(), ready for sqlite3_deserialize().  A plain
+** in-memory database has no file to read pages from, so it is copied out
+** with sqlite3_serialize() and that image defragmented instead.
+*/
+int sqlite3_scrub_and_defrag_serialize(
+  sqlite3 *db,             /* Source connection, not in a transaction */
+  const char *zSchema,     /* Schema of db to copy, or NULL for "main" */
+  unsigned char **paOut,   /* OUT: The image, from sqlite3_malloc() */
+  sqlite3_int64 *pnOut,    /* OUT: Size of the image in bytes */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  const char *zDb = zSchema ? zSchema : "main";
+  sqlite3_file *pFile = 0;
+  sqlite3_int64 nImage = 0;
+  unsigned char *aImage;
+  int rc;
+
+  if( !sqlite3_get_autocommit(db)
+   || sqlite3_file_control(db, zDb, SQLITE_FCNTL_FILE_POINTER, &pFile)
+   || (pFile && pFile->pMethods)
+  ){
+    return scrubDefragSerializeDb(db, zSchema, paOut, pnOut, pzErr);
+  }
+  *paOut = 0;
+  *pnOut = 0;
+  aImage = sqlite3_serialize(db, zDb, &nImage, 0);
+  if( aImage==0 && nImage!=0 ){
+    /* An empty database has a zero-size image, which is not allocated */
+    if( pzErr ) *pzErr = sqlite3_mprintf("cannot serialize the source");
+    return SQLITE_NOMEM;
+  }
+  rc = scrubDefragSerializeImage(aImage, nImage, paOut, pnOut, pzErr);
+  sqlite3_free(aImage);
+  return rc;
+}
+
+/*
+** As sqlite3_scrub_and_defrag_serialize(), but the source is the nSrc byte
+** database image aSrc, for example from sqlite3_serialize().  aSrc is read
+** in place and not modified.
+*/
+int sqlite3_scrub_and_defrag_buffer(
+  const unsigned char *aSrc, /* Source database image */
+  sqlite3_int64 nSrc,      /* Size of aSrc in bytes */
+  unsigned char **paOut,   /* OUT: The image, from sqlite3_malloc() */
+  sqlite3_int64 *pnOut,    /* OUT: Size of the image in bytes */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  return scrubDefragSerializeImage(aSrc, nSrc, paOut, pnOut, pzErr);
+}
+
+/*
+** Incremental copy.  The init call opens both databases and returns NULL
+** only if out of memory; any other error is returned by the first step.
+*/
+sqlite3_defrag *sqlite3_scrub_and_defrag_init(
+  const char *zSrcFile,    /* Source file */
+  const char *zDestFile    /* Destination file */
+){
+  ScrubDefragState *p = sqlite3_malloc(sizeof(*p));
+  if( p==0 ) return 0;
+  memset(p, 0, sizeof(*p));
+  p->zSrcFile = zSrcFile;
+  p->zDestFile = zDestFile;
+  p->eCkpt = SQLITE_CHECKPOINT_FULL;
+  scrubDefragCopyInit(p);
+  return p;
+}
+
+/*
+** Copy up to nPage more pages, or all of them if nPage<0.  Return SQLITE_OK
+** if there is more to do, SQLITE_DONE once the copy is complete, or an
+** error code, which is returned again by every later call.
+*/
+int sqlite3_scrub_and_defrag_step(sqlite3_defrag *p, int nPage){
+  if( p->rcErr==SQLITE_OK && nPage!=0 ){
+    scrubDefragCopyStep(p, nPage);
+  }
+  if( p->rcErr ) return p->rcErr;
+  return p->bDone ? SQLITE_DONE : SQLITE_OK;
+}
+
+/* Pages still to be copied, and the size of the copy, in pages */
+int sqlite3_scrub_and_defrag_remaining(sqlite3_defrag *p){
+  return p->nDestPage>p->nPageDone ? (int)(p->nDestPage - p->nPageDone) : 0;
+}
+int sqlite3_scrub_and_defrag_pagecount(sqlite3_defrag *p){
+  return (int)p->nDestPage;
+}
+
+/* Install a progress callback, as for sqlite3_scrub_and_defrag_v2() */
+void sqlite3_scrub_and_defrag_progress(
+  sqlite3_defrag *p,
+  int nStep,               /* Pages between callbacks, or <=0 for default */
+  int (*xProgress)(void*,unsigned,unsigned,sqlite3_int64,sqlite3_int64,
+                   const char*),
+  void *pArg               /* First argument to xProgress */
+){
+  p->xProgress = xProgress;
+  p->pProgressArg = pArg;
+  p->nProgressStep = nStep>0 ? nStep : SCRUB_DEFRAG_PROGRESS_STEP;
+}
+
+/*
+** Turn on the structural checks of strict mode.  This must come before the
+** first step; later it returns SQLITE_MISUSE.
+*/
+int sqlite3_scrub_and_defrag_strict(sqlite3_defrag *p, int bStrict){
+  if( p->rcErr ) return p->rcErr;
+  if( p->nPageDone>0 || p->nFrame>0 ) return SQLITE_MISUSE;
+  if( bStrict ){
+    u32 nByte = p->nSrcPage/8 + 1;
+    if( p->nSeen<nByte ){
+      u8 *aSeen = sqlite3_realloc64(p->aSeen, nByte);
+      if( aSeen==0 ) return SQLITE_NOMEM;
+      p->aSeen = aSeen;
+      p->nSeen = nByte;
+    }
+    memset(p->aSeen, 0, nByte);
+  }
+  p->bStrict = bStrict!=0;
+  return SQLITE_OK;
+}
+
+/*
+** Turn on salvage mode, and with it strict mode: a corrupt subtree or
+** overflow chain is dropped and the copy goes on.  This must come before
+** the first step; later it returns SQLITE_MISUSE.
+*/
+int sqlite3_scrub_and_defrag_salvage(sqlite3_defrag *p, int bSalvage){
+  int rc = sqlite3_scrub_and_defrag_strict(p, bSalvage || p->bStrict);
+  if( rc==SQLITE_OK && bSalvage && p->aUsed==0 ){
+    p->aUsed = sqlite3_malloc(p->szPage);
+    if( p->aUsed==0 ) rc = SQLITE_NOMEM;
+  }
+  if( rc==SQLITE_OK ) p->bSalvage = bSalvage!=0;
+  return rc;
+}
+
+/*
+** Return what salvage mode has dropped so far, one line for each corrupt
+** subtree or chain and a last line with the number of pages lost, in
+** memory from sqlite3_malloc().  Return NULL if nothing was dropped.
+*/
+char *sqlite3_scrub_and_defrag_salvage_report(sqlite3_defrag *p){
+  if( p->pLoss==0 || sqlite3_str_length(p->pLoss)==0 ) return 0;
+  return sqlite3_mprintf("%s", sqlite3_str_value(p->pLoss));
+}
+
+/*
+** Gather figures for each table and index as they are copied, reported
+** in the "objects" member of sqlite3_scrub_and_defrag_stats().  This must
+** come before the first step; later it returns SQLITE_MISUSE.
+*/
+int sqlite3_scrub_and_defrag_objects(sqlite3_defrag *p, int bObjects){
+  if( p->rcErr ) return p->rcErr;
+  if( p->nPageDone>0 || p->nFrame>0 ) return SQLITE_MISUSE;
+  p->bObjects = bObjects!=0;
+  return SQLITE_OK;
+}
+
+/*
+** Time every read and write from now on, for the read, write and throttle
+** times and the latency histograms of sqlite3_scrub_and_defrag_stats().
+** Off by default, as it costs two clock readings per page.
+*/
+int sqlite3_scrub_and_defrag_timers(sqlite3_defrag *p, int bTimers){
+  if( p->rcErr ) return p->rcErr;
+  p->bTimers = bTimers!=0;
+  return SQLITE_OK;
+}
+
+/*
+** Fill sqlite_stat1 of the copy from the keys the copy reads anyway, so
+** that it does not need ANALYZE, and sqlite_stat4 too if the library was
+** built with SQLITE_ENABLE_STAT4 or the source has one.  This must come
+** before the first step; later it returns SQLITE_MISUSE.
+*/
+int sqlite3_scrub_and_defrag_stat1(sqlite3_defrag *p, int bStat1){
+  char *zSql;
+  if( p->rcErr ) return p->rcErr;
+  if( p->nPageDone>0 || p->nFrame>0 ) return SQLITE_MISUSE;
+  p->bStat1 = bStat1!=0;
+  p->bStat4 = 0;
+  if( !p->bStat1 || sqlite3_compileoption_used("ENABLE_STAT4") ){
+    p->bStat4 = p->bStat1;
+    return SQLITE_OK;
+  }
+  zSql = sqlite3_mprintf("SELECT count(*) FROM \"%w\".sqlite_master"
+                         "  WHERE type='table' AND name='sqlite_stat4'",
+                         p->zSrcDb ? p->zSrcDb : "main");
+  if( zSql==0 ) return p->rcErr = SQLITE_NOMEM;
+  scrubDefragDbInt(p, zSql, &p->bStat4, "cannot read the schema");
+  sqlite3_free(zSql);
+  return p->rcErr;
+}
+
+/*
+** Check the checksums of the checksum VFS on every page read from the
+** source and write fresh ones on every page of the copy.  The source must
+** have 8 reserved bytes per page.  This must come before the first step;
+** later it returns SQLITE_MISUSE.  SQLITE_CORRUPT means the checksum of
+** page 1 of the source is wrong.
+*/
+int sqlite3_scrub_and_defrag_cksum(sqlite3_defrag *p, int bCksum){
+  u8 *a;
+  if( p->rcErr ) return p->rcErr;
+  if( p->nPageDone>0 || p->nFrame>0 ) return SQLITE_MISUSE;
+  p->bCksum = 0;
+  if( !bCksum ) return SQLITE_OK;
+  if( p->page1[20]!=SCRUB_DEFRAG_CKSUM_RESERVE ) return SQLITE_MISMATCH;
+  if( p->aCksumW==0 ){
+    scrubDefragCksumInit(p);
+    if( p->rcErr ) return p->rcErr;
+  }
+  /* p->page1 has had its header edited, so check page 1 as it is on disk */
+  p->bCksum = 1;
+  a = scrubDefragRead(p, 1, 0);
+  sqlite3_free(a);
+  return p->rcErr;
+}
+
+/* Apply the options of pOpt, if any, to a copy just initialized */
+static void scrubDefragCopyOptions(
+  ScrubDefragState *p,
+  const sqlite3_defrag_options *pOpt
+){
+  if( pOpt && pOpt->bStrict && p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_scrub_and_defrag_strict(p, 1);
+  }
+  if( pOpt && pOpt->bSalvage && p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_scrub_and_defrag_salvage(p, 1);
+  }
+  if( pOpt && pOpt->bObjects && p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_scrub_and_defrag_objects(p, 1);
+  }
+  if( pOpt && pOpt->bStat1 && p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_scrub_and_defrag_stat1(p, 1);
+  }
+  if( pOpt && pOpt->bTimers && p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_scrub_and_defrag_timers(p, 1);
+  }
+  if( pOpt && pOpt->bCksum && p->rcErr==SQLITE_OK ){
+    int rc = sqlite3_scrub_and_defrag_cksum(p, 1);
+    if( rc==SQLITE_MISMATCH ){
+      scrubDefragErr(p, "the source does not have %d reserved bytes "
+                        "per page for checksums", SCRUB_DEFRAG_CKSUM_RESERVE);
+    }
+    p->rcErr = rc;
+  }
+}
+
+/*
+** Copy schema zSchema of connection db into the main database of dbDest,
+** on ScrubDefragState p, zeroed by the caller.  Everything but the final
+** scrubDefragCopyClose() of sqlite3_scrub_and_defrag_db().
+*/
+static void scrubDefragCopyDb(
+  ScrubDefragState *p,
+  sqlite3 *db,
+  const char *zSchema,
+  sqlite3 *dbDest,
+  const sqlite3_defrag_options *pOpt
+){
+  p->zSrcFile = sqlite3_db_filename(db, zSchema ? zSchema : "main");
+  p->zDestFile = sqlite3_db_filename(dbDest, "main");
+  p->eCkpt = SQLITE_CHECKPOINT_FULL;
+  p->nProgressStep = SCRUB_DEFRAG_PROGRESS_STEP;
+  if( pOpt ){
+    sqlite3_scrub_and_defrag_progress(p, pOpt->nStep, pOpt->xProgress,
+                                      pOpt->pProgressArg);
+  }
+  if( db==dbDest ){
+    scrubDefragErr(p, "the source and destination connections must differ");
+    return;
+  }
+  if( !sqlite3_get_autocommit(db) || !sqlite3_get_autocommit(dbDest) ){
+    scrubDefragErr(p, "cannot defragment from inside a transaction");
+    return;
+  }
+  p->dbSrc = db;
+  p->zSrcDb = zSchema;
+  p->bBorrowSrc = 1;
+  p->dbDest = dbDest;
+  p->bBorrowDest = 1;
+  scrubDefragCopyInit(p);
+  scrubDefragCopyOptions(p, pOpt);
+  scrubDefragCopyStep(p, 0);
+}
+
+
+/*
+** Copy schema zSchema (NULL for "main") of connection db into the main
+** database of connection dbDest, which must be empty.  Both connections
+** stay open and keep their VFS; neither may be in a transaction.
+*/
+int sqlite3_scrub_and_defrag_db(
+  sqlite3 *db,             /* Source connection */
+  const char *zSchema,     /* Schema of db to copy, or NULL for "main" */
+  sqlite3 *dbDest,         /* Destination connection */
+  const sqlite3_defrag_options *pOpt,  /* Options, or NULL for defaults */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+
+  memset(&s, 0, sizeof(s));
+  scrubDefragCopyDb(&s, db, zSchema, dbDest, pOpt);
+  if( pOpt && pOpt->pzReport ){
+    *pOpt->pzReport = sqlite3_scrub_and_defrag_salvage_report(&s);
+  }
+  scrubDefragCopyClose(&s);
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+
+/*
+** A context for many copies in a row, from one thread at a time.  It keeps
+** its page buffers, the SQL that remaps the root pages, the strict-mode
+** bitmap and the checksum weights from one run to the next, so that a run
+** on a small database allocates almost nothing.  The counters and timers
+** of the last run stay readable through sqlite3_scrub_and_defrag_stats().
+*/
+sqlite3_defrag *sqlite3_scrub_and_defrag_create(void){
+  ScrubDefragState *p = sqlite3_malloc(sizeof(*p));
+  if( p==0 ) return 0;
+  memset(p, 0, sizeof(*p));
+  p->bKeep = 1;
+  return p;
+}
+
+/* Clear context p for its next run, keeping what it pools */
+static void scrubDefragReset(ScrubDefragState *p){
+  ScrubDefragState k = *p;
+  scrubDefragObjFree(p);
+  sqlite3_free(p->zErr);
+  memset(p, 0, sizeof(*p));
+  p->bKeep = 1;
+  memcpy(p->aBucket, k.aBucket, sizeof(p->aBucket));
+  p->pShared = k.pShared;
+  p->zSql = k.zSql;
+  p->nSqlAlloc = k.nSqlAlloc;
+  p->aSeen = k.aSeen;
+  p->nSeen = k.nSeen;
+  p->szBuf = k.szBuf;
+  memcpy(p->apPage, k.apPage, sizeof(p->apPage));
+  p->aPage1 = k.aPage1;
+  p->aOvfl = k.aOvfl;
+  p->aUsed = k.aUsed;
+  p->aCksumW = k.aCksumW;
+}
+
+/*
+** Copy zSrcFile to zDestFile on context p, as sqlite3_scrub_and_defrag_v2()
+** would with the options of pOpt (NULL for the defaults).
+*/
+int sqlite3_scrub_and_defrag_run(
+  sqlite3_defrag *p,       /* Context from sqlite3_scrub_and_defrag_create() */
+  const char *zSrcFile,    /* Source file */
+  const char *zDestFile,   /* Destination file */
+  const sqlite3_defrag_options *pOpt,  /* Options, or NULL for defaults */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  int rc;
+  scrubDefragReset(p);
+  p->zSrcFile = zSrcFile;
+  p->zDestFile = zDestFile;
+  p->eCkpt = SQLITE_CHECKPOINT_FULL;
+  p->nProgressStep = SCRUB_DEFRAG_PROGRESS_STEP;
+  if( pOpt ){
+    sqlite3_scrub_and_defrag_progress(p, pOpt->nStep, pOpt->xProgress,
+                                      pOpt->pProgressArg);
+  }
+  scrubDefragCopyInit(p);
+  scrubDefragCopyOptions(p, pOpt);
+  scrubDefragCopyStep(p, 0);
+  if( pOpt && pOpt->pzReport ){
+    *pOpt->pzReport = sqlite3_scrub_and_defrag_salvage_report(p);
+  }
+  scrubDefragCopyClose(p);
+  rc = p->rcErr;
+  if( pzErr ){
+    *pzErr = p->zErr;
+    p->zErr = 0;
+  }
+  return rc;
+}
+
+/* Free context p and everything it pools */
+void sqlite3_scrub_and_defrag_destroy(sqlite3_defrag *p){
+  if( p==0 ) return;
+  scrubDefragObjFree(p);
+  sqlite3_free(p->zErr);
+  sqlite3_free(p->zSql);
+  sqlite3_free(p->aSeen);
+  scrubDefragPoolFree(p);
+  sqlite3_free(p);
+}
+
+/* Append histogram aHist[] to pOut as a JSON array */
+static void scrubDefragJsonHist(sqlite3_str *pOut, const sqlite3_int64 *aHist){
+  int i;
+  for(i=0; i<SCRUB_DEFRAG_NHIST; i++){
+    sqlite3_str_appendf(pOut, "%s%lld", i ? "," : "[", aHist[i]);
+  }
+  sqlite3_str_appendall(pOut, "]");
+}
+
+/* Append text z to pOut as a JSON string */
+static void scrubDefragJsonString(sqlite3_str *pOut, const char *z){
+  sqlite3_str_appendchar(pOut, 1, '"');
+  for(; *z; z++){
+    if( *z=='"' || *z=='\\' ){
+      sqlite3_str_appendf(pOut, "\\%c", *z);
+    }else if( (u8)*z<0x20 ){
+      sqlite3_str_appendf(pOut, "\\u%04x", (u8)*z);
+    }else{
+      sqlite3_str_appendchar(pOut, 1, *z);
+    }
+  }
+  sqlite3_str_appendchar(pOut, 1, '"');
+}
+
+/*
+** Return the counters and timers of the copy so far as a JSON object in
+** memory from sqlite3_malloc(), or NULL if out of memory.  Times are in
+** microseconds.  Entry i of each latency histogram counts calls that took
+** less than 2^i microseconds; the last entry counts all longer calls.
+*/
+char *sqlite3_scrub_and_defrag_stats(sqlite3_defrag *p){
+  static const char *azType[] = {
+    "index_interior", "table_interior", "index_leaf", "table_leaf", "overflow"
+  };
+  ScrubDefragStats *pSt = &p->st;
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  sqlite3_int64 tTotal, tParse;
+  int i, j;
+
+  tTotal = p->bDone ? pSt->tTotal : scrubDefragClock() - pSt->tStart;
+  tParse = pSt->tWalk - pSt->tRead - pSt->tWrite - pSt->tThrottle;
+  if( tParse<0 ) tParse = 0;
+  sqlite3_str_appendf(pOut, "{\"pages\":%u,\"done\":%u", p->nDestPage,
+                      p->nPageDone);
+  for(j=0; j<2; j++){
+    const sqlite3_int64 *a = j ? pSt->aWrite : pSt->aRead;
+    sqlite3_str_appendf(pOut, ",\"%s\":{", j ? "written" : "read");
+    for(i=0; i<SCRUB_DEFRAG_NTYPE; i++){
+      sqlite3_str_appendf(pOut, "%s\"%s\":%lld", i ? "," : "", azType[i], a[i]);
+    }
+    sqlite3_str_appendall(pOut, "}");
+  }
+  sqlite3_str_appendf(pOut,
+      ",\"bytes_read\":%lld,\"bytes_written\":%lld"
+      ",\"gap_bytes_zeroed\":%lld,\"freeblocks\":%lld"
+      ",\"freeblock_bytes_zeroed\":%lld,\"overflow_tail_bytes_zeroed\":%lld"
+      ",\"overflow_pages_kernel_copied\":%lld,\"max_depth\":%d",
+      p->nByteRead, p->nByteWrite, pSt->nGapZero, pSt->nFreeblock,
+      pSt->nFreeblockZero, pSt->nTailZero, pSt->nKcopy, pSt->mxDepth);
+  if( p->bObjects ){
+    scrubDefragObjEnd(p);  /* Bring the b-tree being copied up to date */
+    sqlite3_str_appendall(pOut, ",\"objects\":[");
+    for(j=0; j<p->nObj; j++){
+      const ScrubDefragBtreeStats *pObj = &p->aObj[j];
+      sqlite3_int64 nLeaf = pObj->aPage[SCRUB_DEFRAG_TYPE_INDEX_LEAF]
+                          + pObj->aPage[SCRUB_DEFRAG_TYPE_TABLE_LEAF];
+      sqlite3_str_appendall(pOut, j ? ",{\"name\":" : "{\"name\":");
+      scrubDefragJsonString(pOut, pObj->zName);
+      sqlite3_str_appendall(pOut, ",\"type\":");
+      scrubDefragJsonString(pOut, pObj->zType);
+      sqlite3_str_appendall(pOut, ",\"pages\":{");
+      for(i=0; i<SCRUB_DEFRAG_NTYPE; i++){
+        sqlite3_str_appendf(pOut, "%s\"%s\":%lld", i ? "," : "", azType[i],
+                            pObj->aPage[i]);
+      }
+      sqlite3_str_appendf(pOut,
+          "},\"depth\":%d,\"cells\":%lld,\"entries\":%lld"
+          ",\"payload_bytes\":%lld,\"leaf_fill_pct\":%.1f,\"leaf_fill\":",
+          pObj->nDepth, pObj->nCell, pObj->nEntry, pObj->nPayload,
+          nLeaf ? 100.0*pObj->nLeafUsed/((double)nLeaf*p->szUsable) : 0.0);
+      for(i=0; i<SCRUB_DEFRAG_NFILL; i++){
+        sqlite3_str_appendf(pOut, "%s%lld", i ? "," : "[", pObj->aFill[i]);
+      }
+      sqlite3_str_appendf(pOut, "],\"overflow_chains\":%lld"
+                          ",\"chain_length\":", pObj->nChain);
+      scrubDefragJsonHist(pOut, pObj->aChain);
+      sqlite3_str_appendf(pOut, ",\"free_bytes_zeroed\":%lld}", pObj->nZero);
+    }
+    sqlite3_str_appendall(pOut, "]");
+  }
+  if( p->bSalvage ){
+    const char *zLoss = p->pLoss ? sqlite3_str_value(p->pLoss) : 0;
+    sqlite3_str_appendall(pOut, ",\"salvage_report\":");
+    scrubDefragJsonString(pOut, zLoss ? zLoss : "");
+  }
+  sqlite3_str_appendf(pOut,
+      ",\"time_us\":{\"open\":%lld,\"checkpoint\":%lld,\"read\":%lld"
+      ",\"parse\":%lld,\"write\":%lld,\"throttle\":%lld,\"roots\":%lld"
+      ",\"total\":%lld}",
+      pSt->tOpen, pSt->tCkpt, pSt->tRead, tParse, pSt->tWrite,
+      pSt->tThrottle, pSt->tRoots, tTotal);
+  sqlite3_str_appendall(pOut, ",\"read_latency_us\":");
+  scrubDefragJsonHist(pOut, pSt->aReadHist);
+  sqlite3_str_appendall(pOut, ",\"write_latency_us\":");
+  scrubDefragJsonHist(pOut, pSt->aWriteHist);
+#ifdef SCRUB_DEFRAG_PROFILE
+  sqlite3_str_appendall(pOut, ",\"profile\":{");
+  for(i=0; i<SCRUB_DEFRAG_NTYPE; i++){
+    const sqlite3_int64 *a = pSt->aProf[i];
+    sqlite3_int64 nPg = pSt->aProfPage[i], nCl = pSt->aProfCell[i];
+    sqlite3_str_appendf(pOut,
+        "%s\"%s\":{\"pages\":%lld,\"cells\":%lld,\"cycles\":%lld"
+        ",\"instructions\":%lld,\"cache_misses\":%lld"
+        ",\"branch_misses\":%lld,\"cycles_per_page\":%.1f"
+        ",\"cycles_per_cell\":%.1f}",
+        i ? "," : "", azType[i], nPg, nCl,
+        a[SCRUB_DEFRAG_PROF_CYCLES], a[SCRUB_DEFRAG_PROF_INSNS],
+        a[SCRUB_DEFRAG_PROF_CACHE], a[SCRUB_DEFRAG_PROF_BRANCH],
+        nPg ? (double)a[SCRUB_DEFRAG_PROF_CYCLES]/nPg : 0.0,
+        nCl ? (double)a[SCRUB_DEFRAG_PROF_CYCLES]/nCl : 0.0);
+  }
+  sqlite3_str_appendall(pOut, "}");
+#endif
+  sqlite3_str_appendall(pOut, "}");
+  return sqlite3_str_finish(pOut);
+}
+
+/*
+** Close both databases and free p.  A copy abandoned before step returned
+** SQLITE_DONE leaves an empty destination.  Return the error that stopped
+** the copy, if any.
+*/
+int sqlite3_scrub_and_defrag_finish(sqlite3_defrag *p, char **pzErr){
+  int rc;
+  if( p==0 ) return SQLITE_OK;
+  scrubDefragCopyClose(p);
+  rc = p->rcErr;
+  if( pzErr ){
+    *pzErr = p->zErr;
+  }else{
+    sqlite3_free(p->zErr);
+  }
+  sqlite3_free(p);
+  return rc;
+}
+
+/* Header string of a database, and the one that stands in for it on page 1
+** while a file must not be opened */
+static const char aScrubDefragMagic[16] = "SQLite format 3";
+static const char aScrubDefragBusy[16] = "SQLite in-place";
+
+#ifdef SQLITE_ENABLE_SESSION
+/*
+** Online mode.  The snapshot copy made by scrubDefragCopy() is brought up
+** to date by replaying the changes recorded with the session extension,
+** round after round, until the remaining delta is small.  The last round
+** runs with writers locked out and ends by renaming the copy over the
+** source.  Before the lock is released the old file is poisoned, see
+** scrubDefragPoison(), so that connections still open on it fail instead
+** of writing where nobody will look.
+*/
+#define SCRUB_DEFRAG_ONLINE_ROUNDS  8      /* Max catch-up rounds */
+#define SCRUB_DEFRAG_ONLINE_DELTA   65536  /* Changeset size ending catch-up */
+
+/* Conflict handler used while replaying a changeset.  Changes made before
+** the snapshot was taken may be recorded twice, so the newest version of a
+** row always wins and deletes of rows already gone are ignored. */
+static int scrubDefragConflict(
+  void *pCtx,
+  int eConflict,
+  sqlite3_changeset_iter *pIter
+){
+  (void)pCtx;
+  (void)pIter;
+  switch( eConflict ){
+    case SQLITE_CHANGESET_DATA:
+    case SQLITE_CHANGESET_CONFLICT:
+      return SQLITE_CHANGESET_REPLACE;
+    case SQLITE_CHANGESET_NOTFOUND:
+    case SQLITE_CHANGESET_FOREIGN_KEY:
+      return SQLITE_CHANGESET_OMIT;
+  }
+  return SQLITE_CHANGESET_ABORT;
+}
+
+/* Start a session recording every change made to "main" through db */
+static sqlite3_session *scrubDefragSession(ScrubDefragState *p, sqlite3 *db){
+  sqlite3_session *pSession = 0;
+  if( p->rcErr ) return 0;
+  p->rcErr = sqlite3session_create(db, "main", &pSession);
+  if( p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3session_attach(pSession, 0);
+  }
+  if( p->rcErr ){
+    scrubDefragErr(p, "cannot start a session on the source database");
+    if( pSession ) sqlite3session_delete(pSession);
+    return 0;
+  }
+  return pSession;
+}
+
+/* Take the changeset recorded by pSession, start the session for the next
+** round in *ppNext (if ppNext is not NULL), and delete pSession.  Sessions
+** read row values through db, so unless writers are already locked out this
+** waits for db to be at a transaction boundary and holds its mutex so that
+** both sessions split the history at the same point. */
+static void scrubDefragDrain(
+  ScrubDefragState *p,
+  sqlite3 *db,
+  sqlite3_session *pSession,
+  sqlite3_session **ppNext,
+  int *pnChange,
+  void **ppChange
+){
+  sqlite3_mutex *pMutex = sqlite3_db_mutex(db);
+  int nWait = 0;
+  *pnChange = 0;
+  *ppChange = 0;
+  sqlite3_mutex_enter(pMutex);
+  while( ppNext && !sqlite3_get_autocommit(db) && nWait<10000 ){
+    sqlite3_mutex_leave(pMutex);
+    sqlite3_sleep(1);
+    nWait++;
+    sqlite3_mutex_enter(pMutex);
+  }
+  if( ppNext && !sqlite3_get_autocommit(db) ){
+    scrubDefragErr(p, "a transaction on the source stayed open too long");
+  }
+  if( ppNext ) *ppNext = scrubDefragSession(p, db);
+  if( p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3session_changeset(pSession, pnChange, ppChange);
+    if( p->rcErr ){
+      scrubDefragErr(p, "cannot read the changes made to the source");
+    }
+  }
+  sqlite3session_delete(pSession);
+  sqlite3_mutex_leave(pMutex);
+}
+
+/* Replay a changeset into the destination and free it */
+static void scrubDefragReplay(ScrubDefragState *p, int nChange, void *pChange){
+  if( p->rcErr==SQLITE_OK && nChange>0 ){
+    p->rcErr = sqlite3changeset_apply(p->dbDest, nChange, pChange, 0,
+                                      scrubDefragConflict, 0);
+    if( p->rcErr ){
+      scrubDefragErr(p, "cannot replay changes into the destination: %s",
+                     sqlite3_errmsg(p->dbDest));
+    }
+  }
+  sqlite3_free(pChange);
+}
+
+/*
+** Make every connection still open on the old source file fail from its
+** next transaction on.  p->dbLock holds the write lock on that file, so no
+** one else is using the WAL.  Its header and both copies of the wal-index
+** header are zeroed: the next reader finds the index invalid, rebuilds it
+** from a WAL that is now empty, drops its page cache and reads page 1 from
+** the file, where the header string has been replaced by aScrubDefragBusy.
+** That read fails with SQLITE_NOTADB.
+*/
+static void scrubDefragPoison(ScrubDefragState *p){
+  static const u8 aZero[32] = {0};
+  sqlite3_file *pDb = 0;
+  sqlite3_file *pWal = 0;
+  volatile void *pShm = 0;
+  int rc = SQLITE_OK;
+
+  sqlite3_file_control(p->dbLock, "main", SQLITE_FCNTL_FILE_POINTER, &pDb);
+  sqlite3_file_control(p->dbLock, "main", SQLITE_FCNTL_JOURNAL_POINTER,
+                       &pWal);
+  if( pDb==0 || pDb->pMethods==0 || pDb->pMethods->iVersion<2 ){
+    rc = SQLITE_ERROR;
+  }
+  if( rc==SQLITE_OK && pWal && pWal->pMethods ){
+    rc = pWal->pMethods->xWrite(pWal, aZero, sizeof(aZero), 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = pDb->pMethods->xShmMap(pDb, 0, 32768, 0, &pShm);
+  }
+  if( rc==SQLITE_OK && pShm ){
+    memset((void*)pShm, 0, 96);   /* Two copies of the 48-byte header */
+    pDb->pMethods->xShmBarrier(pDb);
+  }
+  if( rc==SQLITE_OK ){
+    rc = pDb->pMethods->xWrite(pDb, aScrubDefragBusy, 16, 0);
+  }
+  if( rc ){
+    scrubDefragErr(p, "the copy is in place, but connections still open "
+                      "on the old file could not be stopped: close them");
+    p->rcErr = SQLITE_IOERR;
+  }
+}
+
+/* Remove the sidecar file named by appending zSuffix to zFile */
+static void scrubDefragRemoveSidecar(const char *zFile, const char *zSuffix){
+  char *zName = sqlite3_mprintf("%s%s", zFile, zSuffix);
+  if( zName ){
+    remove(zName);
+    sqlite3_free(zName);
+  }
+}
+
+int sqlite3_scrub_and_defrag_online(
+  sqlite3 *db,             /* Connection all writes to the source go through */
+  const char *zDestFile,   /* Scratch file renamed over the source at the end */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+  sqlite3_session *pSession = 0;
+  const char *zSrcFile;
+  void *pChange;
+  int iCookie = 0, iCookie2 = 0;
+  int nByte = 0;
+  int iRound;
+  int bPersist = 1;
+
+  memset(&s, 0, sizeof(s));
+  zSrcFile = sqlite3_db_filename(db, "main");
+  s.zSrcFile = zSrcFile;
+  s.zDestFile = zDestFile;
+  s.eCkpt = SQLITE_CHECKPOINT_PASSIVE;
+
+  /* Sessions only see changes to tables that have a PRIMARY KEY, and only
+  ** a WAL database lets the service keep writing while the snapshot is
+  ** read. */
+  if( zSrcFile==0 || zSrcFile[0]==0 ){
+    scrubDefragErr(&s, "online mode needs an on-disk source database");
+  }else if( !sqlite3_get_autocommit(db) ){
+    scrubDefragErr(&s, "online mode cannot start inside a transaction");
+  }else{
+    int nNoPk = 0;
+    s.dbSrc = db;
+    scrubDefragDbInt(&s,
+        "SELECT count(*) FROM sqlite_master AS m WHERE m.type='table'"
+        "   AND m.rootpage>0 AND m.name NOT LIKE 'sqlite_%'"
+        "   AND NOT EXISTS(SELECT 1 FROM pragma_table_info(m.name) WHERE pk)",
+        &nNoPk, "cannot read the source schema");
+    if( s.rcErr==SQLITE_OK && nNoPk>0 ){
+      scrubDefragErr(&s, "online mode requires every table to have a "
+                         "PRIMARY KEY (%d do not)", nNoPk);
+    }
+    scrubDefragDbInt(&s, "PRAGMA main.schema_version", &iCookie,
+                     "cannot read the source schema version");
+    s.dbSrc = 0;
+    if( s.rcErr==SQLITE_OK ){
+      sqlite3_stmt *pStmt = scrubDefragPrepare(&s, db, "PRAGMA main.journal_mode");
+      if( pStmt && sqlite3_step(pStmt)==SQLITE_ROW
+       && sqlite3_stricmp((const char*)sqlite3_column_text(pStmt, 0), "wal") ){
+        scrubDefragErr(&s, "online mode requires a WAL mode source database");
+      }
+      sqlite3_finalize(pStmt);
+    }
+  }
+  if( s.rcErr ) goto online_abort;
+
+  /* Start recording, then take the snapshot with writers briefly locked
+  ** out so that every change is either in the snapshot or in the session.
+  ** Changes that land in both are made idempotent by
+  ** scrubDefragConflict(). */
+  pSession = scrubDefragSession(&s, db);
+  if( s.rcErr ) goto online_abort;
+  s.rcErr = sqlite3_open_v2(zSrcFile, &s.dbLock,
+                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_PRIVATECACHE, 0);
+  if( s.rcErr==SQLITE_OK ){
+    sqlite3_busy_timeout(s.dbLock, 5000);
+    s.rcErr = sqlite3_exec(s.dbLock, "BEGIN IMMEDIATE;", 0, 0, 0);
+  }
+  if( s.rcErr ){
+    scrubDefragErr(&s, "cannot lock out writers on the source database: %s",
+                   sqlite3_errmsg(s.dbLock));
+    goto online_abort;
+  }
+  scrubDefragCopy(&s);
+  if( s.rcErr ) goto online_abort;
+
+  s.rcErr = sqlite3_open_v2(zDestFile, &s.dbDest,
+                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_PRIVATECACHE, 0);
+  if( s.rcErr ){
+    scrubDefragErr(&s, "cannot reopen destination database: %s",
+                   sqlite3_errmsg(s.dbDest));
+    goto online_abort;
+  }
+
+  /* Catch-up rounds */
+  for(iRound=1; iRound<SCRUB_DEFRAG_ONLINE_ROUNDS; iRound++){
+    sqlite3_session *pDone = pSession;
+    pSession = 0;
+    scrubDefragDrain(&s, db, pDone, &pSession, &nByte, &pChange);
+    scrubDefragReplay(&s, nByte, pChange);
+    if( s.rcErr ) goto online_abort;
+    if( nByte<SCRUB_DEFRAG_ONLINE_DELTA ) break;
+  }
+
+  /* Final round with writers locked out */
+  s.rcErr = sqlite3_exec(s.dbLock, "BEGIN IMMEDIATE;", 0, 0, 0);
+  if( s.rcErr ){
+    scrubDefragErr(&s, "cannot lock out writers on the source database: %s",
+                   sqlite3_errmsg(s.dbLock));
+    goto online_abort;
+  }
+  scrubDefragDrain(&s, db, pSession, 0, &nByte, &pChange);
+  pSession = 0;
+  scrubDefragReplay(&s, nByte, pChange);
+  if( s.rcErr ) goto online_abort;
+  s.dbSrc = s.dbLock;
+  scrubDefragDbInt(&s, "PRAGMA main.schema_version", &iCookie2,
+                   "cannot read the source schema version");
+  s.dbSrc = 0;
+  if( s.rcErr ) goto online_abort;
+  if( iCookie!=iCookie2 ){
+    scrubDefragErr(&s, "the source schema changed during the online copy");
+    goto online_abort;
+  }
+  s.rcErr = sqlite3_close(s.dbDest);
+  s.dbDest = 0;
+  if( s.rcErr ){
+    scrubDefragErr(&s, "cannot close the destination database");
+    goto online_abort;
+  }
+
+  /* Swap.  The old WAL and shared-memory files belong to the old inode and
+  ** must not be seen by the new file; persistent-WAL mode keeps the open
+  ** connections from deleting the new ones by name when they close. */
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_PERSIST_WAL, &bPersist);
+  sqlite3_file_control(s.dbLock, "main", SQLITE_FCNTL_PERSIST_WAL, &bPersist);
+  if( rename(zDestFile, zSrcFile) ){
+    scrubDefragErr(&s, "cannot rename %s over %s", zDestFile, zSrcFile);
+    s.rcErr = SQLITE_IOERR;
+    goto online_abort;
+  }
+  scrubDefragPoison(&s);
+  scrubDefragRemoveSidecar(zSrcFile, "-wal");
+  scrubDefragRemoveSidecar(zSrcFile, "-shm");
+
+online_abort:
+  if( pSession ) sqlite3session_delete(pSession);
+  sqlite3_close(s.dbDest);
+  if( s.dbLock ){
+    sqlite3_exec(s.dbLock, "ROLLBACK;", 0, 0, 0);
+    sqlite3_close(s.dbLock);
+  }
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+#endif /* SQLITE_ENABLE_SESSION */
+
+/*
+** In-place defragmentation.
+**
+** The mapping pass runs scrubDefragBtree() exactly as a copy would but,
+** instead of writing pages, records in aMap[] where each live source page
+** would land.  The resulting permutation is then applied inside the source
+** file.  Moving a page into a slot that is free or already vacated needs
+** no buffer, so the moves are enumerated as chains that each start at a
+** free slot, followed by the remaining cycles, each rotated through a
+** single page buffer.  Every moved page is rewritten on the way through:
+** deleted content is zeroed and child and overflow page numbers are
+** translated with aMap[].
+**
+** The moves are applied in bounded batches.  Before a batch touches the
+** database, the original content of every slot it will overwrite is
+** written to the "-defrag" journal next to the database and synced.  The
+** journal also holds the permutation, the number of moves known to be
+** durable and the content of the cycle buffer.  After a crash the next
+** call to sqlite3_scrub_and_defrag_inplace() restores the slots touched
+** by the interrupted batch and resumes from there.  While the file is
+** being rearranged the header string on page 1 is replaced, so that
+** SQLite refuses to open the half-done file.
+*/
+#define SCRUB_DEFRAG_INPLACE_BATCH  64      /* Max moves per batch */
+
+/* States of an in-place defrag, as recorded in the journal header */
+#define SCRUB_DEFRAG_INPLACE_MOVING 1       /* Applying the permutation */
+#define SCRUB_DEFRAG_INPLACE_ROOTS  2       /* Updating sqlite_schema */
+#define SCRUB_DEFRAG_INPLACE_COMMIT 3       /* Restoring header, truncating */
+#define SCRUB_DEFRAG_INPLACE_COMPACT 4      /* Applying a compaction round */
+
+/* Operations of one move */
+#define SCRUB_DEFRAG_MOVE_MARK      1       /* Replace the header string */
+#define SCRUB_DEFRAG_MOVE_PAGE      2       /* Page iSrc goes to slot iDest */
+#define SCRUB_DEFRAG_MOVE_LOAD      3       /* Page iSrc to the cycle buffer */
+#define SCRUB_DEFRAG_MOVE_STORE     4       /* Cycle buffer to slot iDest */
+
+/* Journal layout */
+#define SCRUB_DEFRAG_JRNL_HDR       64      /* Size of each header slot */
+#define SCRUB_DEFRAG_JRNL_MAP       512     /* Offset of the permutation */
+#define SCRUB_DEFRAG_JRNL_BATCH     20      /* Size of a batch header */
+
+static const u8 aScrubDefragJrnlMagic[8] = {
+  0x9b, 0x1c, 0xdf, 0x5a, 0x44, 0x46, 0x52, 0x01
+};
+
+typedef struct ScrubDefragMove ScrubDefragMove;
+typedef struct ScrubDefragInplace ScrubDefragInplace;
+
+/* One step of the permutation */
+struct ScrubDefragMove {
+  u8 eOp;                  /* SCRUB_DEFRAG_MOVE_* */
+  u32 iDest;               /* Slot written */
+  u32 iSrc;                /* Page read */
+};
+
+/* State of an in-place defrag beyond what ScrubDefragState holds */
+struct ScrubDefragInplace {
+  sqlite3_vfs *pVfs;       /* VFS of the database file and journal */
+  char *zPath;             /* Full path of the database */
+  int eLock;               /* Lock held on the database */
+  sqlite3_file *pJrnl;     /* The "-defrag" journal, or NULL */
+  char *zJrnl;             /* Name of the journal */
+  u32 *aInv;               /* aInv[dest] is the source page that goes there */
+  u8 *aDone;               /* Bitmap of source pages already moved */
+  u32 nSchema;             /* Pages of sqlite_schema in the new layout */
+  u32 eState;              /* SCRUB_DEFRAG_INPLACE_* */
+  u32 iSeq;                /* Sequence number of the newest journal header */
+  sqlite3_int64 nDone;     /* Moves known to be durable */
+  sqlite3_int64 iBufOff;   /* Journal offset of the cycle buffer */
+  sqlite3_int64 iBatchOff; /* Journal offset of the batch record */
+  u8 *aBuf;                /* Cycle buffer */
+  u32 iBuf;                /* Source page held in aBuf, or 0 */
+  /* Move enumeration */
+  int ePhase;              /* 0: mark, 1: chains, 2: cycles, 3: page 1 */
+  u32 iScan;               /* Last slot examined by the current phase */
+  u32 iCur;                /* Next slot to fill in a chain or cycle */
+  u32 iCycle;              /* First page of the current cycle */
+  int bPending;            /* True if sPending was pushed back */
+  ScrubDefragMove sPending;
+};
+
+/*
+** A VFS shim used for the SQL steps of an in-place defrag.  The in-place
+** code already holds an EXCLUSIVE lock through its own file handle, so
+** locking is a no-op here, and page 1 is presented with the normal header
+** string while the replacement string stays on disk.
+*/
+typedef struct ScrubDefragShimFile ScrubDefragShimFile;
+struct ScrubDefragShimFile {
+  sqlite3_file base;       /* Base class.  Must be first */
+  sqlite3_file *pReal;     /* Underlying file.  Allocated after this */
+  int bMain;               /* True for the main database file */
+};
+#define SCRUB_DEFRAG_SHIM_VFS "scrubdefrag-inplace"
+#define ORIGVFS(p)  ((sqlite3_vfs*)((p)->pAppData))
+#define ORIGFILE(p) (((ScrubDefragShimFile*)(p))->pReal)
+
+static int scrubDefragShimClose(sqlite3_file *pFile){
+  return ORIGFILE(pFile)->pMethods->xClose(ORIGFILE(pFile));
+}
+static int scrubDefragShimRead(
+  sqlite3_file *pFile, void *zBuf, int iAmt, sqlite3_int64 iOfst
+){
+  sqlite3_file *pReal = ORIGFILE(pFile);
+  int rc = pReal->pMethods->xRead(pReal, zBuf, iAmt, iOfst);
+  if( rc==SQLITE_OK && iOfst==0 && iAmt>=16
+   && ((ScrubDefragShimFile*)pFile)->bMain
+   && memcmp(zBuf, aScrubDefragBusy, 16)==0
+  ){
+    memcpy(zBuf, aScrubDefragMagic, 16);
+  }
+  return rc;
+}
+static int scrubDefragShimWrite(
+  sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite3_int64 iOfst
+){
+  sqlite3_file *pReal = ORIGFILE(pFile);
+  if( iOfst==0 && iAmt>=16 && ((ScrubDefragShimFile*)pFile)->bMain ){
+    int rc;
+    u8 *aCopy = sqlite3_malloc(iAmt);
+    if( aCopy==0 ) return SQLITE_NOMEM;
+    memcpy(aCopy, zBuf, iAmt);
+    memcpy(aCopy, aScrubDefragBusy, 16);
+    rc = pReal->pMethods->xWrite(pReal, aCopy, iAmt, iOfst);
+    sqlite3_free(aCopy);
+    return rc;
+  }
+  return pReal->pMethods->xWrite(pReal, zBuf, iAmt, iOfst);
+}
+static int scrubDefragShimTruncate(sqlite3_file *pFile, sqlite3_int64 size){
+  return ORIGFILE(pFile)->pMethods->xTruncate(ORIGFILE(pFile), size);
+}
+static int scrubDefragShimSync(sqlite3_file *pFile, int flags){
+  return ORIGFILE(pFile)->pMethods->xSync(ORIGFILE(pFile), flags);
+}
+static int scrubDefragShimFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize){
+  return ORIGFILE(pFile)->pMethods->xFileSize(ORIGFILE(pFile), pSize);
+}
+static int scrubDefragShimLock(sqlite3_file *pFile, int eLock){
+  (void)pFile;
+  (void)eLock;
+  return SQLITE_OK;
+}
+static int scrubDefragShimCheckReservedLock(sqlite3_file *pFile, int *pResOut){
+  (void)pFile;
+  *pResOut = 0;
+  return SQLITE_OK;
+}
+static int scrubDefragShimFileControl(sqlite3_file *pFile, int op, void *pArg){
+  return ORIGFILE(pFile)->pMethods->xFileControl(ORIGFILE(pFile), op, pArg);
+}
+static int scrubDefragShimSectorSize(sqlite3_file *pFile){
+  return ORIGFILE(pFile)->pMethods->xSectorSize(ORIGFILE(pFile));
+}
+static int scrubDefragShimDeviceCharacteristics(sqlite3_file *pFile){
+  return ORIGFILE(pFile)->pMethods->xDeviceCharacteristics(ORIGFILE(pFile));
+}
+static const sqlite3_io_methods scrubDefragShimIo = {
+  1,                                    /* iVersion */
+  scrubDefragShimClose,                 /* xClose */
+  scrubDefragShimRead,                  /* xRead */
+  scrubDefragShimWrite,                 /* xWrite */
+  scrubDefragShimTruncate,              /* xTruncate */
+  scrubDefragShimSync,                  /* xSync */
+  scrubDefragShimFileSize,              /* xFileSize */
+  scrubDefragShimLock,                  /* xLock */
+  scrubDefragShimLock,                  /* xUnlock */
+  scrubDefragShimCheckReservedLock,     /* xCheckReservedLock */
+  scrubDefragShimFileControl,           /* xFileControl */
+  scrubDefragShimSectorSize,            /* xSectorSize */
+  scrubDefragShimDeviceCharacteristics, /* xDeviceCharacteristics */
+  0, 0, 0, 0, 0, 0                      /* v2 and v3 methods */
+};
+static int scrubDefragShimOpen(
+  sqlite3_vfs *pVfs, const char *zName, sqlite3_file *pFile,
+  int flags, int *pOutFlags
+){
+  ScrubDefragShimFile *pShim = (ScrubDefragShimFile*)pFile;
+  int rc;
+  memset(pShim, 0, sizeof(*pShim));
+  pShim->pReal = (sqlite3_file*)&pShim[1];
+  pShim->bMain = (flags & SQLITE_OPEN_MAIN_DB)!=0;
+  rc = ORIGVFS(pVfs)->xOpen(ORIGVFS(pVfs), zName, pShim->pReal, flags,
+                            pOutFlags);
+  if( pShim->pReal->pMethods ) pFile->pMethods = &scrubDefragShimIo;
+  return rc;
+}
+static int scrubDefragShimDelete(sqlite3_vfs *pVfs, const char *zName, int d){
+  return ORIGVFS(pVfs)->xDelete(ORIGVFS(pVfs), zName, d);
+}
+static int scrubDefragShimAccess(
+  sqlite3_vfs *pVfs, const char *zName, int flags, int *pResOut
+){
+  return ORIGVFS(pVfs)->xAccess(ORIGVFS(pVfs), zName, flags, pResOut);
+}
+static int scrubDefragShimFullPathname(
+  sqlite3_vfs *pVfs, const char *zName, int nOut, char *zOut
+){
+  return ORIGVFS(pVfs)->xFullPathname(ORIGVFS(pVfs), zName, nOut, zOut);
+}
+static void *scrubDefragShimDlOpen(sqlite3_vfs *pVfs, const char *zPath){
+  return ORIGVFS(pVfs)->xDlOpen(ORIGVFS(pVfs), zPath);
+}
+static void scrubDefragShimDlError(sqlite3_vfs *pVfs, int nByte, char *zErr){
+  ORIGVFS(pVfs)->xDlError(ORIGVFS(pVfs), nByte, zErr);
+}
+static void (*scrubDefragShimDlSym(sqlite3_vfs *pVfs, void *p, const char *z))(void){
+  return ORIGVFS(pVfs)->xDlSym(ORIGVFS(pVfs), p, z);
+}
+static void scrubDefragShimDlClose(sqlite3_vfs *pVfs, void *pHandle){
+  ORIGVFS(pVfs)->xDlClose(ORIGVFS(pVfs), pHandle);
+}
+static int scrubDefragShimRandomness(sqlite3_vfs *pVfs, int nByte, char *zOut){
+  return ORIGVFS(pVfs)->xRandomness(ORIGVFS(pVfs), nByte, zOut);
+}
+static int scrubDefragShimSleep(sqlite3_vfs *pVfs, int nMicro){
+  return ORIGVFS(pVfs)->xSleep(ORIGVFS(pVfs), nMicro);
+}
+static int scrubDefragShimCurrentTime(sqlite3_vfs *pVfs, double *pTime){
+  return ORIGVFS(pVfs)->xCurrentTime(ORIGVFS(pVfs), pTime);
+}
+static int scrubDefragShimGetLastError(sqlite3_vfs *pVfs, int n, char *z){
+  return ORIGVFS(pVfs)->xGetLastError(ORIGVFS(pVfs), n, z);
+}
+static sqlite3_vfs scrubDefragShimVfs = {
+  1,                              /* iVersion */
+  0,                              /* szOsFile (set when registered) */
+  0,                              /* mxPathname (set when registered) */
+  0,                              /* pNext */
+  SCRUB_DEFRAG_SHIM_VFS,          /* zName */
+  0,                              /* pAppData (set when registered) */
+  scrubDefragShimOpen,            /* xOpen */
+  scrubDefragShimDelete,          /* xDelete */
+  scrubDefragShimAccess,          /* xAccess */
+  scrubDefragShimFullPathname,    /* xFullPathname */
+  scrubDefragShimDlOpen,          /* xDlOpen */
+  scrubDefragShimDlError,         /* xDlError */
+  scrubDefragShimDlSym,           /* xDlSym */
+  scrubDefragShimDlClose,         /* xDlClose */
+  scrubDefragShimRandomness,      /* xRandomness */
+  scrubDefragShimSleep,           /* xSleep */
+  scrubDefragShimCurrentTime,     /* xCurrentTime */
+  scrubDefragShimGetLastError,    /* xGetLastError */
+  0,                              /* xCurrentTimeInt64 */
+  0,                              /* xSetSystemCall */
+  0,                              /* xGetSystemCall */
+  0                               /* xNextSystemCall */
+};
+
+/* Open the database through the shim as p->dbSrc */
+static void scrubDefragShimOpenDb(ScrubDefragState *p, sqlite3_vfs *pOrig){
+  if( p->rcErr ) return;
+  if( sqlite3_vfs_find(SCRUB_DEFRAG_SHIM_VFS)==0 ){
+    scrubDefragShimVfs.szOsFile = sizeof(ScrubDefragShimFile)+pOrig->szOsFile;
+    scrubDefragShimVfs.mxPathname = pOrig->mxPathname;
+    scrubDefragShimVfs.pAppData = pOrig;
+    sqlite3_vfs_register(&scrubDefragShimVfs, 0);
+  }else if( scrubDefragShimVfs.pAppData!=pOrig ){
+    scrubDefragErr(p, "the default VFS changed since the in-place shim "
+                      "was registered");
+    return;
+  }
+  p->rcErr = sqlite3_open_v2(p->zSrcFile, &p->dbSrc,
+                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_PRIVATECACHE,
+                 SCRUB_DEFRAG_SHIM_VFS);
+  if( p->rcErr==SQLITE_OK ){
+    p->rcErr = sqlite3_exec(p->dbSrc, "PRAGMA journal_mode=MEMORY;", 0, 0, 0);
+  }
+  if( p->rcErr ){
+    scrubDefragErr(p, "cannot open the database: %s",
+                   sqlite3_errmsg(p->dbSrc));
+  }
+}
+
+/* Checksum used for journal headers and batch records */
+static u32 scrubDefragCksum(u32 s, const u8 *a, int n){
+  int i;
+  for(i=0; i<n; i++) s = (s<<5) + (s>>27) + a[i];
+  return s;
+}
+
+/* Read/write nByte bytes at iOff of the journal */
+static void scrubDefragJrnlIo(
+  ScrubDefragState *p,
+  ScrubDefragInplace *x,
+  int bWrite,
+  void *a,
+  int nByte,
+  sqlite3_int64 iOff
+){
+  int rc;
+  sqlite3_file *pJ = x->pJrnl;
+  if( p->rcErr ) return;
+  if( bWrite ){
+    rc = pJ->pMethods->xWrite(pJ, a, nByte, iOff);
+  }else{
+    rc = pJ->pMethods->xRead(pJ, a, nByte, iOff);
+  }
+  if( rc!=SQLITE_OK ){
+    scrubDefragErr(p, "%s failed on %s", bWrite ? "write" : "read", x->zJrnl);
+    p->rcErr = SQLITE_IOERR;
+  }
+}
+
+/* Sync the database (pFile==p->pSrc) or the journal */
+static void scrubDefragSync(ScrubDefragState *p, sqlite3_file *pFile){
+  if( p->rcErr ) return;
+  if( pFile->pMethods->xSync(pFile, SQLITE_SYNC_NORMAL) ){
+    scrubDefragErr(p, "sync failed");
+    p->rcErr = SQLITE_IOERR;
+  }
+}
+
+/* Write a new journal header recording eState and nDone, then sync */
+static void scrubDefragJrnlHeader(ScrubDefragState *p, ScrubDefragInplace *x){
+  u8 aHdr[SCRUB_DEFRAG_JRNL_HDR];
+  memset(aHdr, 0, sizeof(aHdr));
+  x->iSeq++;
+  memcpy(aHdr, aScrubDefragJrnlMagic, 8);
+  scrubDefragWriteInt32(&aHdr[8], x->iSeq);
+  scrubDefragWriteInt32(&aHdr[12], p->szPage);
+  scrubDefragWriteInt32(&aHdr[16], p->nSrcPage);
+  scrubDefragWriteInt32(&aHdr[20], p->nDestPage);
+  scrubDefragWriteInt32(&aHdr[24], x->nSchema);
+  scrubDefragWriteInt32(&aHdr[28], x->eState);
+  scrubDefragWriteInt32(&aHdr[32], (u32)(x->nDone>>32));
+  scrubDefragWriteInt32(&aHdr[36], (u32)x->nDone);
+  scrubDefragWriteInt32(&aHdr[40], scrubDefragCksum(0, aHdr, 40));
+  /* Alternate between two header slots so that a torn write leaves the
+  ** previous header intact */
+  scrubDefragJrnlIo(p, x, 1, aHdr, sizeof(aHdr),
+                    (x->iSeq&1)*SCRUB_DEFRAG_JRNL_HDR);
+  scrubDefragSync(p, x->pJrnl);
+}
+
+/* Read the newest valid journal header.  Return 0 if there is none. */
+static int scrubDefragJrnlReadHeader(ScrubDefragState *p, ScrubDefragInplace *x){
+  u8 aHdr[2][SCRUB_DEFRAG_JRNL_HDR];
+  int i, iBest = -1;
+  u32 iSeq = 0;
+  sqlite3_int64 sz = 0;
+  if( x->pJrnl->pMethods->xFileSize(x->pJrnl, &sz) ) return 0;
+  if( sz<SCRUB_DEFRAG_JRNL_MAP ) return 0;
+  scrubDefragJrnlIo(p, x, 0, aHdr, sizeof(aHdr), 0);
+  if( p->rcErr ) return 0;
+  for(i=0; i<2; i++){
+    u8 *a = aHdr[i];
+    if( memcmp(a, aScrubDefragJrnlMagic, 8) ) continue;
+    if( scrubDefragInt32(&a[40])!=scrubDefragCksum(0, a, 40) ) continue;
+    if( iBest<0 || scrubDefragInt32(&a[8])>iSeq ){
+      iBest = i;
+      iSeq = scrubDefragInt32(&a[8]);
+    }
+  }
+  if( iBest<0 ) return 0;
+  x->iSeq = iSeq;
+  p->szPage = scrubDefragInt32(&aHdr[iBest][12]);
+  p->nSrcPage = scrubDefragInt32(&aHdr[iBest][16]);
+  p->nDestPage = scrubDefragInt32(&aHdr[iBest][20]);
+  x->nSchema = scrubDefragInt32(&aHdr[iBest][24]);
+  x->eState = scrubDefragInt32(&aHdr[iBest][28]);
+  x->nDone = ((sqlite3_int64)scrubDefragInt32(&aHdr[iBest][32])<<32)
+           + scrubDefragInt32(&aHdr[iBest][36]);
+  return 1;
+}
+
+/* Compute journal offsets and allocate the in-memory permutation */
+static void scrubDefragInplaceAlloc(ScrubDefragState *p, ScrubDefragInplace *x){
+  sqlite3_int64 n = p->nSrcPage;
+  if( p->rcErr ) return;
+  x->iBufOff = (SCRUB_DEFRAG_JRNL_MAP + n*5 + 511) & ~(sqlite3_int64)511;
+  x->iBatchOff = (x->iBufOff + 4 + p->szPage + 511) & ~(sqlite3_int64)511;
+  p->aMap = sqlite3_malloc64((n+1)*sizeof(u32));
+  p->aKind = sqlite3_malloc64(n+1);
+  x->aInv = sqlite3_malloc64(((sqlite3_int64)p->nDestPage+1)*sizeof(u32));
+  x->aDone = sqlite3_malloc64(n/8+1);
+  x->aBuf = scrubDefragAllocPage(p);
+  if( p->aMap==0 || p->aKind==0 || x->aInv==0 || x->aDone==0 || x->aBuf==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  memset(p->aMap, 0, (n+1)*sizeof(u32));
+  memset(p->aKind, 0, n+1);
+  memset(x->aDone, 0, n/8+1);
+}
+
+/* Fill aInv[] from aMap[] */
+static void scrubDefragInplaceInvert(ScrubDefragState *p, ScrubDefragInplace *x){
+  u32 i;
+  memset(x->aInv, 0, ((sqlite3_int64)p->nDestPage+1)*sizeof(u32));
+  for(i=1; i<=p->nSrcPage; i++){
+    if( p->aKind[i] ) x->aInv[p->aMap[i]] = i;
+  }
+}
+
+/*
+** Compute the permutation with a mapping pass over every b-tree, then
+** write it to a new journal.  The journal header is written last, so a
+** journal without a valid header means the database was never touched.
+*/
+static void scrubDefragInplacePlan(ScrubDefragState *p, ScrubDefragInplace *x){
+  sqlite3_stmt *pStmt;
+  u32 i, nLive = 0;
+  u8 *aOut;
+  int szPage = 0, nPage = 0;
+
+  scrubDefragDbInt(p, "PRAGMA page_size", &szPage,
+                      "unable to determine the page size");
+  scrubDefragDbInt(p, "PRAGMA page_count", &nPage,
+                      "unable to determine the size of the database");
+  if( p->rcErr ) return;
+  p->szPage = (u32)szPage;
+  p->nSrcPage = (u32)nPage;
+  p->iLock = (1073742335/p->szPage)+1;
+  p->page1 = scrubDefragRead(p, 1, 0);
+  if( p->page1==0 ) return;
+  scrubDefragSetUsable(p, p->page1[20]);
+  p->nDestPage = p->nSrcPage;
+  scrubDefragInplaceAlloc(p, x);
+  if( p->rcErr ) return;
+
+  /* The mapping pass.  Roots are visited in the same order as the copy */
+  p->iDestPageNo = 1;
+  scrubDefragBtree(p, 1);
+  x->nSchema = p->iDestPageNo-1;
+  pStmt = scrubDefragPrepare(p, p->dbSrc,
+      "SELECT rootpage FROM sqlite_master WHERE coalesce(rootpage,0)>0"
+      "   ORDER BY CASE type WHEN 'table' THEN 2 "
+      "                      WHEN 'index' THEN 1 "
+      "                      ELSE 0 END, rootpage");
+  if( pStmt==0 ) return;
+  while( p->rcErr==SQLITE_OK && sqlite3_step(pStmt)==SQLITE_ROW ){
+    scrubDefragBtree(p, (u32)sqlite3_column_int(pStmt, 0));
+  }
+  i = sqlite3_finalize(pStmt);
+  if( p->rcErr ) return;
+  if( i ){
+    p->rcErr = i;
+    scrubDefragErr(p, "cannot read the schema: %s", sqlite3_errmsg(p->dbSrc));
+    return;
+  }
+
+  /* The copy numbers pages densely, skipping only the lock page */
+  p->nDestPage = 0;
+  for(i=1; i<=p->nSrcPage; i++){
+    if( p->aKind[i]==0 ) continue;
+    nLive++;
+    if( p->aMap[i]>p->nDestPage ) p->nDestPage = p->aMap[i];
+  }
+  if( nLive!=p->nDestPage - (p->nDestPage>=p->iLock) ){
+    scrubDefragErr(p, "internal logic error: in-place permutation has holes");
+    return;
+  }
+  scrubDefragInplaceInvert(p, x);
+
+  /* Write the permutation, then the header */
+  aOut = sqlite3_malloc64((sqlite3_int64)p->nSrcPage*4);
+  if( aOut==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  for(i=1; i<=p->nSrcPage; i++){
+    scrubDefragWriteInt32(&aOut[(i-1)*4], p->aMap[i]);
+  }
+  scrubDefragJrnlIo(p, x, 1, aOut, p->nSrcPage*4, SCRUB_DEFRAG_JRNL_MAP);
+  sqlite3_free(aOut);
+  scrubDefragJrnlIo(p, x, 1, &p->aKind[1], p->nSrcPage,
+                    SCRUB_DEFRAG_JRNL_MAP + (sqlite3_int64)p->nSrcPage*4);
+  scrubDefragSync(p, x->pJrnl);
+  x->eState = SCRUB_DEFRAG_INPLACE_MOVING;
+  x->nDone = 0;
+  scrubDefragJrnlHeader(p, x);
+}
+
+/* Load the permutation of an interrupted in-place defrag */
+static void scrubDefragInplaceLoad(ScrubDefragState *p, ScrubDefragInplace *x){
+  u8 *aIn;
+  u32 i;
+  p->iLock = (1073742335/p->szPage)+1;
+  p->page1 = scrubDefragRead(p, 1, 0);
+  if( p->page1==0 ) return;
+  scrubDefragSetUsable(p, p->page1[20]);
+  scrubDefragInplaceAlloc(p, x);
+  if( p->rcErr ) return;
+  aIn = sqlite3_malloc64((sqlite3_int64)p->nSrcPage*4);
+  if( aIn==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  scrubDefragJrnlIo(p, x, 0, aIn, p->nSrcPage*4, SCRUB_DEFRAG_JRNL_MAP);
+  scrubDefragJrnlIo(p, x, 0, &p->aKind[1], p->nSrcPage,
+                    SCRUB_DEFRAG_JRNL_MAP + (sqlite3_int64)p->nSrcPage*4);
+  for(i=1; p->rcErr==SQLITE_OK && i<=p->nSrcPage; i++){
+    p->aMap[i] = scrubDefragInt32(&aIn[(i-1)*4]);
+    if( p->aKind[i] && (p->aMap[i]==0 || p->aMap[i]>p->nDestPage) ){
+      scrubDefragErr(p, "the in-place journal %s is corrupt", x->zJrnl);
+    }
+  }
+  sqlite3_free(aIn);
+  if( p->rcErr==SQLITE_OK ) scrubDefragInplaceInvert(p, x);
+}
+
+/* Return the next move of the permutation in *pMove, or 0 when done */
+static int scrubDefragNextMove(
+  ScrubDefragState *p,
+  ScrubDefragInplace *x,
+  ScrubDefragMove *pMove
+){
+  u32 iSrc;
+  if( x->bPending ){
+    x->bPending = 0;
+    *pMove = x->sPending;
+    return 1;
+  }
+  while( 1 ){
+    if( x->iCur ){
+      /* Fill slot iCur from the page that belongs there */
+      iSrc = x->aInv[x->iCur];
+      pMove->iDest = x->iCur;
+      if( iSrc==x->iCycle ){
+        pMove->eOp = SCRUB_DEFRAG_MOVE_STORE;
+        pMove->iSrc = x->iCycle;
+        x->iCur = x->iCycle = 0;
+        return 1;
+      }
+      pMove->eOp = SCRUB_DEFRAG_MOVE_PAGE;
+      pMove->iSrc = iSrc;
+      x->aDone[iSrc/8] |= 1<<(iSrc%8);
+      if( x->ePhase==1 && (iSrc>p->nDestPage || x->aInv[iSrc]==0) ){
+        x->iCur = 0;   /* End of a chain: iSrc lies past the new end */
+      }else{
+        x->iCur = iSrc;
+      }
+      return 1;
+    }
+    switch( x->ePhase ){
+      case 0:
+        x->ePhase = 1;
+        pMove->eOp = SCRUB_DEFRAG_MOVE_MARK;
+        pMove->iDest = pMove->iSrc = 1;
+        return 1;
+      case 1:
+        /* Chains start at slots that hold no live page */
+        while( ++x->iScan<=p->nDestPage ){
+          if( p->aKind[x->iScan]==0 && x->aInv[x->iScan] ){
+            x->iCur = x->iScan;
+            break;
+          }
+        }
+        if( x->iCur==0 ){
+          x->ePhase = 2;
+          x->iScan = 1;
+        }
+        break;
+      case 2:
+        /* Everything not moved yet, except page 1, lies on a cycle */
+        while( ++x->iScan<=p->nDestPage ){
+          iSrc = x->iScan;
+          if( p->aKind[iSrc] && (x->aDone[iSrc/8] & (1<<(iSrc%8)))==0 ){
+            x->aDone[iSrc/8] |= 1<<(iSrc%8);
+            pMove->iSrc = iSrc;
+            if( p->aMap[iSrc]==iSrc ){
+              pMove->eOp = SCRUB_DEFRAG_MOVE_PAGE;
+              pMove->iDest = iSrc;
+            }else{
+              pMove->eOp = SCRUB_DEFRAG_MOVE_LOAD;
+              pMove->iDest = 0;
+              x->iCycle = x->iCur = iSrc;
+            }
+            return 1;
+          }
+        }
+        x->ePhase = 3;
+        break;
+      case 3:
+        x->ePhase = 4;
+        pMove->eOp = SCRUB_DEFRAG_MOVE_PAGE;
+        pMove->iDest = pMove->iSrc = 1;
+        return 1;
+      default:
+        return 0;
+    }
+  }
+}
+
+/* Translate the page number stored at a[] through aMap[] */
+static int scrubDefragRemapPtr(ScrubDefragState *p, u8 *a){
+  u32 v = scrubDefragInt32(a);
+  if( v==0 || v>p->nSrcPage || p->aKind[v]==0 ) return __LINE__;
+  scrubDefragWriteInt32(a, p->aMap[v]);
+  return 0;
+}
+
+/*
+** Rewrite page a[], read from source page iSrc, for its new place: zero
+** deleted content and translate every page number it holds.  Page 1 also
+** gets the new header, still carrying the replacement header string.
+** Return 0 on success or the line number of the failed check.
+*/
+static int scrubDefragRemapPage(ScrubDefragState *p, u8 *a, u32 iSrc){
+  u32 i, pc, nCell, szHdr, nOvfl, nPrefix;
   u8 *aTop;
-  u8 *aCell;
-  u32 x, y;
+  int ln;
+  if( p->aKind[iSrc]==SCRUB_DEFRAG_KIND_OVERFLOW ){
+    return scrubDefragInt32(a) ? scrubDefragRemapPtr(p, a) : 0;
+  }
+  nPrefix = iSrc==1 ? 100 : 0;
+  aTop = &a[nPrefix];
+  szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  nCell = scrubDefragInt16(&aTop[3]);
+  ln = scrubDefragZeroFree(p, a, nPrefix);
+  if( ln ) return ln;
+  for(i=0; i<nCell; i++){
+    pc = scrubDefragInt16(&aTop[szHdr+i*2]);
+    if( pc <= szHdr ) return __LINE__;
+    if( pc > p->szUsable-3 ) return __LINE__;
+    if( aTop[0]==0x05 || aTop[0]==0x02 ){
+      if( pc+4 > p->szUsable ) return __LINE__;
+      if( (ln = scrubDefragRemapPtr(p, &a[pc]))!=0 ) return ln;
+      pc += 4;
+      if( aTop[0]==0x05 ) continue;
+    }
+    ln = scrubDefragCellOverflow(p, a, aTop[0], pc, &pc, &nOvfl);
+    if( ln ) return ln;
+    if( pc && (ln = scrubDefragRemapPtr(p, &a[pc]))!=0 ) return ln;
+  }
+  if( aTop[0]==0x05 || aTop[0]==0x02 ){
+    if( (ln = scrubDefragRemapPtr(p, &aTop[8]))!=0 ) return ln;
+  }
+  if( iSrc==1 ){
+    u32 iChange = scrubDefragInt32(&a[24]) + 1;
+    memcpy(a, aScrubDefragBusy, 16);
+    scrubDefragWriteInt32(&a[24], iChange);
+    scrubDefragWriteInt32(&a[28], p->nDestPage);
+    scrubDefragWriteInt32(&a[32], 0);
+    scrubDefragWriteInt32(&a[36], 0);
+    scrubDefragWriteInt32(&a[52], 0);
+    scrubDefragWriteInt32(&a[64], 0);
+    scrubDefragWriteInt32(&a[92], iChange);
+  }
+  return 0;
+}
+
+/*
+** Write a batch record holding the current content of the nImage slots
+** listed in aiSlot[] (content in aImage[]), plus the cycle buffer if
+** bBuf, and sync the journal.  The batch is then safe to apply.
+*/
+static void scrubDefragJrnlBatch(
+  ScrubDefragState *p,
+  ScrubDefragInplace *x,
+  int nImage,
+  const u32 *aiSlot,
+  u8 *aImage,
+  int bBuf
+){
+  u8 aHdr[SCRUB_DEFRAG_JRNL_BATCH];
+  u8 aPgno[4];
+  sqlite3_int64 iOff = x->iBatchOff + SCRUB_DEFRAG_JRNL_BATCH;
+  u32 cksum;
+  int i;
+  if( bBuf ){
+    scrubDefragWriteInt32(aPgno, x->iBuf);
+    scrubDefragJrnlIo(p, x, 1, aPgno, 4, x->iBufOff);
+    scrubDefragJrnlIo(p, x, 1, x->aBuf, p->szPage, x->iBufOff+4);
+  }
+  scrubDefragWriteInt32(&aHdr[0], nImage);
+  scrubDefragWriteInt32(&aHdr[4], (u32)(x->nDone>>32));
+  scrubDefragWriteInt32(&aHdr[8], (u32)x->nDone);
+  scrubDefragWriteInt32(&aHdr[12], x->eState);
+  cksum = scrubDefragCksum(0, aHdr, 16);
+  for(i=0; i<nImage; i++){
+    u8 *a = &aImage[(sqlite3_int64)i*p->szPage];
+    scrubDefragWriteInt32(aPgno, aiSlot[i]);
+    cksum = scrubDefragCksum(cksum, aPgno, 4);
+    cksum = scrubDefragCksum(cksum, a, p->szPage);
+    scrubDefragJrnlIo(p, x, 1, aPgno, 4, iOff);
+    scrubDefragJrnlIo(p, x, 1, a, p->szPage, iOff+4);
+    iOff += 4 + p->szPage;
+  }
+  scrubDefragWriteInt32(&aHdr[16], cksum);
+  scrubDefragJrnlIo(p, x, 1, aHdr, sizeof(aHdr), x->iBatchOff);
+  scrubDefragSync(p, x->pJrnl);
+}
+
+/*
+** If the journal holds a complete batch record for the current state that
+** starts at nDone, that batch may have been partly applied: write the
+** original content of its slots back to the database.
+*/
+static void scrubDefragJrnlRestore(ScrubDefragState *p, ScrubDefragInplace *x){
+  u8 aHdr[SCRUB_DEFRAG_JRNL_BATCH];
+  sqlite3_int64 iOff = x->iBatchOff + SCRUB_DEFRAG_JRNL_BATCH;
+  sqlite3_int64 sz = 0;
+  u32 i, nImage, cksum;
+  u8 *a;
+  if( p->rcErr ) return;
+  x->pJrnl->pMethods->xFileSize(x->pJrnl, &sz);
+  if( sz<x->iBatchOff+SCRUB_DEFRAG_JRNL_BATCH ) return;
+  scrubDefragJrnlIo(p, x, 0, aHdr, sizeof(aHdr), x->iBatchOff);
+  if( p->rcErr ) return;
+  nImage = scrubDefragInt32(&aHdr[0]);
+  if( scrubDefragInt32(&aHdr[4])!=(u32)(x->nDone>>32)
+   || scrubDefragInt32(&aHdr[8])!=(u32)x->nDone
+   || scrubDefragInt32(&aHdr[12])!=x->eState
+   || sz<iOff+(sqlite3_int64)nImage*(4+p->szPage)
+  ){
+    return;
+  }
+  a = sqlite3_malloc64(((sqlite3_int64)nImage+1)*(4+p->szPage));
+  if( a==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  scrubDefragJrnlIo(p, x, 0, a, nImage*(4+p->szPage), iOff);
+  cksum = scrubDefragCksum(0, aHdr, 16);
+  cksum = scrubDefragCksum(cksum, a, nImage*(4+p->szPage));
+  if( p->rcErr==SQLITE_OK && cksum==scrubDefragInt32(&aHdr[16]) ){
+    for(i=0; i<nImage && p->rcErr==SQLITE_OK; i++){
+      u8 *aRec = &a[(sqlite3_int64)i*(4+p->szPage)];
+      int rc = p->pSrc->pMethods->xWrite(p->pSrc, &aRec[4], p->szPage,
+                  (scrubDefragInt32(aRec)-1)*(sqlite3_int64)p->szPage);
+      if( rc ){
+        scrubDefragErr(p, "write failed for page %d",scrubDefragInt32(aRec));
+        p->rcErr = SQLITE_IOERR;
+      }
+    }
+    scrubDefragSync(p, p->pSrc);
+  }
+  sqlite3_free(a);
+}
+
+/*
+** Apply the permutation, one batch at a time, starting after the first
+** x->nDone moves.
+*/
+static void scrubDefragInplaceMoves(ScrubDefragState *p, ScrubDefragInplace *x){
+  ScrubDefragMove aMove[SCRUB_DEFRAG_INPLACE_BATCH];
+  u32 aiSlot[SCRUB_DEFRAG_INPLACE_BATCH];
+  u8 *aImage, *aOut;
+  sqlite3_int64 i;
+  int nMove, nWrite, bLoad, ln;
+  u32 iBufAtStart;
+
+  aImage = sqlite3_malloc64((sqlite3_int64)SCRUB_DEFRAG_INPLACE_BATCH*p->szPage);
+  aOut = sqlite3_malloc64((sqlite3_int64)SCRUB_DEFRAG_INPLACE_BATCH*p->szPage);
+  if( aImage==0 || aOut==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto moves_done;
+  }
+
+  /* Skip the moves already made.  If that stops inside a cycle, the
+  ** page that started it is in the journal. */
+  for(i=0; i<x->nDone && scrubDefragNextMove(p, x, &aMove[0]); i++){
+    if( aMove[0].eOp==SCRUB_DEFRAG_MOVE_LOAD ) x->iBuf = aMove[0].iSrc;
+    if( aMove[0].eOp==SCRUB_DEFRAG_MOVE_STORE ) x->iBuf = 0;
+  }
+  if( x->iBuf ){
+    u8 aPgno[4];
+    scrubDefragJrnlIo(p, x, 0, aPgno, 4, x->iBufOff);
+    scrubDefragJrnlIo(p, x, 0, x->aBuf, p->szPage, x->iBufOff+4);
+    if( p->rcErr==SQLITE_OK && scrubDefragInt32(aPgno)!=x->iBuf ){
+      scrubDefragErr(p, "the in-place journal %s is corrupt", x->zJrnl);
+    }
+  }
+
+  while( p->rcErr==SQLITE_OK ){
+    /* Gather a batch.  A batch that starts inside a cycle ends with that
+    ** cycle, because the journal keeps only one cycle buffer. */
+    iBufAtStart = x->iBuf;
+    nMove = nWrite = bLoad = 0;
+    while( nMove<SCRUB_DEFRAG_INPLACE_BATCH
+        && scrubDefragNextMove(p, x, &aMove[nMove])
+    ){
+      ScrubDefragMove *pM = &aMove[nMove];
+      if( pM->eOp==SCRUB_DEFRAG_MOVE_LOAD && iBufAtStart ){
+        x->sPending = *pM;
+        x->bPending = 1;
+        break;
+      }
+      nMove++;
+    }
+    if( nMove==0 ) break;
+
+    /* Read the original content of every slot written and build the new
+    ** content, before anything is written */
+    for(i=0; i<nMove && p->rcErr==SQLITE_OK; i++){
+      ScrubDefragMove *pM = &aMove[i];
+      u8 *aNew = &aOut[nWrite*(sqlite3_int64)p->szPage];
+      if( pM->eOp==SCRUB_DEFRAG_MOVE_LOAD ){
+        scrubDefragRead(p, pM->iSrc, x->aBuf);
+        x->iBuf = pM->iSrc;
+        bLoad = 1;
+        continue;
+      }
+      aiSlot[nWrite] = pM->iDest;
+      scrubDefragRead(p, pM->iDest,
+                      &aImage[nWrite*(sqlite3_int64)p->szPage]);
+      if( pM->eOp==SCRUB_DEFRAG_MOVE_STORE ){
+        memcpy(aNew, x->aBuf, p->szPage);
+        x->iBuf = 0;
+      }else{
+        scrubDefragRead(p, pM->iSrc, aNew);
+      }
+      if( p->rcErr ) break;
+      if( pM->eOp==SCRUB_DEFRAG_MOVE_MARK ){
+        memcpy(aNew, aScrubDefragBusy, 16);
+      }else if( (ln = scrubDefragRemapPage(p, aNew, pM->iSrc))!=0 ){
+        scrubDefragErr(p, "corruption on page %d of source database "
+                          "(errid=%d)", pM->iSrc, ln);
+      }
+      nWrite++;
+    }
+    if( p->rcErr ) break;
+
+    /* Journal, apply, then record the progress */
+    scrubDefragJrnlBatch(p, x, nWrite, aiSlot, aImage, bLoad);
+    for(i=0; i<nWrite; i++){
+      scrubDefragWrite(p, aiSlot[i], &aOut[i*(sqlite3_int64)p->szPage]);
+    }
+    scrubDefragSync(p, p->pSrc);
+    x->nDone += nMove;
+    if( p->rcErr==SQLITE_OK ) scrubDefragJrnlHeader(p, x);
+  }
+
+moves_done:
+  sqlite3_free(aImage);
+  sqlite3_free(aOut);
+  if( p->rcErr==SQLITE_OK ){
+    x->eState = SCRUB_DEFRAG_INPLACE_ROOTS;
+    scrubDefragJrnlHeader(p, x);
+  }
+}
+
+/* SQL function scrub_defrag_root(N): the new number of root page N */
+static void scrubDefragRootFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  ScrubDefragState *p = (ScrubDefragState*)sqlite3_user_data(ctx);
+  sqlite3_int64 iRoot = sqlite3_value_int64(argv[0]);
+  (void)argc;
+  if( iRoot<1 || iRoot>p->nSrcPage || p->aKind[iRoot]!=SCRUB_DEFRAG_KIND_BTREE ){
+    sqlite3_result_error(ctx, "root page is not a b-tree page", -1);
+    return;
+  }
+  sqlite3_result_int64(ctx, p->aMap[iRoot]);
+}
+
+/*
+** Point the sqlite_schema rows at the new root pages.  This goes through
+** SQLite (via the shim) since the records may change size.  Its own
+** journal is kept in memory; the original content of the sqlite_schema
+** pages, which occupy the first nSchema pages of the new layout, is in the
+** in-place journal instead.
+*/
+static void scrubDefragInplaceRoots(ScrubDefragState *p, ScrubDefragInplace *x){
+  u32 *aiSlot;
+  u8 *aImage;
+  u32 i;
+  int nPage = 0;
+  if( p->rcErr ) return;
+  aiSlot = sqlite3_malloc64(((sqlite3_int64)x->nSchema+1)*sizeof(u32));
+  aImage = sqlite3_malloc64(((sqlite3_int64)x->nSchema+1)*p->szPage);
+  if( aiSlot==0 || aImage==0 ){
+    p->rcErr = SQLITE_NOMEM;
+  }
+  for(i=0; i<x->nSchema && p->rcErr==SQLITE_OK; i++){
+    aiSlot[i] = i+1;
+    scrubDefragRead(p, i+1, &aImage[i*(sqlite3_int64)p->szPage]);
+  }
+  scrubDefragJrnlBatch(p, x, x->nSchema, aiSlot, aImage, 0);
+  sqlite3_free(aiSlot);
+  sqlite3_free(aImage);
+
+  scrubDefragShimOpenDb(p, x->pVfs);
+  if( p->rcErr==SQLITE_OK ){
+    sqlite3_create_function(p->dbSrc, "scrub_defrag_root", 1, SQLITE_UTF8,
+                            p, scrubDefragRootFunc, 0, 0);
+    p->rcErr = sqlite3_exec(p->dbSrc,
+        "PRAGMA writable_schema=ON;"
+        "BEGIN;"
+        "UPDATE sqlite_master SET rootpage=scrub_defrag_root(rootpage)"
+        " WHERE coalesce(rootpage,0)>0;"
+        "COMMIT;"
+        "PRAGMA writable_schema=OFF;", 0, 0, 0);
+    if( p->rcErr ){
+      scrubDefragErr(p, "cannot update the root pages: %s",
+                     sqlite3_errmsg(p->dbSrc));
+    }
+  }
+  scrubDefragDbInt(p, "PRAGMA page_count", &nPage,
+                   "unable to determine the size of the database");
+  sqlite3_close(p->dbSrc);
+  p->dbSrc = 0;
+  if( p->rcErr ) return;
+
+  /* The update may have split a sqlite_schema page onto a new page */
+  if( (u32)nPage>p->nDestPage ) p->nDestPage = nPage;
+  x->eState = SCRUB_DEFRAG_INPLACE_COMMIT;
+  scrubDefragJrnlHeader(p, x);
+}
+
+/*
+** Empty the journal.  It is deleted when the database is unlocked.
+*/
+static void scrubDefragInplaceReset(ScrubDefragState *p, ScrubDefragInplace *x){
+  if( p->rcErr ) return;
+  if( x->pJrnl->pMethods->xTruncate(x->pJrnl, 0) ){
+    scrubDefragErr(p, "cannot truncate %s", x->zJrnl);
+    p->rcErr = SQLITE_IOERR;
+    return;
+  }
+  x->iSeq = 0;
+  x->eState = 0;
+}
+
+/*
+** Truncate, put the header string back and empty the journal.  Once the
+** header string is back the database may be opened and changed again, so
+** if a crash left the journal behind after that point, only the journal
+** is deleted.
+*/
+static void scrubDefragInplaceCommit(ScrubDefragState *p, ScrubDefragInplace *x){
+  u8 aMagic[16];
+  int rc;
+  if( p->rcErr ) return;
+  rc = p->pSrc->pMethods->xRead(p->pSrc, aMagic, 16, 0);
+  if( rc==SQLITE_OK && memcmp(aMagic, aScrubDefragBusy, 16)==0 ){
+    rc = p->pSrc->pMethods->xTruncate(p->pSrc,
+                                   (sqlite3_int64)p->nDestPage*p->szPage);
+    if( rc==SQLITE_OK ){
+      rc = p->pSrc->pMethods->xSync(p->pSrc, SQLITE_SYNC_NORMAL);
+    }
+    if( rc==SQLITE_OK ){
+      rc = p->pSrc->pMethods->xWrite(p->pSrc, aScrubDefragMagic, 16, 0);
+    }
+    if( rc==SQLITE_OK ){
+      rc = p->pSrc->pMethods->xSync(p->pSrc, SQLITE_SYNC_NORMAL);
+    }
+  }
+  if( rc ){
+    scrubDefragErr(p, "cannot finish the in-place defrag of %s", p->zSrcFile);
+    p->rcErr = SQLITE_IOERR;
+    return;
+  }
+  scrubDefragInplaceReset(p, x);
+}
+
+/*
+** Open zFile for an in-place operation and take an EXCLUSIVE lock on it,
+** which is held until scrubDefragInplaceClose().  Also open the "-defrag"
+** journal, creating it if need be.
+*/
+static void scrubDefragInplaceOpen(
+  ScrubDefragState *p,
+  ScrubDefragInplace *x,
+  const char *zFile
+){
+  sqlite3_vfs *pVfs = sqlite3_vfs_find(0);
+  char *zHot = 0;
+  int flags = 0;
+  int bExists = 0;
+
+  x->pVfs = pVfs;
+  x->zPath = sqlite3_malloc(pVfs->mxPathname+1);
+  if( x->zPath==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  if( pVfs->xFullPathname(pVfs, zFile, pVfs->mxPathname+1, x->zPath) ){
+    scrubDefragErr(p, "cannot resolve the path of %s", zFile);
+    return;
+  }
+  p->zSrcFile = x->zPath;
+  x->zJrnl = sqlite3_mprintf("%s-defrag", x->zPath);
+  zHot = sqlite3_mprintf("%s-journal", x->zPath);
+  p->pSrc = sqlite3_malloc(pVfs->szOsFile);
+  x->pJrnl = sqlite3_malloc(pVfs->szOsFile);
+  if( x->zJrnl==0 || zHot==0 || p->pSrc==0 || x->pJrnl==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto open_done;
+  }
+  memset(p->pSrc, 0, pVfs->szOsFile);
+  memset(x->pJrnl, 0, pVfs->szOsFile);
+
+  p->rcErr = pVfs->xOpen(pVfs, x->zPath, p->pSrc,
+                         SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_READWRITE, &flags);
+  if( p->rcErr ){
+    if( p->pSrc->pMethods==0 ){
+      sqlite3_free(p->pSrc);
+      p->pSrc = 0;
+    }
+    scrubDefragErr(p, "cannot open database: %s", zFile);
+    goto open_done;
+  }
+  p->pDest = p->pSrc;
+  for(x->eLock=SQLITE_LOCK_SHARED; x->eLock<=SQLITE_LOCK_EXCLUSIVE; x->eLock++){
+    if( x->eLock==SQLITE_LOCK_PENDING ) continue;
+    if( p->pSrc->pMethods->xLock(p->pSrc, x->eLock) ) break;
+  }
+  x->eLock--;
+  if( x->eLock!=SQLITE_LOCK_EXCLUSIVE ){
+    scrubDefragErr(p, "database is locked");
+    p->rcErr = SQLITE_BUSY;
+    goto open_done;
+  }
+  pVfs->xAccess(pVfs, zHot, SQLITE_ACCESS_EXISTS, &bExists);
+  if( bExists ){
+    scrubDefragErr(p, "%s exists: open the database with SQLite first so "
+                      "that the interrupted transaction is rolled back", zHot);
+    goto open_done;
+  }
+
+  p->rcErr = pVfs->xOpen(pVfs, x->zJrnl, x->pJrnl,
+                  SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_READWRITE |
+                  SQLITE_OPEN_CREATE, &flags);
+  if( p->rcErr ){
+    if( x->pJrnl->pMethods==0 ){
+      sqlite3_free(x->pJrnl);
+      x->pJrnl = 0;
+    }
+    scrubDefragErr(p, "cannot open %s", x->zJrnl);
+  }
+
+open_done:
+  sqlite3_free(zHot);
+}
+
+/*
+** Refuse WAL databases.  The shim VFS has no shared-memory methods and
+** pages in the WAL would be invisible to the raw file handle.
+*/
+static void scrubDefragInplaceCheckWal(ScrubDefragState *p){
+  u8 aHdr[20];
+  if( p->rcErr ) return;
+  memset(aHdr, 0, sizeof(aHdr));
+  p->pSrc->pMethods->xRead(p->pSrc, aHdr, sizeof(aHdr), 0);
+  if( aHdr[18]!=1 || aHdr[19]!=1 ){
+    scrubDefragErr(p, "in-place mode needs a rollback-journal database; "
+                      "change journal_mode away from WAL first");
+  }
+}
+
+/* Release the lock and everything scrubDefragInplaceOpen() allocated */
+static void scrubDefragInplaceClose(ScrubDefragState *p, ScrubDefragInplace *x){
+  sqlite3_close(p->dbSrc);
+  p->dbSrc = 0;
+  if( x->pJrnl ){
+    if( x->pJrnl->pMethods ){
+      x->pJrnl->pMethods->xClose(x->pJrnl);
+      /* No header was written: the database was never touched */
+      if( x->iSeq==0 ) x->pVfs->xDelete(x->pVfs, x->zJrnl, 0);
+    }
+    sqlite3_free(x->pJrnl);
+  }
+  if( p->pSrc ){
+    if( x->eLock>SQLITE_LOCK_NONE ){
+      p->pSrc->pMethods->xUnlock(p->pSrc, SQLITE_LOCK_NONE);
+    }
+    p->pSrc->pMethods->xClose(p->pSrc);
+    sqlite3_free(p->pSrc);
+  }
+  sqlite3_free(p->page1);
+  scrubDefragPoolFree(p);
+  sqlite3_free(p->aMap);
+  sqlite3_free(p->aKind);
+  sqlite3_free(x->aInv);
+  sqlite3_free(x->aDone);
+  sqlite3_free(x->aBuf);
+  sqlite3_free(x->zJrnl);
+  sqlite3_free(x->zPath);
+}
+
+int sqlite3_scrub_and_defrag_inplace(
+  const char *zFile,       /* Database to defragment */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+  ScrubDefragInplace x;
+  ScrubDefragState *p = &s;
+
+  memset(&s, 0, sizeof(s));
+  memset(&x, 0, sizeof(x));
+  scrubDefragInplaceOpen(p, &x, zFile);
+  if( s.rcErr ) goto inplace_done;
+
+  /* Resume an interrupted run, or plan a new one.  An interrupted
+  ** compaction round is rolled back first. */
+  if( scrubDefragJrnlReadHeader(p, &x)
+   && x.eState==SCRUB_DEFRAG_INPLACE_COMPACT
+  ){
+    x.iBatchOff = SCRUB_DEFRAG_JRNL_MAP;
+    scrubDefragJrnlRestore(p, &x);
+    scrubDefragInplaceReset(p, &x);
+  }
+  if( x.eState==SCRUB_DEFRAG_INPLACE_COMMIT ){
+    /* Only the final step is left */
+  }else if( x.eState ){
+    scrubDefragInplaceLoad(p, &x);
+  }else if( s.rcErr==SQLITE_OK ){
+    scrubDefragInplaceCheckWal(p);
+    if( s.rcErr ) goto inplace_done;
+    x.pJrnl->pMethods->xTruncate(x.pJrnl, 0);
+    scrubDefragShimOpenDb(p, x.pVfs);
+    scrubDefragInplacePlan(p, &x);
+    sqlite3_close(s.dbSrc);
+    s.dbSrc = 0;
+  }
+  if( s.rcErr ) goto inplace_done;
+
+  scrubDefragJrnlRestore(p, &x);
+  if( x.eState==SCRUB_DEFRAG_INPLACE_MOVING ) scrubDefragInplaceMoves(p, &x);
+  if( x.eState==SCRUB_DEFRAG_INPLACE_ROOTS ) scrubDefragInplaceRoots(p, &x);
+  if( x.eState==SCRUB_DEFRAG_INPLACE_COMMIT ) scrubDefragInplaceCommit(p, &x);
+
+inplace_done:
+  scrubDefragInplaceClose(p, &x);
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+
+/*
+** Tail compaction.
+**
+** For databases with auto-vacuum off, sqlite3_scrub_and_defrag_compact()
+** moves live pages from the end of the file into freelist slots near the
+** front and truncates the file, doing a bounded amount of work per call.
+** There are no pointer-maps, so the page that points at each moved page is
+** found by a walk from the roots.  The first walk reads only interior pages
+** (and one leaf below each lowest interior page, to learn the depth), which
+** finds the parents of all moved b-tree pages.  Only if an overflow page is
+** among those being moved is a second walk made that also reads leaves and
+** overflow chains.  Root pages are pointed to by their sqlite_schema row,
+** which is patched in place.
+**
+** Each round is applied as one batch of the in-place journal, so a crash
+** leaves the database either as it was before the round or after it.
+*/
+#define SCRUB_DEFRAG_COMPACT_ROUND  1024    /* Max pages moved per round */
+
+typedef struct ScrubDefragCached ScrubDefragCached;
+typedef struct ScrubDefragCompact ScrubDefragCompact;
+
+/* A page changed by the current round */
+struct ScrubDefragCached {
+  u32 iPg;                 /* Page the content was read from */
+  u32 iWrite;              /* Page it is written to */
+  u8 *a;                   /* New content */
+};
+
+/* State of one compaction round */
+struct ScrubDefragCompact {
+  u32 nTail;               /* Size of the file after the round, in pages */
+  u8 *aFree;               /* Bitmap of pages on the freelist */
+  u32 nTarget;             /* Number of pages moved */
+  u32 *aTarget;            /* aTarget[i] is the i-th page moved */
+  u32 *aDest;              /* ... aDest[i] is where it goes */
+  u32 *aOwner;             /* ... aOwner[i] is the page pointing at it */
+  u16 *aOff;               /* ... aOff[i] is the offset of that pointer */
+  u8 *aWidth;              /* ... aWidth[i] is the width of that pointer */
+  int *aSlot;              /* aSlot[pg-nTail-1] indexes aTarget[], or -1 */
+  u32 nUnresolved;         /* Moved pages whose owner is not yet known */
+  int nRoot;               /* Number of entries in aRoot[] */
+  u32 *aRoot;              /* Root pages other than 1 */
+  u32 *aRootOwner;         /* Page holding the sqlite_schema row of aRoot[i] */
+  u16 *aRootOff;           /* Offset of the rootpage value */
+  u8 *aRootWidth;          /* Width of the rootpage value */
+  int nCache;              /* Number of entries in aCache[] */
+  int nCacheAlloc;         /* Allocated size of aCache[] */
+  ScrubDefragCached *aCache;
+};
+
+/* Return the cached copy of page iPg, reading it on first use */
+static ScrubDefragCached *scrubDefragCompactPage(
+  ScrubDefragState *p,
+  ScrubDefragCompact *c,
+  u32 iPg
+){
+  ScrubDefragCached *pC;
+  int i;
+  if( p->rcErr ) return 0;
+  for(i=0; i<c->nCache; i++){
+    if( c->aCache[i].iPg==iPg ) return &c->aCache[i];
+  }
+  if( c->nCache==c->nCacheAlloc ){
+    int nNew = c->nCacheAlloc ? c->nCacheAlloc*2 : 64;
+    pC = sqlite3_realloc64(c->aCache, nNew*sizeof(ScrubDefragCached));
+    if( pC==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return 0;
+    }
+    c->aCache = pC;
+    c->nCacheAlloc = nNew;
+  }
+  pC = &c->aCache[c->nCache];
+  pC->a = scrubDefragRead(p, iPg, 0);
+  if( pC->a==0 ) return 0;
+  pC->iPg = pC->iWrite = iPg;
+  if( iPg>c->nTail && c->aSlot[iPg-c->nTail-1]>=0 ){
+    pC->iWrite = c->aDest[c->aSlot[iPg-c->nTail-1]];
+  }
+  c->nCache++;
+  return pC;
+}
+
+/* Page iOwner holds, at offset iOff, a nWidth-byte pointer to page iPg */
+static void scrubDefragCompactNote(
+  ScrubDefragState *p,
+  ScrubDefragCompact *c,
+  u32 iPg,
+  u32 iOwner,
+  u32 iOff,
+  u8 nWidth
+){
+  int i;
+  if( iPg<=c->nTail || p->rcErr ) return;
+  if( iPg>p->nSrcPage ){
+    scrubDefragErr(p, "corrupt: page %d points past the end of the file",
+                   iOwner);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  i = c->aSlot[iPg-c->nTail-1];
+  if( i<0 || c->aOwner[i] ){
+    scrubDefragErr(p, "corrupt: page %d is free or used more than once", iPg);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  c->aOwner[i] = iOwner;
+  c->aOff[i] = iOff;
+  c->aWidth[i] = nWidth;
+  c->nUnresolved--;
+}
+
+/*
+** Record the owner of every pointer on b-tree page pgno that refers to a
+** page being moved, then descend.  Leaf pages are only examined, and
+** overflow chains only followed, if bLeaves is true.  Return 1 if pgno is
+** a leaf, so that the caller need not visit its siblings.
+*/
+static int scrubDefragCompactWalk(
+  ScrubDefragState *p,
+  ScrubDefragCompact *c,
+  u32 pgno,
+  int iDepth,
+  int bLeaves
+){
+  u8 *a, *aTop;
+  u32 i, pc, nCell, nPrefix, szHdr, iPtr, nOvfl, iOvfl;
+  int ln = 0;
+
+  if( p->rcErr ) return 0;
+  if( iDepth>50 ){
+    scrubDefragErr(p, "corrupt: b-tree too deep at page %d", pgno);
+    p->rcErr = SQLITE_CORRUPT;
+    return 0;
+  }
+  a = scrubDefragRead(p, pgno, 0);
+  if( a==0 ) return 0;
+  nPrefix = pgno==1 ? 100 : 0;
+  aTop = &a[nPrefix];
+  if( aTop[0]!=0x02 && aTop[0]!=0x05 && aTop[0]!=0x0a && aTop[0]!=0x0d ){
+    ln = __LINE__;
+    goto walk_done;
+  }
+  if( (aTop[0]==0x0a || aTop[0]==0x0d) && !bLeaves ){
+    sqlite3_free(a);
+    return 1;
+  }
+  szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  nCell = scrubDefragInt16(&aTop[3]);
+  if( nPrefix+szHdr+nCell*2 > p->szUsable ){ ln = __LINE__; goto walk_done; }
+  for(i=0; i<nCell && p->rcErr==SQLITE_OK; i++){
+    pc = scrubDefragInt16(&aTop[szHdr+i*2]);
+    if( pc<=szHdr || pc>p->szUsable-4 ){ ln = __LINE__; goto walk_done; }
+    if( aTop[0]==0x02 || aTop[0]==0x05 ){
+      scrubDefragCompactNote(p, c, scrubDefragInt32(&a[pc]), pgno, pc, 4);
+      pc += 4;
+      if( aTop[0]==0x05 ) continue;
+    }
+    ln = scrubDefragCellOverflow(p, a, aTop[0], pc, &iPtr, &nOvfl);
+    if( ln ) goto walk_done;
+    if( iPtr==0 ) continue;
+    iOvfl = scrubDefragInt32(&a[iPtr]);
+    scrubDefragCompactNote(p, c, iOvfl, pgno, iPtr, 4);
+    if( !bLeaves ) continue;
+    while( nOvfl>p->szUsable-4 && p->rcErr==SQLITE_OK ){
+      u8 aNext[4];
+      if( iOvfl<2 || iOvfl>p->nSrcPage ){ ln = __LINE__; goto walk_done; }
+      if( p->pSrc->pMethods->xRead(p->pSrc, aNext, 4,
+                                 (iOvfl-1)*(sqlite3_int64)p->szPage) ){
+        scrubDefragErr(p, "read failed for page %d", iOvfl);
+        p->rcErr = SQLITE_IOERR;
+        break;
+      }
+      scrubDefragCompactNote(p, c, scrubDefragInt32(aNext), iOvfl, 0, 4);
+      iOvfl = scrubDefragInt32(aNext);
+      nOvfl -= p->szUsable-4;
+    }
+  }
+  if( aTop[0]==0x02 || aTop[0]==0x05 ){
+    scrubDefragCompactNote(p, c, scrubDefragInt32(&aTop[8]), pgno,
+                           nPrefix+8, 4);
+    for(i=0; i<=nCell && p->rcErr==SQLITE_OK; i++){
+      u32 iChild;
+      if( i<nCell ){
+        iChild = scrubDefragInt32(&a[scrubDefragInt16(&aTop[szHdr+i*2])]);
+      }else{
+        iChild = scrubDefragInt32(&aTop[8]);
+      }
+      if( scrubDefragCompactWalk(p, c, iChild, iDepth+1, bLeaves) ) break;
+    }
+  }
+
+walk_done:
+  if( ln ){
+    scrubDefragErr(p, "corruption on page %d of source database "
+                      "(errid=%d)", pgno, ln);
+    p->rcErr = SQLITE_CORRUPT;
+  }
+  sqlite3_free(a);
+  return 0;
+}
+
+/*
+** Collect every root page from the sqlite_schema b-tree starting at pgno,
+** along with where in the file its rootpage value is stored, so that it
+** can be patched if the root is moved.
+*/
+static void scrubDefragCompactSchema(
+  ScrubDefragState *p,
+  ScrubDefragCompact *c,
+  u32 pgno,
+  int iDepth
+){
+  u8 *a, *aTop;
+  u32 i, pc, nCell, nPrefix, szHdr, iPtr, nOvfl, iEnd, iBody, iOff, nSkip;
+  sqlite3_int64 nPayload, iRowid, nHdr, t, iRoot;
+  int ln = 0;
+  int k;
+
+  if( p->rcErr ) return;
+  if( iDepth>50 ){
+    scrubDefragErr(p, "corrupt: b-tree too deep at page %d", pgno);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  a = scrubDefragRead(p, pgno, 0);
+  if( a==0 ) return;
+  nPrefix = pgno==1 ? 100 : 0;
+  aTop = &a[nPrefix];
+  if( aTop[0]!=0x05 && aTop[0]!=0x0d ){ ln = __LINE__; goto schema_done; }
+  szHdr = 8 + 4*(aTop[0]==0x05);
+  nCell = scrubDefragInt16(&aTop[3]);
+  if( nPrefix+szHdr+nCell*2 > p->szUsable ){ ln = __LINE__; goto schema_done; }
+  for(i=0; i<nCell && p->rcErr==SQLITE_OK; i++){
+    pc = scrubDefragInt16(&aTop[szHdr+i*2]);
+    if( pc<=szHdr || pc>p->szUsable-4 ){ ln = __LINE__; goto schema_done; }
+    if( aTop[0]==0x05 ){
+      scrubDefragCompactSchema(p, c, scrubDefragInt32(&a[pc]), iDepth+1);
+      continue;
+    }
+    ln = scrubDefragCellOverflow(p, a, aTop[0], pc, &iPtr, &nOvfl);
+    if( ln ) goto schema_done;
+    pc += scrubDefragVarint(&a[pc], &nPayload);
+    pc += scrubDefragVarint(&a[pc], &iRowid);
+    iEnd = iPtr ? iPtr : pc+nPayload;
+    if( iEnd>p->szUsable ){ ln = __LINE__; goto schema_done; }
+
+    /* Columns are type, name, tbl_name, rootpage, sql */
+    iOff = pc + scrubDefragVarint(&a[pc], &nHdr);
+    iBody = pc + nHdr;
+    nSkip = 0;
+    t = 0;
+    for(k=0; k<4 && iOff<iBody && iOff<iEnd; k++){
+      iOff += scrubDefragVarint(&a[iOff], &t);
+      if( k<3 ) nSkip += scrubDefragSerialSize(t);
+    }
+    if( k<4 || iOff>iBody ){
+      scrubDefragErr(p, "sqlite_schema row %lld is too large to compact "
+                        "around", iRowid);
+      break;
+    }
+    pc = iBody + nSkip;
+    if( t==0 || t==8 ) continue;                  /* No b-tree */
+    if( t>6 || pc+scrubDefragSerialSize(t)>iEnd ){
+      scrubDefragErr(p, "sqlite_schema row %lld is too large to compact "
+                        "around", iRowid);
+      break;
+    }
+    if( (c->nRoot & 63)==0 ){
+      int n = c->nRoot+64;
+      u32 *a1 = sqlite3_realloc64(c->aRoot, n*sizeof(u32));
+      u32 *a2 = a1 ? sqlite3_realloc64(c->aRootOwner, n*sizeof(u32)) : 0;
+      u16 *a3 = a2 ? sqlite3_realloc64(c->aRootOff, n*sizeof(u16)) : 0;
+      u8 *a4 = a3 ? sqlite3_realloc64(c->aRootWidth, n) : 0;
+      if( a1 ) c->aRoot = a1;
+      if( a2 ) c->aRootOwner = a2;
+      if( a3 ) c->aRootOff = a3;
+      if( a4==0 ){
+        p->rcErr = SQLITE_NOMEM;
+        break;
+      }
+      c->aRootWidth = a4;
+    }
+    k = scrubDefragSerialSize(t);
+    iRoot = (a[pc]&0x80) ? -1 : 0;
+    for(iOff=0; iOff<(u32)k; iOff++) iRoot = (iRoot<<8) + a[pc+iOff];
+    if( iRoot<2 || iRoot>p->nSrcPage ){ ln = __LINE__; goto schema_done; }
+    c->aRoot[c->nRoot] = (u32)iRoot;
+    c->aRootOwner[c->nRoot] = pgno;
+    c->aRootOff[c->nRoot] = pc;
+    c->aRootWidth[c->nRoot] = k;
+    c->nRoot++;
+  }
+  if( aTop[0]==0x05 && p->rcErr==SQLITE_OK ){
+    scrubDefragCompactSchema(p, c, scrubDefragInt32(&aTop[8]), iDepth+1);
+  }
+
+schema_done:
+  if( ln ){
+    scrubDefragErr(p, "corruption on page %d of source database "
+                      "(errid=%d)", pgno, ln);
+    p->rcErr = SQLITE_CORRUPT;
+  }
+  sqlite3_free(a);
+}
+
+/* Mark every page on the freelist in c->aFree[].  Return the count. */
+static u32 scrubDefragCompactFreelist(
+  ScrubDefragState *p,
+  ScrubDefragCompact *c,
+  const u8 *aPage1
+){
+  u32 iTrunk = scrubDefragInt32(&aPage1[32]);
+  u32 nExpect = scrubDefragInt32(&aPage1[36]);
+  u32 nFree = 0;
+  u32 i, n, pg;
+  u8 *a = scrubDefragAllocPage(p);
+  if( a==0 ) return 0;
+  while( iTrunk && p->rcErr==SQLITE_OK ){
+    if( iTrunk>p->nSrcPage || nFree>=nExpect
+     || (c->aFree[iTrunk/8] & (1<<(iTrunk%8)))
+    ){
+      scrubDefragErr(p, "corrupt: freelist trunk page %d", iTrunk);
+      p->rcErr = SQLITE_CORRUPT;
+      break;
+    }
+    if( scrubDefragRead(p, iTrunk, a)==0 ) break;
+    c->aFree[iTrunk/8] |= 1<<(iTrunk%8);
+    nFree++;
+    n = scrubDefragInt32(&a[4]);
+    if( n>p->szUsable/4-2 || nFree+n>nExpect ){
+      scrubDefragErr(p, "corrupt: freelist trunk page %d", iTrunk);
+      p->rcErr = SQLITE_CORRUPT;
+      break;
+    }
+    for(i=0; i<n; i++){
+      pg = scrubDefragInt32(&a[8+i*4]);
+      if( pg<2 || pg>p->nSrcPage || (c->aFree[pg/8] & (1<<(pg%8))) ){
+        scrubDefragErr(p, "corrupt: freelist leaf page %d", pg);
+        p->rcErr = SQLITE_CORRUPT;
+        break;
+      }
+      c->aFree[pg/8] |= 1<<(pg%8);
+    }
+    nFree += n;
+    iTrunk = scrubDefragInt32(a);
+  }
+  sqlite3_free(a);
+  return nFree;
+}
+
+/* Free everything owned by a compaction round */
+static void scrubDefragCompactFree(ScrubDefragCompact *c){
+  int i;
+  for(i=0; i<c->nCache; i++) sqlite3_free(c->aCache[i].a);
+  sqlite3_free(c->aCache);
+  sqlite3_free(c->aFree);
+  sqlite3_free(c->aTarget);
+  sqlite3_free(c->aDest);
+  sqlite3_free(c->aOwner);
+  sqlite3_free(c->aOff);
+  sqlite3_free(c->aWidth);
+  sqlite3_free(c->aSlot);
+  sqlite3_free(c->aRoot);
+  sqlite3_free(c->aRootOwner);
+  sqlite3_free(c->aRootOff);
+  sqlite3_free(c->aRootWidth);
+  memset(c, 0, sizeof(*c));
+}
+
+/*
+** Run one round of compaction, moving at most nMax pages.  Set *pbDone
+** if, afterwards, nothing is left to reclaim.  Return the number of pages
+** moved.
+*/
+static u32 scrubDefragCompactRound(
+  ScrubDefragState *p,
+  ScrubDefragInplace *x,
+  u32 nMax,
+  int *pbDone
+){
+  ScrubDefragCompact c;
+  ScrubDefragCached *pC, *pOwner;
+  u8 aHdr[100];
+  u8 *aImage = 0;
+  u32 *aLeft = 0;
+  u32 nFree, iTop, iNext, i, j, nLeft, iTrunk, nPer;
+  sqlite3_int64 sz = 0;
+  int k;
+
+  memset(&c, 0, sizeof(c));
+  *pbDone = 1;
+  if( p->pSrc->pMethods->xRead(p->pSrc, aHdr, sizeof(aHdr), 0) ){
+    scrubDefragErr(p, "read failed for page 1");
+    p->rcErr = SQLITE_IOERR;
+    return 0;
+  }
+  p->szPage = (aHdr[16]<<8) + aHdr[17];
+  if( p->szPage==1 ) p->szPage = 65536;
+  scrubDefragSetUsable(p, aHdr[20]);
+  p->iLock = (1073742335/p->szPage)+1;
+  p->pSrc->pMethods->xFileSize(p->pSrc, &sz);
+  p->nSrcPage = scrubDefragInt32(&aHdr[28]);
+  if( p->nSrcPage==0
+   || scrubDefragInt32(&aHdr[24])!=scrubDefragInt32(&aHdr[92])
+  ){
+    p->nSrcPage = (u32)(sz/p->szPage);
+  }
+  if( scrubDefragInt32(&aHdr[52]) ){
+    scrubDefragErr(p, "auto-vacuum is on: use PRAGMA incremental_vacuum");
+    return 0;
+  }
+  if( scrubDefragInt32(&aHdr[36])==0 ) return 0;
+
+  c.aFree = sqlite3_malloc64(p->nSrcPage/8+1);
+  if( c.aFree==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto round_done;
+  }
+  memset(c.aFree, 0, p->nSrcPage/8+1);
+  nFree = scrubDefragCompactFreelist(p, &c, aHdr);
+  if( p->rcErr==SQLITE_OK && nFree!=scrubDefragInt32(&aHdr[36]) ){
+    scrubDefragErr(p, "corrupt: freelist holds %d pages, header says %d",
+                   nFree, scrubDefragInt32(&aHdr[36]));
+    p->rcErr = SQLITE_CORRUPT;
+  }
+  if( p->rcErr ) goto round_done;
+
+  /* Pick the pages to move: the live pages nearest the end, each going
+  ** to the lowest free slot, while a free slot below it remains */
+  c.aTarget = sqlite3_malloc64(((sqlite3_int64)nMax+1)*sizeof(u32));
+  c.aDest = sqlite3_malloc64(((sqlite3_int64)nMax+1)*sizeof(u32));
+  if( c.aTarget==0 || c.aDest==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto round_done;
+  }
+  iNext = 1;
+  for(iTop=p->nSrcPage; iTop>1 && iTop>=iNext; iTop--){
+    if( iTop==p->iLock || (c.aFree[iTop/8] & (1<<(iTop%8))) ) continue;
+    while( iNext<iTop && (c.aFree[iNext/8] & (1<<(iNext%8)))==0 ) iNext++;
+    if( iNext>=iTop || c.nTarget==nMax ) break;
+    c.aTarget[c.nTarget] = iTop;
+    c.aDest[c.nTarget] = iNext++;
+    c.nTarget++;
+  }
+  c.nTail = iTop;
+  if( c.nTail==p->nSrcPage ) goto round_done;
+
+  /* Any free slot left below the new end means more work remains */
+  for(nLeft=0, i=iNext; i<c.nTail; i++){
+    if( c.aFree[i/8] & (1<<(i%8)) ) nLeft++;
+  }
+  *pbDone = nLeft==0;
+
+  /* Find the owner of every page moved */
+  c.aOwner = sqlite3_malloc64(((sqlite3_int64)c.nTarget+1)*sizeof(u32));
+  c.aOff = sqlite3_malloc64(((sqlite3_int64)c.nTarget+1)*sizeof(u16));
+  c.aWidth = sqlite3_malloc64((sqlite3_int64)c.nTarget+1);
+  c.aSlot = sqlite3_malloc64(((sqlite3_int64)p->nSrcPage-c.nTail+1)*sizeof(int));
+  if( c.aOwner==0 || c.aOff==0 || c.aWidth==0 || c.aSlot==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto round_done;
+  }
+  for(i=0; i<p->nSrcPage-c.nTail; i++) c.aSlot[i] = -1;
+  for(i=0; i<c.nTarget; i++) c.aSlot[c.aTarget[i]-c.nTail-1] = i;
+  scrubDefragCompactSchema(p, &c, 1, 0);
+  for(k=0; k<2 && p->rcErr==SQLITE_OK; k++){
+    memset(c.aOwner, 0, c.nTarget*sizeof(u32));
+    c.nUnresolved = c.nTarget;
+    for(i=0; i<(u32)c.nRoot; i++){
+      scrubDefragCompactNote(p, &c, c.aRoot[i], c.aRootOwner[i],
+                             c.aRootOff[i], c.aRootWidth[i]);
+    }
+    scrubDefragCompactWalk(p, &c, 1, 0, k);
+    for(i=0; i<(u32)c.nRoot; i++){
+      scrubDefragCompactWalk(p, &c, c.aRoot[i], 0, k);
+    }
+    if( c.nUnresolved==0 ) break;
+  }
+  if( p->rcErr ) goto round_done;
+  if( c.nUnresolved ){
+    for(i=0; c.aOwner[i]; i++){}
+    scrubDefragErr(p, "corrupt: page %d is neither free nor in use",
+                   c.aTarget[i]);
+    p->rcErr = SQLITE_CORRUPT;
+    goto round_done;
+  }
+
+  /* Build the new content of every page written */
+  for(i=0; i<c.nTarget && p->rcErr==SQLITE_OK; i++){
+    u32 v = c.aDest[i];
+    scrubDefragCompactPage(p, &c, c.aTarget[i]);
+    pOwner = scrubDefragCompactPage(p, &c, c.aOwner[i]);
+    if( pOwner==0 ) break;
+    for(k=c.aWidth[i]-1; k>=0; k--, v >>= 8){
+      pOwner->a[c.aOff[i]+k] = v & 0xff;
+    }
+  }
+  pC = scrubDefragCompactPage(p, &c, 1);
+  if( pC==0 ) goto round_done;
+
+  /* Rebuild the freelist from the free slots that remain */
+  aLeft = sqlite3_malloc64(((sqlite3_int64)nLeft+1)*sizeof(u32));
+  if( aLeft==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto round_done;
+  }
+  for(j=0, i=iNext; i<c.nTail; i++){
+    if( c.aFree[i/8] & (1<<(i%8)) ) aLeft[j++] = i;
+  }
+  nPer = p->szUsable/4 - 8;
+  for(j=0; j<nLeft && p->rcErr==SQLITE_OK; j+=nPer+1){
+    u32 n = nLeft-j-1 < nPer ? nLeft-j-1 : nPer;
+    ScrubDefragCached *pTrunk = scrubDefragCompactPage(p, &c, aLeft[j]);
+    if( pTrunk==0 ) break;
+    memset(pTrunk->a, 0, p->szPage);
+    scrubDefragWriteInt32(pTrunk->a, j+nPer+1<nLeft ? aLeft[j+nPer+1] : 0);
+    scrubDefragWriteInt32(&pTrunk->a[4], n);
+    for(i=0; i<n; i++){
+      scrubDefragWriteInt32(&pTrunk->a[8+i*4], aLeft[j+1+i]);
+    }
+  }
+  iTrunk = nLeft ? aLeft[0] : 0;
+  scrubDefragWriteInt32(&pC->a[24], scrubDefragInt32(&pC->a[24])+1);
+  scrubDefragWriteInt32(&pC->a[92], scrubDefragInt32(&pC->a[24]));
+  scrubDefragWriteInt32(&pC->a[28], c.nTail);
+  scrubDefragWriteInt32(&pC->a[32], iTrunk);
+  scrubDefragWriteInt32(&pC->a[36], nLeft);
+  scrubDefragWriteInt32(&pC->a[40], scrubDefragInt32(&pC->a[40])+1);
+  memcpy(pC->a, aScrubDefragBusy, 16);
+  if( p->rcErr ) goto round_done;
+
+  /* Journal the original content of every slot written */
+  aImage = sqlite3_malloc64((sqlite3_int64)c.nCache*p->szPage);
+  if( aImage==0 ){
+    p->rcErr = SQLITE_NOMEM;
+    goto round_done;
+  }
+  for(k=0; k<c.nCache; k++){
+    scrubDefragRead(p, c.aCache[k].iWrite, &aImage[k*(sqlite3_int64)p->szPage]);
+  }
+  {
+    u32 *aiSlot = sqlite3_malloc64(((sqlite3_int64)c.nCache+1)*sizeof(u32));
+    if( aiSlot==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      goto round_done;
+    }
+    for(k=0; k<c.nCache; k++) aiSlot[k] = c.aCache[k].iWrite;
+    x->pJrnl->pMethods->xTruncate(x->pJrnl, 0);
+    x->eState = SCRUB_DEFRAG_INPLACE_COMPACT;
+    x->nDone = 0;
+    x->nSchema = 0;
+    x->iBatchOff = SCRUB_DEFRAG_JRNL_MAP;
+    p->nDestPage = c.nTail;
+    scrubDefragJrnlBatch(p, x, c.nCache, aiSlot, aImage, 0);
+    sqlite3_free(aiSlot);
+  }
+  scrubDefragJrnlHeader(p, x);
+
+  /* Make page 1 unopenable first, then write everything */
+  if( p->rcErr==SQLITE_OK
+   && p->pSrc->pMethods->xWrite(p->pSrc, aScrubDefragBusy, 16, 0)
+  ){
+    scrubDefragErr(p, "write failed for page 1");
+    p->rcErr = SQLITE_IOERR;
+  }
+  scrubDefragSync(p, p->pSrc);
+  for(k=0; k<c.nCache; k++){
+    scrubDefragWrite(p, c.aCache[k].iWrite, c.aCache[k].a);
+  }
+  scrubDefragSync(p, p->pSrc);
+  if( p->rcErr==SQLITE_OK ){
+    x->eState = SCRUB_DEFRAG_INPLACE_COMMIT;
+    scrubDefragJrnlHeader(p, x);
+    scrubDefragInplaceCommit(p, x);
+  }
+
+round_done:
+  i = c.nTarget;
+  sqlite3_free(aLeft);
+  sqlite3_free(aImage);
+  scrubDefragCompactFree(&c);
+  return p->rcErr ? 0 : i;
+}
+
+int sqlite3_scrub_and_defrag_compact(
+  const char *zFile,       /* Database to compact */
+  int nPage,               /* Move at most this many pages, or <=0 */
+  int nMs,                 /* Stop after about this many ms, or <=0 */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+  ScrubDefragInplace x;
+  ScrubDefragState *p = &s;
+  sqlite3_int64 iEnd = 0;
+  int bDone = 0;
+  u32 nMax;
+
+  memset(&s, 0, sizeof(s));
+  memset(&x, 0, sizeof(x));
+  scrubDefragInplaceOpen(p, &x, zFile);
+  if( s.rcErr ) goto compact_done;
+  if( nMs>0 ) iEnd = scrubDefragNow(x.pVfs) + nMs;
+
+  /* Settle whatever a crash left behind */
+  if( scrubDefragJrnlReadHeader(p, &x) ){
+    if( x.eState==SCRUB_DEFRAG_INPLACE_COMPACT ){
+      x.iBatchOff = SCRUB_DEFRAG_JRNL_MAP;
+      scrubDefragJrnlRestore(p, &x);
+      scrubDefragInplaceReset(p, &x);
+    }else if( x.eState==SCRUB_DEFRAG_INPLACE_COMMIT ){
+      scrubDefragInplaceCommit(p, &x);
+    }else{
+      scrubDefragErr(p, "an in-place defrag of %s was interrupted: run "
+                        "sqlite3_scrub_and_defrag_inplace() to finish it",
+                     zFile);
+    }
+  }
+  scrubDefragInplaceCheckWal(p);
+
+  while( s.rcErr==SQLITE_OK ){
+    nMax = SCRUB_DEFRAG_COMPACT_ROUND;
+    if( nPage>0 && (u32)nPage<nMax ) nMax = nPage;
+    nMax = scrubDefragCompactRound(p, &x, nMax, &bDone);
+    if( bDone ) break;
+    if( nPage>0 && (nPage -= nMax)<=0 ) break;
+    if( iEnd && scrubDefragNow(x.pVfs)>=iEnd ) break;
+  }
+
+compact_done:
+  scrubDefragInplaceClose(p, &x);
+  if( pzErr ){
+    *pzErr = s.zErr;
+  }else{
+    sqlite3_free(s.zErr);
+  }
+  if( s.rcErr==SQLITE_OK && bDone ) return SQLITE_DONE;
+  return s.rcErr;
+}
+
+/*
+** Fragmentation analysis.
+**
+** sqlite3_scrub_and_defrag_analyze() walks every b-tree the way
+** scrubDefragBtree() does, without writing, and reports per table and
+** index how far the pages are from the layout a defrag would give them.
+** The only write is the passive checkpoint scrubDefragOpenSrc() runs on a
+** WAL source, without which pages still in the WAL would be missed.
+**
+** Links between pages adjacent in key order are counted from the child
+** lists of interior pages, so they are known without reading the leaves.
+** With sampling, all interior pages above the lowest interior level are
+** read and the lowest interior pages (parents of leaves) are listed in key
+** order.  Then every k-th of those is read, k being 100/nSamplePct, with
+** all of its leaves and the overflow chains of its cells, starting half a
+** step in so that each of the equal strata the list falls into is
+** represented by its middle page.  The sample is deterministic, and
+** overflow-heavy key ranges are hit in proportion to their size.  At least
+** SCRUB_DEFRAG_MIN_SAMPLE pages are read per b-tree where it has that
+** many.  What is measured below the lowest interior level is scaled by the
+** ratio of lowest interior pages listed to those read, and the spread of
+** the page totals of the subtrees read gives a 95% confidence interval for
+** the page count of the b-tree.
+*/
+#define SCRUB_DEFRAG_MAX_DEPTH  50
+#define SCRUB_DEFRAG_MIN_SAMPLE 8   /* Least lowest interior pages sampled */
+
+typedef struct ScrubDefragAnalysis ScrubDefragAnalysis;
+typedef struct ScrubDefragObj ScrubDefragObj;
+
+/* Estimated statistics of one table or index */
+struct ScrubDefragObj {
+  char *zName;             /* Table or index name */
+  char *zType;             /* "table" or "index" */
+  int nDepth;              /* Depth of the b-tree, leaves included */
+  double nInterior;        /* Interior pages */
+  double nLeaf;            /* Leaf pages */
+  double nOvfl;            /* Overflow pages */
+  double nLink;            /* Links between pages adjacent in key order */
+  double nJump;            /* ... where the second page does not follow */
+  double nFreeBytes;       /* Freeblock and fragment bytes on leaves */
+  double nGapBytes;        /* Unused bytes before the cell content on leaves */
+  double nLeafUsed;        /* Bytes in use on the leaves sampled */
+  double nLeafRead;        /* Leaf pages those bytes were measured on */
+  double nChainLink;       /* Links within overflow chains */
+  double nChainJump;       /* ... where the next page does not follow */
+  u32 nLow;                /* Sampling: lowest interior pages */
+  u32 nLowRead;            /* Sampling: how many of those were read */
+  double nPageErr;         /* Sampling: 95% half-width of the page count */
+};
+
+/* State of an analysis */
+struct ScrubDefragAnalysis {
+  int nSamplePct;          /* Sampling percentage, or 0 to read everything */
+  u32 *aLow;               /* Sampling: lowest interior pages in key order */
+  u32 nLow;                /* Entries used in aLow[] */
+  u32 nLowAlloc;           /* Entries allocated */
+  u32 aPrev[SCRUB_DEFRAG_MAX_DEPTH+2];  /* Last page seen at each depth */
+};
+
+/* Return the depth of the b-tree rooted at pgno, following leftmost links */
+static int scrubDefragAnalyzeDepth(ScrubDefragState *p, u32 pgno){
+  u8 *a = scrubDefragAllocPage(p);
+  int nDepth = 0;
+  while( a && p->rcErr==SQLITE_OK && nDepth<=SCRUB_DEFRAG_MAX_DEPTH ){
+    u8 *aTop;
+    if( scrubDefragRead(p, pgno, a)==0 ) break;
+    aTop = &a[pgno==1 ? 100 : 0];
+    nDepth++;
+    if( aTop[0]!=0x02 && aTop[0]!=0x05 ) break;
+    if( scrubDefragInt16(&aTop[3])==0 ){
+      pgno = scrubDefragInt32(&aTop[8]);
+    }else{
+      pgno = scrubDefragInt32(&a[scrubDefragInt16(&aTop[12])]);
+    }
+    if( pgno<1 || pgno>p->nSrcPage ){
+      scrubDefragErr(p, "corrupt: child page %d out of range", pgno);
+      p->rcErr = SQLITE_CORRUPT;
+    }
+  }
+  sqlite3_free(a);
+  return nDepth;
+}
+
+/*
+** Measure the overflow chain whose first page is iOvfl and which holds
+** nOvfl bytes.  Only the 4-byte next pointers are read.
+*/
+static void scrubDefragAnalyzeChain(
+  ScrubDefragState *p,
+  ScrubDefragObj *pObj,
+  u32 iOvfl,
+  u32 nOvfl,
+  double w
+){
+  u8 aNext[4];
+  u32 iNext;
+  while( p->rcErr==SQLITE_OK ){
+    pObj->nOvfl += w;
+    if( nOvfl<=p->szUsable-4 ) break;
+    nOvfl -= p->szUsable-4;
+    if( iOvfl<2 || iOvfl>p->nSrcPage ){
+      scrubDefragErr(p, "corrupt: overflow page %d out of range", iOvfl);
+      p->rcErr = SQLITE_CORRUPT;
+      break;
+    }
+    if( p->pSrc->pMethods->xRead(p->pSrc, aNext, 4,
+                                 (iOvfl-1)*(sqlite3_int64)p->szPage) ){
+      scrubDefragErr(p, "read failed for page %d", iOvfl);
+      p->rcErr = SQLITE_IOERR;
+      break;
+    }
+    iNext = scrubDefragInt32(aNext);
+    pObj->nChainLink += w;
+    if( iNext!=iOvfl+1 ) pObj->nChainJump += w;
+    iOvfl = iNext;
+  }
+}
+
+/*
+** Analyze page pgno at depth iDepth of a b-tree and its subtree.  When
+** sampling, the lowest interior pages of the subtree are appended to
+** pA->aLow[] instead of being read, unless pgno is itself one of them.
+*/
+static void scrubDefragAnalyzeBtree(
+  ScrubDefragState *p,
+  ScrubDefragAnalysis *pA,
+  ScrubDefragObj *pObj,
+  u32 pgno,
+  int iDepth
+){
+  u8 *a, *aTop;
+  u32 i, pc, nCell, nPrefix, szHdr, iPtr, nOvfl, x, nFree;
+  u32 nChild, iChild;
   int ln = 0;
-  u32 iCurrentPageNo = p->iDestPageNo;
-  
+
   if( p->rcErr ) return;
-  if( iDepth>50 ){
+  if( iDepth>=SCRUB_DEFRAG_MAX_DEPTH ){
     scrubDefragErr(p, "corrupt: b-tree too deep at page %d", pgno);
+    p->rcErr = SQLITE_CORRUPT;
     return;
   }
-  if( pgno==1 ){
-    a = p->page1;
+  a = scrubDefragRead(p, pgno, 0);
+  if( a==0 ) return;
+  nPrefix = pgno==1 ? 100 : 0;
+  aTop = &a[nPrefix];
+  if( aTop[0]!=0x02 && aTop[0]!=0x05 && aTop[0]!=0x0a && aTop[0]!=0x0d ){
+    ln = __LINE__;
+    goto analyze_done;
+  }
+  szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  nCell = scrubDefragInt16(&aTop[3]);
+  x = scrubDefragInt16(&aTop[5]);
+  if( x==0 ) x = 65536;
+  if( nPrefix+szHdr+nCell*2>x || x>p->szUsable ){
+    ln = __LINE__;
+    goto analyze_done;
+  }
+
+  /* Cells: overflow chains on leaves and on index interior pages */
+  for(i=0; i<nCell; i++){
+    pc = scrubDefragInt16(&aTop[szHdr+i*2]);
+    if( pc<=szHdr || pc>p->szUsable-4 ){ ln = __LINE__; goto analyze_done; }
+    if( aTop[0]==0x05 ) continue;
+    if( aTop[0]==0x02 ) pc += 4;
+    ln = scrubDefragCellOverflow(p, a, aTop[0], pc, &iPtr, &nOvfl);
+    if( ln ) goto analyze_done;
+    if( iPtr ){
+      scrubDefragAnalyzeChain(p, pObj, scrubDefragInt32(&a[iPtr]), nOvfl, 1.0);
+    }
+  }
+
+  if( aTop[0]==0x0a || aTop[0]==0x0d ){
+    /* Leaf: measure unused space */
+    nFree = aTop[7];
+    pc = scrubDefragInt16(&aTop[1]);
+    while( pc ){
+      if( pc>p->szUsable-4 ){ ln = __LINE__; goto analyze_done; }
+      nFree += scrubDefragInt16(&a[pc+2]);
+      i = scrubDefragInt16(&a[pc]);
+      if( i>0 && i<pc+4 ){ ln = __LINE__; goto analyze_done; }
+      pc = i;
+    }
+    pObj->nFreeBytes += nFree;
+    pObj->nGapBytes += x - (nPrefix+szHdr+nCell*2);
+    pObj->nLeafUsed += p->szUsable - nFree - (x - (nPrefix+szHdr+nCell*2));
+    pObj->nLeafRead += 1;
+    if( iDepth==0 ) pObj->nLeaf += 1;
+    goto analyze_done;
+  }
+
+  /* Interior page: links between children, then descend */
+  pObj->nInterior += 1;
+  nChild = nCell+1;
+  for(i=0; i<nChild; i++){
+    iChild = i<nCell ? scrubDefragInt32(&a[scrubDefragInt16(&aTop[szHdr+i*2])])
+                     : scrubDefragInt32(&aTop[8]);
+    if( pA->aPrev[iDepth+1] ){
+      pObj->nLink += 1;
+      if( iChild!=pA->aPrev[iDepth+1]+1 ) pObj->nJump += 1;
+    }
+    pA->aPrev[iDepth+1] = iChild;
+  }
+  if( iDepth+2==pObj->nDepth ){
+    /* Children are leaves */
+    pObj->nLeaf += nChild;
+  }
+  for(i=0; i<nChild && p->rcErr==SQLITE_OK; i++){
+    iChild = i<nCell ? scrubDefragInt32(&a[scrubDefragInt16(&aTop[szHdr+i*2])])
+                     : scrubDefragInt32(&aTop[8]);
+    if( pA->nSamplePct && iDepth+3==pObj->nDepth ){
+      /* Child is one of the lowest interior pages: list it for sampling */
+      if( pA->nLow>=pA->nLowAlloc ){
+        u32 n = pA->nLowAlloc ? pA->nLowAlloc*2 : 256;
+        u32 *aNew = sqlite3_realloc64(pA->aLow, n*sizeof(u32));
+        if( aNew==0 ){
+          p->rcErr = SQLITE_NOMEM;
+          break;
+        }
+        pA->aLow = aNew;
+        pA->nLowAlloc = n;
+      }
+      pA->aLow[pA->nLow++] = iChild;
+      continue;
+    }
+    scrubDefragAnalyzeBtree(p, pA, pObj, iChild, iDepth+1);
+  }
+
+analyze_done:
+  if( ln ){
+    scrubDefragErr(p, "corruption on page %d of source database "
+                      "(errid=%d)", pgno, ln);
+    p->rcErr = SQLITE_CORRUPT;
+  }
+  sqlite3_free(a);
+}
+
+/* Percentage n/d, or 0 if d is 0 */
+static double scrubDefragPct(double n, double d){
+  return d>0 ? 100.0*n/d : 0.0;
+}
+
+/* Square root of x>=0 by Newton's method, so as not to need libm */
+static double scrubDefragSqrt(double x){
+  double r = x>1 ? x : 1;
+  int i;
+  if( x<=0 ) return 0;
+  for(i=0; i<64; i++){
+    double r2 = (r + x/r)/2;
+    if( r2>=r ) break;
+    r = r2;
+  }
+  return r;
+}
+
+/*
+** Read every k-th of the lowest interior pages listed in pA->aLow[] with
+** their subtrees, and add what they hold, scaled up, to pObj.
+*/
+static void scrubDefragAnalyzeSample(
+  ScrubDefragState *p,
+  ScrubDefragAnalysis *pA,
+  ScrubDefragObj *pObj
+){
+  ScrubDefragObj sS;
+  u32 n = pA->nLow;
+  u32 k = 100/pA->nSamplePct;
+  u32 i;
+  double nRead = 0, s1 = 0, s2 = 0, r;
+
+  if( n==0 ) return;
+  if( n/k<SCRUB_DEFRAG_MIN_SAMPLE ){
+    k = n/SCRUB_DEFRAG_MIN_SAMPLE;
+    if( k<1 ) k = 1;
+  }
+  memset(&sS, 0, sizeof(sS));
+  sS.nDepth = pObj->nDepth;
+  for(i=k/2; i<n && p->rcErr==SQLITE_OK; i+=k){
+    double y = sS.nInterior + sS.nLeaf + sS.nOvfl;
+    memset(pA->aPrev, 0, sizeof(pA->aPrev));
+    scrubDefragAnalyzeBtree(p, pA, &sS, pA->aLow[i], pObj->nDepth-2);
+    y = sS.nInterior + sS.nLeaf + sS.nOvfl - y;
+    s1 += y;
+    s2 += y*y;
+    nRead += 1;
+  }
+  if( nRead==0 ) return;
+  r = n/nRead;
+  pObj->nInterior += r*sS.nInterior;
+  pObj->nLeaf += r*sS.nLeaf;
+  pObj->nOvfl += r*sS.nOvfl;
+  pObj->nLink += r*sS.nLink;
+  pObj->nJump += r*sS.nJump;
+  pObj->nFreeBytes += r*sS.nFreeBytes;
+  pObj->nGapBytes += r*sS.nGapBytes;
+  pObj->nLeafUsed += r*sS.nLeafUsed;
+  pObj->nLeafRead += r*sS.nLeafRead;
+  pObj->nChainLink += r*sS.nChainLink;
+  pObj->nChainJump += r*sS.nChainJump;
+  pObj->nLow = n;
+  pObj->nLowRead = (u32)nRead;
+  if( nRead>1 && nRead<n ){
+    /* Standard error of n times the mean, without replacement */
+    double v = (s2 - s1*s1/nRead)/(nRead-1);
+    if( v<0 ) v = 0;
+    pObj->nPageErr = 1.96*n*scrubDefragSqrt((1.0 - nRead/n)*v/nRead);
+  }
+}
+
+int sqlite3_scrub_and_defrag_analyze(
+  const char *zFile,       /* Database to analyze */
+  int nSamplePct,          /* Percent of lowest interior pages read, or 0 */
+  char **pzReport,         /* OUT: Report text, from sqlite3_malloc() */
+  char **pzErr             /* Write error here if non-NULL */
+){
+  ScrubDefragState s;
+  ScrubDefragState *p = &s;
+  ScrubDefragAnalysis sA;
+  ScrubDefragObj *aObj = 0;
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_str *pOut = 0;
+  int nObj = 0, i;
+  double nLive = 0, nLink = 0, nJump = 0;
+  u32 nExpect;
+
+  memset(&s, 0, sizeof(s));
+  memset(&sA, 0, sizeof(sA));
+  *pzReport = 0;
+  if( nSamplePct>=100 || nSamplePct<0 ) nSamplePct = 0;
+  sA.nSamplePct = nSamplePct;
+  s.zSrcFile = zFile;
+  s.eCkpt = SQLITE_CHECKPOINT_PASSIVE;
+  scrubDefragOpenSrc(p);
+  if( s.rcErr ) goto analyze_end;
+  s.iLock = (1073742335/s.szPage)+1;
+  s.page1 = scrubDefragRead(p, 1, 0);
+  if( s.page1==0 ) goto analyze_end;
+  scrubDefragSetUsable(&s, s.page1[20]);
+
+  pStmt = scrubDefragPrepare(p, s.dbSrc,
+      "SELECT 'sqlite_schema', 'table', 1 UNION ALL "
+      "SELECT name, type, rootpage FROM sqlite_master"
+      " WHERE coalesce(rootpage,0)>0");
+  if( pStmt==0 ) goto analyze_end;
+  while( s.rcErr==SQLITE_OK && sqlite3_step(pStmt)==SQLITE_ROW ){
+    ScrubDefragObj *pObj;
+    u32 iRoot = (u32)sqlite3_column_int(pStmt, 2);
+    if( (nObj & 63)==0 ){
+      pObj = sqlite3_realloc64(aObj, (nObj+64)*sizeof(ScrubDefragObj));
+      if( pObj==0 ){
+        s.rcErr = SQLITE_NOMEM;
+        break;
+      }
+      aObj = pObj;
+    }
+    pObj = &aObj[nObj++];
+    memset(pObj, 0, sizeof(*pObj));
+    pObj->zName = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+    pObj->zType = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 1));
+    if( iRoot<1 || iRoot>s.nSrcPage ){
+      scrubDefragErr(p, "corrupt: root page %d of %s out of range",
+                     iRoot, pObj->zName);
+      s.rcErr = SQLITE_CORRUPT;
+      break;
+    }
+    pObj->nDepth = scrubDefragAnalyzeDepth(p, iRoot);
+    memset(sA.aPrev, 0, sizeof(sA.aPrev));
+    sA.nLow = 0;
+    scrubDefragAnalyzeBtree(p, &sA, pObj, iRoot, 0);
+    if( sA.nSamplePct ) scrubDefragAnalyzeSample(p, &sA, pObj);
+  }
+  if( s.rcErr ) goto analyze_end;
+
+  /* Format the report */
+  pOut = sqlite3_str_new(0);
+  sqlite3_str_appendf(pOut,
+      "%-24s %-5s %10s %5s %8s %6s %12s %12s %10s %8s%s\n",
+      "name", "type", "pages", "depth", "nonseq%", "fill%",
+      "free-bytes", "gap-bytes", "ovfl-pages", "scatter%",
+      nSamplePct ? "   pages+-%" : "");
+  for(i=0; i<nObj; i++){
+    ScrubDefragObj *pObj = &aObj[i];
+    double nPage = pObj->nInterior + pObj->nLeaf + pObj->nOvfl;
+    double nLeafBytes = pObj->nLeafRead*p->szUsable;
+    sqlite3_str_appendf(pOut,
+        "%-24s %-5s %10.0f %5d %8.1f %6.1f %12.0f %12.0f %10.0f %8.1f",
+        pObj->zName, pObj->zType, nPage, pObj->nDepth,
+        scrubDefragPct(pObj->nJump, pObj->nLink),
+        scrubDefragPct(pObj->nLeafUsed, nLeafBytes),
+        pObj->nLeafRead>0 ? pObj->nFreeBytes*pObj->nLeaf/pObj->nLeafRead : 0.0,
+        pObj->nLeafRead>0 ? pObj->nGapBytes*pObj->nLeaf/pObj->nLeafRead : 0.0,
+        pObj->nOvfl,
+        scrubDefragPct(pObj->nChainJump, pObj->nChainLink));
+    if( nSamplePct ){
+      sqlite3_str_appendf(pOut, " %10.1f",
+          scrubDefragPct(pObj->nPageErr, nPage));
+    }
+    sqlite3_str_appendchar(pOut, 1, '\n');
+    nLive += nPage;
+    nLink += pObj->nLink;
+    nJump += pObj->nJump;
+  }
+  if( nSamplePct ){
+    /* Every page is copied but the freelist, the lock page and the ptrmap
+    ** pages of an auto-vacuum database, one per szUsable/5 pages after
+    ** page 1 */
+    nExpect = s.nSrcPage - s.nFreePage;
+    if( s.nSrcPage>=s.iLock ) nExpect--;
+    if( scrubDefragInt32(&s.page1[52]) && s.nSrcPage>=2 ){
+      nExpect -= (s.nSrcPage-2)/(s.szUsable/5+1) + 1;
+    }
+  }else{
+    nExpect = (u32)(nLive+0.5);
+  }
+  if( nExpect>=s.iLock ) nExpect++;
+  sqlite3_str_appendf(pOut, "\n"
+      "file pages:           %u (%lld bytes)\n"
+      "freelist pages:       %u\n"
+      "expected pages:       %u (%lld bytes)\n"
+      "reclaimable:          %lld bytes (%.1f%%)\n"
+      "non-sequential links: %.1f%%\n",
+      s.nSrcPage, (sqlite3_int64)s.nSrcPage*s.szPage,
+      s.nFreePage,
+      nExpect, (sqlite3_int64)nExpect*s.szPage,
+      nExpect<s.nSrcPage ? (sqlite3_int64)(s.nSrcPage-nExpect)*s.szPage : 0,
+      nExpect<s.nSrcPage ? scrubDefragPct(s.nSrcPage-nExpect, s.nSrcPage) : 0.0,
+      scrubDefragPct(nJump, nLink));
+  if( nSamplePct ){
+    sqlite3_str_appendf(pOut, "sampled:              1 in %d of the lowest "
+        "interior pages, at least %d per b-tree\n"
+        "pages+-%%:             95%% error bound of the page count\n",
+        100/nSamplePct, SCRUB_DEFRAG_MIN_SAMPLE);
+  }
+  s.rcErr = sqlite3_str_errcode(pOut);
+  *pzReport = sqlite3_str_finish(pOut);
+
+analyze_end:
+  sqlite3_finalize(pStmt);
+  for(i=0; i<nObj; i++){
+    sqlite3_free(aObj[i].zName);
+    sqlite3_free(aObj[i].zType);
+  }
+  sqlite3_free(aObj);
+  sqlite3_free(sA.aLow);
+  sqlite3_free(s.page1);
+  sqlite3_close(s.dbSrc);
+  if( pzErr ){
+    *pzErr = s.zErr;
   }else{
-    a = scrubDefragRead(p, pgno, 0);
-    if( a==0 )  return;
+    sqlite3_free(s.zErr);
+  }
+  return s.rcErr;
+}
+
+/*
+** Verification.
+**
+** sqlite3_scrub_and_defrag_verify() walks each b-tree of the source side by
+** side with the b-tree of the same name in the destination, in key order,
+** and compares the entries one at a time: the rowid of table entries, and
+** the size and a hash of the whole payload, overflow chain included.  The
+** entries of index b-trees are also found on interior pages, between the
+** children.  Pages are read straight from the files as for a copy, and
+** the b-tree pairs are shared out between up to nThread threads, each with
+** its own connections to both files, so that verifying takes about as
+** long as copying.  The schemas are compared with SQL, since the copy
+** changes the root page numbers in sqlite_schema.  The sqlite_stat tables
+** are skipped both there and in the pairing: they hold statistics about
+** the other b-trees, which a copy with stat1 set writes anew.
+*/
+#define SCRUB_DEFRAG_VERIFY_NOSTAT "name NOT LIKE 'sqlite\\_stat%' ESCAPE '\\'"
+#define SCRUB_DEFRAG_VERIFY_THREADS 4     /* Default number of threads */
+#define SCRUB_DEFRAG_MAX_THREAD     64
+
+typedef struct ScrubDefragCursor ScrubDefragCursor;
+typedef struct ScrubDefragPair ScrubDefragPair;
+typedef struct ScrubDefragVerify ScrubDefragVerify;
+
+/* A position in a b-tree, moving through its entries in key order */
+struct ScrubDefragCursor {
+  ScrubDefragState *p;     /* Database read from */
+  ScrubDefragFrame aFrame[SCRUB_DEFRAG_MAX_DEPTH+1];  /* Path from the root */
+  u8 *aPage[SCRUB_DEFRAG_MAX_DEPTH+1];  /* Page buffers, one per level */
+  int nFrame;              /* Number of entries in aFrame[] */
+  u8 *aOvfl;               /* Buffer for overflow pages */
+  int bTable;              /* The current entry is from a table leaf */
+  sqlite3_int64 iRowid;    /* Rowid of the current entry, if bTable */
+  sqlite3_int64 nPayload;  /* Payload size of the current entry */
+  sqlite3_uint64 h;        /* Hash state of the current payload */
+  sqlite3_uint64 w;        /* Bytes not yet mixed into h */
+  int nW;                  /* Number of bytes in w */
+};
+
+/* A source b-tree and its copy in the destination */
+struct ScrubDefragPair {
+  char *zName;             /* Table or index name */
+  u32 iSrcRoot;            /* Root page in the source, or 0 if none */
+  u32 iDestRoot;           /* Root page in the destination, or 0 if none */
+  sqlite3_int64 nEntry;    /* Entries found equal */
+  char *zDiff;             /* First difference, or NULL */
+};
+
+/* State of a verification, shared by its threads */
+struct ScrubDefragVerify {
+  const char *zSrcFile;    /* Source database */
+  const char *zDestFile;   /* Destination database */
+  ScrubDefragPair *aPair;  /* B-trees to compare */
+  int nPair;               /* Number of entries in aPair[] */
+  int iNext;               /* Next entry of aPair[] to hand out */
+  int rcErr;               /* First error of any thread */
+  char *zErr;              /* Its message */
+#if SCRUB_DEFRAG_THREADS
+  pthread_mutex_t mutex;   /* Guards iNext, rcErr and zErr */
+#endif
+};
+
+/* Mix the 8 bytes in w into hash h */
+static sqlite3_uint64 scrubDefragMix(sqlite3_uint64 h, sqlite3_uint64 w){
+  h ^= w*0x87c37b91114253d5ULL;
+  h = (h<<27) | (h>>37);
+  return h*0x4cf5ad432745937fULL + 0x52dce729;
+}
+
+/*
+** Add n bytes of payload to the hash of cursor c.  Whole words are mixed
+** as they come, so the hash does not depend on where the payload is split
+** between the page and the overflow chain.
+*/
+static void scrubDefragHashAdd(ScrubDefragCursor *c, const u8 *a, u32 n){
+  sqlite3_uint64 w;
+  while( n>0 && c->nW>0 ){
+    c->w |= (sqlite3_uint64)*(a++) << (8*c->nW);
+    n--;
+    if( ++c->nW==8 ){
+      c->h = scrubDefragMix(c->h, c->w);
+      c->w = 0;
+      c->nW = 0;
+    }
+  }
+  for(; n>=8; n-=8, a+=8){
+    memcpy(&w, a, 8);
+    c->h = scrubDefragMix(c->h, w);
+  }
+  while( n>0 ){
+    c->w |= (sqlite3_uint64)*(a++) << (8*c->nW++);
+    n--;
+  }
+}
+
+/* Finish the hash of cursor c */
+static sqlite3_uint64 scrubDefragHashEnd(ScrubDefragCursor *c){
+  sqlite3_uint64 h = scrubDefragMix(c->h, c->w) ^ (sqlite3_uint64)c->nPayload;
+  h ^= h>>33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h>>33;
+  return h;
+}
+
+/* Record corruption on page pgno, found at line ln */
+static void scrubDefragCursorCorrupt(ScrubDefragCursor *c, u32 pgno, int ln){
+  scrubDefragErr(c->p, "corruption on page %d of %s (errid=%d)",
+                 pgno, c->p->zSrcFile, ln);
+  c->p->rcErr = SQLITE_CORRUPT;
+}
+
+/* Read b-tree page pgno and push it onto the path of cursor c */
+static void scrubDefragCursorPush(ScrubDefragCursor *c, u32 pgno){
+  ScrubDefragState *p = c->p;
+  ScrubDefragFrame *pFrame;
+  u8 *a, *aTop;
+  u32 szHdr, x;
+
+  if( c->nFrame>SCRUB_DEFRAG_MAX_DEPTH ){
+    scrubDefragErr(p, "corrupt: b-tree too deep at page %d of %s",
+                   pgno, p->zSrcFile);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  if( pgno<1 || pgno>p->nSrcPage || pgno==p->iLock ){
+    scrubDefragErr(p, "corrupt: child page %d of %s out of range",
+                   pgno, p->zSrcFile);
+    p->rcErr = SQLITE_CORRUPT;
+    return;
+  }
+  a = c->aPage[c->nFrame];
+  if( a==0 ){
+    /* A few spare bytes so that a varint at the end of a page stays inside */
+    a = sqlite3_malloc(p->szPage+16);
+    if( a==0 ){
+      p->rcErr = SQLITE_NOMEM;
+      return;
+    }
+    memset(&a[p->szPage], 0, 16);
+    c->aPage[c->nFrame] = a;
+  }
+  if( scrubDefragRead(p, pgno, a)==0 ) return;
+  aTop = &a[pgno==1 ? 100 : 0];
+  if( aTop[0]!=0x02 && aTop[0]!=0x05 && aTop[0]!=0x0a && aTop[0]!=0x0d ){
+    scrubDefragCursorCorrupt(c, pgno, __LINE__);
+    return;
+  }
+  szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
+  pFrame = &c->aFrame[c->nFrame++];
+  memset(pFrame, 0, sizeof(*pFrame));
+  pFrame->a = a;
+  pFrame->pgno = pgno;
+  pFrame->eType = aTop[0];
+  pFrame->nCell = scrubDefragInt16(&aTop[3]);
+  pFrame->iPtr = (u32)(aTop - a) + szHdr;
+  x = scrubDefragInt16(&aTop[5]);
+  if( x==0 ) x = 65536;
+  if( pFrame->iPtr + pFrame->nCell*2 > x || x>p->szUsable ){
+    scrubDefragCursorCorrupt(c, pgno, __LINE__);
+  }
+}
+
+/* Offset of cell pFrame->iCell, or 0 after an error */
+static u32 scrubDefragCursorCell(ScrubDefragCursor *c, ScrubDefragFrame *pFrame){
+  u32 pc = SCRUB_DEFRAG_CELL(&pFrame->a[pFrame->iPtr], pFrame->iCell);
+  if( pc < pFrame->iPtr + pFrame->nCell*2 || pc > c->p->szUsable-4 ){
+    scrubDefragCursorCorrupt(c, pFrame->pgno, __LINE__);
+    return 0;
+  }
+  return pc;
+}
+
+/*
+** Load the entry whose payload-size varint is at offset pc of the page in
+** pFrame into cursor c: rowid, payload size and payload hash, reading the
+** overflow chain if there is one.  Return 1, or 0 after an error.
+*/
+static int scrubDefragCursorEntry(
+  ScrubDefragCursor *c,
+  ScrubDefragFrame *pFrame,
+  u32 pc
+){
+  ScrubDefragState *p = c->p;
+  const u8 *a = pFrame->a;
+  sqlite3_int64 P;
+  u32 X, K, nLocal, iOvfl, nPage = 0;
+
+  pc += scrubDefragVarint(&a[pc], &P);
+  c->bTable = pFrame->eType==0x0d;
+  c->iRowid = 0;
+  if( c->bTable ) pc += scrubDefragVarint(&a[pc], &c->iRowid);
+  if( P<0 || P>0x7fffffff || pc>p->szUsable ){
+    scrubDefragCursorCorrupt(c, pFrame->pgno, __LINE__);
+    return 0;
+  }
+  c->nPayload = P;
+  c->h = 0;
+  c->w = 0;
+  c->nW = 0;
+  X = c->bTable ? p->mxLocalLeaf : p->mxLocal;
+  if( P<=X ){
+    if( pc+P > p->szUsable ){
+      scrubDefragCursorCorrupt(c, pFrame->pgno, __LINE__);
+      return 0;
+    }
+    scrubDefragHashAdd(c, &a[pc], (u32)P);
+    return 1;
+  }
+  K = p->mnLocal + ((P - p->mnLocal)%(p->szUsable-4));
+  nLocal = K<=X ? K : p->mnLocal;
+  if( pc+nLocal+4 > p->szUsable ){
+    scrubDefragCursorCorrupt(c, pFrame->pgno, __LINE__);
+    return 0;
+  }
+  scrubDefragHashAdd(c, &a[pc], nLocal);
+  P -= nLocal;
+  iOvfl = scrubDefragInt32(&a[pc+nLocal]);
+  if( c->aOvfl==0 ){
+    c->aOvfl = scrubDefragAllocPage(p);
+    if( c->aOvfl==0 ) return 0;
+  }
+  while( P>0 ){
+    u32 n = P < p->szUsable-4 ? (u32)P : p->szUsable-4;
+    if( iOvfl<2 || iOvfl>p->nSrcPage || ++nPage>p->nSrcPage ){
+      scrubDefragErr(p, "corrupt: overflow page %d of %s out of range",
+                     iOvfl, p->zSrcFile);
+      p->rcErr = SQLITE_CORRUPT;
+      return 0;
+    }
+    if( scrubDefragRead(p, iOvfl, c->aOvfl)==0 ) return 0;
+    scrubDefragHashAdd(c, &c->aOvfl[4], n);
+    iOvfl = scrubDefragInt32(c->aOvfl);
+    P -= n;
+  }
+  return 1;
+}
+
+/*
+** Move cursor c to the next entry in key order.  Return 1 if there is one,
+** or 0 at the end of the b-tree or after an error.
+*/
+static int scrubDefragCursorNext(ScrubDefragCursor *c){
+  ScrubDefragState *p = c->p;
+  while( p->rcErr==SQLITE_OK && c->nFrame>0 ){
+    ScrubDefragFrame *pFrame = &c->aFrame[c->nFrame-1];
+    u32 pc, iChild;
+    if( pFrame->eType==0x0a || pFrame->eType==0x0d ){
+      if( pFrame->iCell>=pFrame->nCell ){
+        c->nFrame--;
+        continue;
+      }
+      pc = scrubDefragCursorCell(c, pFrame);
+      pFrame->iCell++;
+      return pc && scrubDefragCursorEntry(c, pFrame, pc);
+    }
+    if( pFrame->bDown ){
+      /* Back from the child of cell iCell.  On an index b-tree the cell
+      ** itself is the next entry. */
+      pFrame->bDown = 0;
+      if( pFrame->eType==0x02 && pFrame->iCell<pFrame->nCell ){
+        pc = scrubDefragCursorCell(c, pFrame);
+        pFrame->iCell++;
+        return pc && scrubDefragCursorEntry(c, pFrame, pc+4);
+      }
+      pFrame->iCell++;
+      continue;
+    }
+    if( pFrame->iCell>pFrame->nCell ){
+      c->nFrame--;
+      continue;
+    }
+    if( pFrame->iCell<pFrame->nCell ){
+      pc = scrubDefragCursorCell(c, pFrame);
+      if( pc==0 ) break;
+      iChild = scrubDefragInt32(&pFrame->a[pc]);
+    }else{
+      iChild = scrubDefragInt32(&pFrame->a[pFrame->iPtr-4]);
+    }
+    pFrame->bDown = 1;
+    scrubDefragCursorPush(c, iChild);
+  }
+  return 0;
+}
+
+/* Release the buffers of cursor c */
+static void scrubDefragCursorClose(ScrubDefragCursor *c){
+  int i;
+  for(i=0; i<=SCRUB_DEFRAG_MAX_DEPTH; i++) sqlite3_free(c->aPage[i]);
+  sqlite3_free(c->aOvfl);
+}
+
+/*
+** Compare the b-trees of pPair, in the source through pS and in the
+** destination through pD.  A difference is recorded in pPair->zDiff.
+*/
+static void scrubDefragVerifyPair(
+  ScrubDefragState *pS,
+  ScrubDefragState *pD,
+  ScrubDefragPair *pPair
+){
+  ScrubDefragCursor *aCsr;
+  ScrubDefragCursor *cS, *cD;
+  int bS, bD;
+
+  if( pPair->iSrcRoot==0 || pPair->iDestRoot==0 ){
+    pPair->zDiff = sqlite3_mprintf("missing from the %s",
+                       pPair->iSrcRoot ? "destination" : "source");
+    return;
+  }
+  aCsr = sqlite3_malloc(2*sizeof(ScrubDefragCursor));
+  if( aCsr==0 ){
+    pS->rcErr = SQLITE_NOMEM;
+    return;
+  }
+  memset(aCsr, 0, 2*sizeof(ScrubDefragCursor));
+  cS = &aCsr[0];
+  cD = &aCsr[1];
+  cS->p = pS;
+  cD->p = pD;
+  scrubDefragCursorPush(cS, pPair->iSrcRoot);
+  scrubDefragCursorPush(cD, pPair->iDestRoot);
+  while( pS->rcErr==SQLITE_OK && pD->rcErr==SQLITE_OK ){
+    bS = scrubDefragCursorNext(cS);
+    bD = scrubDefragCursorNext(cD);
+    if( pS->rcErr || pD->rcErr ) break;
+    if( !bS || !bD ){
+      if( bS ){
+        pPair->zDiff = sqlite3_mprintf("the destination ends after %lld "
+                                       "entries", pPair->nEntry);
+      }else if( bD ){
+        pPair->zDiff = sqlite3_mprintf("the source ends after %lld entries",
+                                       pPair->nEntry);
+      }
+      break;
+    }
+    if( cS->bTable!=cD->bTable ){
+      pPair->zDiff = sqlite3_mprintf("entry %lld: a table in one database "
+                                     "and an index in the other",
+                                     pPair->nEntry+1);
+    }else if( cS->iRowid!=cD->iRowid ){
+      pPair->zDiff = sqlite3_mprintf("entry %lld: rowid %lld in the source, "
+                                     "%lld in the destination",
+                                     pPair->nEntry+1, cS->iRowid, cD->iRowid);
+    }else if( cS->nPayload!=cD->nPayload
+           || scrubDefragHashEnd(cS)!=scrubDefragHashEnd(cD)
+    ){
+      if( cS->bTable ){
+        pPair->zDiff = sqlite3_mprintf("entry %lld (rowid %lld): payload "
+                                       "differs", pPair->nEntry+1, cS->iRowid);
+      }else{
+        pPair->zDiff = sqlite3_mprintf("entry %lld: payload differs",
+                                       pPair->nEntry+1);
+      }
+    }
+    if( pPair->zDiff ) break;
+    pPair->nEntry++;
+  }
+  scrubDefragCursorClose(cS);
+  scrubDefragCursorClose(cD);
+  sqlite3_free(aCsr);
+}
+
+/* Open zFile for verification: a read transaction and the page geometry */
+static void scrubDefragVerifyOpen(ScrubDefragState *p, const char *zFile){
+  u8 *a;
+  memset(p, 0, sizeof(*p));
+  p->zSrcFile = zFile;
+  p->eCkpt = SQLITE_CHECKPOINT_PASSIVE;
+  scrubDefragOpenSrc(p);
+  if( p->rcErr ){
+    /* The messages of scrubDefragOpenSrc() speak of the source */
+    char *zErr = p->zErr;
+    p->zErr = 0;
+    scrubDefragErr(p, "%s: %s", zFile, zErr);
+    sqlite3_free(zErr);
+    return;
+  }
+  p->iLock = (1073742335/p->szPage)+1;
+  a = scrubDefragRead(p, 1, 0);
+  if( a==0 ) return;
+  scrubDefragSetUsable(p, a[20]);
+  sqlite3_free(a);
+}
+
+/* Close a database opened by scrubDefragVerifyOpen() */
+static void scrubDefragVerifyClose(ScrubDefragState *p){
+  sqlite3_close(p->dbSrc);
+  sqlite3_free(p->zErr);
+}
+
+/* Hand the error of p, if any, to pV unless it already has one */
+static void scrubDefragVerifyErr(ScrubDefragVerify *pV, ScrubDefragState *p){
+  if( p->rcErr==SQLITE_OK ) return;
+#if SCRUB_DEFRAG_THREADS
+  pthread_mutex_lock(&pV->mutex);
+#endif
+  if( pV->rcErr==SQLITE_OK ){
+    pV->rcErr = p->rcErr;
+    pV->zErr = p->zErr;
+    p->zErr = 0;
+  }
+#if SCRUB_DEFRAG_THREADS
+  pthread_mutex_unlock(&pV->mutex);
+#endif
+}
+
+/* Body of a verification thread: compare b-tree pairs until none is left */
+static void *scrubDefragVerifyThread(void *pArg){
+  ScrubDefragVerify *pV = (ScrubDefragVerify*)pArg;
+  ScrubDefragState s, d;
+  int i;
+
+  scrubDefragVerifyOpen(&s, pV->zSrcFile);
+  scrubDefragVerifyOpen(&d, pV->zDestFile);
+  while( s.rcErr==SQLITE_OK && d.rcErr==SQLITE_OK ){
+#if SCRUB_DEFRAG_THREADS
+    pthread_mutex_lock(&pV->mutex);
+#endif
+    i = pV->rcErr ? pV->nPair : pV->iNext++;
+#if SCRUB_DEFRAG_THREADS
+    pthread_mutex_unlock(&pV->mutex);
+#endif
+    if( i>=pV->nPair ) break;
+    scrubDefragVerifyPair(&s, &d, &pV->aPair[i]);
   }
-  nPrefix = pgno==1 ? 100 : 0;
-  aTop = &a[nPrefix];
-  szHdr = 8 + 4*(aTop[0]==0x02 || aTop[0]==0x05);
-  aCell = aTop + szHdr;
-  nCell = scrubDefragInt16(&aTop[3]);
+  scrubDefragVerifyErr(pV, &s);
+  scrubDefragVerifyErr(pV, &d);
+  scrubDefragVerifyClose(&s);
+  scrubDefragVerifyClose(&d);
+  return 0;
+}
 
-  /* Zero out the gap between the cell index and the start of the
-  ** cell content area */
-  x = scrubDefragInt16(&aTop[5]);  /* First byte of cell content area */
-  if( x>p->szUsable ){ ln=__LINE__; goto btree_corrupt; }
-  y = szHdr + nPrefix + nCell*2;
-  if( y>x ){ ln=__LINE__; goto btree_corrupt; }
-  if( y<x ) memset(a+y, 0, x-y);  /* Zero the gap */
+/*
+** Compare the schemas of pS and pD apart from root page numbers.  Return
+** a description of the first difference, or NULL if there is none.
+*/
+static char *scrubDefragVerifySchema(ScrubDefragState *pS, ScrubDefragState *pD){
+  static const char zSql[] =
+      "SELECT type, name, tbl_name, sql FROM sqlite_schema"
+      " WHERE " SCRUB_DEFRAG_VERIFY_NOSTAT " ORDER BY name";
+  sqlite3_stmt *pStmtS = scrubDefragPrepare(pS, pS->dbSrc, zSql);
+  sqlite3_stmt *pStmtD = scrubDefragPrepare(pD, pD->dbSrc, zSql);
+  char *zDiff = 0;
+  int i;
+  while( pStmtS && pStmtD && zDiff==0 ){
+    int rcS = sqlite3_step(pStmtS);
+    int rcD = sqlite3_step(pStmtD);
+    const char *zS = (const char*)sqlite3_column_text(pStmtS, 1);
+    const char *zD = (const char*)sqlite3_column_text(pStmtD, 1);
+    int c;
+    if( rcS!=SQLITE_ROW && rcD!=SQLITE_ROW ) break;
+    c = rcS!=SQLITE_ROW ? 1 : rcD!=SQLITE_ROW ? -1 : strcmp(zS, zD);
+    if( c ){
+      zDiff = sqlite3_mprintf("sqlite_schema: \"%s\" is only in the %s",
+                              c<0 ? zS : zD, c<0 ? "source" : "destination");
+      break;
+    }
+    for(i=0; i<4; i++){
+      const char *zColS = (const char*)sqlite3_column_text(pStmtS, i);
+      const char *zColD = (const char*)sqlite3_column_text(pStmtD, i);
+      if( (zColS==0)!=(zColD==0) || (zColS && strcmp(zColS, zColD)) ){
+        zDiff = sqlite3_mprintf("sqlite_schema: entry for \"%s\" differs",
+                                zS);
+        break;
+      }
+    }
+  }
+  sqlite3_finalize(pStmtS);
+  sqlite3_finalize(pStmtD);
+  return zDiff;
+}
 
-  /* Zero out all the free blocks */  
-  pc = scrubDefragInt16(&aTop[1]);
-  if( pc>0 && pc<x ){ ln=__LINE__; goto btree_corrupt; }
-  while( pc ){
-    if( pc>(p->szUsable)-4 ){ ln=__LINE__; goto btree_corrupt; }
-    n = scrubDefragInt16(&a[pc+2]);
-    if( pc+n>(p->szUsable) ){ ln=__LINE__; goto btree_corrupt; }
-    if( n>4 ) memset(&a[pc+4], 0, n-4);
-    x = scrubDefragInt16(&a[pc]);
-    if( x<pc+4 && x>0 ){ ln=__LINE__; goto btree_corrupt; }
-    pc = x;
+int sqlite3_scrub_and_defrag_verify(
+  const char *zSrcFile,    /* Source database */
+  const char *zDestFile,   /* Its defragmented copy */
+  int nThread,             /* Threads to use, or <=0 for the default */
+  char **pzReport,         /* OUT: Differences, from sqlite3_malloc() */
+  char **pzErr             /* Write error message here if non-NULL */
+){
+  ScrubDefragVerify v;
+  ScrubDefragState s, d;
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_str *pOut = 0;
+  char *zSchemaDiff = 0;
+  sqlite3_int64 nEntry = 0;
+  int i, nDiff = 0;
+#if SCRUB_DEFRAG_THREADS
+  pthread_t aThread[SCRUB_DEFRAG_MAX_THREAD];
+  int nStarted = 0;
+#endif
+
+  memset(&v, 0, sizeof(v));
+  *pzReport = 0;
+  v.zSrcFile = zSrcFile;
+  v.zDestFile = zDestFile;
+  scrubDefragVerifyOpen(&s, zSrcFile);
+  scrubDefragVerifyOpen(&d, zDestFile);
+  if( s.rcErr || d.rcErr ) goto verify_end;
+  zSchemaDiff = scrubDefragVerifySchema(&s, &d);
+  if( zSchemaDiff ) nDiff++;
+
+  /* Pair the b-trees up by name, merging the two sorted lists */
+  pStmt = scrubDefragPrepare(&s, s.dbSrc,
+      "SELECT name, rootpage FROM sqlite_schema"
+      " WHERE coalesce(rootpage,0)>0 AND " SCRUB_DEFRAG_VERIFY_NOSTAT
+      " ORDER BY name");
+  while( pStmt && sqlite3_step(pStmt)==SQLITE_ROW ){
+    ScrubDefragPair *pPair;
+    if( (v.nPair & 63)==0 ){
+      pPair = sqlite3_realloc64(v.aPair, (v.nPair+64)*sizeof(ScrubDefragPair));
+      if( pPair==0 ){
+        s.rcErr = SQLITE_NOMEM;
+        break;
+      }
+      v.aPair = pPair;
+    }
+    pPair = &v.aPair[v.nPair++];
+    memset(pPair, 0, sizeof(*pPair));
+    pPair->zName = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+    pPair->iSrcRoot = (u32)sqlite3_column_int(pStmt, 1);
+    if( pPair->zName==0 ){
+      s.rcErr = SQLITE_NOMEM;
+      break;
+    }
+  }
+  sqlite3_finalize(pStmt);
+  pStmt = scrubDefragPrepare(&d, d.dbSrc,
+      "SELECT name, rootpage FROM sqlite_schema"
+      " WHERE coalesce(rootpage,0)>0 AND " SCRUB_DEFRAG_VERIFY_NOSTAT
+      " ORDER BY name");
+  i = 0;
+  while( s.rcErr==SQLITE_OK && pStmt && sqlite3_step(pStmt)==SQLITE_ROW ){
+    const char *zName = (const char*)sqlite3_column_text(pStmt, 0);
+    while( i<v.nPair && strcmp(v.aPair[i].zName, zName)<0 ) i++;
+    if( i<v.nPair && strcmp(v.aPair[i].zName, zName)==0 ){
+      v.aPair[i].iDestRoot = (u32)sqlite3_column_int(pStmt, 1);
+    }
+    /* A b-tree only in the destination is reported by the schema check */
   }
+  sqlite3_finalize(pStmt);
+  pStmt = 0;
+  if( s.rcErr || d.rcErr ) goto verify_end;
 
-  /* Walk the tree and process child pages */
-  for(i=0; i<nCell; i++){
-    u32 X, M, K, nLocal;
-    sqlite3_int64 P;
-    pc = scrubDefragInt16(&aCell[i*2]);
-    if( pc <= szHdr ){ ln=__LINE__; goto btree_corrupt; }
-    if( pc > p->szUsable-3 ){ ln=__LINE__; goto btree_corrupt; }
-    if( aTop[0]==0x05 || aTop[0]==0x02 ){
-      if( pc+4 > p->szUsable ){ ln=__LINE__; goto btree_corrupt; }
-      iChild = scrubDefragInt32(&a[pc]);
-      assert(iChild); 
-      scrubDefragIncDestPageNo(p);
-      scrubDefragWriteInt32(&a[pc], p->iDestPageNo);
-      pc += 4;
-      scrubDefragBtree(p, iChild, iDepth+1, 0);
-      if( aTop[0]==0x05 ) continue;
+  if( nThread<=0 ) nThread = SCRUB_DEFRAG_VERIFY_THREADS;
+  if( nThread>SCRUB_DEFRAG_MAX_THREAD ) nThread = SCRUB_DEFRAG_MAX_THREAD;
+  if( nThread>v.nPair ) nThread = v.nPair;
+#if SCRUB_DEFRAG_THREADS
+  pthread_mutex_init(&v.mutex, 0);
+  for(i=1; i<nThread; i++){
+    if( pthread_create(&aThread[nStarted], 0, scrubDefragVerifyThread, &v) ){
+      break;
     }
-    pc += scrubDefragVarint(&a[pc], &P);
-    if( pc >= p->szUsable ){ ln=__LINE__; goto btree_corrupt; }
-    if( aTop[0]==0x0d ){
-      X = p->szUsable - 35;
+    nStarted++;
+  }
+#endif
+  scrubDefragVerifyThread(&v);
+#if SCRUB_DEFRAG_THREADS
+  for(i=0; i<nStarted; i++) pthread_join(aThread[i], 0);
+  pthread_mutex_destroy(&v.mutex);
+#endif
+  if( v.rcErr ) goto verify_end;
+
+  /* Report the differences */
+  pOut = sqlite3_str_new(0);
+  if( zSchemaDiff ) sqlite3_str_appendf(pOut, "%s\n", zSchemaDiff);
+  for(i=0; i<v.nPair; i++){
+    nEntry += v.aPair[i].nEntry;
+    if( v.aPair[i].zDiff ){
+      sqlite3_str_appendf(pOut, "%s: %s\n", v.aPair[i].zName, v.aPair[i].zDiff);
+      nDiff++;
+    }
+  }
+  sqlite3_str_appendf(pOut, "%d b-trees, %lld entries compared, %d differ\n",
+                      v.nPair, nEntry, nDiff);
+  v.rcErr = sqlite3_str_errcode(pOut);
+  *pzReport = sqlite3_str_finish(pOut);
+  if( v.rcErr==SQLITE_OK && nDiff ){
+    v.rcErr = SQLITE_MISMATCH;
+    v.zErr = sqlite3_mprintf("the destination differs from the source");
+  }
+
+verify_end:
+  if( v.rcErr==SQLITE_OK ){
+    /* An error opening either file or reading the schemas */
+    ScrubDefragState *pErr = s.rcErr ? &s : &d;
+    v.rcErr = pErr->rcErr;
+    v.zErr = pErr->zErr;
+    pErr->zErr = 0;
+  }
+  for(i=0; i<v.nPair; i++){
+    sqlite3_free(v.aPair[i].zName);
+    sqlite3_free(v.aPair[i].zDiff);
+  }
+  sqlite3_free(v.aPair);
+  sqlite3_free(zSchemaDiff);
+  scrubDefragVerifyClose(&s);
+  scrubDefragVerifyClose(&d);
+  if( pzErr ){
+    *pzErr = v.zErr;
+  }else{
+    sqlite3_free(v.zErr);
+  }
+  return v.rcErr;
+}
+
+#if SCRUB_DEFRAG_DAEMON
+/*
+** Daemon mode.  sqlite3_scrub_and_defrag_daemon() listens on a Unix domain
+** socket and runs the copy jobs it is sent on a fixed set of worker
+** threads, so that a service defragmenting many databases pays for
+** process start-up and thread creation once.  Requests and replies are
+** JSON objects, one per line:
+**
+**   {"op":"copy","src":S,"dest":D[,"strict":1][,"cksum":1][,"salvage":1]
+**    [,"objects":1][,"stat1":1]}
+**   {"op":"status"[,"id":N]}
+**   {"op":"cancel","id":N}
+**   {"op":"shutdown"}
+**
+** Each worker runs its jobs on one context from
+** sqlite3_scrub_and_defrag_create(), so buffers are reused from job to job.
+** The progress callback of a job checks whether it has been cancelled and,
+** every SCRUB_DEFRAG_DAEMON_STEP bytes, refreshes the stats that "status"
+** reports.  All jobs draw on one pair of rate limit buckets, so
+** --read-limit and --write-limit bound the daemon as a whole.  Connections
+** are served one at a time on the calling thread.
+*/
+#define SCRUB_DEFRAG_DAEMON_WORKERS 4      /* Default number of workers */
+#define SCRUB_DEFRAG_DAEMON_STEP    (4<<20) /* Bytes copied between updates */
+#define SCRUB_DEFRAG_DAEMON_PROGRESS 16    /* Pages between cancel checks */
+#define SCRUB_DEFRAG_DAEMON_KEEP    1024   /* Finished jobs remembered */
+#define SCRUB_DEFRAG_DAEMON_LINE    8192   /* Longest request */
+#define SCRUB_DEFRAG_DAEMON_TIMEOUT 5      /* Seconds a client may stall */
+
+#define SCRUB_DEFRAG_JOB_QUEUED     0
+#define SCRUB_DEFRAG_JOB_RUNNING    1
+#define SCRUB_DEFRAG_JOB_DONE       2
+#define SCRUB_DEFRAG_JOB_FAILED     3
+#define SCRUB_DEFRAG_JOB_CANCELLED  4
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+typedef struct ScrubDefragJob ScrubDefragJob;
+typedef struct ScrubDefragDaemon ScrubDefragDaemon;
+
+/* One copy job.  Fields below eState are guarded by the daemon mutex. */
+struct ScrubDefragJob {
+  sqlite3_int64 iId;       /* Job number, from 1 */
+  char *zSrc;              /* Source database */
+  char *zDest;             /* Destination database */
+  int bStrict;             /* Options of the job */
+  int bCksum;
+  int bSalvage;
+  int bObjects;
+  int bStat1;
+  int eState;              /* SCRUB_DEFRAG_JOB_* */
+  int bCancel;             /* Set by a "cancel" request */
+  int rc;                  /* Result once finished */
+  char *zErr;              /* Error message, or NULL */
+  char *zStats;            /* Latest sqlite3_scrub_and_defrag_stats() */
+  sqlite3_int64 tQueued;   /* Clock times in us, or 0 if not yet */
+  sqlite3_int64 tStart;
+  sqlite3_int64 tEnd;
+  ScrubDefragJob *pNext;   /* Next job in order of id */
+};
+
+struct ScrubDefragDaemon {
+  pthread_mutex_t mutex;   /* Guards everything below but "shared" */
+  pthread_cond_t cond;     /* Signalled when a job is queued and on stop */
+  ScrubDefragJob *pFirst;  /* Jobs queued, running and remembered */
+  ScrubDefragJob *pLast;   /* Last job in the list */
+  sqlite3_int64 iNextId;   /* Id of the next job */
+  int nWorker;             /* Worker threads */
+  int nFinished;           /* Finished jobs in the list */
+  int bStop;               /* Workers exit once no job is queued */
+  ScrubDefragShared shared;  /* Rate limits of all jobs */
+};
+
+static const char *scrubDefragJobState(int eState){
+  static const char *azState[] = {
+    "queued", "running", "done", "failed", "cancelled"
+  };
+  return azState[eState];
+}
+
+static void scrubDefragJobFree(ScrubDefragJob *pJob){
+  sqlite3_free(pJob->zSrc);
+  sqlite3_free(pJob->zDest);
+  sqlite3_free(pJob->zErr);
+  sqlite3_free(pJob->zStats);
+  sqlite3_free(pJob);
+}
+
+/* Forget the oldest finished jobs beyond SCRUB_DEFRAG_DAEMON_KEEP */
+static void scrubDefragDaemonPrune(ScrubDefragDaemon *pD){
+  ScrubDefragJob **pp = &pD->pFirst;
+  ScrubDefragJob *pPrev = 0;
+  while( pD->nFinished>SCRUB_DEFRAG_DAEMON_KEEP && *pp ){
+    ScrubDefragJob *pJob = *pp;
+    if( pJob->eState>=SCRUB_DEFRAG_JOB_DONE ){
+      *pp = pJob->pNext;
+      if( pD->pLast==pJob ) pD->pLast = pPrev;
+      scrubDefragJobFree(pJob);
+      pD->nFinished--;
     }else{
-      X = ((p->szUsable - 12)*64/255) - 23;
+      pPrev = pJob;
+      pp = &pJob->pNext;
     }
-    if( P<=X ){
-      /* All content is local.  No overflow */
+  }
+}
+
+/* A job on a worker thread, as seen by scrubDefragJobProgress() */
+typedef struct ScrubDefragWorker ScrubDefragWorker;
+struct ScrubDefragWorker {
+  ScrubDefragDaemon *pD;   /* The daemon */
+  ScrubDefragJob *pJob;    /* The job running */
+  sqlite3_defrag *p;       /* Context of this thread, kept from job to job */
+  sqlite3_int64 nLast;     /* Bytes written at the last stats refresh */
+};
+
+/*
+** Progress callback of a job: refresh its stats every
+** SCRUB_DEFRAG_DAEMON_STEP bytes and stop it if it has been cancelled.
+*/
+static int scrubDefragJobProgress(
+  void *pArg,
+  unsigned nDone,
+  unsigned nTotal,
+  sqlite3_int64 nRead,
+  sqlite3_int64 nWrite,
+  const char *zBtree
+){
+  ScrubDefragWorker *pW = (ScrubDefragWorker*)pArg;
+  char *zStats = 0;
+  int bCancel;
+  (void)nDone; (void)nTotal; (void)nRead; (void)zBtree;
+  if( nWrite-pW->nLast>=SCRUB_DEFRAG_DAEMON_STEP ){
+    pW->nLast = nWrite;
+    zStats = sqlite3_scrub_and_defrag_stats(pW->p);
+  }
+  pthread_mutex_lock(&pW->pD->mutex);
+  if( zStats ){
+    sqlite3_free(pW->pJob->zStats);
+    pW->pJob->zStats = zStats;
+  }
+  bCancel = pW->pJob->bCancel;
+  pthread_mutex_unlock(&pW->pD->mutex);
+  return bCancel;
+}
+
+/* Run job pJob on the calling worker thread */
+static void scrubDefragDaemonRun(ScrubDefragWorker *pW, ScrubDefragJob *pJob){
+  ScrubDefragDaemon *pD = pW->pD;
+  sqlite3_defrag_options opt;
+  char *zStats;
+  char *zErr = 0;
+  int rc;
+
+  memset(&opt, 0, sizeof(opt));
+  opt.nStep = SCRUB_DEFRAG_DAEMON_PROGRESS;
+  opt.xProgress = scrubDefragJobProgress;
+  opt.pProgressArg = pW;
+  opt.bStrict = pJob->bStrict;
+  opt.bCksum = pJob->bCksum;
+  opt.bSalvage = pJob->bSalvage;
+  opt.bObjects = pJob->bObjects;
+  opt.bStat1 = pJob->bStat1;
+  opt.bTimers = 1;
+  pW->pJob = pJob;
+  pW->nLast = 0;
+  rc = sqlite3_scrub_and_defrag_run(pW->p, pJob->zSrc, pJob->zDest, &opt,
+                                    &zErr);
+  zStats = sqlite3_scrub_and_defrag_stats(pW->p);
+
+  pthread_mutex_lock(&pD->mutex);
+  if( zStats ){
+    sqlite3_free(pJob->zStats);
+    pJob->zStats = zStats;
+  }
+  pJob->tEnd = scrubDefragClock();
+  if( rc==SQLITE_ABORT && pJob->bCancel ){
+    sqlite3_free(zErr);
+    pJob->eState = SCRUB_DEFRAG_JOB_CANCELLED;
+  }else{
+    pJob->rc = rc;
+    pJob->zErr = zErr;
+    pJob->eState = rc ? SCRUB_DEFRAG_JOB_FAILED : SCRUB_DEFRAG_JOB_DONE;
+  }
+  pthread_mutex_unlock(&pD->mutex);
+}
+
+/* Worker thread: run queued jobs, oldest first, until told to stop */
+static void *scrubDefragDaemonThread(void *pArg){
+  ScrubDefragDaemon *pD = (ScrubDefragDaemon*)pArg;
+  ScrubDefragWorker w;
+  memset(&w, 0, sizeof(w));
+  w.pD = pD;
+  w.p = sqlite3_scrub_and_defrag_create();
+  if( w.p ) w.p->pShared = &pD->shared;
+  pthread_mutex_lock(&pD->mutex);
+  for(;;){
+    ScrubDefragJob *pJob = pD->pFirst;
+    while( pJob && pJob->eState!=SCRUB_DEFRAG_JOB_QUEUED ) pJob = pJob->pNext;
+    if( pJob==0 ){
+      if( pD->bStop ) break;
+      pthread_cond_wait(&pD->cond, &pD->mutex);
       continue;
     }
-    M = ((p->szUsable - 12)*32/255)-23;
-    K = M + ((P-M)%(p->szUsable-4));
-    if( aTop[0]==0x0d ){
-      pc += scrubDefragVarintSize(&a[pc]);
-      if( pc > (p->szUsable-4) ){ ln=__LINE__; goto btree_corrupt; }
+    pJob->eState = SCRUB_DEFRAG_JOB_RUNNING;
+    pJob->tStart = scrubDefragClock();
+    pthread_mutex_unlock(&pD->mutex);
+    if( w.p ) scrubDefragDaemonRun(&w, pJob);
+    pthread_mutex_lock(&pD->mutex);
+    if( w.p==0 ){
+      pJob->rc = SQLITE_NOMEM;
+      pJob->eState = SCRUB_DEFRAG_JOB_FAILED;
+      pJob->tEnd = scrubDefragClock();
     }
-    nLocal = K<=X ? K : M;
-    if( pc+nLocal > p->szUsable-4 ){ ln=__LINE__; goto btree_corrupt; }
-    iChild = scrubDefragInt32(&a[pc+nLocal]);
-    assert(iChild); 
-    scrubDefragIncDestPageNo(p);
-    scrubDefragWriteInt32(&a[pc+nLocal], p->iDestPageNo);
-    scrubDefragOverflow(p, iChild, P-nLocal);
+    pD->nFinished++;
+    scrubDefragDaemonPrune(pD);
   }
+  pthread_mutex_unlock(&pD->mutex);
+  sqlite3_scrub_and_defrag_destroy(w.p);
+  return 0;
+}
 
-  /* Walk the right-most tree */
-  if( aTop[0]==0x05 || aTop[0]==0x02 ){
-    iChild = scrubDefragInt32(&aTop[8]);
-    scrubDefragIncDestPageNo(p);
-    scrubDefragWriteInt32(&aTop[8], p->iDestPageNo);
-    scrubDefragBtree(p, iChild, iDepth+1, 0);
+/* Append the status of pJob to pOut.  The caller holds the mutex. */
+static void scrubDefragJobJson(sqlite3_str *pOut, ScrubDefragJob *pJob,
+                               int bFull){
+  sqlite3_int64 tNow = scrubDefragClock();
+  sqlite3_str_appendf(pOut, "{\"id\":%lld,\"state\":\"%s\",\"src\":",
+                      pJob->iId, scrubDefragJobState(pJob->eState));
+  scrubDefragJsonString(pOut, pJob->zSrc);
+  sqlite3_str_appendall(pOut, ",\"dest\":");
+  scrubDefragJsonString(pOut, pJob->zDest);
+  if( !bFull ){
+    sqlite3_str_appendall(pOut, "}");
+    return;
   }
-  if(bRoot) {
-      scrubDefragIncDestPageNo(p);
+  sqlite3_str_appendf(pOut, ",\"wait_us\":%lld,\"run_us\":%lld",
+      (pJob->tStart ? pJob->tStart : pJob->tEnd ? pJob->tEnd : tNow)
+        - pJob->tQueued,
+      pJob->tStart ? (pJob->tEnd ? pJob->tEnd : tNow) - pJob->tStart : 0);
+  if( pJob->eState>=SCRUB_DEFRAG_JOB_DONE ){
+    sqlite3_str_appendf(pOut, ",\"rc\":%d", pJob->rc);
+  }
+  if( pJob->zErr || pJob->rc ){
+    sqlite3_str_appendall(pOut, ",\"error\":");
+    scrubDefragJsonString(pOut,
+        pJob->zErr ? pJob->zErr : sqlite3_errstr(pJob->rc));
   }
+  if( pJob->zStats ){
+    sqlite3_str_appendf(pOut, ",\"stats\":%s", pJob->zStats);
+  }
+  sqlite3_str_appendall(pOut, "}");
+}
 
-  /* Write this one page */
-  scrubDefragWrite(p, iCurrentPageNo, a);
+/*
+** Carry out the request in zLine, parsing it with the JSON functions of
+** db, and append the reply to pOut.
+*/
+static void scrubDefragDaemonRequest(
+  ScrubDefragDaemon *pD,
+  sqlite3 *db,
+  const char *zLine,
+  sqlite3_str *pOut
+){
+  sqlite3_stmt *pStmt = 0;
+  const char *zOp;
+  const char *zSrc, *zDest;
+  ScrubDefragJob *pJob;
+  sqlite3_int64 iId;
+  int bId;
 
-  /* All done */
-  if( pgno>1 ) sqlite3_free(a);
-  return;
+  if( sqlite3_prepare_v2(db,
+        "SELECT json_extract(?1,'$.op'), json_extract(?1,'$.src'),"
+        "       json_extract(?1,'$.dest'), json_extract(?1,'$.strict'),"
+        "       json_extract(?1,'$.cksum'), json_extract(?1,'$.salvage'),"
+        "       json_extract(?1,'$.id'), json_extract(?1,'$.objects'),"
+        "       json_extract(?1,'$.stat1')",
+        -1, &pStmt, 0)
+  ){
+    sqlite3_str_appendall(pOut, "{\"error\":");
+    scrubDefragJsonString(pOut, sqlite3_errmsg(db));
+    sqlite3_str_appendall(pOut, "}");
+    return;
+  }
+  sqlite3_bind_text(pStmt, 1, zLine, -1, SQLITE_STATIC);
+  if( sqlite3_step(pStmt)!=SQLITE_ROW ){
+    sqlite3_str_appendall(pOut, "{\"error\":");
+    scrubDefragJsonString(pOut, sqlite3_errmsg(db));
+    sqlite3_str_appendall(pOut, "}");
+    sqlite3_finalize(pStmt);
+    return;
+  }
+  zOp = (const char*)sqlite3_column_text(pStmt, 0);
+  zSrc = (const char*)sqlite3_column_text(pStmt, 1);
+  zDest = (const char*)sqlite3_column_text(pStmt, 2);
+  bId = sqlite3_column_type(pStmt, 6)!=SQLITE_NULL;
+  iId = sqlite3_column_int64(pStmt, 6);
+  if( zOp==0 ) zOp = "";
 
-btree_corrupt:
-  scrubDefragErr(p, "corruption on page %d of source database (errid=%d)",
-                 pgno, ln);
-  if( pgno>1 ) sqlite3_free(a);  
+  pthread_mutex_lock(&pD->mutex);
+  pJob = 0;
+  if( bId ){
+    for(pJob=pD->pFirst; pJob && pJob->iId!=iId; pJob=pJob->pNext);
+  }
+  if( strcmp(zOp, "copy")==0 ){
+    if( zSrc==0 || zDest==0 ){
+      sqlite3_str_appendall(pOut, "{\"error\":\"copy needs src and dest\"}");
+    }else if( pD->bStop ){
+      sqlite3_str_appendall(pOut, "{\"error\":\"shutting down\"}");
+    }else if( (pJob = sqlite3_malloc(sizeof(*pJob)))==0 ){
+      sqlite3_str_appendall(pOut, "{\"error\":\"out of memory\"}");
+    }else{
+      memset(pJob, 0, sizeof(*pJob));
+      pJob->zSrc = sqlite3_mprintf("%s", zSrc);
+      pJob->zDest = sqlite3_mprintf("%s", zDest);
+      if( pJob->zSrc==0 || pJob->zDest==0 ){
+        scrubDefragJobFree(pJob);
+        sqlite3_str_appendall(pOut, "{\"error\":\"out of memory\"}");
+      }else{
+        pJob->iId = ++pD->iNextId;
+        pJob->bStrict = sqlite3_column_int(pStmt, 3);
+        pJob->bCksum = sqlite3_column_int(pStmt, 4);
+        pJob->bSalvage = sqlite3_column_int(pStmt, 5);
+        pJob->bObjects = sqlite3_column_int(pStmt, 7);
+        pJob->bStat1 = sqlite3_column_int(pStmt, 8);
+        pJob->tQueued = scrubDefragClock();
+        if( pD->pLast ){
+          pD->pLast->pNext = pJob;
+        }else{
+          pD->pFirst = pJob;
+        }
+        pD->pLast = pJob;
+        pthread_cond_signal(&pD->cond);
+        scrubDefragJobJson(pOut, pJob, 0);
+      }
+    }
+  }else if( strcmp(zOp, "status")==0 && !bId ){
+    int nQueued = 0, nRunning = 0;
+    for(pJob=pD->pFirst; pJob; pJob=pJob->pNext){
+      if( pJob->eState==SCRUB_DEFRAG_JOB_QUEUED ) nQueued++;
+      if( pJob->eState==SCRUB_DEFRAG_JOB_RUNNING ) nRunning++;
+    }
+    sqlite3_str_appendf(pOut,
+        "{\"workers\":%d,\"queued\":%d,\"running\":%d,\"finished\":%d"
+        ",\"jobs\":[", pD->nWorker, nQueued, nRunning, pD->nFinished);
+    for(pJob=pD->pFirst; pJob; pJob=pJob->pNext){
+      if( pJob!=pD->pFirst ) sqlite3_str_appendall(pOut, ",");
+      scrubDefragJobJson(pOut, pJob, 0);
+    }
+    sqlite3_str_appendall(pOut, "]}");
+  }else if( strcmp(zOp, "status")==0 || strcmp(zOp, "cancel")==0 ){
+    if( pJob==0 ){
+      sqlite3_str_appendall(pOut, "{\"error\":\"no such job\"}");
+    }else{
+      if( zOp[0]=='c' ){
+        if( pJob->eState==SCRUB_DEFRAG_JOB_QUEUED ){
+          pJob->eState = SCRUB_DEFRAG_JOB_CANCELLED;
+          pJob->tEnd = scrubDefragClock();
+          pD->nFinished++;
+        }else{
+          pJob->bCancel = 1;
+        }
+      }
+      scrubDefragJobJson(pOut, pJob, 1);
+    }
+  }else if( strcmp(zOp, "shutdown")==0 ){
+    /* Queued jobs are cancelled; running ones are left to finish */
+    for(pJob=pD->pFirst; pJob; pJob=pJob->pNext){
+      if( pJob->eState==SCRUB_DEFRAG_JOB_QUEUED ){
+        pJob->eState = SCRUB_DEFRAG_JOB_CANCELLED;
+        pJob->tEnd = scrubDefragClock();
+        pD->nFinished++;
+      }
+    }
+    pD->bStop = 1;
+    pthread_cond_broadcast(&pD->cond);
+    sqlite3_str_appendall(pOut, "{\"state\":\"stopping\"}");
+  }else{
+    sqlite3_str_appendall(pOut, "{\"error\":\"unknown op\"}");
+  }
+  pthread_mutex_unlock(&pD->mutex);
+  sqlite3_finalize(pStmt);
 }
 
-int sqlite3_scrub_and_defrag(
-  const char *zSrcFile,    /* Source file */
-  const char *zDestFile,   /* Destination file */
-  char **pzErr             /* Write error here if non-NULL */
-){
-  ScrubDefragState s;
-  u32 n, i;
-  sqlite3_stmt *pStmt;
-  char* errmsg=0;
-  char* zSql = sqlite3_mprintf("%s","BEGIN EXCLUSIVE;\nPRAGMA writable_schema=on;");
+/* Write all n bytes of z to socket fd.  Return non-zero on error. */
+static int scrubDefragSend(int fd, const char *z, sqlite3_int64 n){
+  while( n>0 ){
+    ssize_t nDone = send(fd, z, (size_t)n, MSG_NOSIGNAL);
+    if( nDone<0 && errno==EINTR ) continue;
+    if( nDone<=0 ) return 1;
+    z += nDone;
+    n -= nDone;
+  }
+  return 0;
+}
 
-  memset(&s, 0, sizeof(s));
-  s.zSrcFile = zSrcFile;
-  s.zDestFile = zDestFile;
-  s.iDestPageNo = 1;
+/* Read requests from client fd and answer each in turn until EOF */
+static void scrubDefragDaemonServe(ScrubDefragDaemon *pD, sqlite3 *db, int fd){
+  char aBuf[SCRUB_DEFRAG_DAEMON_LINE];
+  int nBuf = 0;
+  struct timeval tv;
 
-  /* Open both source and destination databases */
-  scrubDefragOpenSrc(&s);
-  scrubDefragOpenDest(&s);
-  if (s.rcErr) goto scrub_abort;
+  tv.tv_sec = SCRUB_DEFRAG_DAEMON_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+  {
+    int bOn = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &bOn, sizeof(bOn));
+  }
+#endif
+  for(;;){
+    char *zEol;
+    ssize_t n;
+    while( (zEol = memchr(aBuf, '\n', nBuf))!=0 ){
+      sqlite3_str *pOut = sqlite3_str_new(0);
+      char *zReply;
+      int nLine = (int)(zEol - aBuf);
+      int rc;
+      *zEol = 0;
+      if( nLine>0 ) scrubDefragDaemonRequest(pD, db, aBuf, pOut);
+      nBuf -= nLine+1;
+      memmove(aBuf, zEol+1, nBuf);
+      if( nLine==0 ) continue;
+      sqlite3_str_appendchar(pOut, 1, '\n');
+      n = sqlite3_str_length(pOut);
+      zReply = sqlite3_str_finish(pOut);
+      rc = zReply ? scrubDefragSend(fd, zReply, n) : 1;
+      sqlite3_free(zReply);
+      if( rc ) return;
+    }
+    if( nBuf==(int)sizeof(aBuf) ){
+      const char zTooLong[] = "{\"error\":\"request too long\"}\n";
+      scrubDefragSend(fd, zTooLong, sizeof(zTooLong)-1);
+      return;
+    }
+    n = recv(fd, &aBuf[nBuf], sizeof(aBuf) - nBuf, 0);
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) return;
+    nBuf += (int)n;
+  }
+}
 
-  s.iLock = (1073742335/s.szPage)+1;
-  /* Read in page 1 */
-  s.page1 = scrubDefragRead(&s, 1, 0);
-  if( s.page1==0 ) goto scrub_abort;
+/*
+** Serve jobs on Unix domain socket zSocket with nWorker threads until a
+** "shutdown" request.  Return once the jobs that were running then have
+** finished.
+*/
+int sqlite3_scrub_and_defrag_daemon(
+  const char *zSocket,     /* Path of the socket to create */
+  int nWorker,             /* Worker threads, or <=0 for the default */
+  char **pzErr             /* Write error message here if non-NULL */
+){
+  ScrubDefragDaemon d;
+  pthread_t aThread[SCRUB_DEFRAG_MAX_THREAD];
+  struct sockaddr_un addr;
+  sqlite3 *db = 0;
+  char *zErr = 0;
+  int rc = SQLITE_OK;
+  int fd = -1;
+  int i;
 
-  s.nDestPage = s.nSrcPage - s.nFreePage;
-  if(s.nSrcPage >= s.iLock && s.nDestPage < s.iLock){
-    s.nDestPage--; 
+  memset(&d, 0, sizeof(d));
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if( strlen(zSocket)>=sizeof(addr.sun_path) ){
+    rc = SQLITE_CANTOPEN;
+    zErr = sqlite3_mprintf("socket path too long: %s", zSocket);
+    goto daemon_end;
+  }
+  memcpy(addr.sun_path, zSocket, strlen(zSocket)+1);
+  rc = sqlite3_open(":memory:", &db);
+  if( rc ){
+    zErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    goto daemon_end;
   }
-  scrubDefragWriteInt32(&s.page1[28], s.nDestPage);
-  /* First freelist trunk page */
-  scrubDefragWriteInt32(&s.page1[32], 0);
-  /* freelist count */
-  scrubDefragWriteInt32(&s.page1[36], 0);
-  /* autovacuum */
-  scrubDefragWriteInt32(&s.page1[52], 0);
 
-  s.szUsable = s.szPage - s.page1[20];
+  /* A socket file left by a daemon that has gone is removed; one that
+  ** still answers belongs to a live daemon */
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if( fd>=0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr))==0 ){
+    close(fd);
+    fd = -1;
+    rc = SQLITE_BUSY;
+    zErr = sqlite3_mprintf("a daemon is already listening on %s", zSocket);
+    goto daemon_end;
+  }
+  if( fd>=0 ) close(fd);
+  unlink(zSocket);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if( fd>=0 ){
+    /* Jobs run with the daemon's rights, so only its owner may connect */
+    mode_t mask = umask(077);
+    if( bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 64) ){
+      close(fd);
+      fd = -1;
+    }
+    umask(mask);
+  }
+  if( fd<0 ){
+    rc = SQLITE_CANTOPEN;
+    zErr = sqlite3_mprintf("cannot listen on %s: %s", zSocket,
+                           strerror(errno));
+    goto daemon_end;
+  }
 
-  /* Copy all of the btrees */
-  scrubDefragBtree(&s, 1, 0, 1);
-  pStmt = scrubDefragPrepare(&s, s.dbSrc,
-      "SELECT rootpage,name,type FROM sqlite_master WHERE coalesce(rootpage,0)>0"
-      "   ORDER BY CASE type WHEN 'table' THEN 2 "
-      "                      WHEN 'index' THEN 1 "
-      "                      ELSE 0 END, rootpage");
-  if( pStmt==0 ) goto scrub_abort;
-  while( sqlite3_step(pStmt)==SQLITE_ROW ){
-    i = (u32)sqlite3_column_int(pStmt, 0);
-    zSql = sqlite3_mprintf("%z\nUPDATE SQLITE_MASTER SET rootpage=%d "
-                           "  WHERE rootpage=%d AND name=%Q AND type=%Q;",
-                           zSql, 
-                           s.iDestPageNo, 
-                           sqlite3_column_int(pStmt, 0),
-                           sqlite3_column_text(pStmt, 1), 
-                           sqlite3_column_text(pStmt, 2));
-    scrubDefragBtree(&s, i, 0, 1);
-  }
-  s.rcErr = sqlite3_finalize(pStmt);
-  if( s.rcErr ) goto scrub_abort;
-
-  zSql = sqlite3_mprintf("%z\nCOMMIT;\nPRAGMA writable_schema=off;", zSql);
-  if(zSql == 0){
-     s.rcErr = SQLITE_NOMEM;
-  }else{
-    sqlite3_close(s.dbDest);
-    /* reopen the destination database and update the root pages */
-    s.rcErr = sqlite3_open_v2(s.zDestFile, &s.dbDest, 
-                     SQLITE_OPEN_READWRITE |
-                     SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
-    if( s.rcErr ){ 
-      scrubDefragErr(&s, "Error occurred while reopen destination database:%s",
-                         sqlite3_errmsg(s.dbDest));
-    }else if( s.rcErr = sqlite3_exec(s.dbDest, zSql, 0, 0, &errmsg) ){
-        scrubDefragErr(&s, "Error occurred while update root page: %z",errmsg);
+  if( nWorker<=0 ) nWorker = SCRUB_DEFRAG_DAEMON_WORKERS;
+  if( nWorker>SCRUB_DEFRAG_MAX_THREAD ) nWorker = SCRUB_DEFRAG_MAX_THREAD;
+  pthread_mutex_init(&d.mutex, 0);
+  pthread_mutex_init(&d.shared.mutex, 0);
+  pthread_cond_init(&d.cond, 0);
+  for(i=0; i<nWorker; i++){
+    if( pthread_create(&aThread[d.nWorker], 0, scrubDefragDaemonThread, &d) ){
+      break;
     }
+    d.nWorker++;
   }
-  sqlite3_free(zSql);
+  if( d.nWorker==0 ){
+    rc = SQLITE_ERROR;
+    zErr = sqlite3_mprintf("cannot start worker threads");
+    d.bStop = 1;
+  }
+  while( !d.bStop ){
+    int fdClient = accept(fd, 0, 0);
+    if( fdClient<0 ){
+      if( errno==EINTR || errno==ECONNABORTED ) continue;
+      rc = SQLITE_IOERR;
+      zErr = sqlite3_mprintf("accept() failed: %s", strerror(errno));
+      pthread_mutex_lock(&d.mutex);
+      d.bStop = 1;
+      pthread_cond_broadcast(&d.cond);
+      pthread_mutex_unlock(&d.mutex);
+      break;
+    }
+    scrubDefragDaemonServe(&d, db, fdClient);
+    close(fdClient);
+  }
+  close(fd);
+  unlink(zSocket);
+  for(i=0; i<d.nWorker; i++) pthread_join(aThread[i], 0);
+  while( d.pFirst ){
+    ScrubDefragJob *pJob = d.pFirst;
+    d.pFirst = pJob->pNext;
+    scrubDefragJobFree(pJob);
+  }
+  pthread_cond_destroy(&d.cond);
+  pthread_mutex_destroy(&d.shared.mutex);
+  pthread_mutex_destroy(&d.mutex);
 
-scrub_abort:    
-  /* Close the destination database without closing the transaction. If we
-  ** commit, page zero will be overwritten. */
-  sqlite3_close(s.dbDest);
-  /* But do close out the read-transaction on the source database */
-  sqlite3_exec(s.dbSrc, "COMMIT;", 0, 0, 0);
-  sqlite3_close(s.dbSrc);
-  sqlite3_free(s.page1);
+daemon_end:
+  sqlite3_close(db);
   if( pzErr ){
-    *pzErr = s.zErr;
+    *pzErr = zErr;
+  }else{
+    sqlite3_free(zErr);
+  }
+  return rc;
+}
+#endif /* SCRUB_DEFRAG_DAEMON */
+
+/*
+** Implementation of the SQL function scrub_defrag(DEST [, OPTIONS]).
+** OPTIONS is a JSON object with optional members "schema", "strict",
+** "cksum", "salvage", "objects" and "stat1".  The result is the JSON text of
+** sqlite3_scrub_and_defrag_stats(), which reports what salvage dropped.
+*/
+static void scrubDefragSqlFunc(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  sqlite3 *db = sqlite3_context_db_handle(ctx);
+  const char *zDest = (const char*)sqlite3_value_text(argv[0]);
+  sqlite3_defrag_options opt;
+  ScrubDefragState s;
+  sqlite3 *dbDest = 0;
+  char *zSchema = 0;
+  char *zJson = 0;
+
+  memset(&s, 0, sizeof(s));
+  memset(&opt, 0, sizeof(opt));
+  opt.bTimers = 1;          /* The result is the stats */
+  if( zDest==0 ){
+    sqlite3_result_error(ctx, "scrub_defrag(): no destination file", -1);
+    return;
+  }
+  if( argc>1 && sqlite3_value_type(argv[1])!=SQLITE_NULL ){
+    sqlite3_stmt *pStmt = scrubDefragPrepare(&s, db,
+        "SELECT json_extract(?1,'$.schema'), json_extract(?1,'$.strict'),"
+        "       json_extract(?1,'$.cksum'), json_extract(?1,'$.salvage'),"
+        "       json_extract(?1,'$.objects'), json_extract(?1,'$.stat1')");
+    if( pStmt ){
+      sqlite3_bind_value(pStmt, 1, argv[1]);
+      if( sqlite3_step(pStmt)==SQLITE_ROW ){
+        if( sqlite3_column_type(pStmt, 0)!=SQLITE_NULL ){
+          zSchema = sqlite3_mprintf("%s", sqlite3_column_text(pStmt, 0));
+          if( zSchema==0 ) s.rcErr = SQLITE_NOMEM;
+        }
+        opt.bStrict = sqlite3_column_int(pStmt, 1);
+        opt.bCksum = sqlite3_column_int(pStmt, 2);
+        opt.bSalvage = sqlite3_column_int(pStmt, 3);
+        opt.bObjects = sqlite3_column_int(pStmt, 4);
+        opt.bStat1 = sqlite3_column_int(pStmt, 5);
+      }
+      if( sqlite3_finalize(pStmt) && s.rcErr==SQLITE_OK ){
+        scrubDefragErr(&s, "scrub_defrag(): bad options: %s",
+                       sqlite3_errmsg(db));
+      }
+    }
+  }
+  if( s.rcErr==SQLITE_OK ){
+    s.rcErr = sqlite3_open_v2(zDest, &dbDest,
+                   SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                   SQLITE_OPEN_URI | SQLITE_OPEN_PRIVATECACHE, 0);
+    if( s.rcErr ){
+      scrubDefragErr(&s, "cannot open destination database: %s",
+                     sqlite3_errmsg(dbDest));
+    }else{
+      scrubDefragCopyDb(&s, db, zSchema, dbDest, &opt);
+    }
+  }
+  if( s.rcErr==SQLITE_OK ){
+    zJson = sqlite3_scrub_and_defrag_stats(&s);
+    if( zJson==0 ) s.rcErr = SQLITE_NOMEM;
+  }
+  scrubDefragCopyClose(&s);
+  sqlite3_close(dbDest);
+  sqlite3_free(zSchema);
+  if( s.rcErr==SQLITE_OK ){
+    sqlite3_result_text(ctx, zJson, -1, sqlite3_free);
   }else{
+    if( s.rcErr==SQLITE_NOMEM ){
+      sqlite3_result_error_nomem(ctx);
+    }else{
+      sqlite3_result_error(ctx, s.zErr ? s.zErr : sqlite3_errstr(s.rcErr), -1);
+      sqlite3_result_error_code(ctx, s.rcErr);
+    }
     sqlite3_free(s.zErr);
   }
-  return s.rcErr;
-}   
+}
+
+/*
+** Register scrub_defrag() on connection db.  This is the entry point when
+** built with -DSCRUB_DEFRAG_EXTENSION as a loadable extension; otherwise
+** it can be passed to sqlite3_auto_extension().
+*/
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_defrag_init(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+){
+  int rc = SQLITE_OK;
+  int nArg;
+#ifdef SCRUB_DEFRAG_EXTENSION
+  SQLITE_EXTENSION_INIT2(pApi);
+#else
+  (void)pApi;
+#endif
+  (void)pzErrMsg;
+  for(nArg=1; nArg<=2 && rc==SQLITE_OK; nArg++){
+    rc = sqlite3_create_function(db, "scrub_defrag", nArg,
+                                 SQLITE_UTF8 | SQLITE_DIRECTONLY, 0,
+                                 scrubDefragSqlFunc, 0, 0);
+  }
+  return rc;
+}
 
 #ifdef DEFRAG_STANDALONE
 /* Error and warning log */
@@ -596,25 +8398,270 @@ static void errorLogCallback(void *pNotUsed, int iErr, const char *zMsg){
   fprintf(stderr, "%s: %s\n", zType, zMsg);
 }
 
+#ifdef SIGHUP
+/* SIGHUP makes a running defrag re-read its --limit-file */
+static void reloadLimitsOnSignal(int sig){
+  (void)sig;
+  sqlite3_scrub_and_defrag_reload_limits();
+}
+#endif
+
+/* Progress callback for --progress: one status line on stderr */
+static int progressCallback(
+  void *pArg,
+  unsigned nDone,
+  unsigned nTotal,
+  sqlite3_int64 nRead,
+  sqlite3_int64 nWrite,
+  const char *zBtree
+){
+  (void)pArg;
+  fprintf(stderr, "\r%u/%u pages (%d%%), %lld MB read, %lld MB written: %-24.24s",
+          nDone, nTotal, nTotal ? (int)(nDone*100.0/nTotal) : 100,
+          nRead>>20, nWrite>>20, zBtree ? zBtree : "");
+  if( nDone==nTotal ) fprintf(stderr, "\n");
+  return 0;
+}
+
+#if SCRUB_DEFRAG_DAEMON
+/* --request: send one request to the daemon on zSocket, print the reply */
+static int sendRequest(const char *zSocket, const char *zRequest){
+  struct sockaddr_un addr;
+  char zBuf[4096];
+  ssize_t n;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, zSocket, sizeof(addr.sun_path)-1);
+  if( fd<0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) ){
+    return 1;
+  }
+  if( scrubDefragSend(fd, zRequest, strlen(zRequest))
+   || scrubDefragSend(fd, "\n", 1)
+  ){
+    close(fd);
+    return 1;
+  }
+  shutdown(fd, SHUT_WR);
+  while( (n = recv(fd, zBuf, sizeof(zBuf), 0))>0 ){
+    fwrite(zBuf, 1, (size_t)n, stdout);
+  }
+  close(fd);
+  return n<0;
+}
+#endif
+
+/* Print the usage message and exit */
+static void usage(const char *zApp){
+  fprintf(stderr,
+    "Usage: %s [OPTIONS] SOURCE DESTINATION\n"
+    "       %s [OPTIONS] --in-place DATABASE\n"
+    "       %s [OPTIONS] --compact DATABASE [MAXPAGES [MAXMS]]\n"
+    "       %s [OPTIONS] --analyze DATABASE [SAMPLE-PERCENT]\n"
+    "       %s [OPTIONS] --verify SOURCE DESTINATION [THREADS]\n"
+    "       %s [OPTIONS] --daemon SOCKET [WORKERS]\n"
+    "       %s --request SOCKET JSON\n"
+    "Options:\n"
+    "  --read-limit N     Read at most N bytes per second\n"
+    "  --write-limit N    Write at most N bytes per second\n"
+    "  --limit-file FILE  Take limits from FILE (\"read=N write=N\"),\n"
+    "                     re-read every second and on SIGHUP\n"
+    "  --idle             Use the idle I/O scheduling class (Linux)\n"
+    "  --progress         Report progress on stderr (copy only)\n"
+    "  --stats            Print counters and timers as JSON (copy only)\n"
+    "  --strict           Check the b-tree structure while copying\n"
+    "  --cksum            Check and rewrite checksum VFS page checksums\n"
+    "  --salvage          Drop corrupt subtrees and report them (copy only)\n"
+    "  --objects          Add figures for each table and index to --stats\n"
+    "  --stat1            Write sqlite_stat1 (and sqlite_stat4) to the copy\n",
+    zApp, zApp, zApp, zApp, zApp, zApp, zApp);
+  exit(1);
+}
+
 /* The main() routine when this utility is run as a stand-alone program */
 int main(int argc, char **argv){
+  const char *zApp = argv[0];
   char *zErr = 0;
   int rc;
-  if( argc!=3 ){
-    fprintf(stderr,"Usage: %s SOURCE DESTINATION\n", argv[0]);
+  int bCompact, bAnalyze, bVerify, bDaemon;
+  sqlite3_int64 nRead = -1, nWrite = -1;
+  int bProgress = 0;
+  int bStats = 0;
+  int bStrict = 0;
+  int bCksum = 0;
+  int bSalvage = 0;
+  int bObjects = 0;
+  int bStat1 = 0;
+  int bLost = 0;
+
+  /* Options shared by all modes come first */
+  while( argc>1 && strncmp(argv[1], "--", 2)==0 ){
+    if( strcmp(argv[1], "--idle")==0 ){
+      if( sqlite3_scrub_and_defrag_idle_io() ){
+        fprintf(stderr, "%s: cannot set the idle I/O class\n", zApp);
+      }
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--progress")==0 ){
+      bProgress = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--stats")==0 ){
+      bStats = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--strict")==0 ){
+      bStrict = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--cksum")==0 ){
+      bCksum = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--salvage")==0 ){
+      bSalvage = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--objects")==0 ){
+      bObjects = bStats = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( strcmp(argv[1], "--stat1")==0 ){
+      bStat1 = 1;
+      argv++;
+      argc--;
+      continue;
+    }
+    if( argc<3 ) break;
+    if( strcmp(argv[1], "--read-limit")==0 ){
+      nRead = atoll(argv[2]);
+    }else if( strcmp(argv[1], "--write-limit")==0 ){
+      nWrite = atoll(argv[2]);
+    }else if( strcmp(argv[1], "--limit-file")==0 ){
+      if( sqlite3_scrub_and_defrag_limit_file(argv[2]) ){
+        fprintf(stderr, "%s: cannot read %s\n", zApp, argv[2]);
+        exit(1);
+      }
+#ifdef SIGHUP
+      signal(SIGHUP, reloadLimitsOnSignal);
+#endif
+    }else{
+      break;
+    }
+    argv += 2;
+    argc -= 2;
+  }
+  if( nRead>=0 || nWrite>=0 ){
+    sqlite3_scrub_and_defrag_set_limits(nRead>0 ? nRead : 0,
+                                        nWrite>0 ? nWrite : 0);
+  }
+
+  bCompact = argc>=3 && argc<=5 && strcmp(argv[1], "--compact")==0;
+  bAnalyze = argc>=3 && argc<=4 && strcmp(argv[1], "--analyze")==0;
+  bVerify = argc>=4 && argc<=5 && strcmp(argv[1], "--verify")==0;
+  bDaemon = argc>=3 && argc<=4 && strcmp(argv[1], "--daemon")==0;
+#if SCRUB_DEFRAG_DAEMON
+  if( argc==4 && strcmp(argv[1], "--request")==0 ){
+    if( sendRequest(argv[2], argv[3]) ){
+      fprintf(stderr, "%s: no daemon answering on %s\n", zApp, argv[2]);
+      exit(1);
+    }
+    return 0;
+  }
+#else
+  if( bDaemon ){
+    fprintf(stderr, "%s: built without daemon support\n", zApp);
     exit(1);
   }
+#endif
+  if( argc!=3 && !bCompact && !bAnalyze && !bVerify && !bDaemon ){
+    usage(zApp);
+  }
   sqlite3_config(SQLITE_CONFIG_LOG, errorLogCallback, 0);
-  rc = sqlite3_scrub_and_defrag(argv[1], argv[2], &zErr);
+  if( bDaemon ){
+#if SCRUB_DEFRAG_DAEMON
+    rc = sqlite3_scrub_and_defrag_daemon(argv[2],
+             argc>3 ? atoi(argv[3]) : 0, &zErr);
+#endif
+  }else if( bVerify ){
+    char *zReport = 0;
+    rc = sqlite3_scrub_and_defrag_verify(argv[2], argv[3],
+             argc>4 ? atoi(argv[4]) : 0, &zReport, &zErr);
+    if( zReport ) fputs(zReport, stdout);
+    sqlite3_free(zReport);
+  }else if( bAnalyze ){
+    char *zReport = 0;
+    rc = sqlite3_scrub_and_defrag_analyze(argv[2],
+             argc>3 ? atoi(argv[3]) : 0, &zReport, &zErr);
+    if( zReport ) fputs(zReport, stdout);
+    sqlite3_free(zReport);
+  }else if( bCompact ){
+    rc = sqlite3_scrub_and_defrag_compact(argv[2],
+             argc>3 ? atoi(argv[3]) : 0, argc>4 ? atoi(argv[4]) : 0, &zErr);
+  }else if( strcmp(argv[1], "--in-place")==0 ){
+    rc = sqlite3_scrub_and_defrag_inplace(argv[2], &zErr);
+  }else{
+    sqlite3_defrag *pDefrag = sqlite3_scrub_and_defrag_init(argv[1], argv[2]);
+    rc = SQLITE_NOMEM;
+    if( pDefrag ){
+      if( bProgress ){
+        sqlite3_scrub_and_defrag_progress(pDefrag, 0, progressCallback, 0);
+      }
+      if( bStrict ) sqlite3_scrub_and_defrag_strict(pDefrag, 1);
+      if( bSalvage ) sqlite3_scrub_and_defrag_salvage(pDefrag, 1);
+      if( bObjects ) sqlite3_scrub_and_defrag_objects(pDefrag, 1);
+      if( bStat1 ) sqlite3_scrub_and_defrag_stat1(pDefrag, 1);
+      if( bStats ) sqlite3_scrub_and_defrag_timers(pDefrag, 1);
+      if( bCksum
+       && sqlite3_scrub_and_defrag_cksum(pDefrag, 1)==SQLITE_MISMATCH
+      ){
+        fprintf(stderr, "%s: %s does not reserve 8 bytes per page\n",
+                zApp, argv[1]);
+        exit(1);
+      }
+      rc = sqlite3_scrub_and_defrag_step(pDefrag, -1);
+      if( bStats && rc==SQLITE_DONE ){
+        char *zJson = sqlite3_scrub_and_defrag_stats(pDefrag);
+        if( zJson ) printf("%s\n", zJson);
+        sqlite3_free(zJson);
+      }
+      if( bSalvage ){
+        char *zReport = sqlite3_scrub_and_defrag_salvage_report(pDefrag);
+        if( zReport ){
+          fputs(zReport, stderr);
+          bLost = 1;
+        }
+        sqlite3_free(zReport);
+      }
+      rc = sqlite3_scrub_and_defrag_finish(pDefrag, &zErr);
+    }
+  }
   if( rc==SQLITE_NOMEM ){
-    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    fprintf(stderr, "%s: out of memory\n", zApp);
     exit(1);
   }
   if( zErr ){
-    fprintf(stderr, "%s: %s\n", argv[0], zErr);
+    fprintf(stderr, "%s: %s\n", zApp, zErr);
     sqlite3_free(zErr);
     exit(1);
   }
-  return 0;
+  /* A compaction that stopped on its budget exits with 2, a salvaged copy
+  ** that lost pages with 3 */
+  if( bLost ) return 3;
+  return bCompact && rc==SQLITE_OK ? 2 : 0;
 }
 #endif
@@ -0,0 +1,792 @@
+/*
+** 2026-10-16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+******************************************************************************
+**
+** Benchmark for sqlite3_scrub_and_defrag() against VACUUM, VACUUM INTO and
+** the backup API.  Build it next to defrag.c:
+**
+**      gcc defragbench.c -lsqlite3 -O2 -o defragbench
+**      ./defragbench [OPTIONS] > results.csv
+**
+** For every combination of the options below a source database is
+** generated (or reused, if a file of the same name is already in DIR) from
+** a fixed seed, so that runs on different builds see identical input.
+** Each method is then timed on it, with the page cache of the input dropped
+** first (cold) or the input read once beforehand (warm).  The time of every
+** method includes an fsync() of its output, since sqlite3_scrub_and_defrag()
+** does not sync and VACUUM does.  One CSV row is written per run.
+**
+**   --dir DIR              Where databases are kept (default ".")
+**   --sizes MB,...         Source sizes in MiB (default 10)
+**   --page-sizes N,...     Page sizes, or "all" for 512..65536 (default 4096)
+**   --frag PCT,...         Share of rows inserted in random key order (50)
+**   --free PCT,...         Share of rows deleted, in runs of 64 keys (20)
+**   --shapes S,...         mixed, rowid, blob, norowid, indexed (mixed)
+**   --methods M,...        defrag, vacuum, vacuum_into, backup (all)
+**   --cache C,...          cold, warm (both)
+**   --reps N               Runs per method (default 3)
+**   --seed N               Generator seed (default 1)
+**   --queries              Benchmark queries on the outputs instead
+**   --lookups N            Queries per range/point/index batch (1000)
+**
+** With --queries nothing is timed while building: the source is copied by
+** sqlite3_scrub_and_defrag() and by VACUUM INTO, then a full scan, range
+** scans of 100 keys, point lookups by key and lookups through an index
+** (where the schema has one) are run on the source and on both copies.
+** Each batch starts with the file dropped from the page cache and prints
+** latency percentiles, SQLite page cache misses and, where /proc/self/io
+** exists, bytes read from storage.
+**
+** Dropping the cache of a single file uses posix_fadvise(), which needs
+** no privileges but only exists on some systems; elsewhere cold runs are
+** skipped with a warning, and --queries, whose batches are all cold, fails.
+*/
+#include "defrag.c"
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <unistd.h>
+#endif
+
+/* Longest comma-separated list accepted by an option */
+#define BENCH_MAX_LIST 16
+
+/* Rows per delete run, so that --free releases whole pages */
+#define BENCH_FREE_RUN 64
+
+/* Rows inserted into each table per transaction */
+#define BENCH_BATCH 100
+
+/* A list of values given to an option */
+typedef struct BenchList BenchList;
+struct BenchList {
+  int n;
+  const char *az[BENCH_MAX_LIST];
+};
+
+/* One generated source database */
+typedef struct BenchSpec BenchSpec;
+struct BenchSpec {
+  int nMB;                 /* Target size in MiB before deletes */
+  int szPage;              /* Page size */
+  int nFrag;               /* Percent of rows with random keys */
+  int nFree;               /* Percent of rows deleted */
+  const char *zShape;      /* Schema, see benchSchema() */
+  unsigned long long iSeed;/* Generator state */
+};
+
+/* xorshift64*: small, fast and the same everywhere */
+static unsigned long long benchRandom(BenchSpec *pSpec){
+  unsigned long long x = pSpec->iSeed;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  pSpec->iSeed = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Fill a[0..n-1] with generator output */
+static void benchFill(BenchSpec *pSpec, unsigned char *a, int n){
+  int i;
+  for(i=0; i<n; i++) a[i] = (unsigned char)(benchRandom(pSpec)>>56);
+}
+
+/* Split a comma-separated option value into p.  The text is modified. */
+static void benchSplit(BenchList *p, char *z){
+  p->n = 0;
+  while( z && *z && p->n<BENCH_MAX_LIST ){
+    char *zEnd = strchr(z, ',');
+    p->az[p->n++] = z;
+    if( zEnd==0 ) break;
+    *zEnd = 0;
+    z = zEnd+1;
+  }
+}
+
+/* Abort the benchmark with an error message */
+static void benchFatal(const char *zFormat, ...){
+  va_list ap;
+  va_start(ap, zFormat);
+  fprintf(stderr, "defragbench: ");
+  vfprintf(stderr, zFormat, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+/* Run SQL that must succeed */
+static void benchExec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  if( sqlite3_exec(db, zSql, 0, 0, &zErr) ){
+    benchFatal("%s: %s", zSql, zErr);
+  }
+}
+
+/* Size of file zFile in bytes, or -1 if it does not exist */
+static sqlite3_int64 benchFileSize(const char *zFile){
+  struct stat st;
+  if( stat(zFile, &st) ) return -1;
+  return (sqlite3_int64)st.st_size;
+}
+
+/* Flush zFile to disk */
+static void benchSync(const char *zFile){
+#ifndef _WIN32
+  int fd = open(zFile, O_RDONLY);
+  if( fd>=0 ){
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+/*
+** Put zFile in the requested cache state: read it once if bWarm, else
+** drop it from the page cache.  Return non-zero if that is not possible.
+*/
+static int benchCache(const char *zFile, int bWarm){
+  if( bWarm ){
+    char aBuf[65536];
+    FILE *in = fopen(zFile, "rb");
+    if( in==0 ) return 1;
+    while( fread(aBuf, 1, sizeof(aBuf), in)>0 ){}
+    fclose(in);
+    return 0;
+  }
+#if defined(POSIX_FADV_DONTNEED) && !defined(_WIN32)
+  {
+    int fd = open(zFile, O_RDONLY);
+    int rc;
+    if( fd<0 ) return 1;
+    fsync(fd);
+    rc = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return rc!=0;
+  }
+#else
+  return 1;
+#endif
+}
+
+/* Copy file zFrom to zTo */
+static void benchCopyFile(const char *zFrom, const char *zTo){
+  char aBuf[65536];
+  size_t n;
+  FILE *in = fopen(zFrom, "rb");
+  FILE *out = fopen(zTo, "wb");
+  if( in==0 || out==0 ) benchFatal("cannot copy %s to %s", zFrom, zTo);
+  while( (n = fread(aBuf, 1, sizeof(aBuf), in))>0 ){
+    if( fwrite(aBuf, 1, n, out)!=n ) benchFatal("cannot write %s", zTo);
+  }
+  fclose(in);
+  fclose(out);
+}
+
+/*
+** The schema of each shape.  Every table has an insertion sequence column
+** n, which the delete pass uses, and a key k that is either the next in
+** order or random, depending on --frag.
+*/
+static const char *benchSchema(const char *zShape){
+  static const char zRowid[] =
+    "CREATE TABLE t(k INTEGER PRIMARY KEY, n INT, a INT, b TEXT);"
+    "CREATE INDEX t_a ON t(a);";
+  static const char zBlob[] =
+    "CREATE TABLE b(k INTEGER PRIMARY KEY, n INT, v BLOB);";
+  static const char zNorowid[] =
+    "CREATE TABLE w(k TEXT PRIMARY KEY, n INT, v BLOB) WITHOUT ROWID;";
+  static const char zIndexed[] =
+    "CREATE TABLE x(k INTEGER PRIMARY KEY, n INT, c1, c2, c3, c4, c5, c6, "
+    "               c7, c8);"
+    "CREATE INDEX x1 ON x(c1); CREATE INDEX x2 ON x(c2);"
+    "CREATE INDEX x3 ON x(c3); CREATE INDEX x4 ON x(c4);"
+    "CREATE INDEX x5 ON x(c5); CREATE INDEX x6 ON x(c6);"
+    "CREATE INDEX x7 ON x(c7); CREATE INDEX x8 ON x(c8, c1);";
+  static const char zMixed[] =
+    "CREATE TABLE t(k INTEGER PRIMARY KEY, n INT, a INT, b TEXT);"
+    "CREATE INDEX t_a ON t(a);"
+    "CREATE TABLE b(k INTEGER PRIMARY KEY, n INT, v BLOB);"
+    "CREATE TABLE w(k TEXT PRIMARY KEY, n INT, v BLOB) WITHOUT ROWID;"
+    "CREATE TABLE x(k INTEGER PRIMARY KEY, n INT, c1, c2, c3, c4, c5, c6, "
+    "               c7, c8);"
+    "CREATE INDEX x1 ON x(c1); CREATE INDEX x2 ON x(c2);"
+    "CREATE INDEX x3 ON x(c3); CREATE INDEX x4 ON x(c4);";
+  if( strcmp(zShape, "rowid")==0 ) return zRowid;
+  if( strcmp(zShape, "blob")==0 ) return zBlob;
+  if( strcmp(zShape, "norowid")==0 ) return zNorowid;
+  if( strcmp(zShape, "indexed")==0 ) return zIndexed;
+  if( strcmp(zShape, "mixed")==0 ) return zMixed;
+  return 0;
+}
+
+/* Next key: in order, or above all in-order keys at random */
+static sqlite3_int64 benchKey(BenchSpec *pSpec, sqlite3_int64 n){
+  if( (int)(benchRandom(pSpec)%100) < pSpec->nFrag ){
+    return ((sqlite3_int64)1<<40) + (sqlite3_int64)(benchRandom(pSpec)>>24);
+  }
+  return n;
+}
+
+/* Insert row n into table zTab of the current shape using pStmt */
+static void benchRow(
+  BenchSpec *pSpec,
+  sqlite3_stmt *pStmt,
+  const char *zTab,
+  sqlite3_int64 n,
+  unsigned char *aBuf
+){
+  sqlite3_int64 k = benchKey(pSpec, n);
+  int i, nByte;
+  sqlite3_reset(pStmt);
+  sqlite3_bind_int64(pStmt, 2, n);
+  switch( zTab[0] ){
+    case 't':
+      sqlite3_bind_int64(pStmt, 1, k);
+      sqlite3_bind_int64(pStmt, 3, (sqlite3_int64)benchRandom(pSpec)>>1);
+      nByte = 50 + (int)(benchRandom(pSpec)%150);
+      for(i=0; i<nByte; i++) aBuf[i] = 'a' + (int)(benchRandom(pSpec)%26);
+      sqlite3_bind_text(pStmt, 4, (char*)aBuf, nByte, SQLITE_TRANSIENT);
+      break;
+    case 'b':
+      /* One to four pages of payload, so most rows overflow */
+      sqlite3_bind_int64(pStmt, 1, k);
+      nByte = pSpec->szPage + (int)(benchRandom(pSpec)%(3*pSpec->szPage));
+      benchFill(pSpec, aBuf, nByte);
+      sqlite3_bind_blob(pStmt, 3, aBuf, nByte, SQLITE_TRANSIENT);
+      break;
+    case 'w': {
+      char zKey[24];
+      sqlite3_snprintf(sizeof(zKey), zKey, "%016llx", k);
+      sqlite3_bind_text(pStmt, 1, zKey, -1, SQLITE_TRANSIENT);
+      nByte = 20 + (int)(benchRandom(pSpec)%200);
+      benchFill(pSpec, aBuf, nByte);
+      sqlite3_bind_blob(pStmt, 3, aBuf, nByte, SQLITE_TRANSIENT);
+      break;
+    }
+    default:
+      sqlite3_bind_int64(pStmt, 1, k);
+      for(i=3; i<=10; i++){
+        sqlite3_bind_int64(pStmt, i, (sqlite3_int64)(benchRandom(pSpec)>>40));
+      }
+      break;
+  }
+  sqlite3_step(pStmt);
+}
+
+/* True if db has a table named zName */
+static int benchHasTable(sqlite3 *db, const char *zName){
+  sqlite3_stmt *pStmt = 0;
+  int bHave;
+  char *zSql = sqlite3_mprintf(
+      "SELECT 1 FROM sqlite_schema WHERE type='table' AND name=%Q", zName);
+  sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  bHave = sqlite3_step(pStmt)==SQLITE_ROW;
+  sqlite3_finalize(pStmt);
+  return bHave;
+}
+
+/* Generate the source database described by pSpec in file zFile */
+static void benchGenerate(BenchSpec *pSpec, const char *zFile){
+  static const struct { const char *zTab; const char *zSql; } aIns[] = {
+    { "t", "INSERT OR IGNORE INTO t VALUES(?1,?2,?3,?4)" },
+    { "b", "INSERT OR IGNORE INTO b VALUES(?1,?2,?3)" },
+    { "w", "INSERT OR IGNORE INTO w VALUES(?1,?2,?3)" },
+    { "x", "INSERT OR IGNORE INTO x VALUES(?1,?2,?3,?4,?5,?6,?7,?8,?9,?10)" },
+  };
+  sqlite3 *db;
+  sqlite3_stmt *apStmt[4];
+  const char *azTab[4];
+  unsigned char *aBuf;
+  sqlite3_int64 nTarget = (sqlite3_int64)pSpec->nMB<<20;
+  sqlite3_int64 n = 0;
+  char *zSql;
+  int i, j, nStmt = 0;
+
+  unlink(zFile);
+  if( sqlite3_open(zFile, &db) ) benchFatal("cannot create %s", zFile);
+  zSql = sqlite3_mprintf("PRAGMA page_size=%d; PRAGMA auto_vacuum=0;"
+                         "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;",
+                         pSpec->szPage);
+  benchExec(db, zSql);
+  sqlite3_free(zSql);
+  benchExec(db, benchSchema(pSpec->zShape));
+  for(i=0; i<4; i++){
+    if( !benchHasTable(db, aIns[i].zTab) ) continue;
+    if( sqlite3_prepare_v2(db, aIns[i].zSql, -1, &apStmt[nStmt], 0) ){
+      benchFatal("%s", sqlite3_errmsg(db));
+    }
+    azTab[nStmt++] = aIns[i].zTab;
+  }
+  aBuf = sqlite3_malloc(4*65536);
+  if( aBuf==0 ) benchFatal("out of memory");
+
+  /* Fill the tables round-robin, so their pages interleave in the file */
+  while( benchFileSize(zFile)<nTarget ){
+    benchExec(db, "BEGIN");
+    for(i=0; i<BENCH_BATCH; i++, n++){
+      for(j=0; j<nStmt; j++) benchRow(pSpec, apStmt[j], azTab[j], n, aBuf);
+    }
+    benchExec(db, "COMMIT");
+  }
+  for(j=0; j<nStmt; j++) sqlite3_finalize(apStmt[j]);
+  sqlite3_free(aBuf);
+
+  /* Delete runs of BENCH_FREE_RUN rows to make freelist pages.  Multiplying
+  ** the run number by 37 (coprime to 100) scatters the deleted runs. */
+  if( pSpec->nFree>0 ){
+    benchExec(db, "BEGIN");
+    for(j=0; j<nStmt; j++){
+      zSql = sqlite3_mprintf("DELETE FROM %s WHERE (n/%d*37)%%100 < %d",
+                             azTab[j], BENCH_FREE_RUN, pSpec->nFree);
+      benchExec(db, zSql);
+      sqlite3_free(zSql);
+    }
+    benchExec(db, "COMMIT");
+  }
+  sqlite3_close(db);
+}
+
+/* Page count and freelist count of database zFile */
+static void benchPages(const char *zFile, int *pnPage, int *pnFree){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt = 0;
+  *pnPage = *pnFree = 0;
+  if( sqlite3_open_v2(zFile, &db, SQLITE_OPEN_READONLY, 0)==SQLITE_OK
+   && sqlite3_prepare_v2(db, "SELECT (SELECT page_count FROM pragma_page_count),"
+                             " (SELECT freelist_count FROM pragma_freelist_count)",
+                         -1, &pStmt, 0)==SQLITE_OK
+   && sqlite3_step(pStmt)==SQLITE_ROW
+  ){
+    *pnPage = sqlite3_column_int(pStmt, 0);
+    *pnFree = sqlite3_column_int(pStmt, 1);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+}
+
+/*
+** Run method zMethod on zSrc, writing zOut, and return the elapsed time in
+** microseconds including an fsync() of the output.  VACUUM works on a
+** copy of the source made beforehand (zOut), which is not timed.
+*/
+static sqlite3_int64 benchRun(
+  const char *zMethod,
+  const char *zSrc,
+  const char *zOut,
+  int bWarm
+){
+  sqlite3_int64 t0;
+  sqlite3 *db = 0, *dbOut = 0;
+  char *zErr = 0;
+  char *zSql;
+  int rc = SQLITE_OK;
+
+  unlink(zOut);
+  if( strcmp(zMethod, "vacuum")==0 ){
+    benchCopyFile(zSrc, zOut);
+    zSrc = zOut;
+  }
+  if( benchCache(zSrc, bWarm) ) return -1;
+  t0 = scrubDefragClock();
+  if( strcmp(zMethod, "defrag")==0 ){
+    rc = sqlite3_scrub_and_defrag(zSrc, zOut, &zErr);
+  }else if( strcmp(zMethod, "vacuum")==0 ){
+    rc = sqlite3_open(zSrc, &db);
+    if( rc==SQLITE_OK ) rc = sqlite3_exec(db, "VACUUM", 0, 0, &zErr);
+  }else if( strcmp(zMethod, "vacuum_into")==0 ){
+    rc = sqlite3_open(zSrc, &db);
+    zSql = sqlite3_mprintf("VACUUM INTO %Q", zOut);
+    if( rc==SQLITE_OK ) rc = sqlite3_exec(db, zSql, 0, 0, &zErr);
+    sqlite3_free(zSql);
+  }else if( strcmp(zMethod, "backup")==0 ){
+    sqlite3_backup *pBackup;
+    rc = sqlite3_open(zSrc, &db);
+    if( rc==SQLITE_OK ) rc = sqlite3_open(zOut, &dbOut);
+    if( rc==SQLITE_OK ){
+      pBackup = sqlite3_backup_init(dbOut, "main", db, "main");
+      if( pBackup ){
+        sqlite3_backup_step(pBackup, -1);
+        sqlite3_backup_finish(pBackup);
+      }
+      rc = sqlite3_errcode(dbOut);
+    }
+  }else{
+    benchFatal("unknown method: %s", zMethod);
+  }
+  sqlite3_close(db);
+  sqlite3_close(dbOut);
+  benchSync(zOut);
+  if( rc ) benchFatal("%s failed on %s: %s", zMethod, zSrc, zErr ? zErr : "");
+  return scrubDefragClock() - t0;
+}
+
+/*
+** Query mode.  The same queries run against the source, the output of
+** sqlite3_scrub_and_defrag() and the output of VACUUM INTO, each batch
+** starting with the file dropped from the page cache.  Keys for lookups
+** are sampled from the source beforehand, so every file sees the same
+** query stream.
+*/
+#define BENCH_MAX_SAMPLE 100000   /* Keys kept for lookups */
+#define BENCH_RANGE      100      /* Keys covered by one range scan */
+
+/* Keys sampled from the table under test */
+typedef struct BenchKeys BenchKeys;
+struct BenchKeys {
+  const char *zTab;        /* Table queried: t, x, w or b */
+  const char *zIdx;        /* Indexed column of zTab, or NULL */
+  const char *zCol;        /* Column summed by scans */
+  int nKey;                /* Number of entries in aKey[] and aIdx[] */
+  sqlite3_int64 *aKey;     /* Sampled primary keys */
+  sqlite3_int64 *aIdx;     /* zIdx value of the same rows */
+  sqlite3_int64 mnKey;     /* Smallest in-order key */
+  sqlite3_int64 mxKey;     /* Largest in-order key */
+};
+
+/* Bytes read from storage by this process so far, or -1 if unknown */
+static sqlite3_int64 benchReadBytes(void){
+  char zLine[128];
+  sqlite3_int64 n = -1;
+  FILE *in = fopen("/proc/self/io", "rb");
+  if( in==0 ) return -1;
+  while( fgets(zLine, sizeof(zLine), in) ){
+    if( sscanf(zLine, "read_bytes: %lld", &n)==1 ) break;
+  }
+  fclose(in);
+  return n;
+}
+
+/* Pick the table to query and sample keys from it, reservoir style */
+static void benchSampleKeys(BenchSpec *pSpec, const char *zSrc, BenchKeys *pK){
+  static const struct { const char *zTab, *zIdx, *zCol; } aTab[] = {
+    { "t", "a", "b" }, { "x", "c1", "c8" }, { "w", 0, "v" }, { "b", 0, "v" },
+  };
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  sqlite3_int64 nSeen = 0;
+  char *zSql;
+  int i;
+
+  memset(pK, 0, sizeof(*pK));
+  if( sqlite3_open_v2(zSrc, &db, SQLITE_OPEN_READONLY, 0) ){
+    benchFatal("cannot open %s", zSrc);
+  }
+  for(i=0; i<4 && !benchHasTable(db, aTab[i].zTab); i++){}
+  if( i==4 ) benchFatal("no table to query in %s", zSrc);
+  pK->zTab = aTab[i].zTab;
+  pK->zIdx = aTab[i].zIdx;
+  pK->zCol = aTab[i].zCol;
+  pK->aKey = sqlite3_malloc64(sizeof(sqlite3_int64)*BENCH_MAX_SAMPLE);
+  pK->aIdx = sqlite3_malloc64(sizeof(sqlite3_int64)*BENCH_MAX_SAMPLE);
+  if( pK->aKey==0 || pK->aIdx==0 ) benchFatal("out of memory");
+
+  /* WITHOUT ROWID keys are the hex text of an integer, parsed below */
+  if( pK->zTab[0]=='w' ){
+    zSql = sqlite3_mprintf("SELECT k, 0 FROM w");
+  }else{
+    zSql = sqlite3_mprintf("SELECT k, %s FROM %s",
+                           pK->zIdx ? pK->zIdx : "0", pK->zTab);
+  }
+  sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  sqlite3_free(zSql);
+  pK->mnKey = -1;
+  while( sqlite3_step(pStmt)==SQLITE_ROW ){
+    sqlite3_int64 k;
+    sqlite3_int64 j = nSeen++;
+    if( pK->zTab[0]=='w' ){
+      const char *z = (const char*)sqlite3_column_text(pStmt, 0);
+      k = z ? strtoll(z, 0, 16) : 0;
+    }else{
+      k = sqlite3_column_int64(pStmt, 0);
+    }
+    if( k<((sqlite3_int64)1<<40) ){
+      if( pK->mnKey<0 || k<pK->mnKey ) pK->mnKey = k;
+      if( k>pK->mxKey ) pK->mxKey = k;
+    }
+    if( j>=BENCH_MAX_SAMPLE ){
+      j = (sqlite3_int64)(benchRandom(pSpec) % (unsigned long long)nSeen);
+      if( j>=BENCH_MAX_SAMPLE ) continue;
+    }else{
+      pK->nKey++;
+    }
+    pK->aKey[j] = k;
+    pK->aIdx[j] = sqlite3_column_int64(pStmt, 1);
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+  if( pK->mnKey<0 ) pK->mnKey = 0;
+}
+
+/* Compare two latencies, for qsort() */
+static int benchCmp(const void *a, const void *b){
+  sqlite3_int64 x = *(const sqlite3_int64*)a, y = *(const sqlite3_int64*)b;
+  return x<y ? -1 : x>y;
+}
+
+/*
+** Run nQuery queries of kind zKind on zFile with a cold cache and print a
+** CSV row with latency percentiles, page cache misses (reads SQLite asked
+** the OS for) and bytes read from storage.
+*/
+static void benchQuery(
+  BenchSpec *pSpec,
+  const BenchKeys *pK,
+  const char *zFile,
+  const char *zLabel,
+  const char *zKind,
+  int nQuery
+){
+  sqlite3 *db;
+  sqlite3_stmt *pStmt;
+  sqlite3_int64 *aLat;
+  sqlite3_int64 nIo, tTotal = 0;
+  int nMiss = 0, nHi = 0;
+  char *zSql;
+  int i;
+
+  if( strcmp(zKind, "index")==0 && pK->zIdx==0 ) return;
+  if( strcmp(zKind, "scan")==0 ){
+    zSql = sqlite3_mprintf("SELECT sum(length(%s)) FROM %s",
+                           pK->zCol, pK->zTab);
+  }else if( strcmp(zKind, "range")==0 ){
+    zSql = pK->zTab[0]=='w' ?
+      sqlite3_mprintf("SELECT sum(length(v)) FROM w WHERE k BETWEEN"
+                      " printf('%%016llx',?1) AND printf('%%016llx',?1+%d)",
+                      BENCH_RANGE) :
+      sqlite3_mprintf("SELECT sum(length(%s)) FROM %s WHERE k BETWEEN"
+                      " ?1 AND ?1+%d", pK->zCol, pK->zTab, BENCH_RANGE);
+  }else if( strcmp(zKind, "point")==0 ){
+    zSql = pK->zTab[0]=='w' ?
+      sqlite3_mprintf("SELECT length(v) FROM w WHERE k=printf('%%016llx',?1)") :
+      sqlite3_mprintf("SELECT length(%s) FROM %s WHERE k=?1",
+                      pK->zCol, pK->zTab);
+  }else{
+    zSql = sqlite3_mprintf("SELECT length(%s) FROM %s WHERE %s=?1",
+                           pK->zCol, pK->zTab, pK->zIdx);
+  }
+  aLat = sqlite3_malloc64(sizeof(sqlite3_int64)*(nQuery>0 ? nQuery : 1));
+  if( zSql==0 || aLat==0 ) benchFatal("out of memory");
+  if( strcmp(zKind, "scan")==0 ) nQuery = 1;
+
+  if( benchCache(zFile, 0) ){
+    benchFatal("cannot drop %s from the page cache", zFile);
+  }
+  if( sqlite3_open_v2(zFile, &db, SQLITE_OPEN_READONLY, 0)
+   || sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0)
+  ){
+    benchFatal("%s: %s", zFile, sqlite3_errmsg(db));
+  }
+  nIo = benchReadBytes();
+  for(i=0; i<nQuery; i++){
+    sqlite3_int64 t0, k;
+    int j = pK->nKey ? (int)(benchRandom(pSpec) % pK->nKey) : 0;
+    if( strcmp(zKind, "range")==0 ){
+      k = pK->mnKey + (sqlite3_int64)(benchRandom(pSpec)
+            % (unsigned long long)(pK->mxKey - pK->mnKey + 1));
+    }else if( strcmp(zKind, "index")==0 ){
+      k = pK->nKey ? pK->aIdx[j] : 0;
+    }else{
+      k = pK->nKey ? pK->aKey[j] : 0;
+    }
+    t0 = scrubDefragClock();
+    sqlite3_bind_int64(pStmt, 1, k);
+    while( sqlite3_step(pStmt)==SQLITE_ROW ){}
+    sqlite3_reset(pStmt);
+    aLat[i] = scrubDefragClock() - t0;
+    tTotal += aLat[i];
+  }
+  if( nIo>=0 ) nIo = benchReadBytes() - nIo;
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &nMiss, &nHi, 0);
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+  sqlite3_free(zSql);
+
+  qsort(aLat, nQuery, sizeof(aLat[0]), benchCmp);
+  printf("%d,%d,%d,%d,%s,%s,%s,%s,%d,%lld,%lld,%lld,%lld,%.6f,%d,%lld\n",
+         pSpec->nMB, pSpec->szPage, pSpec->nFrag, pSpec->nFree,
+         pSpec->zShape, pK->zTab, zLabel, zKind, nQuery,
+         aLat[nQuery/2], aLat[nQuery*9/10], aLat[nQuery*99/100],
+         aLat[nQuery-1], tTotal/1e6, nMiss, nIo);
+  fflush(stdout);
+  sqlite3_free(aLat);
+}
+
+/* Build the outputs to compare, then run every query kind on all three */
+static void benchQueries(
+  BenchSpec *pSpec,
+  const char *zSrc,
+  const char *zDir,
+  int nLookup,
+  int nRep
+){
+  static const char *azKind[] = { "scan", "range", "point", "index" };
+  const char *azFile[3];
+  static const char *azLabel[] = { "source", "defrag", "vacuum" };
+  char *zDefrag = sqlite3_mprintf("%s/bench-q-defrag.db", zDir);
+  char *zVacuum = sqlite3_mprintf("%s/bench-q-vacuum.db", zDir);
+  BenchKeys keys;
+  int i, f, r;
+
+  if( zDefrag==0 || zVacuum==0 ) benchFatal("out of memory");
+  benchRun("defrag", zSrc, zDefrag, 1);
+  benchRun("vacuum_into", zSrc, zVacuum, 1);
+  azFile[0] = zSrc;
+  azFile[1] = zDefrag;
+  azFile[2] = zVacuum;
+  benchSampleKeys(pSpec, zSrc, &keys);
+  for(r=0; r<nRep; r++)
+  for(i=0; i<4; i++)
+  for(f=0; f<3; f++){
+    /* Same query stream for each file */
+    BenchSpec s = *pSpec;
+    s.iSeed += r*4 + i + 1;
+    benchQuery(&s, &keys, azFile[f], azLabel[f], azKind[i], nLookup);
+  }
+  sqlite3_free(keys.aKey);
+  sqlite3_free(keys.aIdx);
+  unlink(zDefrag);
+  unlink(zVacuum);
+  sqlite3_free(zDefrag);
+  sqlite3_free(zVacuum);
+}
+
+/* Parse a list of integers; "all" in a page-size list means every size */
+static int benchInts(const BenchList *p, int *a, int bPageSize){
+  int i, n = 0;
+  for(i=0; i<p->n; i++){
+    if( bPageSize && strcmp(p->az[i], "all")==0 ){
+      int sz;
+      for(sz=512; sz<=65536 && n<BENCH_MAX_LIST; sz*=2) a[n++] = sz;
+    }else if( n<BENCH_MAX_LIST ){
+      a[n++] = atoi(p->az[i]);
+    }
+  }
+  return n;
+}
+
+int main(int argc, char **argv){
+  static char zSizes[] = "10", zPageSizes[] = "4096", zFrag[] = "50";
+  static char zFree[] = "20", zShapes[] = "mixed";
+  static char zMethods[] = "defrag,vacuum,vacuum_into,backup";
+  static char zCaches[] = "cold,warm";
+  const char *zDir = ".";
+  BenchList sizes, pageSizes, frag, freePct, shapes, methods, caches;
+  int aSize[BENCH_MAX_LIST], aPage[BENCH_MAX_LIST];
+  int aFrag[BENCH_MAX_LIST], aFree[BENCH_MAX_LIST];
+  int nSize, nPageSize, nFragPct, nFreePct;
+  int nRep = 3;
+  unsigned long long iSeed = 1;
+  int bWarnCold = 0;
+  int bQueries = 0;
+  int nLookup = 1000;
+  int i, a, b, c, e, m, k, r;
+
+  benchSplit(&sizes, zSizes);
+  benchSplit(&pageSizes, zPageSizes);
+  benchSplit(&frag, zFrag);
+  benchSplit(&freePct, zFree);
+  benchSplit(&shapes, zShapes);
+  benchSplit(&methods, zMethods);
+  benchSplit(&caches, zCaches);
+  for(i=1; i<argc; i++){
+    const char *z = argv[i];
+    if( strcmp(z, "--queries")==0 ){
+      bQueries = 1;
+      continue;
+    }
+    if( i+1>=argc ) benchFatal("missing argument to %s", z);
+    if( strcmp(z, "--dir")==0 ) zDir = argv[++i];
+    else if( strcmp(z, "--sizes")==0 ) benchSplit(&sizes, argv[++i]);
+    else if( strcmp(z, "--page-sizes")==0 ) benchSplit(&pageSizes, argv[++i]);
+    else if( strcmp(z, "--frag")==0 ) benchSplit(&frag, argv[++i]);
+    else if( strcmp(z, "--free")==0 ) benchSplit(&freePct, argv[++i]);
+    else if( strcmp(z, "--shapes")==0 ) benchSplit(&shapes, argv[++i]);
+    else if( strcmp(z, "--methods")==0 ) benchSplit(&methods, argv[++i]);
+    else if( strcmp(z, "--cache")==0 ) benchSplit(&caches, argv[++i]);
+    else if( strcmp(z, "--reps")==0 ) nRep = atoi(argv[++i]);
+    else if( strcmp(z, "--seed")==0 ) iSeed = strtoull(argv[++i], 0, 0);
+    else if( strcmp(z, "--lookups")==0 ) nLookup = atoi(argv[++i]);
+    else benchFatal("unknown option: %s", z);
+  }
+  nSize = benchInts(&sizes, aSize, 0);
+  nPageSize = benchInts(&pageSizes, aPage, 1);
+  nFragPct = benchInts(&frag, aFrag, 0);
+  nFreePct = benchInts(&freePct, aFree, 0);
+  for(e=0; e<shapes.n; e++){
+    if( benchSchema(shapes.az[e])==0 ) benchFatal("unknown shape: %s",
+                                                  shapes.az[e]);
+  }
+
+  if( nLookup<1 ) nLookup = 1;
+  if( bQueries ){
+    printf("size_mb,page_size,frag_pct,free_pct,shape,table,file,query,count,"
+           "p50_us,p90_us,p99_us,max_us,seconds,cache_misses,read_bytes\n");
+  }else{
+    printf("size_mb,page_size,frag_pct,free_pct,shape,src_pages,"
+           "src_free_pages,method,cache,rep,seconds,out_pages\n");
+  }
+  for(a=0; a<nSize; a++)
+  for(b=0; b<nPageSize; b++)
+  for(c=0; c<nFragPct; c++)
+  for(k=0; k<nFreePct; k++)
+  for(e=0; e<shapes.n; e++){
+    BenchSpec spec;
+    char *zSrc, *zOut;
+    int nPage, nFreePage;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.nMB = aSize[a];
+    spec.szPage = aPage[b];
+    spec.nFrag = aFrag[c];
+    spec.nFree = aFree[k];
+    spec.zShape = shapes.az[e];
+    spec.iSeed = iSeed*0x9E3779B97F4A7C15ULL + 1;
+    zSrc = sqlite3_mprintf("%s/bench-%dm-%d-%d-%d-%s-%llu.db", zDir,
+                           spec.nMB, spec.szPage, spec.nFrag, spec.nFree,
+                           spec.zShape, iSeed);
+    zOut = sqlite3_mprintf("%s/bench-out.db", zDir);
+    if( zSrc==0 || zOut==0 ) benchFatal("out of memory");
+    if( benchFileSize(zSrc)<0 ){
+      fprintf(stderr, "generating %s\n", zSrc);
+      benchGenerate(&spec, zSrc);
+    }
+    if( bQueries ){
+      benchQueries(&spec, zSrc, zDir, nLookup, nRep);
+      sqlite3_free(zSrc);
+      sqlite3_free(zOut);
+      continue;
+    }
+    benchPages(zSrc, &nPage, &nFreePage);
+    for(m=0; m<methods.n; m++)
+    for(i=0; i<caches.n; i++)
+    for(r=1; r<=nRep; r++){
+      int bWarm = strcmp(caches.az[i], "warm")==0;
+      int nOut, nOutFree;
+      sqlite3_int64 t = benchRun(methods.az[m], zSrc, zOut, bWarm);
+      if( t<0 ){
+        if( !bWarnCold ) fprintf(stderr, "cannot drop caches: "
+                                 "skipping cold runs\n");
+        bWarnCold = 1;
+        break;
+      }
+      benchPages(zOut, &nOut, &nOutFree);
+      printf("%d,%d,%d,%d,%s,%d,%d,%s,%s,%d,%.6f,%d\n",
+             spec.nMB, spec.szPage, spec.nFrag, spec.nFree, spec.zShape,
+             nPage, nFreePage, methods.az[m], caches.az[i], r, t/1e6, nOut);
+      fflush(stdout);
+    }
+    unlink(zOut);
+    sqlite3_free(zSrc);
+    sqlite3_free(zOut);
+  }
+  return 0;
+}
@@ -0,0 +1,1046 @@
+/*
+** 2026-10-16
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+******************************************************************************
+**
+** Tests of what the command line cannot reach or check by itself:
+**
+**   - sqlite3_scrub_and_defrag_online(), which needs a live connection to
+**     the source;
+**   - the sqlite_stat1 and sqlite_stat4 written by a copy with stat1 set,
+**     checked against ANALYZE and by verifying the copy;
+**   - sqlite3_scrub_and_defrag_inplace() run to the end, interrupted at
+**     several points by a VFS that makes writes fail and then resumed, and
+**     refused on a WAL database with a reader;
+**   - sqlite3_scrub_and_defrag_compact() in one call and in budgeted calls,
+**     and resumed after a round is interrupted the same way;
+**   - salvage of a source with a damaged index page;
+**   - copies into memory from a file, a serialized image and ":memory:";
+**   - a round trip through sqlite3_scrub_and_defrag_daemon() where it is
+**     built: a copy job, its status, malformed JSON and shutdown.
+**
+** Build it next to defrag.c against an SQLite with the session extension:
+**
+**      gcc defragtest.c -DSQLITE_ENABLE_SESSION -lsqlite3 -o defragtest
+**      ./defragtest [DIR]
+**
+** Databases are created in DIR (default ".") and removed again.  Each test
+** prints one line, and the exit status is the number of tests that failed.
+*/
+#include "defrag.c"
+
+/* Number of tests that failed so far */
+static int nTestFail = 0;
+
+/* Report the outcome of one test */
+static void testResult(const char *zName, int bOk, const char *zWhy){
+  printf("%-36s %s%s%s\n", zName, bOk ? "ok" : "FAILED",
+         bOk || zWhy==0 ? "" : ": ", bOk || zWhy==0 ? "" : zWhy);
+  if( !bOk ) nTestFail++;
+}
+
+/* Run SQL that must succeed */
+static int testExec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  int rc = sqlite3_exec(db, zSql, 0, 0, &zErr);
+  if( rc ) fprintf(stderr, "defragtest: %s\n  in: %s\n", zErr, zSql);
+  sqlite3_free(zErr);
+  return rc;
+}
+
+/* Return the single integer result of zSql on db, or -1 */
+static sqlite3_int64 testInt(sqlite3 *db, const char *zSql){
+  sqlite3_stmt *pStmt = 0;
+  sqlite3_int64 n = -1;
+  if( sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0)==SQLITE_OK
+   && sqlite3_step(pStmt)==SQLITE_ROW
+  ){
+    n = sqlite3_column_int64(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return n;
+}
+
+/*
+** A VFS that passes everything through to the default one, except that
+** once nTestWriteLeft writes have been made to main database files the
+** next ones fail, as if the machine went down in the middle.  It is made
+** the default before the first in-place test, as the in-place code
+** registers its shim on top of whatever VFS is the default then.
+*/
+typedef struct TestFile TestFile;
+struct TestFile {
+  sqlite3_file base;       /* Base class.  Must be first */
+  sqlite3_file *pReal;     /* Underlying file.  Allocated after this */
+  int bMain;               /* True for a main database file */
+};
+#define TESTREAL(p) (((TestFile*)(p))->pReal)
+
+/* Writes to main database files left before they fail, or -1 */
+static int nTestWriteLeft = -1;
+
+static int testClose(sqlite3_file *pFile){
+  return TESTREAL(pFile)->pMethods->xClose(TESTREAL(pFile));
+}
+static int testRead(sqlite3_file *pFile, void *z, int n, sqlite3_int64 iOff){
+  return TESTREAL(pFile)->pMethods->xRead(TESTREAL(pFile), z, n, iOff);
+}
+static int testWrite(
+  sqlite3_file *pFile, const void *z, int n, sqlite3_int64 iOff
+){
+  if( ((TestFile*)pFile)->bMain && nTestWriteLeft>=0 ){
+    if( nTestWriteLeft==0 ) return SQLITE_IOERR_WRITE;
+    nTestWriteLeft--;
+  }
+  return TESTREAL(pFile)->pMethods->xWrite(TESTREAL(pFile), z, n, iOff);
+}
+static int testTruncate(sqlite3_file *pFile, sqlite3_int64 nByte){
+  if( ((TestFile*)pFile)->bMain && nTestWriteLeft==0 ){
+    return SQLITE_IOERR_TRUNCATE;
+  }
+  return TESTREAL(pFile)->pMethods->xTruncate(TESTREAL(pFile), nByte);
+}
+static int testSync(sqlite3_file *pFile, int flags){
+  return TESTREAL(pFile)->pMethods->xSync(TESTREAL(pFile), flags);
+}
+static int testFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize){
+  return TESTREAL(pFile)->pMethods->xFileSize(TESTREAL(pFile), pSize);
+}
+static int testLock(sqlite3_file *pFile, int eLock){
+  return TESTREAL(pFile)->pMethods->xLock(TESTREAL(pFile), eLock);
+}
+static int testUnlock(sqlite3_file *pFile, int eLock){
+  return TESTREAL(pFile)->pMethods->xUnlock(TESTREAL(pFile), eLock);
+}
+static int testCheckReservedLock(sqlite3_file *pFile, int *pResOut){
+  return TESTREAL(pFile)->pMethods->xCheckReservedLock(TESTREAL(pFile),
+                                                       pResOut);
+}
+static int testFileControl(sqlite3_file *pFile, int op, void *pArg){
+  return TESTREAL(pFile)->pMethods->xFileControl(TESTREAL(pFile), op, pArg);
+}
+static int testSectorSize(sqlite3_file *pFile){
+  return TESTREAL(pFile)->pMethods->xSectorSize(TESTREAL(pFile));
+}
+static int testDeviceCharacteristics(sqlite3_file *pFile){
+  return TESTREAL(pFile)->pMethods->xDeviceCharacteristics(TESTREAL(pFile));
+}
+static int testShmMap(
+  sqlite3_file *pFile, int iPg, int pgsz, int bExtend, void volatile **pp
+){
+  return TESTREAL(pFile)->pMethods->xShmMap(TESTREAL(pFile), iPg, pgsz,
+                                            bExtend, pp);
+}
+static int testShmLock(sqlite3_file *pFile, int ofst, int n, int flags){
+  return TESTREAL(pFile)->pMethods->xShmLock(TESTREAL(pFile), ofst, n, flags);
+}
+static void testShmBarrier(sqlite3_file *pFile){
+  TESTREAL(pFile)->pMethods->xShmBarrier(TESTREAL(pFile));
+}
+static int testShmUnmap(sqlite3_file *pFile, int bDelete){
+  return TESTREAL(pFile)->pMethods->xShmUnmap(TESTREAL(pFile), bDelete);
+}
+
+/* Version 2 methods, so that WAL works but nothing is memory-mapped */
+static const sqlite3_io_methods testIoMethods = {
+  2,
+  testClose, testRead, testWrite, testTruncate, testSync, testFileSize,
+  testLock, testUnlock, testCheckReservedLock, testFileControl,
+  testSectorSize, testDeviceCharacteristics,
+  testShmMap, testShmLock, testShmBarrier, testShmUnmap,
+  0, 0
+};
+
+static int testOpen(
+  sqlite3_vfs *pVfs, const char *zName, sqlite3_file *pFile,
+  int flags, int *pOutFlags
+){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  TestFile *p = (TestFile*)pFile;
+  int rc;
+  memset(p, 0, sizeof(*p));
+  p->pReal = (sqlite3_file*)&p[1];
+  p->bMain = (flags & SQLITE_OPEN_MAIN_DB)!=0;
+  rc = pOrig->xOpen(pOrig, zName, p->pReal, flags, pOutFlags);
+  if( p->pReal->pMethods ) p->base.pMethods = &testIoMethods;
+  return rc;
+}
+static int testDelete(sqlite3_vfs *pVfs, const char *zName, int syncDir){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xDelete(pOrig, zName, syncDir);
+}
+static int testAccess(sqlite3_vfs *pVfs, const char *zName, int f, int *pRes){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xAccess(pOrig, zName, f, pRes);
+}
+static int testFullPathname(sqlite3_vfs *pVfs, const char *zName, int n,
+                            char *zOut){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xFullPathname(pOrig, zName, n, zOut);
+}
+static int testRandomness(sqlite3_vfs *pVfs, int n, char *z){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xRandomness(pOrig, n, z);
+}
+static int testSleep(sqlite3_vfs *pVfs, int nMicro){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xSleep(pOrig, nMicro);
+}
+static int testCurrentTime(sqlite3_vfs *pVfs, double *pTime){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xCurrentTime(pOrig, pTime);
+}
+static int testGetLastError(sqlite3_vfs *pVfs, int n, char *z){
+  sqlite3_vfs *pOrig = (sqlite3_vfs*)pVfs->pAppData;
+  return pOrig->xGetLastError(pOrig, n, z);
+}
+
+static sqlite3_vfs testVfs = {
+  1, 0, 0, 0, "defragtest",
+  0,                       /* pAppData: the VFS wrapped, set at startup */
+  testOpen, testDelete, testAccess, testFullPathname,
+  0, 0, 0, 0,              /* No extension loading */
+  testRandomness, testSleep, testCurrentTime, testGetLastError
+};
+
+/* Make testVfs the default VFS */
+static void testVfsInstall(void){
+  sqlite3_vfs *pOrig = sqlite3_vfs_find(0);
+  testVfs.szOsFile = sizeof(TestFile) + pOrig->szOsFile;
+  testVfs.mxPathname = pOrig->mxPathname;
+  testVfs.pAppData = pOrig;
+  sqlite3_vfs_register(&testVfs, 1);
+}
+
+/* Delete zFile and its journal, WAL and shared-memory files */
+static void testRemove(const char *zFile){
+  static const char *azSuffix[] = { "", "-journal", "-wal", "-shm" };
+  int i;
+  for(i=0; i<4; i++){
+    char *zName = sqlite3_mprintf("%s%s", zFile, azSuffix[i]);
+    if( zName ) remove(zName);
+    sqlite3_free(zName);
+  }
+}
+
+/*
+** After the copy is renamed over the source, the connection the caller
+** passed in still refers to the old file.  A write made through it must
+** fail rather than vanish, and the renamed copy must hold every row
+** committed before the call returned.
+*/
+static void testOnlineStale(const char *zDir){
+  char *zSrc = sqlite3_mprintf("%s/defragtest-online.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-online2.db", zDir);
+  char *zErr = 0;
+  sqlite3 *db = 0;
+  int rc;
+
+  testRemove(zSrc);
+  testRemove(zDest);
+  sqlite3_open(zSrc, &db);
+  rc = testExec(db,
+      "PRAGMA journal_mode=wal;"
+      "CREATE TABLE t(a INTEGER PRIMARY KEY, b);"
+      "WITH RECURSIVE c(x) AS (VALUES(1) UNION ALL SELECT x+1 FROM c"
+      "  WHERE x<5000) INSERT INTO t SELECT x, randomblob(x%700) FROM c;"
+      "DELETE FROM t WHERE a%3=0;");
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_scrub_and_defrag_online(db, zDest, &zErr);
+  }
+  testResult("online", rc==SQLITE_OK, zErr);
+  if( rc==SQLITE_OK ){
+    sqlite3 *db2 = 0;
+    rc = sqlite3_exec(db, "INSERT INTO t VALUES(100000, 'lost')", 0, 0, 0);
+    testResult("online: stale write fails", rc!=SQLITE_OK,
+               "the write to the old file succeeded");
+    testResult("online: stale handle closes", sqlite3_close(db)==SQLITE_OK,
+               sqlite3_errmsg(db));
+    db = 0;
+    sqlite3_open(zSrc, &db2);
+    testResult("online: copy is intact",
+               testInt(db2, "SELECT count(*) FROM t")==3334
+               && testInt(db2, "SELECT count(*) FROM pragma_integrity_check"
+                               " WHERE integrity_check='ok'")==1, 0);
+    sqlite3_close(db2);
+  }
+  sqlite3_close(db);
+  sqlite3_free(zErr);
+  testRemove(zSrc);
+  testRemove(zDest);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+}
+
+/*
+** Copy zSrc to zDest with stat1 set, as --stat1 does.  Return an SQLite
+** error code and leave any message in *pzErr.
+*/
+static int testCopyStat1(const char *zSrc, const char *zDest, char **pzErr){
+  sqlite3_defrag *p;
+  int rc;
+  testRemove(zDest);
+  p = sqlite3_scrub_and_defrag_init(zSrc, zDest);
+  if( p==0 ) return SQLITE_NOMEM;
+  rc = sqlite3_scrub_and_defrag_stat1(p, 1);
+  if( rc==SQLITE_OK ){
+    while( (rc = sqlite3_scrub_and_defrag_step(p, 100))==SQLITE_OK ){}
+  }
+  if( rc==SQLITE_DONE ) rc = SQLITE_OK;
+  if( sqlite3_scrub_and_defrag_finish(p, pzErr)!=SQLITE_OK && rc==SQLITE_OK ){
+    rc = SQLITE_ERROR;
+  }
+  return rc;
+}
+
+/*
+** A copy made with stat1 set has a sqlite_stat1 the source may lack, and
+** rows in another order than the source's.  Verifying it must pass.
+*/
+static void testStat1Verify(const char *zDir){
+  char *zSrc = sqlite3_mprintf("%s/defragtest-stat.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-stat2.db", zDir);
+  char *zErr = 0;
+  char *zReport = 0;
+  sqlite3 *db = 0;
+  int rc;
+
+  testRemove(zSrc);
+  sqlite3_open(zSrc, &db);
+  rc = testExec(db,
+      "CREATE TABLE t(a INTEGER PRIMARY KEY, b, c);"
+      "CREATE INDEX tb ON t(b);"
+      "WITH RECURSIVE c(x) AS (VALUES(1) UNION ALL SELECT x+1 FROM c"
+      "  WHERE x<5000) INSERT INTO t SELECT x, x%97, x%13 FROM c;");
+  sqlite3_close(db);
+  if( rc==SQLITE_OK ) rc = testCopyStat1(zSrc, zDest, &zErr);
+  testResult("stat1: unanalyzed copy", rc==SQLITE_OK, zErr);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_scrub_and_defrag_verify(zSrc, zDest, 0, &zReport, &zErr);
+    testResult("stat1: unanalyzed verify", rc==SQLITE_OK,
+               zReport ? zReport : zErr);
+  }
+  sqlite3_free(zReport);
+  sqlite3_free(zErr);
+  testRemove(zSrc);
+  testRemove(zDest);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+}
+
+/*
+** A copy made with stat1 set must hold the sqlite_stat1 that ANALYZE wrote
+** on the source, and verify.  With bStat4 the source is given an empty
+** sqlite_stat4, as an SQLite built without SQLITE_ENABLE_STAT4 would not
+** make one, and the samples of the copy are checked against the table.
+*/
+static void testStat1Analyze(const char *zDir, int bStat4){
+  const char *zTest = bStat4 ? "stat4" : "stat1";
+  char *zSrc = sqlite3_mprintf("%s/defragtest-stat.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-stat2.db", zDir);
+  char *zSql = 0;
+  char *zErr = 0;
+  char *zReport = 0;
+  char zName[40];
+  sqlite3 *db = 0;
+  int rc;
+
+  testRemove(zSrc);
+  sqlite3_open(zSrc, &db);
+  rc = testExec(db,
+      "CREATE TABLE t(a INTEGER PRIMARY KEY, b, c, d);"
+      "CREATE INDEX tb ON t(b);"
+      "CREATE INDEX tbc ON t(b, c);"
+      "CREATE UNIQUE INDEX td ON t(d);"
+      "CREATE INDEX tc ON t(c) WHERE c>5;"
+      "CREATE TABLE w(k PRIMARY KEY, v) WITHOUT ROWID;"
+      "CREATE INDEX wv ON w(v);"
+      "WITH RECURSIVE c(x) AS (VALUES(1) UNION ALL SELECT x+1 FROM c"
+      "  WHERE x<5000) INSERT INTO t SELECT x, x%97, x%13, -x FROM c;"
+      "INSERT INTO w SELECT 'k'||a, c FROM t WHERE a%2;"
+      "ANALYZE;");
+  if( rc==SQLITE_OK && bStat4 ){
+    /* CREATE refuses the name, so rename an ordinary table */
+    sqlite3_db_config(db, SQLITE_DBCONFIG_DEFENSIVE, 0, (int*)0);
+    rc = testExec(db,
+        "CREATE TABLE x(tbl, idx, neq, nlt, ndlt, sample);"
+        "PRAGMA writable_schema=ON;"
+        "UPDATE sqlite_schema SET name='sqlite_stat4', tbl_name='sqlite_stat4',"
+        "  sql='CREATE TABLE sqlite_stat4(tbl,idx,neq,nlt,ndlt,sample)'"
+        "  WHERE name='x';"
+        "PRAGMA writable_schema=OFF;");
+  }
+  sqlite3_close(db);
+  db = 0;
+  if( rc==SQLITE_OK ) rc = testCopyStat1(zSrc, zDest, &zErr);
+  sqlite3_snprintf(sizeof(zName), zName, "%s: copy", zTest);
+  testResult(zName, rc==SQLITE_OK, zErr);
+  if( rc==SQLITE_OK ){
+    sqlite3_open(zDest, &db);
+    zSql = sqlite3_mprintf("ATTACH %Q AS s", zSrc);
+    testExec(db, zSql);
+    sqlite3_snprintf(sizeof(zName), zName, "%s: matches ANALYZE", zTest);
+    testResult(zName,
+        testInt(db, "SELECT count(*) FROM main.sqlite_stat1")==6
+        && testInt(db, "SELECT count(*) FROM ("
+                       "  SELECT * FROM main.sqlite_stat1"
+                       "  EXCEPT SELECT * FROM s.sqlite_stat1)")==0
+        && testInt(db, "SELECT count(*) FROM ("
+                       "  SELECT * FROM s.sqlite_stat1"
+                       "  EXCEPT SELECT * FROM main.sqlite_stat1)")==0, 0);
+    if( bStat4 ){
+      /* Every value of b from 0 to 96 occurs, so the distinct values less
+      ** than a sample are its own value of b */
+      testResult("stat4: samples",
+          testInt(db, "SELECT count(*) FROM sqlite_stat4 WHERE idx='tb'")
+            ==SCRUB_DEFRAG_NSAMPLE
+          && testInt(db, "SELECT count(*) FROM sqlite_stat4 WHERE idx='tb'"
+                         "  AND (CAST(nlt AS INT)!=(SELECT count(*) FROM t"
+                         "         WHERE b<CAST(ndlt AS INT))"
+                         "    OR CAST(neq AS INT)!=(SELECT count(*) FROM t"
+                         "         WHERE b=CAST(ndlt AS INT)))")==0, 0);
+    }
+    sqlite3_snprintf(sizeof(zName), zName, "%s: integrity", zTest);
+    testResult(zName, testInt(db, "SELECT count(*) FROM pragma_integrity_check"
+                                  " WHERE integrity_check='ok'")==1, 0);
+    sqlite3_close(db);
+    rc = sqlite3_scrub_and_defrag_verify(zSrc, zDest, 0, &zReport, &zErr);
+    sqlite3_snprintf(sizeof(zName), zName, "%s: verify", zTest);
+    testResult(zName, rc==SQLITE_OK, zReport ? zReport : zErr);
+  }
+  sqlite3_free(zSql);
+  sqlite3_free(zReport);
+  sqlite3_free(zErr);
+  testRemove(zSrc);
+  testRemove(zDest);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+}
+
+/* True if zFile exists */
+static int testExists(const char *zFile){
+  int bExists = 0;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find(0);
+  pVfs->xAccess(pVfs, zFile, SQLITE_ACCESS_EXISTS, &bExists);
+  return bExists;
+}
+
+/*
+** Fill an empty database with two tables and an index whose pages are
+** interleaved, part of it overflow, and then free a third of them.  The
+** content is the same every time, so that an in-place defrag of it always
+** makes the same writes.
+*/
+static const char zTestFragmented[] =
+  "PRAGMA page_size=1024;"
+  "CREATE TABLE a(x INTEGER PRIMARY KEY, y);"
+  "CREATE TABLE b(x INTEGER PRIMARY KEY, y);"
+  "CREATE INDEX ay ON a(y);"
+  "CREATE TEMP TRIGGER ab AFTER INSERT ON a BEGIN"
+  "  INSERT INTO b VALUES(new.x, printf('%.*c', new.x%2000, 'b'));"
+  "END;"
+  "WITH RECURSIVE c(i) AS (VALUES(1) UNION ALL SELECT i+1 FROM c"
+  "  WHERE i<3000) INSERT INTO a SELECT i, printf('%.*c%d', 150,"
+  "  char(65+i%26), i) FROM c;"
+  "DELETE FROM a WHERE x%3=0;"
+  "DELETE FROM b WHERE x%4=1;"
+  "DROP TRIGGER ab;";
+
+/* Create zFile from zTestFragmented and save a copy of it in zRef */
+static int testMakeFragmented(const char *zFile, const char *zRef){
+  sqlite3 *db = 0;
+  char *zSql = sqlite3_mprintf("VACUUM INTO %Q", zRef);
+  int rc;
+  testRemove(zFile);
+  testRemove(zRef);
+  sqlite3_open(zFile, &db);
+  rc = testExec(db, zTestFragmented);
+  if( rc==SQLITE_OK && zSql ) rc = testExec(db, zSql);
+  sqlite3_close(db);
+  sqlite3_free(zSql);
+  return zSql ? rc : SQLITE_NOMEM;
+}
+
+/*
+** True if zFile passes integrity_check and holds the same schema and rows
+** as zRef.
+*/
+static int testSameAs(const char *zFile, const char *zRef){
+  static const char *azTab[] = { "sqlite_schema", "a", "b" };
+  sqlite3 *db = 0;
+  char *zSql = 0;
+  int bOk, i;
+  sqlite3_open(zFile, &db);
+  zSql = sqlite3_mprintf("ATTACH %Q AS r", zRef);
+  bOk = zSql && testExec(db, zSql)==SQLITE_OK
+     && testInt(db, "SELECT count(*) FROM pragma_integrity_check"
+                    " WHERE integrity_check='ok'")==1;
+  for(i=0; bOk && i<(int)(sizeof(azTab)/sizeof(azTab[0])); i++){
+    const char *zCols = i ? "*" : "type, name, tbl_name, sql";
+    sqlite3_free(zSql);
+    zSql = sqlite3_mprintf(
+        "SELECT (SELECT count(*) FROM main.%s)=(SELECT count(*) FROM r.%s)"
+        " AND NOT EXISTS(SELECT %s FROM main.%s EXCEPT SELECT %s FROM r.%s)",
+        azTab[i], azTab[i], zCols, azTab[i], zCols, azTab[i]);
+    bOk = zSql && testInt(db, zSql)==1;
+  }
+  sqlite3_free(zSql);
+  sqlite3_close(db);
+  return bOk;
+}
+
+/* Writes to the database made by a complete in-place defrag */
+static int nTestInplaceWrite = 0;
+
+/*
+** A complete in-place defrag keeps every row, frees every freelist page
+** and removes its journal.  Count the writes it makes.
+*/
+static void testInplace(const char *zDir){
+  char *zFile = sqlite3_mprintf("%s/defragtest-inplace.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zJrnl = sqlite3_mprintf("%s-defrag", zFile);
+  char *zErr = 0;
+  sqlite3 *db = 0;
+  int rc;
+
+  rc = testMakeFragmented(zFile, zRef);
+  if( rc==SQLITE_OK ){
+    nTestWriteLeft = 0x7fffffff;
+    rc = sqlite3_scrub_and_defrag_inplace(zFile, &zErr);
+    nTestInplaceWrite = 0x7fffffff - nTestWriteLeft;
+    nTestWriteLeft = -1;
+  }
+  testResult("in-place", rc==SQLITE_OK, zErr);
+  if( rc==SQLITE_OK ){
+    testResult("in-place: contents", testSameAs(zFile, zRef), 0);
+    sqlite3_open(zFile, &db);
+    testResult("in-place: no free pages",
+               testInt(db, "PRAGMA freelist_count")==0, 0);
+    sqlite3_close(db);
+    testResult("in-place: journal removed", !testExists(zJrnl), zJrnl);
+  }
+  sqlite3_free(zErr);
+  testRemove(zFile);
+  testRemove(zRef);
+  remove(zJrnl);
+  sqlite3_free(zFile);
+  sqlite3_free(zRef);
+  sqlite3_free(zJrnl);
+}
+
+/*
+** An in-place defrag whose writes start failing after nWrite writes must
+** be finished by the next call, whatever was under way when it stopped:
+** planning, a batch of moves, the root page update or the truncation.
+*/
+static void testInplaceResume(const char *zDir, int nWrite){
+  char *zFile = sqlite3_mprintf("%s/defragtest-inplace.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zJrnl = sqlite3_mprintf("%s-defrag", zFile);
+  char *zErr = 0;
+  char zName[48];
+  int rc;
+
+  sqlite3_snprintf(sizeof(zName), zName,
+                   "in-place: resume after %d writes", nWrite);
+  rc = testMakeFragmented(zFile, zRef);
+  if( rc==SQLITE_OK ){
+    nTestWriteLeft = nWrite;
+    rc = sqlite3_scrub_and_defrag_inplace(zFile, 0);
+    nTestWriteLeft = -1;
+    if( rc==SQLITE_OK ){
+      zErr = sqlite3_mprintf("the first run was not interrupted");
+      rc = SQLITE_ERROR;
+    }else{
+      rc = sqlite3_scrub_and_defrag_inplace(zFile, &zErr);
+    }
+  }
+  testResult(zName, rc==SQLITE_OK && testSameAs(zFile, zRef)
+                    && !testExists(zJrnl), zErr);
+  sqlite3_free(zErr);
+  testRemove(zFile);
+  testRemove(zRef);
+  remove(zJrnl);
+  sqlite3_free(zFile);
+  sqlite3_free(zRef);
+  sqlite3_free(zJrnl);
+}
+
+/*
+** A WAL database with a reader is refused, and neither the reader nor the
+** file is disturbed.
+*/
+static void testInplaceWal(const char *zDir){
+  char *zFile = sqlite3_mprintf("%s/defragtest-inplace.db", zDir);
+  char *zJrnl = sqlite3_mprintf("%s-defrag", zFile);
+  sqlite3 *db = 0;
+  int rc;
+
+  testRemove(zFile);
+  sqlite3_open(zFile, &db);
+  rc = testExec(db,
+      "PRAGMA journal_mode=wal;"
+      "CREATE TABLE t(a INTEGER PRIMARY KEY, b);"
+      "WITH RECURSIVE c(x) AS (VALUES(1) UNION ALL SELECT x+1 FROM c"
+      "  WHERE x<2000) INSERT INTO t SELECT x, randomblob(300) FROM c;"
+      "DELETE FROM t WHERE a%2=0;"
+      "BEGIN;");
+  if( rc==SQLITE_OK && testInt(db, "SELECT count(*) FROM t")==1000 ){
+    rc = sqlite3_scrub_and_defrag_inplace(zFile, 0);
+    testResult("in-place: WAL with a reader refused", rc!=SQLITE_OK, 0);
+    testResult("in-place: reader undisturbed",
+               testInt(db, "SELECT count(*) FROM t")==1000
+               && testExec(db, "COMMIT")==SQLITE_OK
+               && testInt(db, "SELECT count(*) FROM pragma_integrity_check"
+                              " WHERE integrity_check='ok'")==1
+               && !testExists(zJrnl), 0);
+  }else{
+    testResult("in-place: WAL with a reader refused", 0, "setup failed");
+  }
+  sqlite3_close(db);
+  testRemove(zFile);
+  remove(zJrnl);
+  sqlite3_free(zFile);
+  sqlite3_free(zJrnl);
+}
+
+/* Writes to the database made by a compaction done in one call */
+static int nTestCompactWrite = 0;
+
+/*
+** Compaction nPage pages per call, or all in one call if nPage is 0, gets
+** to SQLITE_DONE, after which no page is free, every row is kept and the
+** journal is gone.  Count the writes.
+*/
+static void testCompact(const char *zDir, int nPage){
+  char *zFile = sqlite3_mprintf("%s/defragtest-compact.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zJrnl = sqlite3_mprintf("%s-defrag", zFile);
+  char *zErr = 0;
+  char zName[48];
+  sqlite3 *db = 0;
+  int rc, nCall = 0;
+
+  rc = testMakeFragmented(zFile, zRef);
+  nTestWriteLeft = 0x7fffffff;
+  while( rc==SQLITE_OK && nCall<1000 ){
+    rc = sqlite3_scrub_and_defrag_compact(zFile, nPage, 0, &zErr);
+    nCall++;
+  }
+  if( nPage==0 ) nTestCompactWrite = 0x7fffffff - nTestWriteLeft;
+  nTestWriteLeft = -1;
+  sqlite3_snprintf(sizeof(zName), zName, "compact %d", nPage);
+  testResult(zName, rc==SQLITE_DONE && (nPage==0)==(nCall==1), zErr);
+  if( rc==SQLITE_DONE ){
+    sqlite3_snprintf(sizeof(zName), zName, "compact %d: contents", nPage);
+    testResult(zName, testSameAs(zFile, zRef), 0);
+    sqlite3_open(zFile, &db);
+    sqlite3_snprintf(sizeof(zName), zName, "compact %d: no free pages", nPage);
+    testResult(zName, testInt(db, "PRAGMA freelist_count")==0, 0);
+    sqlite3_close(db);
+    sqlite3_snprintf(sizeof(zName), zName, "compact %d: journal removed",
+                     nPage);
+    testResult(zName, !testExists(zJrnl), zJrnl);
+  }
+  sqlite3_free(zErr);
+  testRemove(zFile);
+  testRemove(zRef);
+  remove(zJrnl);
+  sqlite3_free(zFile);
+  sqlite3_free(zRef);
+  sqlite3_free(zJrnl);
+}
+
+/*
+** A compaction whose writes start failing after nWrite writes leaves a
+** round half done.  The next call must roll it back and carry on to the
+** end with every row intact.
+*/
+static void testCompactResume(const char *zDir, int nWrite){
+  char *zFile = sqlite3_mprintf("%s/defragtest-compact.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zJrnl = sqlite3_mprintf("%s-defrag", zFile);
+  char *zErr = 0;
+  char zName[48];
+  int rc;
+
+  sqlite3_snprintf(sizeof(zName), zName,
+                   "compact: resume after %d writes", nWrite);
+  rc = testMakeFragmented(zFile, zRef);
+  if( rc==SQLITE_OK ){
+    nTestWriteLeft = nWrite;
+    rc = sqlite3_scrub_and_defrag_compact(zFile, 0, 0, 0);
+    nTestWriteLeft = -1;
+    if( rc==SQLITE_OK || rc==SQLITE_DONE ){
+      zErr = sqlite3_mprintf("the first run was not interrupted");
+      rc = SQLITE_ERROR;
+    }else{
+      rc = sqlite3_scrub_and_defrag_compact(zFile, 0, 0, &zErr);
+    }
+  }
+  testResult(zName, rc==SQLITE_DONE && testSameAs(zFile, zRef)
+                    && !testExists(zJrnl), zErr);
+  sqlite3_free(zErr);
+  testRemove(zFile);
+  testRemove(zRef);
+  remove(zJrnl);
+  sqlite3_free(zFile);
+  sqlite3_free(zRef);
+  sqlite3_free(zJrnl);
+}
+
+/*
+** Salvage of a source with a damaged index leaf drops that leaf, says so
+** in the loss report and rebuilds the index, so that the copy passes
+** integrity_check with every row of the tables.
+*/
+static void testSalvageIndex(const char *zDir){
+  char *zSrc = sqlite3_mprintf("%s/defragtest-salvage.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-salvage2.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zErr = 0;
+  char *zReport = 0;
+  sqlite3_defrag *p = 0;
+  sqlite3 *db = 0;
+  sqlite3_int64 iPg = -1, szPage = 0;
+  FILE *f;
+  int rc;
+
+  rc = testMakeFragmented(zSrc, zRef);
+  testRemove(zDest);
+  if( rc==SQLITE_OK ){
+    sqlite3_open(zSrc, &db);
+    iPg = testInt(db, "SELECT pageno FROM dbstat WHERE name='ay'"
+                      " AND pagetype='leaf' ORDER BY pageno LIMIT 1 OFFSET 3");
+    szPage = testInt(db, "PRAGMA page_size");
+    sqlite3_close(db);
+    db = 0;
+  }
+
+  /* An invalid page type */
+  f = iPg>1 ? fopen(zSrc, "r+b") : 0;
+  if( f==0 || fseek(f, (long)((iPg-1)*szPage), SEEK_SET) || fputc(0x63, f)<0 ){
+    testResult("salvage: damage an index leaf", 0, "setup failed");
+    if( f ) fclose(f);
+    goto salvage_end;
+  }
+  fclose(f);
+
+  p = sqlite3_scrub_and_defrag_init(zSrc, zDest);
+  rc = p ? sqlite3_scrub_and_defrag_salvage(p, 1) : SQLITE_NOMEM;
+  if( rc==SQLITE_OK ){
+    while( (rc = sqlite3_scrub_and_defrag_step(p, 100))==SQLITE_OK ){}
+  }
+  if( rc==SQLITE_DONE ){
+    rc = SQLITE_OK;
+    zReport = sqlite3_scrub_and_defrag_salvage_report(p);
+  }
+  if( sqlite3_scrub_and_defrag_finish(p, &zErr)!=SQLITE_OK && rc==SQLITE_OK ){
+    rc = SQLITE_ERROR;
+  }
+  testResult("salvage: damaged index leaf", rc==SQLITE_OK, zErr);
+  if( rc==SQLITE_OK ){
+    testResult("salvage: loss reported",
+               zReport && strncmp(zReport, "ay: ", 4)==0
+               && strstr(zReport, "cannot reindex")==0, zReport);
+    testResult("salvage: index rebuilt, rows kept", testSameAs(zDest, zRef), 0);
+    sqlite3_open(zDest, &db);
+    testResult("salvage: index complete",
+               testInt(db, "SELECT count(*) FROM a INDEXED BY ay"
+                           " WHERE y>''")==2000, 0);
+    sqlite3_close(db);
+  }
+
+salvage_end:
+  sqlite3_free(zReport);
+  sqlite3_free(zErr);
+  testRemove(zSrc);
+  testRemove(zDest);
+  testRemove(zRef);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+  sqlite3_free(zRef);
+}
+
+/*
+** Report whether image a of n bytes, written to zFile, is a defragmented
+** database with the content of zRef.
+*/
+static void testImage(
+  const char *zName,       /* Test name */
+  int rc,                  /* Result of making the image */
+  const char *zErr,        /* Error message, if rc is not SQLITE_OK */
+  const unsigned char *a,  /* The image */
+  sqlite3_int64 n,         /* Its size in bytes */
+  const char *zFile,       /* Write it here */
+  const char *zRef         /* Compare it with this */
+){
+  sqlite3 *db = 0;
+  FILE *f;
+  int bOk = 0;
+  testRemove(zFile);
+  if( rc==SQLITE_OK && (f = fopen(zFile, "wb"))!=0 ){
+    bOk = fwrite(a, 1, (size_t)n, f)==(size_t)n;
+    bOk = fclose(f)==0 && bOk;
+  }
+  if( bOk ){
+    bOk = testSameAs(zFile, zRef);
+    sqlite3_open(zFile, &db);
+    bOk = bOk && testInt(db, "PRAGMA freelist_count")==0;
+    sqlite3_close(db);
+  }
+  testResult(zName, bOk, zErr);
+  testRemove(zFile);
+}
+
+/*
+** Copies into memory: sqlite3_scrub_and_defrag_serialize() of a file and
+** of a plain ":memory:" database, and sqlite3_scrub_and_defrag_buffer()
+** of the sqlite3_serialize() image of the file.
+*/
+static void testSerialize(const char *zDir){
+  char *zSrc = sqlite3_mprintf("%s/defragtest-serialize.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-serialize2.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zSql = sqlite3_mprintf("VACUUM INTO %Q", zRef);
+  char *zErr = 0;
+  unsigned char *aImage = 0;
+  unsigned char *aOut = 0;
+  sqlite3_int64 nImage = 0, nOut = 0;
+  sqlite3 *db = 0;
+  int rc;
+
+  rc = testMakeFragmented(zSrc, zRef);
+  if( rc==SQLITE_OK ){
+    sqlite3_open(zSrc, &db);
+    rc = sqlite3_scrub_and_defrag_serialize(db, 0, &aOut, &nOut, &zErr);
+    testImage("serialize: file", rc, zErr, aOut, nOut, zDest, zRef);
+    sqlite3_free(aOut);
+    sqlite3_free(zErr);
+    aOut = 0;
+    zErr = 0;
+
+    aImage = sqlite3_serialize(db, "main", &nImage, 0);
+    rc = aImage ? SQLITE_OK : SQLITE_NOMEM;
+    if( rc==SQLITE_OK ){
+      rc = sqlite3_scrub_and_defrag_buffer(aImage, nImage, &aOut, &nOut, &zErr);
+    }
+    testImage("buffer: serialized file", rc, zErr, aOut, nOut, zDest, zRef);
+    sqlite3_free(aImage);
+    sqlite3_free(aOut);
+    sqlite3_free(zErr);
+    aOut = 0;
+    zErr = 0;
+    sqlite3_close(db);
+    db = 0;
+  }
+
+  testRemove(zRef);
+  sqlite3_open(":memory:", &db);
+  rc = zSql ? testExec(db, zTestFragmented) : SQLITE_NOMEM;
+  if( rc==SQLITE_OK ) rc = testExec(db, zSql);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_scrub_and_defrag_serialize(db, 0, &aOut, &nOut, &zErr);
+  }
+  testImage("serialize: :memory:", rc, zErr, aOut, nOut, zDest, zRef);
+  sqlite3_close(db);
+
+  sqlite3_free(aOut);
+  sqlite3_free(zErr);
+  testRemove(zSrc);
+  testRemove(zRef);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+  sqlite3_free(zRef);
+  sqlite3_free(zSql);
+}
+
+#if SCRUB_DEFRAG_DAEMON
+/* Arguments and result of a daemon run on its own thread */
+typedef struct TestDaemon TestDaemon;
+struct TestDaemon {
+  const char *zSocket;     /* Socket to listen on */
+  int rc;                  /* Return code of the daemon */
+  char *zErr;              /* Its error message */
+};
+
+static void *testDaemonThread(void *pArg){
+  TestDaemon *pT = (TestDaemon*)pArg;
+  pT->rc = sqlite3_scrub_and_defrag_daemon(pT->zSocket, 2, &pT->zErr);
+  return 0;
+}
+
+/*
+** Send request zReq to the daemon on zSocket over a connection of its own
+** and return the reply, from sqlite3_malloc(), or NULL if there is none.
+*/
+static char *testRequest(const char *zSocket, const char *zReq){
+  struct sockaddr_un addr;
+  sqlite3_str *pReply = sqlite3_str_new(0);
+  char zBuf[1024];
+  ssize_t n;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, zSocket, sizeof(addr.sun_path)-1);
+  if( fd<0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))
+   || scrubDefragSend(fd, zReq, strlen(zReq))
+   || scrubDefragSend(fd, "\n", 1)
+  ){
+    if( fd>=0 ) close(fd);
+    sqlite3_free(sqlite3_str_finish(pReply));
+    return 0;
+  }
+  shutdown(fd, SHUT_WR);
+  while( (n = recv(fd, zBuf, sizeof(zBuf), 0))>0 ){
+    sqlite3_str_append(pReply, zBuf, (int)n);
+  }
+  close(fd);
+  if( sqlite3_str_length(pReply)==0 ){
+    sqlite3_free(sqlite3_str_finish(pReply));
+    return 0;
+  }
+  return sqlite3_str_finish(pReply);
+}
+
+/* Return the integer result of zSql with %Q replaced by zJson, or -1 */
+static sqlite3_int64 testJson(sqlite3 *db, const char *zSql, const char *zJson){
+  char *z;
+  sqlite3_int64 n;
+  if( zJson==0 ) return -1;
+  z = sqlite3_mprintf(zSql, zJson);
+  n = z ? testInt(db, z) : -1;
+  sqlite3_free(z);
+  return n;
+}
+
+/*
+** A daemon queues a copy and reports it done, answers malformed JSON with
+** an error and keeps serving, and on shutdown returns and removes its
+** socket.
+*/
+static void testDaemon(const char *zDir){
+  char *zSrc = sqlite3_mprintf("%s/defragtest-daemon.db", zDir);
+  char *zDest = sqlite3_mprintf("%s/defragtest-daemon2.db", zDir);
+  char *zRef = sqlite3_mprintf("%s/defragtest-ref.db", zDir);
+  char *zSocket = sqlite3_mprintf("%s/defragtest.sock", zDir);
+  char *zReq = 0;
+  char *zReply = 0;
+  sqlite3 *db = 0;
+  TestDaemon t;
+  pthread_t thread;
+  sqlite3_int64 iId;
+  int i;
+
+  memset(&t, 0, sizeof(t));
+  t.zSocket = zSocket;
+  testRemove(zDest);
+  if( testMakeFragmented(zSrc, zRef)!=SQLITE_OK
+   || pthread_create(&thread, 0, testDaemonThread, &t)
+  ){
+    testResult("daemon", 0, "setup failed");
+    goto daemon_end;
+  }
+  sqlite3_open(":memory:", &db);
+
+  /* Wait for the daemon to listen */
+  for(i=0; i<500 && (zReply = testRequest(zSocket, "{\"op\":\"status\"}"))==0;
+      i++){
+    sqlite3_sleep(10);
+  }
+  testResult("daemon: listening", zReply!=0, t.zErr);
+  sqlite3_free(zReply);
+
+  zReq = sqlite3_mprintf("{\"op\":\"copy\",\"src\":\"%s\",\"dest\":\"%s\"}",
+                         zSrc, zDest);
+  zReply = zReq ? testRequest(zSocket, zReq) : 0;
+  iId = testJson(db, "SELECT json_extract(%Q,'$.id')", zReply);
+  testResult("daemon: copy queued", iId>0, zReply);
+  sqlite3_free(zReply);
+  sqlite3_free(zReq);
+  zReq = sqlite3_mprintf("{\"op\":\"status\",\"id\":%lld}", iId);
+  zReply = 0;
+  for(i=0; i<1000 && zReq; i++){
+    sqlite3_free(zReply);
+    zReply = testRequest(zSocket, zReq);
+    if( testJson(db, "SELECT json_extract(%Q,'$.state')"
+                     " IN ('queued','running')", zReply)!=1 ) break;
+    sqlite3_sleep(10);
+  }
+  testResult("daemon: status done",
+      testJson(db, "SELECT json_extract(j,'$.state')='done'"
+                   " AND json_extract(j,'$.rc')=0"
+                   " AND json_extract(j,'$.stats') IS NOT NULL"
+                   " FROM (SELECT %Q AS j)", zReply)==1, zReply);
+  testResult("daemon: copy intact", testSameAs(zDest, zRef), 0);
+  sqlite3_free(zReply);
+
+  zReply = testRequest(zSocket, "{\"op\":\"copy\",");
+  testResult("daemon: malformed JSON",
+      testJson(db, "SELECT json_extract(%Q,'$.error') IS NOT NULL", zReply)==1,
+      zReply);
+  sqlite3_free(zReply);
+  zReply = testRequest(zSocket, zReq);
+  testResult("daemon: still serving",
+      testJson(db, "SELECT json_extract(%Q,'$.id')", zReply)==iId, zReply);
+  sqlite3_free(zReply);
+
+  zReply = testRequest(zSocket, "{\"op\":\"shutdown\"}");
+  testResult("daemon: shutdown",
+      testJson(db, "SELECT json_extract(%Q,'$.state')='stopping'",
+               zReply)==1, zReply);
+  sqlite3_free(zReply);
+  pthread_join(thread, 0);
+  testResult("daemon: returned", t.rc==SQLITE_OK, t.zErr);
+  testResult("daemon: socket removed", !testExists(zSocket), zSocket);
+
+daemon_end:
+  sqlite3_close(db);
+  sqlite3_free(zReq);
+  sqlite3_free(t.zErr);
+  testRemove(zSrc);
+  testRemove(zDest);
+  testRemove(zRef);
+  remove(zSocket);
+  sqlite3_free(zSrc);
+  sqlite3_free(zDest);
+  sqlite3_free(zRef);
+  sqlite3_free(zSocket);
+}
+#endif /* SCRUB_DEFRAG_DAEMON */
+
+int main(int argc, char **argv){
+  const char *zDir = argc>1 ? argv[1] : ".";
+  testOnlineStale(zDir);
+  testStat1Verify(zDir);
+  testStat1Analyze(zDir, 0);
+  testStat1Analyze(zDir, 1);
+  testVfsInstall();
+  testInplace(zDir);
+  testInplaceResume(zDir, 0);
+  testInplaceResume(zDir, 1);
+  testInplaceResume(zDir, nTestInplaceWrite/3);
+  testInplaceResume(zDir, nTestInplaceWrite*2/3);
+  testInplaceResume(zDir, nTestInplaceWrite-1);
+  testInplaceWal(zDir);
+  testCompact(zDir, 0);
+  testCompact(zDir, 100);
+  testCompactResume(zDir, 0);
+  testCompactResume(zDir, 1);
+  testCompactResume(zDir, nTestCompactWrite/2);
+  testCompactResume(zDir, nTestCompactWrite-1);
+  testSalvageIndex(zDir);
+  testSerialize(zDir);
+#if SCRUB_DEFRAG_DAEMON
+  testDaemon(zDir);
+#endif
+  return nTestFail;
+}